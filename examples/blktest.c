@@ -5,134 +5,621 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include "utils.h"
 
-enum test_mode {
-    TEST_MODE_SIMPLE,
-    TEST_MODE_HARD,
+/*
+ * Block device load generator. Runs a workload on a device (and optionally on a reference device
+ * with the same parameters, to measure the overhead of bius) and reports IOPS, bandwidth and
+ * latency percentiles.
+ */
+
+enum workload {
+    WORKLOAD_READ,
+    WORKLOAD_WRITE,
+    WORKLOAD_RW,
+    WORKLOAD_RANDREAD,
+    WORKLOAD_RANDWRITE,
+    WORKLOAD_RANDRW,
+};
+
+static const char *workload_names[] = {
+    [WORKLOAD_READ] = "read",
+    [WORKLOAD_WRITE] = "write",
+    [WORKLOAD_RW] = "rw",
+    [WORKLOAD_RANDREAD] = "randread",
+    [WORKLOAD_RANDWRITE] = "randwrite",
+    [WORKLOAD_RANDRW] = "randrw",
+};
+
+enum engine {
+    ENGINE_PSYNC,
+    ENGINE_AIO,
+};
+
+struct benchmark_options {
+    enum workload workload;
+    enum engine engine;
+    size_t block_size;
+    unsigned int queue_depth;
+    unsigned int num_jobs;
+    size_t region_size;
+    unsigned int runtime;
+    unsigned int read_percent;
+    bool direct;
+    bool verify;
+};
+
+/*
+ * Log-linear latency histogram. Values below 2^HIST_SUB_BITS ns are exact, larger values fall in
+ * one of 2^HIST_SUB_BITS buckets per power of two, which bounds the error to about 3%.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_NUM_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+    unsigned long counts[HIST_NUM_BUCKETS];
+    unsigned long total;
+    unsigned long sum;
 };
 
-char *buffer;
-const size_t buffer_size = 128 * 1024;
-const int simple_test_seed = 541615336;
-const size_t hard_test_size = 1lu * 1024 * 1024 * 1024;
-const size_t hard_test_iteration = hard_test_size / buffer_size;
+struct job {
+    pthread_t thread;
+    const char *path;
+    const struct benchmark_options *options;
+    unsigned int index;
+    uint64_t rng;
+    size_t next_offset;
+    size_t region_start;
+    size_t region_size;
 
-static inline char pattern(int seed, int index) {
-    return (char)(index + seed * index);
+    unsigned long read_ops;
+    unsigned long write_ops;
+    unsigned long errors;
+    struct histogram histogram;
+    int result;
+};
+
+struct result {
+    double seconds;
+    unsigned long read_ops;
+    unsigned long write_ops;
+    unsigned long errors;
+    struct histogram histogram;
+};
+
+static inline unsigned int histogram_bucket(uint64_t value) {
+    unsigned int msb;
+
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+
+    msb = 63 - __builtin_clzl(value);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
 }
 
-int do_test_simple(int fd) {
-    fprintf(stderr, "Writing test: simple\n");
+/* Returns the upper bound of bucket */
+static inline uint64_t histogram_value(unsigned int bucket) {
+    unsigned int exponent = bucket / HIST_SUB_BUCKETS;
+    uint64_t sub = bucket % HIST_SUB_BUCKETS;
 
-    for (int i = 0; i < buffer_size; i++)
-        buffer[i] = pattern(simple_test_seed, i);
+    if (exponent == 0)
+        return sub;
 
-    ssize_t result = write(fd, buffer, buffer_size);
-    fprintf(stderr, "Write result = %ld, %s\n", result, strerror(errno));
-    if (result <= 0)
-        return 1;
+    return ((HIST_SUB_BUCKETS + sub + 1) << (exponent - 1)) - 1;
+}
 
-    result = lseek(fd, 0, SEEK_SET);
-    if (result < 0) {
-        fprintf(stderr, "lseek failed: %s\n", strerror(errno));
-        return 1;
+static inline void histogram_add(struct histogram *histogram, uint64_t value) {
+    histogram->counts[histogram_bucket(value)]++;
+    histogram->total++;
+    histogram->sum += value;
+}
+
+static void histogram_merge(struct histogram *dest, const struct histogram *src) {
+    for (int i = 0; i < HIST_NUM_BUCKETS; i++)
+        dest->counts[i] += src->counts[i];
+    dest->total += src->total;
+    dest->sum += src->sum;
+}
+
+static uint64_t histogram_percentile(const struct histogram *histogram, double percentile) {
+    unsigned long target = (unsigned long)(histogram->total * percentile / 100.0);
+    unsigned long seen = 0;
+
+    for (int i = 0; i < HIST_NUM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > target)
+            return histogram_value(i);
     }
 
-    result = read(fd, buffer, buffer_size);
-    fprintf(stderr, "Read result = %ld, %s\n", result, strerror(errno));
-    if (result <= 0)
-        return 1;
+    return 0;
+}
 
-    for (int i = 0; i < buffer_size; i++) {
-        if (buffer[i] != pattern(simple_test_seed, i)) {
-            fprintf(stderr, "Verification failed at %d, (buffer[%d] = %d) != %d\n", i, i, buffer[i], (char)i);
-            return 1;
+static inline uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* Data written at offset. Depends only on the offset so that any read can be verified. */
+static void fill_pattern(char *buffer, size_t offset, size_t length) {
+    uint64_t *words = (uint64_t *)buffer;
+
+    for (size_t i = 0; i < length / sizeof(uint64_t); i++)
+        words[i] = (offset + i * sizeof(uint64_t)) * 0x9e3779b97f4a7c15lu;
+}
+
+static bool check_pattern(const char *buffer, size_t offset, size_t length) {
+    const uint64_t *words = (const uint64_t *)buffer;
+
+    for (size_t i = 0; i < length / sizeof(uint64_t); i++) {
+        uint64_t expected = (offset + i * sizeof(uint64_t)) * 0x9e3779b97f4a7c15lu;
+
+        if (words[i] != expected) {
+            fprintf(stderr, "Verification failed at %lu, %lx != %lx\n", offset + i * sizeof(uint64_t), words[i], expected);
+            return false;
         }
     }
 
-    fprintf(stderr, "Verification ok\n");
+    return true;
+}
+
+static inline bool workload_is_random(enum workload workload) {
+    return workload >= WORKLOAD_RANDREAD;
+}
+
+static bool next_is_read(struct job *job) {
+    switch (job->options->workload) {
+        case WORKLOAD_READ:
+        case WORKLOAD_RANDREAD:
+            return true;
+        case WORKLOAD_WRITE:
+        case WORKLOAD_RANDWRITE:
+            return false;
+        default:
+            return next_random(&job->rng) % 100 < job->options->read_percent;
+    }
+}
+
+static size_t next_offset(struct job *job) {
+    const size_t block_size = job->options->block_size;
+    size_t offset;
+
+    if (workload_is_random(job->options->workload))
+        return job->region_start + next_random(&job->rng) % (job->region_size / block_size) * block_size;
+
+    offset = job->region_start + job->next_offset;
+    job->next_offset += block_size;
+    if (job->next_offset + block_size > job->region_size)
+        job->next_offset = 0;
+
+    return offset;
+}
+
+static void complete_io(struct job *job, bool is_read, char *buffer, size_t offset, long result, uint64_t start) {
+    const size_t block_size = job->options->block_size;
+
+    histogram_add(&job->histogram, now_ns() - start);
+
+    if (result != block_size) {
+        if (job->errors++ == 0)
+            fprintf(stderr, "I/O failed at %lu: %s\n", offset, result < 0 ? strerror(-result) : "short transfer");
+        return;
+    }
+
+    if (is_read) {
+        job->read_ops++;
+        if (job->options->verify && !check_pattern(buffer, offset, block_size))
+            job->errors++;
+    } else {
+        job->write_ops++;
+    }
+}
+
+static void prepare_io(struct job *job, bool is_read, char *buffer, size_t offset) {
+    if (!is_read && job->options->verify)
+        fill_pattern(buffer, offset, job->options->block_size);
+}
+
+static int run_psync(struct job *job, int fd, char *buffer, uint64_t deadline) {
+    const size_t block_size = job->options->block_size;
+
+    while (now_ns() < deadline) {
+        bool is_read = next_is_read(job);
+        size_t offset = next_offset(job);
+        uint64_t start;
+        long result;
+
+        prepare_io(job, is_read, buffer, offset);
+
+        start = now_ns();
+        if (is_read)
+            result = pread(fd, buffer, block_size, offset);
+        else
+            result = pwrite(fd, buffer, block_size, offset);
+
+        complete_io(job, is_read, buffer, offset, result < 0 ? -errno : result, start);
+    }
 
     return 0;
 }
 
-int do_test_hard(int fd) {
-    ssize_t result;
-    fprintf(stderr, "Writing test: hard\n");
+struct aio_slot {
+    struct iocb iocb;
+    uint64_t start;
+};
 
-    for (size_t i = 0; i < hard_test_iteration; i++) {
-        for (int j = 0; j < buffer_size; j++)
-            buffer[j] = pattern(i, j);
+static void submit_aio(struct job *job, struct aio_slot *slot, char *buffer) {
+    bool is_read = next_is_read(job);
+    size_t offset = next_offset(job);
 
-        result = write(fd, buffer, buffer_size);
-        if (result <= 0) {
-            fprintf(stderr, "Write failed: %s\n", strerror(errno));
-            return 1;
-        } else if (result < buffer_size) {
-            fprintf(stderr, "Incomplete write: %ld\n", result);
-            return 1;
-        }
+    prepare_io(job, is_read, buffer, offset);
+
+    slot->iocb.aio_lio_opcode = is_read ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+    slot->iocb.aio_buf = (uint64_t)buffer;
+    slot->iocb.aio_offset = offset;
+    slot->start = now_ns();
+}
+
+static int run_aio(struct job *job, int fd, char *buffers, uint64_t deadline) {
+    const unsigned int queue_depth = job->options->queue_depth;
+    const size_t block_size = job->options->block_size;
+    struct aio_slot *slots = calloc(queue_depth, sizeof(struct aio_slot));
+    struct iocb **iocbs = calloc(queue_depth, sizeof(struct iocb *));
+    struct io_event *events = calloc(queue_depth, sizeof(struct io_event));
+    aio_context_t context = 0;
+    unsigned int in_flight = 0;
+    int result = 0;
+
+    if (slots == NULL || iocbs == NULL || events == NULL) {
+        fprintf(stderr, "aio slot allocation failed\n");
+        result = -1;
+        goto out_free;
     }
 
-    result = lseek(fd, 0, SEEK_SET);
-    if (result < 0) {
-        fprintf(stderr, "lseek failed: %s\n", strerror(errno));
-        return 1;
+    if (syscall(SYS_io_setup, queue_depth, &context) < 0) {
+        fprintf(stderr, "io_setup failed: %s\n", strerror(errno));
+        result = -1;
+        goto out_free;
     }
 
-    for (size_t i = 0; i < hard_test_iteration; i++) {
-        result = read(fd, buffer, buffer_size);
-        if (result <= 0) {
-            fprintf(stderr, "Read failed: %s\n", strerror(errno));
-            return 1;
-        } else if (result < buffer_size) {
-            fprintf(stderr, "Incomplete read: %ld\n", result);
-            return 1;
+    for (unsigned int i = 0; i < queue_depth; i++) {
+        slots[i].iocb.aio_data = i;
+        slots[i].iocb.aio_fildes = fd;
+        slots[i].iocb.aio_nbytes = block_size;
+        submit_aio(job, &slots[i], buffers + i * block_size);
+        iocbs[i] = &slots[i].iocb;
+    }
+    if (syscall(SYS_io_submit, context, queue_depth, iocbs) != queue_depth) {
+        fprintf(stderr, "io_submit failed: %s\n", strerror(errno));
+        result = -1;
+        goto out_destroy;
+    }
+    in_flight = queue_depth;
+
+    while (in_flight > 0) {
+        bool stop = now_ns() >= deadline;
+        unsigned int num_resubmit = 0;
+        long num_events = syscall(SYS_io_getevents, context, 1, queue_depth, events, NULL);
+
+        if (num_events < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "io_getevents failed: %s\n", strerror(errno));
+            result = -1;
+            break;
         }
 
-        for (int j = 0; j < buffer_size; j++) {
-            if (buffer[j] != pattern(i, j)) {
-                fprintf(stderr, "Verification failed at (%lu, %d), (buffer = %d) != %d\n", i, j, buffer[j], pattern(i, j));
-                return 1;
+        for (long i = 0; i < num_events; i++) {
+            struct aio_slot *slot = &slots[events[i].data];
+            char *buffer = buffers + events[i].data * block_size;
+
+            complete_io(job, slot->iocb.aio_lio_opcode == IOCB_CMD_PREAD, buffer, slot->iocb.aio_offset, events[i].res, slot->start);
+            in_flight--;
+
+            if (!stop) {
+                submit_aio(job, slot, buffer);
+                iocbs[num_resubmit++] = &slot->iocb;
             }
         }
+
+        if (num_resubmit > 0) {
+            if (syscall(SYS_io_submit, context, num_resubmit, iocbs) != num_resubmit) {
+                fprintf(stderr, "io_submit failed: %s\n", strerror(errno));
+                result = -1;
+                break;
+            }
+            in_flight += num_resubmit;
+        }
     }
 
-    fprintf(stderr, "Verification ok\n");
+out_destroy:
+    syscall(SYS_io_destroy, context);
+out_free:
+    free(slots);
+    free(iocbs);
+    free(events);
+    return result;
+}
 
-    return 0;
+static void *job_main(void *arg) {
+    struct job *job = arg;
+    const struct benchmark_options *options = job->options;
+    int flags = O_RDWR | (options->direct ? O_DIRECT : 0);
+    char *buffers;
+    int fd;
+
+    job->result = -1;
+
+    fd = open(job->path, flags);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed: %s\n", job->path, strerror(errno));
+        return NULL;
+    }
+
+    buffers = aligned_alloc(4096, options->block_size * options->queue_depth);
+    if (buffers == NULL) {
+        fprintf(stderr, "buffer allocation failed: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    memset(buffers, 0, options->block_size * options->queue_depth);
+
+    uint64_t deadline = now_ns() + options->runtime * 1000000000lu;
+    if (options->engine == ENGINE_AIO)
+        job->result = run_aio(job, fd, buffers, deadline);
+    else
+        job->result = run_psync(job, fd, buffers, deadline);
+
+    free(buffers);
+    close(fd);
+
+    return NULL;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s [device]\n", argv[0]);
-        return 1;
+/* Writes the verification pattern to the whole region, so that every later read can be checked */
+static int prefill(const char *path, const struct benchmark_options *options) {
+    const size_t chunk_size = 1024 * 1024;
+    char *buffer = aligned_alloc(4096, chunk_size);
+    int fd = open(path, O_RDWR | (options->direct ? O_DIRECT : 0));
+    int result = 0;
+
+    if (fd < 0 || buffer == NULL) {
+        fprintf(stderr, "prefill setup failed: %s\n", strerror(errno));
+        result = -1;
+        goto out;
+    }
+
+    for (size_t offset = 0; offset < options->region_size; offset += chunk_size) {
+        size_t size = min(chunk_size, options->region_size - offset);
+
+        fill_pattern(buffer, offset, size);
+        if (pwrite(fd, buffer, size, offset) != size) {
+            fprintf(stderr, "prefill failed at %lu: %s\n", offset, strerror(errno));
+            result = -1;
+            goto out;
+        }
+    }
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(buffer);
+    return result;
+}
+
+static int run_benchmark(const char *path, const struct benchmark_options *options, struct result *out_result) {
+    struct job *jobs = calloc(options->num_jobs, sizeof(struct job));
+    size_t slice = options->region_size / options->num_jobs / options->block_size * options->block_size;
+    uint64_t start;
+    int result = 0;
+
+    if (jobs == NULL)
+        return -1;
+
+    if (options->verify && prefill(path, options) < 0) {
+        free(jobs);
+        return -1;
+    }
+
+    memset(out_result, 0, sizeof(struct result));
+    start = now_ns();
+
+    for (unsigned int i = 0; i < options->num_jobs; i++) {
+        jobs[i].path = path;
+        jobs[i].options = options;
+        jobs[i].index = i;
+        jobs[i].rng = 0x2545f4914f6cdd1dlu * (i + 1);
+        /* Random jobs share the whole region, sequential jobs each stream through their own slice */
+        jobs[i].region_start = workload_is_random(options->workload) ? 0 : slice * i;
+        jobs[i].region_size = workload_is_random(options->workload) ? options->region_size : slice;
+
+        result = pthread_create(&jobs[i].thread, NULL, job_main, &jobs[i]);
+        if (result != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(result));
+            exit(1);
+        }
+    }
+
+    for (unsigned int i = 0; i < options->num_jobs; i++) {
+        pthread_join(jobs[i].thread, NULL);
+        if (jobs[i].result < 0)
+            result = -1;
+
+        out_result->read_ops += jobs[i].read_ops;
+        out_result->write_ops += jobs[i].write_ops;
+        out_result->errors += jobs[i].errors;
+        histogram_merge(&out_result->histogram, &jobs[i].histogram);
     }
 
-    int fd = open(argv[1], O_RDWR | O_DIRECT);
-    enum test_mode mode = TEST_MODE_SIMPLE;
+    out_result->seconds = (now_ns() - start) / 1e9;
+    free(jobs);
+
+    return result;
+}
+
+static void print_result(const char *path, const struct benchmark_options *options, const struct result *result) {
+    const struct histogram *histogram = &result->histogram;
+    double iops = (result->read_ops + result->write_ops) / result->seconds;
+    double bandwidth = iops * options->block_size / (1024 * 1024);
+
+    printf("%s: iops = %.0f (read = %.0f, write = %.0f), bw = %.1f MiB/s, errors = %lu\n", path, iops,
+           result->read_ops / result->seconds, result->write_ops / result->seconds, bandwidth, result->errors);
+    if (histogram->total > 0) {
+        printf("%s: lat (us) avg = %.2f, p50 = %.2f, p99 = %.2f, p99.9 = %.2f\n", path,
+               (double)histogram->sum / histogram->total / 1000,
+               histogram_percentile(histogram, 50) / 1000.0,
+               histogram_percentile(histogram, 99) / 1000.0,
+               histogram_percentile(histogram, 99.9) / 1000.0);
+    }
+}
+
+static void print_comparison(const struct result *device, const struct result *reference) {
+    double device_iops = (device->read_ops + device->write_ops) / device->seconds;
+    double reference_iops = (reference->read_ops + reference->write_ops) / reference->seconds;
+
+    if (reference_iops == 0 || device->histogram.total == 0 || reference->histogram.total == 0)
+        return;
+
+    printf("overhead: iops = %.1f%%, p50 = %+.2f us, p99 = %+.2f us, p99.9 = %+.2f us\n",
+           (1 - device_iops / reference_iops) * 100,
+           ((double)histogram_percentile(&device->histogram, 50) - histogram_percentile(&reference->histogram, 50)) / 1000,
+           ((double)histogram_percentile(&device->histogram, 99) - histogram_percentile(&reference->histogram, 99)) / 1000,
+           ((double)histogram_percentile(&device->histogram, 99.9) - histogram_percentile(&reference->histogram, 99.9)) / 1000);
+}
+
+static size_t get_device_size(const char *path) {
+    int fd = open(path, O_RDONLY);
+    off_t size;
+
     if (fd < 0) {
-        fprintf(stderr, "open failed: %s\n", strerror(errno));
+        fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    size = lseek(fd, 0, SEEK_END);
+    close(fd);
+
+    return size < 0 ? 0 : size;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] device [reference device]\n", program);
+    fprintf(stderr, "  -w WORKLOAD  read, write, rw, randread, randwrite or randrw (default: randread)\n");
+    fprintf(stderr, "  -b SIZE      block size (default: 4K)\n");
+    fprintf(stderr, "  -q DEPTH     queue depth per job, served with Linux AIO if larger than 1 (default: 1)\n");
+    fprintf(stderr, "  -j JOBS      number of jobs (default: 1)\n");
+    fprintf(stderr, "  -s SIZE      size of the region accessed from the start of the device (default: whole device)\n");
+    fprintf(stderr, "  -t SECONDS   runtime per device (default: 10)\n");
+    fprintf(stderr, "  -r PERCENT   share of reads in rw and randrw (default: 50)\n");
+    fprintf(stderr, "  -B           buffered I/O instead of O_DIRECT\n");
+    fprintf(stderr, "  -v           write a pattern over the region first, and verify every read against it\n");
+}
+
+int main(int argc, char **argv) {
+    struct benchmark_options options = {
+        .workload = WORKLOAD_RANDREAD,
+        .block_size = 4096,
+        .queue_depth = 1,
+        .num_jobs = 1,
+        .runtime = 10,
+        .read_percent = 50,
+        .direct = true,
+    };
+    struct result device_result, reference_result;
+    const char *device, *reference = NULL;
+    size_t device_size;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:b:q:j:s:t:r:Bv")) != -1) {
+        switch (opt) {
+            case 'w':
+                options.workload = -1;
+                for (int i = 0; i < sizeof(workload_names) / sizeof(workload_names[0]); i++) {
+                    if (strcmp(optarg, workload_names[i]) == 0)
+                        options.workload = i;
+                }
+                if (options.workload == -1) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'b':
+                options.block_size = parse_size(optarg);
+                break;
+            case 'q':
+                options.queue_depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'j':
+                options.num_jobs = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                options.region_size = parse_size(optarg);
+                break;
+            case 't':
+                options.runtime = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                options.read_percent = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                options.direct = false;
+                break;
+            case 'v':
+                options.verify = true;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        print_usage(argv[0]);
         return 1;
     }
+    device = argv[optind];
+    if (optind + 1 < argc)
+        reference = argv[optind + 1];
 
-    if (argc >= 3) {
-        if (strcmp(argv[2], "--hard") == 0)
-            mode = TEST_MODE_HARD;
+    if (options.block_size == 0 || options.block_size % 512 != 0 || options.queue_depth == 0 || options.num_jobs == 0) {
+        fprintf(stderr, "Block size must be a multiple of 512, queue depth and number of jobs must be positive\n");
+        return 1;
     }
+    options.engine = options.queue_depth > 1 ? ENGINE_AIO : ENGINE_PSYNC;
 
-    buffer = aligned_alloc(4096, buffer_size);
-    if (buffer == NULL) {
-        fprintf(stderr, "buffer allocation failed: %s\n", strerror(errno));
+    device_size = get_device_size(device);
+    if (reference)
+        device_size = min(device_size, get_device_size(reference));
+    if (options.region_size == 0 || options.region_size > device_size)
+        options.region_size = device_size;
+    if (options.region_size < options.block_size * options.num_jobs) {
+        fprintf(stderr, "Region is too small: %lu\n", options.region_size);
         return 1;
     }
 
-    switch (mode) {
-        case TEST_MODE_SIMPLE:
-            return do_test_simple(fd);
-        case TEST_MODE_HARD:
-            return do_test_hard(fd);
-        default:
-            fprintf(stderr, "Mode error: %d\n", mode);
+    printf("workload = %s, bs = %lu, qd = %u, jobs = %u, region = %lu, %s%s\n", workload_names[options.workload],
+           options.block_size, options.queue_depth, options.num_jobs, options.region_size,
+           options.direct ? "direct" : "buffered", options.verify ? ", verify" : "");
+
+    if (run_benchmark(device, &options, &device_result) < 0)
+        return 1;
+    print_result(device, &options, &device_result);
+
+    if (reference) {
+        if (run_benchmark(reference, &options, &reference_result) < 0)
             return 1;
+        print_result(reference, &options, &reference_result);
+        print_comparison(&device_result, &reference_result);
     }
+
+    return device_result.errors > 0 || (reference && reference_result.errors > 0);
 }
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include "libbius.h"
+#include "utils.h"
+#include "lz4-block.h"
+
+/*
+ * Ramdisk storing 4 KiB blocks LZ4 compressed and deduplicated by content. Zero blocks are not
+ * stored at all. Identical blocks share one stored_block, found through a hash table keyed by
+ * the hash of the uncompressed data.
+ */
+
+#define RAMDISK_SIZE (32lu * 1024 * 1024 * 1024)
+#define BLOCK_SIZE 4096
+#define NUM_LOCKS 1024
+
+struct stored_block {
+    struct stored_block *next;
+    uint64_t hash;
+    uint32_t refcount;
+    /* Compressed size, BLOCK_SIZE if the block did not compress */
+    uint32_t size;
+    char data[];
+};
+
+struct ramdisk_stat {
+    unsigned long logical_blocks;
+    unsigned long unique_blocks;
+    unsigned long stored_bytes;
+    unsigned long zero_writes;
+    unsigned long dedup_writes;
+};
+
+static size_t num_blocks;
+static struct stored_block **block_table;
+static pthread_rwlock_t block_locks[NUM_LOCKS];
+
+static struct stored_block **hash_buckets;
+static size_t num_hash_buckets;
+static pthread_mutex_t hash_locks[NUM_LOCKS];
+
+static struct ramdisk_stat stats;
+
+static inline uint64_t block_hash(const void *data) {
+    const uint64_t *words = data;
+    uint64_t h = 0x9e3779b97f4a7c15lu;
+
+    for (int i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+        h = (h ^ words[i]) * 0xff51afd7ed558ccdlu;
+        h ^= h >> 32;
+    }
+
+    return h;
+}
+
+static inline bool is_zero_block(const void *data) {
+    const uint64_t *words = data;
+
+    for (int i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static inline void add_stat(unsigned long *counter, long value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/* Returns a referenced stored_block holding non-zero data, or NULL if allocation fails */
+static struct stored_block *get_stored_block(const void *data) {
+    char compressed[BLOCK_SIZE];
+    const void *payload = compressed;
+    struct stored_block *block;
+    uint64_t hash;
+    size_t bucket;
+    int size;
+
+    size = lz4_compress_block(data, BLOCK_SIZE, compressed, BLOCK_SIZE - 1);
+    if (size <= 0) {
+        payload = data;
+        size = BLOCK_SIZE;
+    }
+
+    hash = block_hash(data);
+    bucket = hash & (num_hash_buckets - 1);
+
+    pthread_mutex_lock(&hash_locks[bucket % NUM_LOCKS]);
+    for (block = hash_buckets[bucket]; block != NULL; block = block->next) {
+        /* Compression is deterministic, so identical data gives identical compressed data */
+        if (block->hash == hash && block->size == size && memcmp(block->data, payload, size) == 0) {
+            block->refcount++;
+            pthread_mutex_unlock(&hash_locks[bucket % NUM_LOCKS]);
+            add_stat(&stats.dedup_writes, 1);
+            return block;
+        }
+    }
+
+    block = malloc(sizeof(struct stored_block) + size);
+    if (block == NULL) {
+        pthread_mutex_unlock(&hash_locks[bucket % NUM_LOCKS]);
+        return NULL;
+    }
+    block->hash = hash;
+    block->refcount = 1;
+    block->size = size;
+    memcpy(block->data, payload, size);
+    block->next = hash_buckets[bucket];
+    hash_buckets[bucket] = block;
+    pthread_mutex_unlock(&hash_locks[bucket % NUM_LOCKS]);
+
+    add_stat(&stats.unique_blocks, 1);
+    add_stat(&stats.stored_bytes, sizeof(struct stored_block) + size);
+
+    return block;
+}
+
+static void put_stored_block(struct stored_block *block) {
+    size_t bucket;
+    struct stored_block **prev;
+
+    if (block == NULL)
+        return;
+
+    bucket = block->hash & (num_hash_buckets - 1);
+
+    pthread_mutex_lock(&hash_locks[bucket % NUM_LOCKS]);
+    if (--block->refcount > 0) {
+        pthread_mutex_unlock(&hash_locks[bucket % NUM_LOCKS]);
+        return;
+    }
+
+    for (prev = &hash_buckets[bucket]; *prev != block; prev = &(*prev)->next);
+    *prev = block->next;
+    pthread_mutex_unlock(&hash_locks[bucket % NUM_LOCKS]);
+
+    add_stat(&stats.unique_blocks, -1);
+    add_stat(&stats.stored_bytes, -(long)(sizeof(struct stored_block) + block->size));
+    free(block);
+}
+
+static blk_status_t load_block(struct stored_block *block, void *data) {
+    if (block == NULL) {
+        memset(data, 0, BLOCK_SIZE);
+    } else if (block->size == BLOCK_SIZE) {
+        memcpy(data, block->data, BLOCK_SIZE);
+    } else if (lz4_decompress_block(block->data, block->size, data, BLOCK_SIZE) != BLOCK_SIZE) {
+        fprintf(stderr, "Corrupted block: hash = %lx\n", block->hash);
+        return BLK_STS_IOERR;
+    }
+
+    return BLK_STS_OK;
+}
+
+/* Replaces block of index with data, NULL data meaning zeros. Called with the block lock held. */
+static blk_status_t store_block_locked(size_t index, const void *data) {
+    struct stored_block *old = block_table[index];
+    struct stored_block *new = NULL;
+
+    if (data && is_zero_block(data)) {
+        add_stat(&stats.zero_writes, 1);
+    } else if (data) {
+        new = get_stored_block(data);
+        if (new == NULL)
+            return BLK_STS_RESOURCE;
+    }
+
+    block_table[index] = new;
+    add_stat(&stats.logical_blocks, (new != NULL) - (old != NULL));
+    put_stored_block(old);
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t ramdisk_read(void *data, off64_t offset, size_t length) {
+    char buffer[BLOCK_SIZE];
+    char *dest = data;
+
+    while (length > 0) {
+        size_t index = offset / BLOCK_SIZE;
+        size_t block_offset = offset % BLOCK_SIZE;
+        size_t size = min(length, BLOCK_SIZE - block_offset);
+        blk_status_t result;
+
+        pthread_rwlock_rdlock(&block_locks[index % NUM_LOCKS]);
+        if (size == BLOCK_SIZE) {
+            result = load_block(block_table[index], dest);
+        } else {
+            result = load_block(block_table[index], buffer);
+            memcpy(dest, buffer + block_offset, size);
+        }
+        pthread_rwlock_unlock(&block_locks[index % NUM_LOCKS]);
+
+        if (result != BLK_STS_OK)
+            return result;
+
+        dest += size;
+        offset += size;
+        length -= size;
+    }
+
+    return BLK_STS_OK;
+}
+
+/* Writes data, or zeros if data is NULL */
+static blk_status_t ramdisk_update(const void *data, off64_t offset, size_t length) {
+    char buffer[BLOCK_SIZE];
+    const char *src = data;
+
+    while (length > 0) {
+        size_t index = offset / BLOCK_SIZE;
+        size_t block_offset = offset % BLOCK_SIZE;
+        size_t size = min(length, BLOCK_SIZE - block_offset);
+        blk_status_t result;
+
+        pthread_rwlock_wrlock(&block_locks[index % NUM_LOCKS]);
+        if (size == BLOCK_SIZE) {
+            result = store_block_locked(index, src);
+        } else {
+            result = load_block(block_table[index], buffer);
+            if (result == BLK_STS_OK) {
+                if (src)
+                    memcpy(buffer + block_offset, src, size);
+                else
+                    memset(buffer + block_offset, 0, size);
+                result = store_block_locked(index, buffer);
+            }
+        }
+        pthread_rwlock_unlock(&block_locks[index % NUM_LOCKS]);
+
+        if (result != BLK_STS_OK)
+            return result;
+
+        if (src)
+            src += size;
+        offset += size;
+        length -= size;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t ramdisk_write(const void *data, off64_t offset, size_t length) {
+    return ramdisk_update(data, offset, length);
+}
+
+static blk_status_t ramdisk_discard(off64_t offset, size_t length) {
+    return ramdisk_update(NULL, offset, length);
+}
+
+static blk_status_t ramdisk_flush() {
+    return BLK_STS_OK;
+}
+
+static int initialize(size_t disk_size) {
+    num_blocks = disk_size / BLOCK_SIZE;
+    block_table = calloc(num_blocks, sizeof(struct stored_block *));
+
+    for (num_hash_buckets = NUM_LOCKS; num_hash_buckets < num_blocks / 4; num_hash_buckets *= 2);
+    hash_buckets = calloc(num_hash_buckets, sizeof(struct stored_block *));
+
+    if (block_table == NULL || hash_buckets == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        return -1;
+    }
+
+    for (int i = 0; i < NUM_LOCKS; i++) {
+        int error = pthread_rwlock_init(&block_locks[i], NULL);
+        if (error == 0)
+            error = pthread_mutex_init(&hash_locks[i], NULL);
+        if (error != 0) {
+            fprintf(stderr, "lock initialization failed: %s\n", strerror(error));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void sigint_handler(int signum) {
+    unsigned long logical_bytes = __atomic_load_n(&stats.logical_blocks, __ATOMIC_RELAXED) * BLOCK_SIZE;
+    unsigned long stored_bytes = __atomic_load_n(&stats.stored_bytes, __ATOMIC_RELAXED);
+
+    printf("logical = %lu / unique blocks = %lu / stored = %lu / zero writes = %lu / dedup writes = %lu\n",
+           logical_bytes, stats.unique_blocks, stored_bytes, stats.zero_writes, stats.dedup_writes);
+    if (stored_bytes > 0)
+        printf("savings = %.2fx\n\n", (double)logical_bytes / stored_bytes);
+    fflush(stdout);
+}
+
+static void set_interrupt_handler() {
+    struct sigaction sa = {
+        .sa_handler = sigint_handler,
+        .sa_flags = SA_RESTART,
+    };
+
+    if (sigemptyset(&sa.sa_mask) < 0) {
+        fprintf(stderr, "sigemptyset failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (sigaction(SIGINT, &sa, NULL) < 0) {
+        fprintf(stderr, "sigaction failed: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct bius_operations operations = {
+        .read = ramdisk_read,
+        .write = ramdisk_write,
+        .discard = ramdisk_discard,
+        .flush = ramdisk_flush,
+    };
+    struct bius_block_device_options options = {
+        .model = BLK_ZONED_NONE,
+        .num_threads = 4,
+        .disk_size = RAMDISK_SIZE,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+            case 's':
+                options.disk_size = parse_size(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s size]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (options.disk_size == 0 || options.disk_size % BLOCK_SIZE != 0) {
+        fprintf(stderr, "Disk size must be a non-zero multiple of %d\n", BLOCK_SIZE);
+        return 1;
+    }
+    strncpy(options.disk_name, "compressed-ramdisk", MAX_DISK_NAME_LEN);
+
+    set_interrupt_handler();
+    if (initialize(options.disk_size) < 0)
+        return 1;
+
+    printf("Ready.\n");
+    fflush(stdout);
+
+    return bius_main(&operations, &options);
+}
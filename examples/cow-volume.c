@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Copy-on-write volumes over a golden image.
+ *
+ *   cow-volume create [-b block size] [-s size] volume [parent]
+ *     creates volume over parent, a base image or a snapshot to clone
+ *   cow-volume serve [-n disk name] volume
+ *     exports volume, and reads commands from stdin while doing so:
+ *       snapshot <path>  freezes the volume into path, which can then be cloned
+ *       stats            prints the allocation statistics
+ */
+
+static const char *program;
+
+static void print_usage() {
+    fprintf(stderr, "Usage: %s create [-b block size] [-s size] volume [parent]\n", program);
+    fprintf(stderr, "       %s serve [-n disk name] volume\n", program);
+}
+
+static int create_main(int argc, char *argv[]) {
+    struct bius_cow_options options = {0};
+    int opt;
+    int result;
+
+    while ((opt = getopt(argc, argv, "b:s:")) != -1) {
+        switch (opt) {
+            case 'b':
+                options.block_size = parse_size(optarg);
+                break;
+            case 's':
+                options.disk_size = parse_size(optarg);
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        print_usage();
+        return 1;
+    }
+
+    result = bius_cow_create_volume(argv[optind], optind + 1 < argc ? argv[optind + 1] : NULL, &options);
+    if (result < 0) {
+        fprintf(stderr, "Creating volume failed: %s\n", strerror(-result));
+        return 1;
+    }
+
+    return 0;
+}
+
+static void *command_main(void *arg) {
+    char line[4096];
+
+    while (fgets(line, sizeof(line), stdin)) {
+        char *command = strtok(line, " \t\n");
+        char *path = strtok(NULL, " \t\n");
+
+        if (command == NULL)
+            continue;
+
+        if (strcmp(command, "snapshot") == 0 && path) {
+            int result = bius_cow_snapshot(path);
+
+            if (result < 0)
+                printf("snapshot failed: %s\n", strerror(-result));
+            else
+                printf("snapshot %s created\n", path);
+        } else if (strcmp(command, "stats") == 0) {
+            struct bius_cow_stats stats;
+
+            bius_cow_get_stats(&stats);
+            printf("allocated blocks = %lu / copied blocks = %lu / snapshots = %lu / layers = %u\n",
+                   stats.allocated_blocks, stats.copied_blocks, stats.snapshots, stats.layers);
+        } else {
+            printf("unknown command: %s\n", command);
+        }
+        fflush(stdout);
+    }
+
+    return NULL;
+}
+
+static int serve_main(int argc, char *argv[]) {
+    struct bius_operations operations;
+    struct bius_block_device_options options = {
+        .model = BLK_ZONED_NONE,
+        .num_threads = 4,
+        /* Flushes persist the mapping of the blocks written since the last one */
+        .volatile_write_cache = true,
+    };
+    const char *disk_name = "cow-volume";
+    pthread_t command_thread;
+    int opt;
+    int result;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                disk_name = optarg;
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        print_usage();
+        return 1;
+    }
+
+    result = bius_cow_open(argv[optind], &operations, &options.disk_size);
+    if (result < 0) {
+        fprintf(stderr, "Opening volume failed: %s\n", strerror(-result));
+        return 1;
+    }
+    strncpy(options.disk_name, disk_name, MAX_DISK_NAME_LEN - 1);
+
+    result = pthread_create(&command_thread, NULL, command_main, NULL);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(result));
+        return 1;
+    }
+
+    printf("Ready.\n");
+    fflush(stdout);
+
+    result = bius_main(&operations, &options);
+    if (bius_cow_close() < 0)
+        fprintf(stderr, "Flushing volume failed\n");
+
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    program = argv[0];
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+
+    /* getopt of the subcommand starts after its name */
+    if (strcmp(argv[1], "create") == 0)
+        return create_main(argc - 1, argv + 1);
+    else if (strcmp(argv[1], "serve") == 0)
+        return serve_main(argc - 1, argv + 1);
+
+    print_usage();
+    return 1;
+}
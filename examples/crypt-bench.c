@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Measures the encryption layer over a backend in memory, against memcpy of the same requests,
+ * which is what the backend costs. Writes encrypt into a bounce buffer then copy it; reads copy
+ * then decrypt in place. Requests cycle through the disk, so that one larger than the caches
+ * measures memory bandwidth. Data read back is compared with what was written.
+ */
+
+static unsigned char *disk;
+
+static blk_status_t memory_read(void *data, off64_t offset, size_t length) {
+    memcpy(data, disk + offset, length);
+    return BLK_STS_OK;
+}
+
+static blk_status_t memory_write(const void *data, off64_t offset, size_t length) {
+    memcpy(disk + offset, data, length);
+    return BLK_STS_OK;
+}
+
+static void report(const char *name, size_t bytes, uint64_t elapsed) {
+    printf("%-8s %8.2f GB/s\n", name, (double)bytes / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    struct bius_operations backend = {
+        .read = memory_read,
+        .write = memory_write,
+    };
+    struct bius_operations operations;
+    struct bius_crypt_options options = {0};
+    unsigned char key[64];
+    size_t request_size = 128 * 1024;
+    size_t disk_size = 64 * 1024 * 1024;
+    unsigned int iterations = 20;
+    unsigned char *buffer;
+    unsigned char *original;
+    size_t nr_requests;
+    uint64_t start;
+    int opt;
+    int result;
+
+    options.key_size = 64;
+    while ((opt = getopt(argc, argv, "k:s:d:t:n:")) != -1) {
+        switch (opt) {
+            case 'k':
+                options.key_size = strtoul(optarg, NULL, 0) / 4;
+                break;
+            case 's':
+                request_size = parse_size(optarg);
+                break;
+            case 'd':
+                disk_size = parse_size(optarg);
+                break;
+            case 't':
+                options.threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-k 128|256 key bits] [-s request size] [-d disk size] [-t threads] [-n iterations]\n", argv[0]);
+                fprintf(stderr, "  threads include the caller, 0 for one per online CPU\n");
+                return 1;
+        }
+    }
+
+    if (request_size == 0 || request_size % SECTOR_SIZE != 0 || disk_size < request_size) {
+        fprintf(stderr, "Request size must be a non-zero multiple of %d, and the disk no smaller\n", SECTOR_SIZE);
+        return 1;
+    }
+    nr_requests = disk_size / request_size;
+    disk_size = nr_requests * request_size;
+
+    disk = malloc(disk_size);
+    buffer = aligned_alloc(4096, disk_size);
+    original = malloc(disk_size);
+    if (disk == NULL || buffer == NULL || original == NULL) {
+        fprintf(stderr, "Allocating %zu bytes failed\n", disk_size);
+        return 1;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(key); i++)
+        key[i] = rand();
+    for (size_t i = 0; i < disk_size; i++)
+        original[i] = rand();
+    memcpy(buffer, original, disk_size);
+
+    options.key = key;
+    result = bius_crypt_create(&backend, &options, &operations);
+    if (result < 0) {
+        fprintf(stderr, "bius_crypt_create failed: %s\n", strerror(-result));
+        return 1;
+    }
+
+    start = now_ns();
+    for (unsigned int i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < nr_requests; j++)
+            memory_write(buffer + j * request_size, j * request_size, request_size);
+    }
+    report("memcpy", disk_size * iterations, now_ns() - start);
+
+    start = now_ns();
+    for (unsigned int i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < nr_requests; j++)
+            operations.write(buffer + j * request_size, j * request_size, request_size);
+    }
+    report("write", disk_size * iterations, now_ns() - start);
+
+    start = now_ns();
+    for (unsigned int i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < nr_requests; j++)
+            operations.read(buffer + j * request_size, j * request_size, request_size);
+    }
+    report("read", disk_size * iterations, now_ns() - start);
+
+    if (memcmp(buffer, original, disk_size) != 0 || memcmp(disk, original, disk_size) == 0) {
+        fprintf(stderr, "Data read back differs, or was stored in the clear\n");
+        return 1;
+    }
+
+    bius_crypt_destroy();
+    return 0;
+}
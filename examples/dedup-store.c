@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Deduplicating block store.
+ *
+ *   dedup-store create [-b block size] -s size store
+ *   dedup-store serve [-n disk name] [-v] store
+ *     exports store, comparing blocks before deduplicating them with -v, and prints its
+ *     statistics on each line read from stdin
+ */
+
+static const char *program;
+
+static void print_usage() {
+    fprintf(stderr, "Usage: %s create [-b block size] -s size store\n", program);
+    fprintf(stderr, "       %s serve [-n disk name] [-v] store\n", program);
+}
+
+static int create_main(int argc, char *argv[]) {
+    struct bius_dedup_options options = {0};
+    int opt;
+    int result;
+
+    while ((opt = getopt(argc, argv, "b:s:")) != -1) {
+        switch (opt) {
+            case 'b':
+                options.block_size = parse_size(optarg);
+                break;
+            case 's':
+                options.disk_size = parse_size(optarg);
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    if (optind >= argc || options.disk_size == 0) {
+        print_usage();
+        return 1;
+    }
+
+    result = bius_dedup_create(argv[optind], &options);
+    if (result < 0) {
+        fprintf(stderr, "Creating store failed: %s\n", strerror(-result));
+        return 1;
+    }
+
+    return 0;
+}
+
+static void *stats_main(void *arg) {
+    char line[256];
+
+    while (fgets(line, sizeof(line), stdin)) {
+        struct bius_dedup_stats stats;
+
+        bius_dedup_get_stats(&stats);
+        printf("mapped blocks = %lu / stored blocks = %lu / deduplicated = %lu / appended = %lu / zero = %lu\n",
+               stats.mapped_blocks, stats.stored_blocks, stats.deduplicated_blocks, stats.appended_blocks, stats.zero_blocks);
+        fflush(stdout);
+    }
+
+    return NULL;
+}
+
+static int serve_main(int argc, char *argv[]) {
+    struct bius_operations operations;
+    struct bius_block_device_options options = {
+        .model = BLK_ZONED_NONE,
+        .num_threads = 4,
+        /* Flushes persist the mapping of the blocks written since the last one */
+        .volatile_write_cache = true,
+    };
+    const char *disk_name = "dedup-store";
+    bool verify = false;
+    pthread_t stats_thread;
+    int opt;
+    int result;
+
+    while ((opt = getopt(argc, argv, "n:v")) != -1) {
+        switch (opt) {
+            case 'n':
+                disk_name = optarg;
+                break;
+            case 'v':
+                verify = true;
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        print_usage();
+        return 1;
+    }
+
+    result = bius_dedup_open(argv[optind], verify, &operations, &options.disk_size);
+    if (result < 0) {
+        fprintf(stderr, "Opening store failed: %s\n", strerror(-result));
+        return 1;
+    }
+    strncpy(options.disk_name, disk_name, MAX_DISK_NAME_LEN - 1);
+
+    result = pthread_create(&stats_thread, NULL, stats_main, NULL);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(result));
+        return 1;
+    }
+
+    printf("Ready.\n");
+    fflush(stdout);
+
+    result = bius_main(&operations, &options);
+    if (bius_dedup_close() < 0)
+        fprintf(stderr, "Flushing store failed\n");
+
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    program = argv[0];
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+
+    /* getopt of the subcommand starts after its name */
+    if (strcmp(argv[1], "create") == 0)
+        return create_main(argc - 1, argv + 1);
+    else if (strcmp(argv[1], "serve") == 0)
+        return serve_main(argc - 1, argv + 1);
+
+    print_usage();
+    return 1;
+}
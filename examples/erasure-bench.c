@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Measures the erasure code: encoding parity for stripes of data, and decoding stripes which
+ * lost as many data chunks as there are parity chunks, the worst case. Throughput counts the data
+ * bytes of the stripes. Decoded chunks are compared with the originals.
+ */
+
+int main(int argc, char *argv[]) {
+    unsigned int data_chunks = 8;
+    unsigned int parity_chunks = 2;
+    size_t chunk_size = 64 * 1024;
+    unsigned int nr_stripes = 64;
+    unsigned int iterations = 100;
+    unsigned int nr_chunks;
+    unsigned char *buffer;
+    unsigned char *original;
+    void **chunks;
+    bool present[BIUS_ERASURE_MAX_CHUNKS];
+    uint64_t start, elapsed;
+    double data_bytes;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:m:c:s:n:")) != -1) {
+        switch (opt) {
+            case 'k':
+                data_chunks = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                parity_chunks = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                chunk_size = parse_size(optarg);
+                break;
+            case 's':
+                nr_stripes = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-k data chunks] [-m parity chunks] [-c chunk size] [-s stripes] [-n iterations]\n", argv[0]);
+                fprintf(stderr, "  stripes are cycled through, so that more of them than fit in cache measure memory bandwidth\n");
+                return 1;
+        }
+    }
+
+    nr_chunks = data_chunks + parity_chunks;
+    if (data_chunks == 0 || parity_chunks == 0 || nr_chunks > BIUS_ERASURE_MAX_CHUNKS || parity_chunks > data_chunks || chunk_size == 0 || nr_stripes == 0) {
+        fprintf(stderr, "Invalid code: at most %d chunks, as many data chunks as parity chunks at least\n", BIUS_ERASURE_MAX_CHUNKS);
+        return 1;
+    }
+
+    buffer = malloc((size_t)nr_stripes * nr_chunks * chunk_size);
+    original = malloc((size_t)nr_stripes * parity_chunks * chunk_size);
+    chunks = malloc(sizeof(void *) * nr_stripes * nr_chunks);
+    if (buffer == NULL || original == NULL || chunks == NULL) {
+        fprintf(stderr, "Allocating %u stripes failed\n", nr_stripes);
+        return 1;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < (size_t)nr_stripes * nr_chunks * chunk_size; i++)
+        buffer[i] = rand();
+    for (unsigned int i = 0; i < nr_stripes * nr_chunks; i++)
+        chunks[i] = buffer + (size_t)i * chunk_size;
+    data_bytes = (double)iterations * nr_stripes * data_chunks * chunk_size;
+
+    start = now_ns();
+    for (unsigned int i = 0; i < iterations; i++) {
+        for (unsigned int stripe = 0; stripe < nr_stripes; stripe++)
+            bius_erasure_encode(data_chunks, parity_chunks, chunks + stripe * nr_chunks, chunk_size);
+    }
+    elapsed = now_ns() - start;
+    printf("encode %u+%u, chunk = %zu: %.2f GB/s\n", data_chunks, parity_chunks, chunk_size, data_bytes / elapsed);
+
+    /* The first data chunks are lost and rebuilt from the others and the parity */
+    for (unsigned int stripe = 0; stripe < nr_stripes; stripe++)
+        memcpy(original + (size_t)stripe * parity_chunks * chunk_size, chunks[stripe * nr_chunks], parity_chunks * chunk_size);
+    for (unsigned int i = 0; i < nr_chunks; i++)
+        present[i] = i >= parity_chunks;
+
+    start = now_ns();
+    for (unsigned int i = 0; i < iterations; i++) {
+        for (unsigned int stripe = 0; stripe < nr_stripes; stripe++) {
+            if (bius_erasure_decode(data_chunks, parity_chunks, chunks + stripe * nr_chunks, present, chunk_size) < 0) {
+                fprintf(stderr, "Decoding failed\n");
+                return 1;
+            }
+        }
+    }
+    elapsed = now_ns() - start;
+
+    for (unsigned int stripe = 0; stripe < nr_stripes; stripe++) {
+        if (memcmp(original + (size_t)stripe * parity_chunks * chunk_size, chunks[stripe * nr_chunks], parity_chunks * chunk_size) != 0) {
+            fprintf(stderr, "Decoded stripe %u differs\n", stripe);
+            return 1;
+        }
+    }
+    printf("decode %u+%u, %u data chunks lost: %.2f GB/s\n", data_chunks, parity_chunks, parity_chunks, data_bytes / elapsed);
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Erasure-coded device over files or block devices.
+ *
+ *   erasure [-n disk name] [-m parity targets] [-c chunk size] [-C cache stripes] target...
+ *     exports the targets as one device surviving the loss of as many targets as there are
+ *     parity targets. The same targets must be given in the same order each time. Lines read from
+ *     stdin control it:
+ *       stats   prints how stripes were written and read
+ *       fail N  stops I/O to target N, serving its data from the others
+ */
+
+#define MAX_TARGETS 8
+
+static int target_fds[MAX_TARGETS];
+
+DEFINE_FD_OPERATIONS(target_fds, 0)
+DEFINE_FD_OPERATIONS(target_fds, 1)
+DEFINE_FD_OPERATIONS(target_fds, 2)
+DEFINE_FD_OPERATIONS(target_fds, 3)
+DEFINE_FD_OPERATIONS(target_fds, 4)
+DEFINE_FD_OPERATIONS(target_fds, 5)
+DEFINE_FD_OPERATIONS(target_fds, 6)
+DEFINE_FD_OPERATIONS(target_fds, 7)
+
+static const struct bius_operations target_operations[MAX_TARGETS] = {
+    FD_OPERATIONS(target_fds, 0),
+    FD_OPERATIONS(target_fds, 1),
+    FD_OPERATIONS(target_fds, 2),
+    FD_OPERATIONS(target_fds, 3),
+    FD_OPERATIONS(target_fds, 4),
+    FD_OPERATIONS(target_fds, 5),
+    FD_OPERATIONS(target_fds, 6),
+    FD_OPERATIONS(target_fds, 7),
+};
+
+static void *command_main(void *arg) {
+    char line[256];
+
+    while (fgets(line, sizeof(line), stdin)) {
+        char command[16];
+        unsigned int target;
+        int result;
+
+        if (sscanf(line, "%15s", command) != 1 || strcmp(command, "stats") == 0) {
+            struct bius_erasure_stats stats;
+
+            bius_erasure_get_stats(&stats);
+            printf("full stripe writes = %lu / read-modify-writes = %lu / reconstruct writes = %lu / degraded reads = %lu / failed targets = %u\n",
+                   stats.full_stripe_writes, stats.read_modify_writes, stats.reconstruct_writes, stats.degraded_reads, stats.failed_targets);
+            fflush(stdout);
+        } else if (strcmp(command, "fail") == 0 && sscanf(line, "%*s %u", &target) == 1) {
+            result = bius_erasure_fail_target(target);
+            if (result < 0)
+                fprintf(stderr, "Failing target %u failed: %s\n", target, strerror(-result));
+        } else {
+            fprintf(stderr, "Commands: stats, fail N\n");
+        }
+    }
+
+    return NULL;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-n disk name] [-m parity targets] [-c chunk size] [-C cache stripes] target...\n", program);
+    fprintf(stderr, "  up to %d targets, regular files or block devices\n", MAX_TARGETS);
+}
+
+int main(int argc, char *argv[]) {
+    struct bius_operations operations;
+    struct bius_operations targets[MAX_TARGETS];
+    struct bius_block_device_options options = {
+        .model = BLK_ZONED_NONE,
+        .num_threads = 4,
+    };
+    struct bius_erasure_options erasure_options = {
+        .parity_targets = 1,
+        .cache_stripes = 64,
+    };
+    const char *disk_name = "erasure";
+    unsigned int nr_targets;
+    pthread_t command_thread;
+    int opt;
+    int result;
+
+    while ((opt = getopt(argc, argv, "n:m:c:C:")) != -1) {
+        switch (opt) {
+            case 'n':
+                disk_name = optarg;
+                break;
+            case 'm':
+                erasure_options.parity_targets = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                erasure_options.chunk_size = parse_size(optarg);
+                if (erasure_options.chunk_size == 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'C':
+                erasure_options.cache_stripes = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    nr_targets = argc - optind;
+    if (nr_targets == 0 || nr_targets > MAX_TARGETS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < nr_targets; i++) {
+        const char *path = argv[optind + i];
+        unsigned long size;
+        struct stat target_stat;
+
+        target_fds[i] = open(path, O_RDWR);
+        if (target_fds[i] < 0) {
+            fprintf(stderr, "Opening %s failed: %s\n", path, strerror(errno));
+            return 1;
+        }
+
+        if (fstat(target_fds[i], &target_stat) < 0) {
+            fprintf(stderr, "fstat failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        if (S_ISREG(target_stat.st_mode)) {
+            size = target_stat.st_size;
+        } else if (ioctl(target_fds[i], BLKGETSIZE64, &size) < 0) {
+            fprintf(stderr, "ioctl BLKGETSIZE64 failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        /* The smallest target limits the others */
+        if (i == 0 || size < erasure_options.target_size)
+            erasure_options.target_size = size;
+        targets[i] = target_operations[i];
+    }
+
+    result = bius_erasure_create(targets, nr_targets, &erasure_options, &operations, &options.disk_size);
+    if (result < 0) {
+        fprintf(stderr, "bius_erasure_create failed: %s\n", strerror(-result));
+        return 1;
+    }
+    /* Partial stripes wait in the stripe cache until a flush */
+    options.volatile_write_cache = erasure_options.cache_stripes > 0;
+    strncpy(options.disk_name, disk_name, MAX_DISK_NAME_LEN - 1);
+
+    result = pthread_create(&command_thread, NULL, command_main, NULL);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(result));
+        return 1;
+    }
+
+    printf("Ready.\n");
+    fflush(stdout);
+
+    result = bius_main(&operations, &options);
+    if (bius_erasure_destroy() < 0)
+        fprintf(stderr, "Writing back the stripe cache failed\n");
+
+    return result;
+}
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "libbius.h"
+#include "utils.h"
+#include "ramdisk-common.h"
+
+/*
+ * Measures the per-request cost of the libbius dispatch loop without the kernel module, using the
+ * loopback transport. With -v, a write pass is followed by a verified read pass, which makes the
+ * run a regression test of the dispatch path and the backend.
+ */
+
+static blk_status_t null_read(void *data, off64_t offset, size_t length) {
+    return BLK_STS_OK;
+}
+
+static blk_status_t null_write(const void *data, off64_t offset, size_t length) {
+    return BLK_STS_OK;
+}
+
+static blk_status_t null_flush() {
+    return BLK_STS_OK;
+}
+
+static unsigned long iov_calls;
+
+static blk_status_t null_read_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    __atomic_fetch_add(&iov_calls, 1, __ATOMIC_RELAXED);
+    return BLK_STS_OK;
+}
+
+static blk_status_t null_write_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    __atomic_fetch_add(&iov_calls, 1, __ATOMIC_RELAXED);
+    return BLK_STS_OK;
+}
+
+static blk_status_t ramdisk_read_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    __atomic_fetch_add(&iov_calls, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < iovcnt; i++) {
+        ramdisk_read(iov[i].iov_base, offset, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    return BLK_STS_OK;
+}
+
+static blk_status_t ramdisk_write_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    __atomic_fetch_add(&iov_calls, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < iovcnt; i++) {
+        ramdisk_write(iov[i].iov_base, offset, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    return BLK_STS_OK;
+}
+
+static bool print_stats = false;
+
+static int run_pass(const struct bius_operations *operations, const struct bius_block_device_options *options, const struct bius_loopback_options *loopback_options) {
+    struct bius_transport transport;
+    struct bius_loopback_stats stats;
+    uint64_t start, elapsed;
+    int result;
+
+    result = bius_loopback_create(loopback_options, &transport);
+    if (result < 0) {
+        fprintf(stderr, "bius_loopback_create failed: %s\n", strerror(-result));
+        return -1;
+    }
+
+    iov_calls = 0;
+    start = now_ns();
+    result = bius_main_with_transport(operations, options, &transport);
+    elapsed = now_ns() - start;
+
+    bius_loopback_get_stats(&transport, &stats);
+    bius_loopback_destroy(&transport);
+
+    if (result < 0) {
+        fprintf(stderr, "bius_main_with_transport failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    printf("%s: requests = %lu, length = %lu, ns/request = %.1f, failed = %lu, mismatched = %lu",
+           loopback_options->opcode == BIUS_READ ? "read" : loopback_options->opcode == BIUS_WRITE ? "write" : "flush",
+           stats.completed, loopback_options->length, (double)elapsed / stats.completed, stats.failed, stats.mismatched);
+    if (operations->read_iov)
+        printf(", vectored calls = %lu", iov_calls);
+    printf("\n");
+
+    if (print_stats) {
+        struct bius_stats *libbius_stats = malloc(sizeof(struct bius_stats));
+
+        if (libbius_stats) {
+            bius_get_stats(libbius_stats);
+            bius_print_stats(stdout, libbius_stats);
+            free(libbius_stats);
+        }
+    }
+
+    return stats.failed > 0 || stats.mismatched > 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct bius_operations operations = {
+        .read = null_read,
+        .write = null_write,
+        .flush = null_flush,
+    };
+    struct bius_block_device_options options = {
+        .model = BLK_ZONED_NONE,
+        .num_threads = 4,
+        .disk_size = 1lu * 1024 * 1024 * 1024,
+    };
+    struct bius_loopback_options loopback_options = {
+        .opcode = BIUS_READ,
+        .length = 4096,
+        .num_requests = 1000000,
+    };
+    bool use_ramdisk = false;
+    bool use_iov = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:b:n:t:s:rvcS")) != -1) {
+        switch (opt) {
+            case 'o':
+                if (strcmp(optarg, "read") == 0) {
+                    loopback_options.opcode = BIUS_READ;
+                } else if (strcmp(optarg, "write") == 0) {
+                    loopback_options.opcode = BIUS_WRITE;
+                } else if (strcmp(optarg, "flush") == 0) {
+                    loopback_options.opcode = BIUS_FLUSH;
+                    loopback_options.length = 0;
+                } else {
+                    fprintf(stderr, "Unknown operation: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                loopback_options.length = parse_size(optarg);
+                break;
+            case 'n':
+                loopback_options.num_requests = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                options.num_threads = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                options.disk_size = parse_size(optarg);
+                break;
+            case 'r':
+                use_ramdisk = true;
+                break;
+            case 'v':
+                loopback_options.verify = true;
+                break;
+            case 'c':
+                use_iov = true;
+                break;
+            case 'S':
+                print_stats = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-o read|write|flush] [-b length] [-n requests] [-t threads] [-s disk size] [-r] [-v] [-c] [-S]\n", argv[0]);
+                fprintf(stderr, "  -r  serve requests from the sparse ramdisk instead of a null backend\n");
+                fprintf(stderr, "  -v  write the whole pattern first, then verify it with a read pass (implies -r)\n");
+                fprintf(stderr, "  -c  give vectored callbacks, which lets libbius coalesce contiguous requests\n");
+                fprintf(stderr, "  -S  print the libbius statistics of each pass as JSON\n");
+                return 1;
+        }
+    }
+    strncpy(options.disk_name, "loopback", MAX_DISK_NAME_LEN);
+    loopback_options.disk_size = options.disk_size;
+
+    if (loopback_options.verify)
+        use_ramdisk = true;
+    if (use_ramdisk) {
+        if (ramdisk_initialize(options.disk_size) < 0)
+            return 1;
+        operations.read = ramdisk_read;
+        operations.write = ramdisk_write;
+        operations.discard = ramdisk_discard;
+        operations.flush = ramdisk_flush;
+    }
+    if (use_iov) {
+        operations.read_iov = use_ramdisk ? ramdisk_read_iov : null_read_iov;
+        operations.write_iov = use_ramdisk ? ramdisk_write_iov : null_write_iov;
+        /* Single requests go through the vectored callbacks too */
+        operations.read = NULL;
+        operations.write = NULL;
+    }
+
+    if (loopback_options.verify) {
+        struct bius_loopback_options write_options = loopback_options;
+
+        write_options.opcode = BIUS_WRITE;
+        if (run_pass(&operations, &options, &write_options) < 0)
+            return 1;
+        loopback_options.opcode = BIUS_READ;
+    }
+
+    return run_pass(&operations, &options, &loopback_options) < 0 ? 1 : 0;
+}
@@ -0,0 +1,193 @@
+#ifndef LZ4_BLOCK_H
+#define LZ4_BLOCK_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Minimal compressor and decompressor for the LZ4 block format, meant for small blocks (up to
+ * 64 KiB, so that every match offset fits in the 16 bit offset field).
+ */
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_HASH_LOG 12
+#define LZ4_MAX_INPUT_SIZE (64 * 1024)
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline uint8_t *lz4_write_length(uint8_t *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/* Returns the compressed size, or 0 if the output does not fit in dst_capacity */
+static int lz4_compress_block(const void *source, int src_size, void *dest, int dst_capacity) {
+    const uint8_t *src = source;
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *const iend = src + src_size;
+    const uint8_t *const mflimit = iend - LZ4_MFLIMIT;
+    const uint8_t *const matchlimit = iend - LZ4_LAST_LITERALS;
+    uint8_t *op = dest;
+    uint8_t *const oend = op + dst_capacity;
+    uint16_t table[1 << LZ4_HASH_LOG];
+    size_t literal_length;
+
+    if (src_size > LZ4_MAX_INPUT_SIZE)
+        return 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (src_size > LZ4_MFLIMIT && ip < mflimit) {
+        uint32_t sequence = lz4_read32(ip);
+        uint32_t h = lz4_hash(sequence);
+        const uint8_t *ref = src + table[h];
+        const uint8_t *match_end;
+        size_t match_length;
+        uint8_t *token;
+
+        table[h] = (uint16_t)(ip - src);
+        if (ref >= ip || lz4_read32(ref) != sequence) {
+            ip++;
+            continue;
+        }
+
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+
+        match_end = ip + LZ4_MIN_MATCH;
+        while (match_end < matchlimit && *match_end == ref[match_end - ip])
+            match_end++;
+
+        literal_length = ip - anchor;
+        match_length = match_end - ip - LZ4_MIN_MATCH;
+
+        /* token + literal length bytes + literals + offset + match length bytes */
+        if (op + 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1 > oend)
+            return 0;
+
+        token = op++;
+        if (literal_length >= 15) {
+            *token = 15 << 4;
+            op = lz4_write_length(op, literal_length - 15);
+        } else {
+            *token = (uint8_t)(literal_length << 4);
+        }
+        memcpy(op, anchor, literal_length);
+        op += literal_length;
+
+        *op++ = (uint8_t)(ip - ref);
+        *op++ = (uint8_t)((ip - ref) >> 8);
+
+        if (match_length >= 15) {
+            *token |= 15;
+            op = lz4_write_length(op, match_length - 15);
+        } else {
+            *token |= (uint8_t)match_length;
+        }
+
+        ip = match_end;
+        anchor = ip;
+    }
+
+    literal_length = iend - anchor;
+    if (op + 1 + literal_length / 255 + 1 + literal_length > oend)
+        return 0;
+
+    if (literal_length >= 15) {
+        *op++ = 15 << 4;
+        op = lz4_write_length(op, literal_length - 15);
+    } else {
+        *op++ = (uint8_t)(literal_length << 4);
+    }
+    memcpy(op, anchor, literal_length);
+    op += literal_length;
+
+    return op - (uint8_t *)dest;
+}
+
+/* Returns the decompressed size, or -1 if the input is malformed or does not fit in dst_capacity */
+static int lz4_decompress_block(const void *source, int src_size, void *dest, int dst_capacity) {
+    const uint8_t *ip = source;
+    const uint8_t *const iend = ip + src_size;
+    uint8_t *const dst = dest;
+    uint8_t *op = dst;
+    uint8_t *const oend = op + dst_capacity;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t length = token >> 4;
+        size_t offset;
+        const uint8_t *match;
+
+        if (length == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+
+        if (length > iend - ip || length > oend - op)
+            return -1;
+        memcpy(op, ip, length);
+        op += length;
+        ip += length;
+
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return -1;
+
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return -1;
+
+        length = token & 15;
+        if (length == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+        length += LZ4_MIN_MATCH;
+
+        if (length > oend - op)
+            return -1;
+
+        match = op - offset;
+        if (offset >= length) {
+            memcpy(op, match, length);
+            op += length;
+        } else {
+            while (length-- > 0)
+                *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
+
+#endif // LZ4_BLOCK_H
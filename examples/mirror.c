@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Mirror over files or block devices.
+ *
+ *   mirror [-n disk name] [-q write quorum] replica...
+ *     exports the replicas as one device. Lines read from stdin control it:
+ *       stats           prints the state of each replica
+ *       fail N          takes replica N out of service
+ *       resync N [full] copies to replica N what it missed, or everything, and puts it back
+ */
+
+#define MAX_REPLICAS 4
+
+static int replica_fds[MAX_REPLICAS];
+
+DEFINE_FD_OPERATIONS(replica_fds, 0)
+DEFINE_FD_OPERATIONS(replica_fds, 1)
+DEFINE_FD_OPERATIONS(replica_fds, 2)
+DEFINE_FD_OPERATIONS(replica_fds, 3)
+
+static const struct bius_operations replica_operations[MAX_REPLICAS] = {
+    FD_OPERATIONS(replica_fds, 0),
+    FD_OPERATIONS(replica_fds, 1),
+    FD_OPERATIONS(replica_fds, 2),
+    FD_OPERATIONS(replica_fds, 3),
+};
+
+static const char *state_names[] = {
+    [BIUS_MIRROR_IN_SYNC] = "in sync",
+    [BIUS_MIRROR_FAILED] = "failed",
+    [BIUS_MIRROR_RESYNCING] = "resyncing",
+};
+
+static void print_stats() {
+    struct bius_mirror_stats stats;
+
+    bius_mirror_get_stats(&stats);
+    for (unsigned int i = 0; i < stats.nr_replicas; i++) {
+        struct bius_mirror_replica_stats *replica = &stats.replicas[i];
+
+        printf("replica %u: %s / reads = %lu / writes = %lu / errors = %lu / dirty regions = %lu / resynced regions = %lu\n",
+               i, state_names[replica->state], replica->reads, replica->writes, replica->errors, replica->dirty_regions,
+               replica->resynced_regions);
+    }
+    fflush(stdout);
+}
+
+static void *command_main(void *arg) {
+    char line[256];
+
+    while (fgets(line, sizeof(line), stdin)) {
+        char command[16];
+        char mode[16] = "";
+        unsigned int replica;
+        int result;
+
+        if (sscanf(line, "%15s", command) != 1 || strcmp(command, "stats") == 0) {
+            print_stats();
+        } else if (strcmp(command, "fail") == 0 && sscanf(line, "%*s %u", &replica) == 1) {
+            result = bius_mirror_fail_replica(replica);
+            if (result < 0)
+                fprintf(stderr, "Failing replica %u failed: %s\n", replica, strerror(-result));
+        } else if (strcmp(command, "resync") == 0 && sscanf(line, "%*s %u %15s", &replica, mode) >= 1) {
+            result = bius_mirror_resync(replica, strcmp(mode, "full") == 0);
+            if (result < 0)
+                fprintf(stderr, "Resyncing replica %u failed: %s\n", replica, strerror(-result));
+            else
+                printf("Replica %u in sync.\n", replica);
+            fflush(stdout);
+        } else {
+            fprintf(stderr, "Commands: stats, fail N, resync N [full]\n");
+        }
+    }
+
+    return NULL;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-n disk name] [-q write quorum] replica...\n", program);
+    fprintf(stderr, "  up to %d replicas, regular files or block devices of the same size\n", MAX_REPLICAS);
+}
+
+int main(int argc, char *argv[]) {
+    struct bius_operations operations;
+    struct bius_operations replicas[MAX_REPLICAS];
+    struct bius_block_device_options options = {
+        .model = BLK_ZONED_NONE,
+        .num_threads = 4,
+    };
+    struct bius_mirror_options mirror_options = {0};
+    const char *disk_name = "mirror";
+    unsigned int nr_replicas;
+    pthread_t command_thread;
+    int opt;
+    int result;
+
+    while ((opt = getopt(argc, argv, "n:q:")) != -1) {
+        switch (opt) {
+            case 'n':
+                disk_name = optarg;
+                break;
+            case 'q':
+                mirror_options.write_quorum = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    nr_replicas = argc - optind;
+    if (nr_replicas == 0 || nr_replicas > MAX_REPLICAS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < nr_replicas; i++) {
+        const char *path = argv[optind + i];
+        unsigned long size;
+        struct stat replica_stat;
+
+        replica_fds[i] = open(path, O_RDWR);
+        if (replica_fds[i] < 0) {
+            fprintf(stderr, "Opening %s failed: %s\n", path, strerror(errno));
+            return 1;
+        }
+
+        if (fstat(replica_fds[i], &replica_stat) < 0) {
+            fprintf(stderr, "fstat failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        replicas[i] = replica_operations[i];
+        if (S_ISREG(replica_stat.st_mode)) {
+            size = replica_stat.st_size;
+        } else if (ioctl(replica_fds[i], BLKGETSIZE64, &size) < 0) {
+            fprintf(stderr, "ioctl BLKGETSIZE64 failed: %s\n", strerror(errno));
+            return 1;
+        } else {
+            /* Punching holes is for files */
+            replicas[i].discard = NULL;
+        }
+
+        if (i > 0 && size != options.disk_size) {
+            fprintf(stderr, "Replicas must have the same size\n");
+            return 1;
+        }
+        options.disk_size = size;
+    }
+
+    if (options.disk_size == 0 || options.disk_size % SECTOR_SIZE != 0) {
+        fprintf(stderr, "Replica size must be a non-zero multiple of %d\n", SECTOR_SIZE);
+        return 1;
+    }
+
+    mirror_options.disk_size = options.disk_size;
+    result = bius_mirror_create(replicas, nr_replicas, &mirror_options, &operations);
+    if (result < 0) {
+        fprintf(stderr, "bius_mirror_create failed: %s\n", strerror(-result));
+        return 1;
+    }
+    strncpy(options.disk_name, disk_name, MAX_DISK_NAME_LEN - 1);
+
+    result = pthread_create(&command_thread, NULL, command_main, NULL);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(result));
+        return 1;
+    }
+
+    printf("Ready.\n");
+    fflush(stdout);
+
+    result = bius_main(&operations, &options);
+    bius_mirror_destroy();
+
+    return result;
+}
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -7,12 +7,21 @@
 #include <unistd.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include "libbius.h"
 #include "utils.h"
 
 static int target_fd;
+static unsigned long target_size;
+
+/*
+ * Last data extent found by each thread of a file target. Reading a range punched since then with
+ * pread still gives zeros, so the extent never has to be invalidated.
+ */
+static __thread off64_t cached_data_start, cached_data_end;
 
 static blk_status_t passthrough_read(void *data, off64_t offset, size_t length) {
     ssize_t read_size = 0;
@@ -48,10 +57,49 @@ static blk_status_t passthrough_write(const void *data, off64_t offset, size_t l
     return BLK_STS_OK;
 }
 
+static blk_status_t passthrough_transfer_iov(const struct iovec *iov, int iovcnt, off64_t offset, bool is_write) {
+    struct iovec remaining[BIUS_MAX_IOV];
+    struct iovec *current = remaining;
+
+    memcpy(remaining, iov, sizeof(struct iovec) * iovcnt);
+    while (iovcnt > 0) {
+        ssize_t result = is_write ? pwritev2(target_fd, current, iovcnt, offset, 0) : preadv2(target_fd, current, iovcnt, offset, 0);
+
+        if (result <= 0) {
+            fprintf(stderr, "%s failed: %s\n", is_write ? "pwritev2" : "preadv2", strerror(errno));
+            return BLK_STS_IOERR;
+        }
+
+        /* Skip what was transferred after a short transfer */
+        offset += result;
+        while (iovcnt > 0 && result >= current->iov_len) {
+            result -= current->iov_len;
+            current++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            current->iov_base += result;
+            current->iov_len -= result;
+        }
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t passthrough_read_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    return passthrough_transfer_iov(iov, iovcnt, offset, false);
+}
+
+static blk_status_t passthrough_write_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    return passthrough_transfer_iov(iov, iovcnt, offset, true);
+}
+
 static blk_status_t passthrough_discard(off64_t offset, size_t length) {
     uint64_t range[2] = {offset, length};
 
     if (ioctl(target_fd, BLKDISCARD, &range) < 0) {
+        if (errno == EOPNOTSUPP)
+            return BLK_STS_NOTSUPP;
         fprintf(stderr, "ioctl BLKDISCARD failed: %s\n", strerror(errno));
         return BLK_STS_IOERR;
     }
@@ -59,6 +107,128 @@ static blk_status_t passthrough_discard(off64_t offset, size_t length) {
     return BLK_STS_OK;
 }
 
+static blk_status_t passthrough_write_zeroes(off64_t offset, size_t length) {
+    uint64_t range[2] = {offset, length};
+
+    if (ioctl(target_fd, BLKZEROOUT, &range) < 0) {
+        fprintf(stderr, "ioctl BLKZEROOUT failed: %s\n", strerror(errno));
+        return BLK_STS_IOERR;
+    }
+
+    return BLK_STS_OK;
+}
+
+/*
+ * Finds the extent of a file target containing offset. Returns 1 if it holds data, 0 if it is a
+ * hole and -1 on error, and sets *out_end to the end of the extent.
+ */
+static int find_extent(off64_t offset, off64_t *out_end) {
+    off64_t data, hole;
+
+    if (offset >= cached_data_start && offset < cached_data_end) {
+        *out_end = cached_data_end;
+        return 1;
+    }
+
+    data = lseek64(target_fd, offset, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+        /* Nothing but a hole up to the end of the file */
+        *out_end = target_size;
+        return 0;
+    } else if (data < 0) {
+        fprintf(stderr, "lseek SEEK_DATA failed: %s\n", strerror(errno));
+        return -1;
+    } else if (data > offset) {
+        *out_end = data;
+        return 0;
+    }
+
+    hole = lseek64(target_fd, offset, SEEK_HOLE);
+    if (hole < 0) {
+        fprintf(stderr, "lseek SEEK_HOLE failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    cached_data_start = offset;
+    cached_data_end = hole;
+    *out_end = hole;
+    return 1;
+}
+
+/* Serves holes of a file target as zeros without reading them */
+static blk_status_t file_read(void *data, off64_t offset, size_t length) {
+    while (length > 0) {
+        off64_t end;
+        int type = find_extent(offset, &end);
+        size_t size;
+
+        if (type < 0)
+            return BLK_STS_IOERR;
+
+        size = min(length, (size_t)(end - offset));
+        if (type == 0) {
+            memset(data, 0, size);
+        } else {
+            blk_status_t result = passthrough_read(data, offset, size);
+
+            if (result != BLK_STS_OK)
+                return result;
+        }
+
+        data += size;
+        offset += size;
+        length -= size;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t file_read_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    size_t length = 0;
+    off64_t end;
+
+    for (int i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+
+    /* One call when the whole range is data, which is the common case of a filled image */
+    if (find_extent(offset, &end) == 1 && end >= offset + length)
+        return passthrough_transfer_iov(iov, iovcnt, offset, false);
+
+    for (int i = 0; i < iovcnt; i++) {
+        blk_status_t result = file_read(iov[i].iov_base, offset, iov[i].iov_len);
+
+        if (result != BLK_STS_OK)
+            return result;
+        offset += iov[i].iov_len;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t file_discard(off64_t offset, size_t length) {
+    if (fallocate(target_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) < 0) {
+        if (errno == EOPNOTSUPP)
+            return BLK_STS_NOTSUPP;
+        fprintf(stderr, "fallocate PUNCH_HOLE failed: %s\n", strerror(errno));
+        return BLK_STS_IOERR;
+    }
+
+    return BLK_STS_OK;
+}
+
+/* Keeps the range allocated when the file system can, so later writes do not fragment */
+static blk_status_t file_write_zeroes(off64_t offset, size_t length) {
+    if (fallocate(target_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        return BLK_STS_OK;
+
+    if (errno != EOPNOTSUPP) {
+        fprintf(stderr, "fallocate ZERO_RANGE failed: %s\n", strerror(errno));
+        return BLK_STS_IOERR;
+    }
+
+    return file_discard(offset, length);
+}
+
 static blk_status_t passthrough_flush() {
     if (fsync(target_fd) < 0) {
         fprintf(stderr, "fsync failed: %s\n", strerror(errno));
@@ -68,36 +238,241 @@ static blk_status_t passthrough_flush() {
     return BLK_STS_OK;
 }
 
+static void *integrity_stats_main(void *arg) {
+    char line[256];
+
+    while (fgets(line, sizeof(line), stdin)) {
+        struct bius_integrity_stats stats;
+
+        bius_integrity_get_stats(&stats);
+        printf("verified blocks = %lu / unverified blocks = %lu / mismatched blocks = %lu (last at %lu) / scrubbed blocks = %lu (%lu passes, %lu seeded) / checksums at %.2f GB/s\n",
+               stats.verified_blocks, stats.unverified_blocks, stats.mismatched_blocks, stats.last_mismatch_offset,
+               stats.scrubbed_blocks, stats.scrub_passes, stats.seeded_blocks,
+               stats.checksum_ns > 0 ? (double)stats.checksum_bytes / stats.checksum_ns : 0);
+        fflush(stdout);
+    }
+
+    return NULL;
+}
+
+/* Keys are raw bytes, 32 for AES-128 or 64 for AES-256. Returns the size, or -1. */
+static ssize_t read_key(const char *path, unsigned char *key, size_t max_size) {
+    int fd = open(path, O_RDONLY);
+    ssize_t size;
+
+    if (fd < 0) {
+        fprintf(stderr, "Key file open failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* One byte more than fits tells a key too long */
+    size = read(fd, key, max_size);
+    close(fd);
+    if (size != 32 && size != 64) {
+        fprintf(stderr, "Key file must hold 32 or 64 bytes\n");
+        return -1;
+    }
+
+    return size;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-c cache size] [-b cache block size] [-p lru|arc] [-r readahead blocks] [-w writeback interval ms] [-f cache file] [-i checksum table] [-s scrub rate] [-k key file] [-l log file] target\n", program);
+    fprintf(stderr, "  target is a block device, or a regular file whose holes read as zeros\n");
+    fprintf(stderr, "  with a checksum table, reads of corrupted blocks fail, and statistics are printed on each line read from stdin\n");
+    fprintf(stderr, "  with a key file, the target is encrypted with XTS-AES as dm-crypt aes-xts-plain64 with that key\n");
+    fprintf(stderr, "  with a log file, small writes complete once appended there, and flushes wait for larger ones only\n");
+}
+
 int main(int argc, char *argv[]) {
     struct bius_operations operations = {
         .read = passthrough_read,
         .write = passthrough_write,
         .discard = passthrough_discard,
         .flush = passthrough_flush,
+        .read_iov = passthrough_read_iov,
+        .write_iov = passthrough_write_iov,
+        .write_zeroes = passthrough_write_zeroes,
     };
     struct bius_block_device_options options = {
         .model = BLK_ZONED_NONE,
         .num_threads = 4,
     };
+    struct bius_cache_options cache_options = {
+        .block_size = 4096,
+        .policy = BIUS_CACHE_ARC,
+        .readahead_blocks = 32,
+        .writeback_interval_ms = 5000,
+    };
+    struct bius_integrity_options integrity_options = {0};
+    const char *key_file = NULL;
+    struct bius_wal_options wal_options = {0};
+    struct stat target_stat;
+    int opt;
+    int result;
 
-    if (argc <  2) {
+    while ((opt = getopt(argc, argv, "c:b:p:r:w:f:i:s:k:l:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cache_options.capacity = parse_size(optarg);
+                break;
+            case 'b':
+                cache_options.block_size = parse_size(optarg);
+                break;
+            case 'p':
+                if (strcmp(optarg, "lru") == 0) {
+                    cache_options.policy = BIUS_CACHE_LRU;
+                } else if (strcmp(optarg, "arc") == 0) {
+                    cache_options.policy = BIUS_CACHE_ARC;
+                } else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r':
+                cache_options.readahead_blocks = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                cache_options.writeback_interval_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                cache_options.backing_file = optarg;
+                break;
+            case 'i':
+                integrity_options.table_file = optarg;
+                break;
+            case 's':
+                integrity_options.scrub_rate = parse_size(optarg);
+                break;
+            case 'k':
+                key_file = optarg;
+                break;
+            case 'l':
+                wal_options.log_file = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
         fprintf(stderr, "Target path not given.\n");
+        print_usage(argv[0]);
         return 1;
     }
 
-    target_fd = open(argv[1], O_RDWR);
+    target_fd = open(argv[optind], O_RDWR);
     if (target_fd < 0) {
         fprintf(stderr, "Target open failed: %s\n", strerror(errno));
         return 1;
     }
 
-    if (ioctl(target_fd, BLKGETSIZE64, &options.disk_size) < 0) {
+    if (fstat(target_fd, &target_stat) < 0) {
+        fprintf(stderr, "fstat failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (S_ISREG(target_stat.st_mode)) {
+        /* Image file, possibly sparse */
+        options.disk_size = target_stat.st_size;
+        operations.read = file_read;
+        operations.read_iov = file_read_iov;
+        operations.discard = file_discard;
+        operations.write_zeroes = file_write_zeroes;
+    } else if (ioctl(target_fd, BLKGETSIZE64, &options.disk_size) < 0) {
         fprintf(stderr, "ioctl BLKGETSIZE64 failed: %s\n", strerror(errno));
         return 1;
     }
     printd("disk_size = %lu\n", options.disk_size);
 
+    if (options.disk_size == 0 || options.disk_size % SECTOR_SIZE != 0) {
+        fprintf(stderr, "Target size must be a non-zero multiple of %d\n", SECTOR_SIZE);
+        return 1;
+    }
+    target_size = options.disk_size;
+
+    /* Lowest, so that the log holds what is stored: checksummed and encrypted */
+    if (wal_options.log_file != NULL) {
+        struct bius_operations backend = operations;
+
+        options.disk_size -= options.disk_size % BIUS_WAL_BLOCK_SIZE;
+        wal_options.disk_size = options.disk_size;
+        result = bius_wal_create(&backend, &wal_options, &operations);
+        if (result < 0) {
+            fprintf(stderr, "bius_wal_create failed: %s\n", strerror(-result));
+            return 1;
+        }
+        /* Writes bypassing the log are durable once flushed */
+        options.volatile_write_cache = true;
+    }
+
+    /* Under the cache, so that what the cache reads is verified */
+    if (integrity_options.table_file != NULL) {
+        struct bius_operations backend = operations;
+        pthread_t stats_thread;
+
+        /* A last partial block cannot have a checksum */
+        options.disk_size -= options.disk_size % BIUS_INTEGRITY_BLOCK_SIZE;
+        integrity_options.disk_size = options.disk_size;
+        result = bius_integrity_create(&backend, &integrity_options, &operations);
+        if (result < 0) {
+            fprintf(stderr, "bius_integrity_create failed: %s\n", strerror(-result));
+            return 1;
+        }
+
+        result = pthread_create(&stats_thread, NULL, integrity_stats_main, NULL);
+        if (result != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(result));
+            return 1;
+        }
+    }
+
+    /* Checksums cover what is stored, and the cache holds decrypted blocks */
+    if (key_file != NULL) {
+        struct bius_operations backend = operations;
+        unsigned char key[65];
+        /* Discards are not passed, as dm-crypt does by default */
+        struct bius_crypt_options crypt_options = {
+            .key = key,
+        };
+        ssize_t key_size = read_key(key_file, key, sizeof(key));
+
+        if (key_size < 0)
+            return 1;
+        crypt_options.key_size = key_size;
+        result = bius_crypt_create(&backend, &crypt_options, &operations);
+        explicit_bzero(key, sizeof(key));
+        if (result < 0) {
+            fprintf(stderr, "bius_crypt_create failed: %s\n", strerror(-result));
+            return 1;
+        }
+    }
+
+    if (cache_options.capacity > 0) {
+        struct bius_operations backend = operations;
+
+        cache_options.disk_size = options.disk_size;
+        result = bius_cache_create(&backend, &cache_options, &operations);
+        if (result < 0) {
+            fprintf(stderr, "bius_cache_create failed: %s\n", strerror(-result));
+            return 1;
+        }
+        options.volatile_write_cache = true;
+    }
+
     strncpy(options.disk_name, "passthrough", MAX_DISK_NAME_LEN);
 
-    return bius_main(&operations, &options);
+    result = bius_main(&operations, &options);
+    /* The cache writes back through the integrity layer */
+    if (cache_options.capacity > 0 && bius_cache_destroy() < 0)
+        fprintf(stderr, "Writing back the cache failed\n");
+    if (key_file != NULL)
+        bius_crypt_destroy();
+    if (integrity_options.table_file != NULL && bius_integrity_destroy() < 0)
+        fprintf(stderr, "Writing back the checksums failed\n");
+    if (wal_options.log_file != NULL && bius_wal_destroy() < 0)
+        fprintf(stderr, "Checkpointing the log failed\n");
+
+    return result;
 }
@@ -0,0 +1,187 @@
+#ifndef RAMDISK_COMMON_H
+#define RAMDISK_COMMON_H
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Sparse ramdisk. The whole capacity is reserved as virtual memory up front, but memory is only
+ * populated when written. Population is tracked per 2 MiB chunk, so that reads of chunks which
+ * were never written are served as zeros without touching the reserved area. Chunks left all zero
+ * by a discard are given back to the kernel.
+ */
+
+#define RAMDISK_CHUNK_SIZE (2lu * 1024 * 1024)
+#define RAMDISK_BITS_PER_WORD (sizeof(unsigned long) * 8)
+#define RAMDISK_NUM_LOCKS 64
+
+size_t ramdisk_size;
+char *ramdisk_data;
+/* Bitmap of chunks which may hold non-zero data */
+unsigned long *ramdisk_chunk_map;
+/* Writes and zeroing hold the lock of their chunk shared, freeing a partially discarded chunk holds it exclusive */
+pthread_rwlock_t ramdisk_chunk_locks[RAMDISK_NUM_LOCKS];
+
+static inline bool ramdisk_chunk_populated(size_t chunk) {
+    unsigned long word = __atomic_load_n(&ramdisk_chunk_map[chunk / RAMDISK_BITS_PER_WORD], __ATOMIC_ACQUIRE);
+    return word & (1lu << (chunk % RAMDISK_BITS_PER_WORD));
+}
+
+static inline void ramdisk_mark_chunk(size_t chunk, bool populated) {
+    unsigned long *word = &ramdisk_chunk_map[chunk / RAMDISK_BITS_PER_WORD];
+    unsigned long bit = 1lu << (chunk % RAMDISK_BITS_PER_WORD);
+
+    if (populated)
+        __atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
+    else
+        __atomic_fetch_and(word, ~bit, __ATOMIC_RELEASE);
+}
+
+static inline bool ramdisk_chunk_zero(size_t chunk) {
+    const unsigned long *words = (const unsigned long *)(ramdisk_data + chunk * RAMDISK_CHUNK_SIZE);
+
+    for (size_t i = 0; i < RAMDISK_CHUNK_SIZE / sizeof(unsigned long); i++) {
+        if (words[i] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static inline size_t ramdisk_populated_size() {
+    size_t num_chunks = (ramdisk_size + RAMDISK_CHUNK_SIZE - 1) / RAMDISK_CHUNK_SIZE;
+    size_t populated = 0;
+
+    for (size_t i = 0; i < num_chunks; i++) {
+        if (ramdisk_chunk_populated(i))
+            populated++;
+    }
+
+    return populated * RAMDISK_CHUNK_SIZE;
+}
+
+static int ramdisk_initialize(size_t size) {
+    size_t num_chunks = (size + RAMDISK_CHUNK_SIZE - 1) / RAMDISK_CHUNK_SIZE;
+    size_t reserved_size = num_chunks * RAMDISK_CHUNK_SIZE + RAMDISK_CHUNK_SIZE;
+    char *reserved;
+
+    reserved = mmap(NULL, reserved_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Align to the chunk size so that each chunk can be backed by a single huge page */
+    ramdisk_data = (char *)(((unsigned long)reserved + RAMDISK_CHUNK_SIZE - 1) & ~(RAMDISK_CHUNK_SIZE - 1));
+    if (madvise(ramdisk_data, num_chunks * RAMDISK_CHUNK_SIZE, MADV_HUGEPAGE) < 0)
+        printd("madvise(MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+
+    ramdisk_chunk_map = calloc((num_chunks + RAMDISK_BITS_PER_WORD - 1) / RAMDISK_BITS_PER_WORD, sizeof(unsigned long));
+    if (ramdisk_chunk_map == NULL) {
+        fprintf(stderr, "chunk map allocation failed\n");
+        munmap(reserved, reserved_size);
+        return -1;
+    }
+
+    for (int i = 0; i < RAMDISK_NUM_LOCKS; i++)
+        pthread_rwlock_init(&ramdisk_chunk_locks[i], NULL);
+
+    ramdisk_size = size;
+    return 0;
+}
+
+static blk_status_t ramdisk_read(void *data, off64_t offset, size_t length) {
+    char *dest = data;
+
+    while (length > 0) {
+        size_t chunk = offset / RAMDISK_CHUNK_SIZE;
+        size_t size = min(length, RAMDISK_CHUNK_SIZE - offset % RAMDISK_CHUNK_SIZE);
+
+        if (ramdisk_chunk_populated(chunk))
+            memcpy(dest, ramdisk_data + offset, size);
+        else
+            memset(dest, 0, size);
+
+        dest += size;
+        offset += size;
+        length -= size;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t ramdisk_write(const void *data, off64_t offset, size_t length) {
+    const char *src = data;
+
+    while (length > 0) {
+        size_t chunk = offset / RAMDISK_CHUNK_SIZE;
+        size_t size = min(length, RAMDISK_CHUNK_SIZE - offset % RAMDISK_CHUNK_SIZE);
+
+        pthread_rwlock_rdlock(&ramdisk_chunk_locks[chunk % RAMDISK_NUM_LOCKS]);
+        memcpy(ramdisk_data + offset, src, size);
+        if (!ramdisk_chunk_populated(chunk))
+            ramdisk_mark_chunk(chunk, true);
+        pthread_rwlock_unlock(&ramdisk_chunk_locks[chunk % RAMDISK_NUM_LOCKS]);
+
+        src += size;
+        offset += size;
+        length -= size;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t ramdisk_free_chunk(size_t chunk) {
+    ramdisk_mark_chunk(chunk, false);
+    if (madvise(ramdisk_data + chunk * RAMDISK_CHUNK_SIZE, RAMDISK_CHUNK_SIZE, MADV_DONTNEED) < 0) {
+        fprintf(stderr, "madvise(MADV_DONTNEED) failed: %s\n", strerror(errno));
+        return BLK_STS_IOERR;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t ramdisk_discard(off64_t offset, size_t length) {
+    while (length > 0) {
+        size_t chunk = offset / RAMDISK_CHUNK_SIZE;
+        size_t size = min(length, RAMDISK_CHUNK_SIZE - offset % RAMDISK_CHUNK_SIZE);
+        pthread_rwlock_t *lock = &ramdisk_chunk_locks[chunk % RAMDISK_NUM_LOCKS];
+        blk_status_t result = BLK_STS_OK;
+
+        if (ramdisk_chunk_populated(chunk)) {
+            if (size == RAMDISK_CHUNK_SIZE) {
+                result = ramdisk_free_chunk(chunk);
+            } else {
+                pthread_rwlock_rdlock(lock);
+                memset(ramdisk_data + offset, 0, size);
+                pthread_rwlock_unlock(lock);
+
+                /* Writes elsewhere in the chunk must not land between the check and the free */
+                pthread_rwlock_wrlock(lock);
+                if (ramdisk_chunk_populated(chunk) && ramdisk_chunk_zero(chunk))
+                    result = ramdisk_free_chunk(chunk);
+                pthread_rwlock_unlock(lock);
+            }
+            if (result != BLK_STS_OK)
+                return result;
+        }
+
+        offset += size;
+        length -= size;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t ramdisk_flush() {
+    return BLK_STS_OK;
+}
+
+#endif // RAMDISK_COMMON_H
@@ -1,35 +1,16 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "libbius.h"
 #include "utils.h"
+#include "ramdisk-common.h"
 
 #define RAMDISK_SIZE (32lu * 1024 * 1024 * 1024)
 
-char in_memory_data[RAMDISK_SIZE];
-
-static blk_status_t ramdisk_read(void *data, off64_t offset, size_t length) {
-    memcpy(data, in_memory_data + offset, length);
-    return BLK_STS_OK;
-}
-
-static blk_status_t ramdisk_write(const void *data, off64_t offset, size_t length) {
-    memcpy(in_memory_data + offset, data, length);
-    return BLK_STS_OK;
-}
-
-static blk_status_t ramdisk_discard(off64_t offset, size_t length) {
-    memset(in_memory_data + offset, 0, length);
-    return BLK_STS_OK;
-}
-
-static blk_status_t ramdisk_flush() {
-    return BLK_STS_OK;
-}
-
 int main(int argc, char *argv[]) {
     struct bius_operations operations = {
         .read = ramdisk_read,
@@ -42,9 +23,27 @@ int main(int argc, char *argv[]) {
         .num_threads = 4,
         .disk_size = RAMDISK_SIZE,
     };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+            case 's':
+                options.disk_size = parse_size(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s size]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (options.disk_size == 0 || options.disk_size % SECTOR_SIZE != 0) {
+        fprintf(stderr, "Disk size must be a non-zero multiple of %d\n", SECTOR_SIZE);
+        return 1;
+    }
     strncpy(options.disk_name, "ramdisk", MAX_DISK_NAME_LEN);
 
-    memset(in_memory_data, 0, RAMDISK_SIZE);
+    if (ramdisk_initialize(options.disk_size) < 0)
+        return 1;
 
     printf("Ready.\n");
     fflush(stdout);
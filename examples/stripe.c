@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Striped device over files or block devices.
+ *
+ *   stripe [-n disk name] [-s stripe size] target...
+ *     exports the targets as one device of which every n-th stripe is on the same target. The
+ *     same targets must be given in the same order each time.
+ */
+
+#define MAX_TARGETS 8
+
+static int target_fds[MAX_TARGETS];
+
+DEFINE_FD_OPERATIONS(target_fds, 0)
+DEFINE_FD_OPERATIONS(target_fds, 1)
+DEFINE_FD_OPERATIONS(target_fds, 2)
+DEFINE_FD_OPERATIONS(target_fds, 3)
+DEFINE_FD_OPERATIONS(target_fds, 4)
+DEFINE_FD_OPERATIONS(target_fds, 5)
+DEFINE_FD_OPERATIONS(target_fds, 6)
+DEFINE_FD_OPERATIONS(target_fds, 7)
+
+static const struct bius_operations target_operations[MAX_TARGETS] = {
+    FD_OPERATIONS(target_fds, 0),
+    FD_OPERATIONS(target_fds, 1),
+    FD_OPERATIONS(target_fds, 2),
+    FD_OPERATIONS(target_fds, 3),
+    FD_OPERATIONS(target_fds, 4),
+    FD_OPERATIONS(target_fds, 5),
+    FD_OPERATIONS(target_fds, 6),
+    FD_OPERATIONS(target_fds, 7),
+};
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-n disk name] [-s stripe size] target...\n", program);
+    fprintf(stderr, "  up to %d targets, regular files or block devices\n", MAX_TARGETS);
+}
+
+int main(int argc, char *argv[]) {
+    struct bius_operations operations;
+    struct bius_operations targets[MAX_TARGETS];
+    struct bius_block_device_options options = {
+        .model = BLK_ZONED_NONE,
+        .num_threads = 4,
+    };
+    struct bius_stripe_options stripe_options = {0};
+    const char *disk_name = "stripe";
+    unsigned int nr_targets;
+    int opt;
+    int result;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                disk_name = optarg;
+                break;
+            case 's':
+                stripe_options.stripe_size = parse_size(optarg);
+                if (stripe_options.stripe_size == 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    nr_targets = argc - optind;
+    if (nr_targets == 0 || nr_targets > MAX_TARGETS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < nr_targets; i++) {
+        const char *path = argv[optind + i];
+        unsigned long size;
+        struct stat target_stat;
+
+        target_fds[i] = open(path, O_RDWR);
+        if (target_fds[i] < 0) {
+            fprintf(stderr, "Opening %s failed: %s\n", path, strerror(errno));
+            return 1;
+        }
+
+        if (fstat(target_fds[i], &target_stat) < 0) {
+            fprintf(stderr, "fstat failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        targets[i] = target_operations[i];
+        if (S_ISREG(target_stat.st_mode)) {
+            size = target_stat.st_size;
+        } else if (ioctl(target_fds[i], BLKGETSIZE64, &size) < 0) {
+            fprintf(stderr, "ioctl BLKGETSIZE64 failed: %s\n", strerror(errno));
+            return 1;
+        } else {
+            /* Punching holes is for files */
+            targets[i].discard = NULL;
+        }
+
+        /* The smallest target limits the others */
+        if (i == 0 || size < stripe_options.target_size)
+            stripe_options.target_size = size;
+    }
+
+    result = bius_stripe_create(targets, nr_targets, &stripe_options, &operations, &options.disk_size);
+    if (result < 0) {
+        fprintf(stderr, "bius_stripe_create failed: %s\n", strerror(-result));
+        return 1;
+    }
+    printd("disk_size = %lu\n", options.disk_size);
+    strncpy(options.disk_name, disk_name, MAX_DISK_NAME_LEN - 1);
+
+    result = bius_main(&operations, &options);
+    bius_stripe_destroy();
+
+    return result;
+}
@@ -1,6 +1,15 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libbius.h"
+
 #ifdef DEBUG
 #define printd(format, ...) fprintf(stderr, format, ##__VA_ARGS__)
 #else
@@ -11,4 +20,140 @@ static inline int printd(const char *format, ...) {
 
 #define min(x, y) ((x) > (y) ? (y) : (x))
 
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000lu + ts.tv_nsec;
+}
+
+/* Parses a size with an optional K, M or G suffix. Returns 0 on malformed input. */
+static inline size_t parse_size(const char *str) {
+    char *end;
+    size_t size = strtoul(str, &end, 0);
+
+    if (end == str)
+        return 0;
+
+    switch (*end) {
+        case 'G':
+        case 'g':
+            size <<= 10;
+        case 'M':
+        case 'm':
+            size <<= 10;
+        case 'K':
+        case 'k':
+            size <<= 10;
+            end++;
+        case '\0':
+            break;
+        default:
+            return 0;
+    }
+
+    return *end == '\0' ? size : 0;
+}
+
+/* Operations over a file or block device, for examples built with the GNU preadv2 and fallocate */
+#ifdef _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* Transfers the whole vector at offset in fd, continuing after short transfers */
+static inline blk_status_t fd_transfer_iov(int fd, const struct iovec *iov, int iovcnt, off64_t offset, bool is_write) {
+    struct iovec remaining[BIUS_MAX_IOV];
+    struct iovec *current = remaining;
+
+    memcpy(remaining, iov, sizeof(struct iovec) * iovcnt);
+    while (iovcnt > 0) {
+        ssize_t result = is_write ? pwritev2(fd, current, iovcnt, offset, 0) : preadv2(fd, current, iovcnt, offset, 0);
+
+        if (result <= 0) {
+            fprintf(stderr, "%s failed: %s\n", is_write ? "pwritev2" : "preadv2", strerror(errno));
+            return BLK_STS_IOERR;
+        }
+
+        /* Skip what was transferred after a short transfer */
+        offset += result;
+        while (iovcnt > 0 && result >= current->iov_len) {
+            result -= current->iov_len;
+            current++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            current->iov_base += result;
+            current->iov_len -= result;
+        }
+    }
+
+    return BLK_STS_OK;
+}
+
+static inline blk_status_t fd_read(int fd, void *data, off64_t offset, size_t length) {
+    struct iovec iov = {data, length};
+
+    return fd_transfer_iov(fd, &iov, 1, offset, false);
+}
+
+static inline blk_status_t fd_write(int fd, const void *data, off64_t offset, size_t length) {
+    struct iovec iov = {(void *)data, length};
+
+    return fd_transfer_iov(fd, &iov, 1, offset, true);
+}
+
+/* Punches a hole, which only regular files support */
+static inline blk_status_t fd_discard(int fd, off64_t offset, size_t length) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) < 0) {
+        fprintf(stderr, "fallocate PUNCH_HOLE failed: %s\n", strerror(errno));
+        return BLK_STS_IOERR;
+    }
+
+    return BLK_STS_OK;
+}
+
+static inline blk_status_t fd_flush(int fd) {
+    if (fdatasync(fd) < 0) {
+        fprintf(stderr, "fdatasync failed: %s\n", strerror(errno));
+        return BLK_STS_IOERR;
+    }
+
+    return BLK_STS_OK;
+}
+
+/*
+ * Operations carry no context, so a device over several descriptors needs a set of operations
+ * bound to each. DEFINE_FD_OPERATIONS(fds, n) defines the set for fds[n] and FD_OPERATIONS(fds, n)
+ * initializes a struct bius_operations with it.
+ */
+#define DEFINE_FD_OPERATIONS(fds, n) \
+    static blk_status_t fds##n##_read(void *data, off64_t offset, size_t length) { \
+        return fd_read(fds[n], data, offset, length); \
+    } \
+    static blk_status_t fds##n##_write(const void *data, off64_t offset, size_t length) { \
+        return fd_write(fds[n], data, offset, length); \
+    } \
+    static blk_status_t fds##n##_read_iov(const struct iovec *iov, int iovcnt, off64_t offset) { \
+        return fd_transfer_iov(fds[n], iov, iovcnt, offset, false); \
+    } \
+    static blk_status_t fds##n##_write_iov(const struct iovec *iov, int iovcnt, off64_t offset) { \
+        return fd_transfer_iov(fds[n], iov, iovcnt, offset, true); \
+    } \
+    static blk_status_t fds##n##_discard(off64_t offset, size_t length) { \
+        return fd_discard(fds[n], offset, length); \
+    } \
+    static blk_status_t fds##n##_flush() { \
+        return fd_flush(fds[n]); \
+    }
+
+#define FD_OPERATIONS(fds, n) { \
+        .read = fds##n##_read, \
+        .write = fds##n##_write, \
+        .read_iov = fds##n##_read_iov, \
+        .write_iov = fds##n##_write_iov, \
+        .discard = fds##n##_discard, \
+        .flush = fds##n##_flush, \
+    }
+#endif
+
 #endif
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Measures small synchronous writes, each a write then a flush as a database commits, from several
+ * threads at once. They go to a file answering each flush with an fdatasync, then through the
+ * write-ahead log over the same file, whose commits are shared between the threads.
+ */
+
+static int target_fds[1];
+static struct bius_operations operations;
+static size_t request_size = 4096;
+static size_t disk_size = 256 * 1024 * 1024;
+static unsigned int requests_per_thread = 1000;
+static bool failed;
+
+DEFINE_FD_OPERATIONS(target_fds, 0)
+
+static void *writer_main(void *arg) {
+    unsigned int seed = (uintptr_t)arg;
+    char *buffer = malloc(request_size);
+
+    if (buffer == NULL) {
+        failed = true;
+        return NULL;
+    }
+    memset(buffer, seed, request_size);
+
+    for (unsigned int i = 0; i < requests_per_thread; i++) {
+        const off64_t offset = rand_r(&seed) % (disk_size / request_size) * request_size;
+
+        if (operations.write(buffer, offset, request_size) != BLK_STS_OK || operations.flush() != BLK_STS_OK) {
+            failed = true;
+            break;
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static int run(const char *name, unsigned int nr_threads) {
+    pthread_t threads[nr_threads];
+    const unsigned long nr_requests = (unsigned long)nr_threads * requests_per_thread;
+    uint64_t elapsed = now_ns();
+
+    for (unsigned int i = 0; i < nr_threads; i++) {
+        if (pthread_create(&threads[i], NULL, writer_main, (void *)(uintptr_t)(i + 1)) != 0)
+            return -1;
+    }
+    for (unsigned int i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = now_ns() - elapsed;
+
+    printf("%-6s %9.0f writes/s %9.1f us per write and flush\n", name, nr_requests * 1e9 / elapsed, (double)elapsed * nr_threads / nr_requests / 1000);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct bius_operations backend = FD_OPERATIONS(target_fds, 0);
+    struct bius_wal_options options = {0};
+    struct bius_wal_stats stats;
+    unsigned int nr_threads = 4;
+    int opt;
+    int result;
+
+    while ((opt = getopt(argc, argv, "s:d:t:n:")) != -1) {
+        switch (opt) {
+            case 's':
+                request_size = parse_size(optarg);
+                break;
+            case 'd':
+                disk_size = parse_size(optarg);
+                break;
+            case 't':
+                nr_threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                requests_per_thread = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s request size] [-d disk size] [-t threads] [-n requests per thread] target log\n", argv[0]);
+                fprintf(stderr, "  target is a file created with the disk size, the log is created if missing\n");
+                return 1;
+        }
+    }
+
+    if (argc - optind != 2 || nr_threads == 0) {
+        fprintf(stderr, "Target and log paths not given.\n");
+        return 1;
+    }
+    if (request_size == 0 || request_size % BIUS_WAL_BLOCK_SIZE != 0 || disk_size < request_size || disk_size % BIUS_WAL_BLOCK_SIZE != 0) {
+        fprintf(stderr, "Sizes must be non-zero multiples of %d, and the disk no smaller than requests\n", BIUS_WAL_BLOCK_SIZE);
+        return 1;
+    }
+
+    target_fds[0] = open(argv[optind], O_RDWR | O_CREAT, 0600);
+    if (target_fds[0] < 0 || ftruncate(target_fds[0], disk_size) < 0) {
+        fprintf(stderr, "Target open failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    operations = backend;
+    if (run("file", nr_threads) < 0) {
+        fprintf(stderr, "Writing the target failed\n");
+        return 1;
+    }
+
+    options.disk_size = disk_size;
+    options.log_file = argv[optind + 1];
+    options.small_write_size = request_size;
+    result = bius_wal_create(&backend, &options, &operations);
+    if (result < 0) {
+        fprintf(stderr, "bius_wal_create failed: %s\n", strerror(-result));
+        return 1;
+    }
+    if (run("wal", nr_threads) < 0) {
+        fprintf(stderr, "Writing through the log failed\n");
+        return 1;
+    }
+
+    bius_wal_get_stats(&stats);
+    printf("%lu writes logged in %lu commits, %lu blocks checkpointed\n", stats.logged_writes, stats.commits, stats.checkpointed_blocks);
+    if (bius_wal_destroy() < 0) {
+        fprintf(stderr, "Checkpointing the log failed\n");
+        return 1;
+    }
+
+    close(target_fds[0]);
+    return 0;
+}
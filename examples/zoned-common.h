@@ -8,13 +8,14 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
+#include <unistd.h>
 #include "libbius.h"
 #include "utils.h"
 
 extern size_t zoned_disk_size;
 extern size_t zone_size;
+extern size_t zone_capacity;
 extern unsigned int num_conventional_zones;
-#define num_zones (zoned_disk_size / zone_size)
 extern unsigned int max_open_zones;
 extern unsigned int max_active_zones;
 extern blk_status_t (*raw_read)(void *data, off64_t offset, size_t length);
@@ -28,6 +29,13 @@ struct zone_stat {
     unsigned long discard_count;
 };
 
+/* Derived from zoned_disk_size and zone_size by initialize() */
+unsigned int num_zones;
+/* log2(zone_size), which the kernel requires to be a power of two */
+unsigned int zone_size_shift;
+/* Number of zones requested with -n, 0 if the whole disk should be used */
+unsigned int requested_num_zones;
+
 pthread_spinlock_t global_lock;
 unsigned int num_open_zones;
 unsigned int num_imp_open_zones;
@@ -38,24 +46,26 @@ struct blk_zone *zone_info;
 struct zone_stat *stats;
 
 static void initialize_zone_info() {
+    const unsigned long zone_sectors = zone_size / SECTOR_SIZE;
+
     memset(zone_info, 0, sizeof(struct blk_zone) * num_zones);
 
     for (int i = 0; i < num_conventional_zones; i++ ) {
-        zone_info[i].start = ZONE_SIZE / SECTOR_SIZE * i;
-        zone_info[i].len = ZONE_SIZE / SECTOR_SIZE;
-        zone_info[i].wp = ZONE_SIZE / SECTOR_SIZE * i;
+        zone_info[i].start = zone_sectors * i;
+        zone_info[i].len = zone_sectors;
+        zone_info[i].wp = zone_sectors * i;
         zone_info[i].type = BLK_ZONE_TYPE_CONVENTIONAL;
         zone_info[i].cond = BLK_ZONE_COND_NOT_WP;
-        zone_info[i].capacity = ZONE_SIZE / SECTOR_SIZE;
+        zone_info[i].capacity = zone_sectors;
     }
 
     for (int i = num_conventional_zones; i < num_zones; i++) {
-        zone_info[i].start = ZONE_SIZE / SECTOR_SIZE * i;
-        zone_info[i].len = ZONE_SIZE / SECTOR_SIZE;
-        zone_info[i].wp = ZONE_SIZE / SECTOR_SIZE * i;
+        zone_info[i].start = zone_sectors * i;
+        zone_info[i].len = zone_sectors;
+        zone_info[i].wp = zone_sectors * i;
         zone_info[i].type = BLK_ZONE_TYPE_SEQWRITE_REQ;
         zone_info[i].cond = BLK_ZONE_COND_EMPTY;
-        zone_info[i].capacity = ZONE_SIZE / SECTOR_SIZE;
+        zone_info[i].capacity = zone_capacity / SECTOR_SIZE;
     }
 
     num_open_zones = 0;
@@ -63,9 +73,91 @@ static void initialize_zone_info() {
     num_active_zones = 0;
 }
 
+static void print_zone_options_usage(const char *program, const char *arguments) {
+    fprintf(stderr, "Usage: %s [options]%s\n", program, arguments);
+    fprintf(stderr, "  -z SIZE   zone size (default: %lu)\n", zone_size);
+    fprintf(stderr, "  -c SIZE   zone capacity, at most the zone size (default: zone size)\n");
+    fprintf(stderr, "  -n COUNT  number of zones (default: as many as fit in the disk)\n");
+    fprintf(stderr, "  -C COUNT  number of conventional zones (default: %u)\n", num_conventional_zones);
+    fprintf(stderr, "  -o COUNT  maximum number of open zones (default: %u)\n", max_open_zones);
+    fprintf(stderr, "  -a COUNT  maximum number of active zones (default: %u)\n", max_active_zones);
+    fprintf(stderr, "SIZE accepts K, M and G suffixes.\n");
+}
+
+/* Parses zone geometry options. Returns the index of the first non-option argument, or -1 on error. */
+static int parse_zone_options(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "z:c:n:C:o:a:")) != -1) {
+        switch (opt) {
+            case 'z':
+                zone_size = parse_size(optarg);
+                break;
+            case 'c':
+                zone_capacity = parse_size(optarg);
+                break;
+            case 'n':
+                requested_num_zones = strtoul(optarg, NULL, 0);
+                break;
+            case 'C':
+                num_conventional_zones = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                max_open_zones = strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                max_active_zones = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if (zone_size < SECTOR_SIZE || (zone_size & (zone_size - 1)) != 0) {
+        fprintf(stderr, "Zone size must be a power of two no smaller than %d\n", SECTOR_SIZE);
+        return -1;
+    }
+    if (zone_capacity == 0)
+        zone_capacity = zone_size;
+    if (zone_capacity > zone_size || zone_capacity % SECTOR_SIZE != 0) {
+        fprintf(stderr, "Zone capacity must be a multiple of %d not larger than the zone size\n", SECTOR_SIZE);
+        return -1;
+    }
+
+    return optind;
+}
+
+/* Sets zoned_disk_size to the largest zoned area that fits in disk_size */
+static int set_zoned_disk_size(size_t disk_size) {
+    size_t zones = disk_size / zone_size;
+
+    if (requested_num_zones != 0) {
+        if (requested_num_zones > zones) {
+            fprintf(stderr, "%u zones do not fit in %lu bytes\n", requested_num_zones, disk_size);
+            return -1;
+        }
+        zones = requested_num_zones;
+    }
+
+    if (zones == 0) {
+        fprintf(stderr, "Invalid number of zones: %lu\n", zones);
+        return -1;
+    }
+    if (num_conventional_zones > zones) {
+        fprintf(stderr, "Number of conventional zones is larger than number of zones: %u\n", num_conventional_zones);
+        return -1;
+    }
+
+    zoned_disk_size = zones * zone_size;
+    return 0;
+}
+
 static void initialize() {
     int error;
 
+    num_zones = zoned_disk_size / zone_size;
+    zone_size_shift = __builtin_ctzl(zone_size);
+
     error = pthread_spin_init(&global_lock, PTHREAD_PROCESS_PRIVATE);
     if (error < 0) {
         fprintf(stderr, "pthread_spin_init failed: %s\n", strerror(error));
@@ -92,7 +184,7 @@ static void initialize() {
 }
 
 static inline unsigned int zone_number(off64_t offset) {
-    return offset / ZONE_SIZE;
+    return offset >> zone_size_shift;
 }
 
 static inline void close_imp_open_zone(unsigned int zone_to_skip) {
@@ -74,6 +74,7 @@ static blk_status_t passthrough_flush() {
 
 size_t zoned_disk_size;
 size_t zone_size = ZONE_SIZE;
+size_t zone_capacity = 0;
 unsigned int num_conventional_zones = 0;
 unsigned int max_open_zones = 32;
 unsigned int max_active_zones = 64;
@@ -92,29 +93,35 @@ int main(int argc, char *argv[]) {
         .model = BLK_ZONED_HM,
         .num_threads = 4,
     };
+    size_t target_size;
+    int arg_index;
 
-    if (argc <  2) {
-        fprintf(stderr, "Target path not given.\n");
+    arg_index = parse_zone_options(argc, argv);
+    if (arg_index < 0 || arg_index >= argc) {
+        print_zone_options_usage(argv[0], " target");
         return 1;
     }
 
-    target_fd = open(argv[1], O_RDWR);
+    target_fd = open(argv[arg_index], O_RDWR);
     if (target_fd < 0) {
         fprintf(stderr, "Target open failed: %s\n", strerror(errno));
         return 1;
     }
 
-    if (ioctl(target_fd, BLKGETSIZE64, &zoned_disk_size) < 0) {
+    if (ioctl(target_fd, BLKGETSIZE64, &target_size) < 0) {
         fprintf(stderr, "ioctl BLKGETSIZE64 failed: %s\n", strerror(errno));
         return 1;
     }
-    zoned_disk_size = zoned_disk_size - (zoned_disk_size % ZONE_SIZE);
-    printd("disk_size = %lu, num_zones = %lu\n", zoned_disk_size, num_zones);
+    if (set_zoned_disk_size(target_size) < 0)
+        return 1;
+
+    initialize();
+    printd("disk_size = %lu, num_zones = %u\n", zoned_disk_size, num_zones);
 
     options.disk_size = zoned_disk_size;
+    options.max_open_zones = max_open_zones;
+    options.max_active_zones = max_active_zones;
     strncpy(options.disk_name, "zoned-passthrough", MAX_DISK_NAME_LEN);
 
-    initialize();
-
     return bius_main(&operations, &options);
 }
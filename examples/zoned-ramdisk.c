@@ -10,32 +10,14 @@
 #include "libbius.h"
 #include "utils.h"
 
+#include "ramdisk-common.h"
+
 #define RAMDISK_SIZE (32lu * 1024 * 1024 * 1024)
 #define ZONE_SIZE (32 * 1024 * 1024)
 
-char in_memory_data[RAMDISK_SIZE];
-
-static blk_status_t ramdisk_read(void *data, off64_t offset, size_t length) {
-    memcpy(data, in_memory_data + offset, length);
-    return BLK_STS_OK;
-}
-
-static blk_status_t ramdisk_write(const void *data, off64_t offset, size_t length) {
-    memcpy(in_memory_data + offset, data, length);
-    return BLK_STS_OK;
-}
-
-static blk_status_t ramdisk_discard(off64_t offset, size_t length) {
-    memset(in_memory_data + offset, 0, length);
-    return BLK_STS_OK;
-}
-
-static blk_status_t ramdisk_flush() {
-    return BLK_STS_OK;
-}
-
-size_t zoned_disk_size = RAMDISK_SIZE;
+size_t zoned_disk_size;
 size_t zone_size = ZONE_SIZE;
+size_t zone_capacity = 0;
 unsigned int num_conventional_zones = 0;
 unsigned int max_open_zones = 32;
 unsigned int max_active_zones = 64;
@@ -60,7 +42,7 @@ void sigint_handler(int signum) {
         pthread_spin_unlock(&zone_locks[i]);
     }
 
-    printf("total: read = %lu / write = %lu / discard = %lu\n\n", read_total, write_total, discard_total);
+    printf("total: read = %lu / write = %lu / discard = %lu / populated = %lu\n\n", read_total, write_total, discard_total, ramdisk_populated_size());
     fflush(stdout);
 }
 
@@ -88,13 +70,25 @@ int main(int argc, char *argv[]) {
     struct bius_block_device_options options = {
         .model = BLK_ZONED_HM,
         .num_threads = 4,
-        .disk_size = RAMDISK_SIZE
     };
+
+    if (parse_zone_options(argc, argv) < 0) {
+        print_zone_options_usage(argv[0], "");
+        return 1;
+    }
+    if (set_zoned_disk_size(RAMDISK_SIZE) < 0)
+        return 1;
+    printd("disk_size = %lu, zone_size = %lu, zone_capacity = %lu\n", zoned_disk_size, zone_size, zone_capacity);
+
+    options.disk_size = zoned_disk_size;
+    options.max_open_zones = max_open_zones;
+    options.max_active_zones = max_active_zones;
     strncpy(options.disk_name, "zoned-ramdisk", MAX_DISK_NAME_LEN);
 
     set_interrupt_handler();
     initialize();
-    memset(in_memory_data, 0, RAMDISK_SIZE);
+    if (ramdisk_initialize(zoned_disk_size) < 0)
+        return 1;
 
     printf("Ready.\n");
     fflush(stdout);
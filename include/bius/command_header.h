@@ -42,12 +42,30 @@ struct bius_u2k_header {
     uint64_t user_data;
 };
 
+enum bius_thread_pinning {
+    BIUS_PIN_NONE = 0,      /* Threads are not pinned */
+    BIUS_PIN_NODE = 1,      /* All threads run on the CPUs of numa_node */
+    BIUS_PIN_SPREAD = 2,    /* Threads are spread over the online nodes, each on the CPUs of its node */
+};
+
 struct bius_block_device_options {
     enum blk_zoned_model model;
     unsigned int num_threads;
     unsigned long disk_size;
     unsigned int max_open_zones;
     unsigned int max_active_zones;
+    enum bius_thread_pinning thread_pinning;
+    int numa_node;
+    /* Completed writes may be lost until a flush, so the kernel must send flushes */
+    bool volatile_write_cache;
+    /*
+     * Large requests may be mapped into userspace instead of copied, toggled later through sysfs.
+     * Device creation fails with -EOPNOTSUPP if the module was built without CONFIG_BIUS_DATAMAP.
+     */
+    bool data_map;
+    /* Set by libbius from bius_operations, so that the kernel only sends what the backend serves */
+    bool discard;
+    bool write_zeroes;
     char disk_name[MAX_DISK_NAME_LEN];
 };
 
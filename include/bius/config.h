@@ -12,7 +12,13 @@
 
 #define BIUS_MAX_ZONES (128 * 1024)
 
+/*
+ * Builds the code mapping data into userspace instead of copying it, which needs a kernel patched
+ * with etc/kernel.patch for partial_map_pfn and flush_tlb_mm_range. Whether a device maps, and
+ * above which length, is then chosen at runtime.
+ */
 //#define CONFIG_BIUS_DATAMAP
+/* Initial length above which data is mapped, adapted per device at runtime */
 #define BIUS_MAP_DATA_THRESHOLD (128 * 1024)
 
 #endif
@@ -13,6 +13,7 @@ typedef enum bius_req {
     BIUS_DISCARD = 4,
     BIUS_IOCTL = 5,
     BIUS_FLUSH = 6,
+    BIUS_WRITE_ZEROES = 8,
     BIUS_REPORT_ZONES = 9,
     BIUS_ZONE_OPEN = 10,
     BIUS_ZONE_CLOSE = 11,
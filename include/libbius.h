@@ -3,16 +3,21 @@
 
 #include <linux/blkzoned.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
 #include <bius/blk_status.h>
 #include <bius/command_header.h>
 
 #define SECTOR_SIZE 512
 #define BIUS_DEFAULT_NUM_THREADS 4
+/* Maximum iovcnt passed to read_iov and write_iov */
+#define BIUS_MAX_IOV 256
 
 struct bius_operations {
     blk_status_t (*read)(void *data, off64_t offset, size_t length);
     blk_status_t (*write)(const void *data, off64_t offset, size_t length);
     blk_status_t (*discard)(off64_t offset, size_t length);
+    /* Called by one worker at a time, for all the flushes which arrived before the call */
     blk_status_t (*flush)();
     int (*report_zones)(off64_t offset, int nr_zones, struct blk_zone *zones);
     blk_status_t (*open_zone)(off64_t offset);
@@ -24,8 +29,442 @@ struct bius_operations {
 #ifdef CONFIG_ZONE_DESC_EXT
     blk_status_t (*zone_set_desc)(const void *data, size_t length);
 #endif
+    /*
+     * Optional vectored variants of read and write, transferring iov in order starting at offset.
+     * When given, libbius coalesces small contiguous requests of the same direction into one call,
+     * and serves data mapped requests made of several segments with one call instead of one per
+     * segment. Coalesced requests are still completed individually with the result of the call.
+     */
+    blk_status_t (*read_iov)(const struct iovec *iov, int iovcnt, off64_t offset);
+    blk_status_t (*write_iov)(const struct iovec *iov, int iovcnt, off64_t offset);
+    /* Optional, makes the range read as zeros. Like discard, only offered by the device when given. */
+    blk_status_t (*write_zeroes)(off64_t offset, size_t length);
 };
 
+/*
+ * Channel between libbius and the kernel. Each worker thread opens its own handle. read and write
+ * have the semantics of read(2) and write(2) on /dev/bius, and map those of mmap(2) on it. map is
+ * only called when bius_block_device_options.data_map is set.
+ * read_nowait is optional and fails with EAGAIN instead of waiting for a request.
+ */
+struct bius_transport {
+    int (*open)(void *context);
+    ssize_t (*read)(void *context, int handle, void *buffer, size_t size);
+    ssize_t (*read_nowait)(void *context, int handle, void *buffer, size_t size);
+    ssize_t (*write)(void *context, int handle, const void *buffer, size_t size);
+    void *(*map)(void *context, int handle, size_t size);
+    void (*close)(void *context, int handle);
+    void *context;
+};
+
+/* Transport over /dev/bius, used by bius_main */
+extern const struct bius_transport bius_char_dev_transport;
+
+/*
+ * In-memory transport which plays the kernel side: it generates num_requests requests of
+ * opcode, length bytes each at sequential offsets wrapping at disk_size, and consumes the
+ * replies. Reads return EOF once every request was issued, which makes bius_main return.
+ * If verify is set, written data is a pattern derived from the offset and read replies are
+ * checked against it.
+ */
+struct bius_loopback_options {
+    bius_req_t opcode;
+    size_t length;
+    unsigned long num_requests;
+    unsigned long disk_size;
+    bool verify;
+};
+
+struct bius_loopback_stats {
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long mismatched;
+};
+
+int bius_loopback_create(const struct bius_loopback_options *options, struct bius_transport *out_transport);
+void bius_loopback_get_stats(const struct bius_transport *transport, struct bius_loopback_stats *out_stats);
+void bius_loopback_destroy(struct bius_transport *transport);
+
+/*
+ * Write-back block cache wrapping another bius_operations, for conventional devices. Writes
+ * complete once cached; dirty blocks are written back by a background thread, when the cache is
+ * under pressure, and on flush, which returns only after every block dirtied before it reached
+ * the backend and the backend was flushed. The block device must be created with
+ * volatile_write_cache set, so that the kernel sends flushes and emulates FUA with them.
+ * There is one cache per process.
+ */
+enum bius_cache_policy {
+    BIUS_CACHE_LRU = 0,
+    BIUS_CACHE_ARC = 1,
+};
+
+struct bius_cache_options {
+    unsigned long disk_size;
+    /* Bytes of cached data */
+    size_t capacity;
+    /* Caching unit, a power of two dividing disk_size */
+    size_t block_size;
+    enum bius_cache_policy policy;
+    /* Blocks read ahead on a miss of a sequential read stream */
+    unsigned int readahead_blocks;
+    /* Dirty blocks are written back within about twice this, 0 writes back only on flush and pressure */
+    unsigned int writeback_interval_ms;
+    /* If set, cached data lives in this file, e.g. on a local SSD, instead of anonymous memory */
+    const char *backing_file;
+};
+
+struct bius_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long readahead;
+    unsigned long writebacks;
+    unsigned long dirty_blocks;
+};
+
+int bius_cache_create(const struct bius_operations *backend, const struct bius_cache_options *options, struct bius_operations *out_operations);
+void bius_cache_get_stats(struct bius_cache_stats *out_stats);
+/* Writes back every dirty block and releases the cache */
+int bius_cache_destroy();
+
+/*
+ * Copy-on-write volumes over a read-only base image, which is a raw file or block device. A
+ * volume is a delta file holding only the blocks written to it. Creating a volume with another
+ * volume frozen by bius_cow_snapshot as parent clones it. Volumes of the same base read it
+ * through the same page cache. There is one open volume per process.
+ */
+struct bius_cow_options {
+    /* Copy-on-write unit, a power of two. 0 picks 64 KiB, or the block size of a parent volume. */
+    size_t block_size;
+    /* 0 takes the size of the parent */
+    unsigned long disk_size;
+};
+
+struct bius_cow_stats {
+    /* Data blocks of the open volume since its last snapshot */
+    unsigned long allocated_blocks;
+    /* Partially written blocks copied up from the parent */
+    unsigned long copied_blocks;
+    unsigned long snapshots;
+    /* Deltas and base image read through, the volume included */
+    unsigned int layers;
+};
+
+/* parent is a base image, a snapshot, or NULL for a volume starting zeroed */
+int bius_cow_create_volume(const char *path, const char *parent, const struct bius_cow_options *options);
+int bius_cow_open(const char *path, struct bius_operations *out_operations, unsigned long *out_disk_size);
+/*
+ * Freezes the open volume into snapshot_path and continues it in a new delta at its path, while
+ * requests are served. Both paths must be on the same file system. Fails with -ELOOP once the
+ * chain of layers is as deep as can be opened.
+ */
+int bius_cow_snapshot(const char *snapshot_path);
+void bius_cow_get_stats(struct bius_cow_stats *out_stats);
+/* Flushes and closes the open volume */
+int bius_cow_close();
+
+/*
+ * Deduplicating block store in a single file. Written blocks already stored are only referenced
+ * again, without I/O; the others are appended to a data log. Blocks of zeros take no space.
+ * Flushes make the writes before them durable. There is one open store per process.
+ */
+struct bius_dedup_options {
+    /* Deduplication unit, a power of two. 0 picks 4 KiB. */
+    size_t block_size;
+    unsigned long disk_size;
+};
+
+struct bius_dedup_stats {
+    /* Logical blocks not reading as zeros */
+    unsigned long mapped_blocks;
+    /* Distinct blocks in the log */
+    unsigned long stored_blocks;
+    /* Written blocks found in the log */
+    unsigned long deduplicated_blocks;
+    /* Written blocks appended to the log */
+    unsigned long appended_blocks;
+    /* Written blocks of zeros, which are not stored */
+    unsigned long zero_blocks;
+};
+
+int bius_dedup_create(const char *path, const struct bius_dedup_options *options);
+/*
+ * Fingerprints are not cryptographic. With verify, blocks matching a stored one are compared to
+ * it before being deduplicated, at the cost of a read, for data which may be crafted to collide.
+ */
+int bius_dedup_open(const char *path, bool verify, struct bius_operations *out_operations, unsigned long *out_disk_size);
+void bius_dedup_get_stats(struct bius_dedup_stats *out_stats);
+/* Flushes and closes the open store */
+int bius_dedup_close();
+
+/*
+ * Mirror over replicas given as bius_operations, e.g. passthroughs of files or loop devices.
+ * Writes are issued to every replica in parallel, reads to the in-sync replica with the fewest
+ * requests in flight. A replica failing a request stops receiving I/O, and the regions written
+ * without it are tracked so that bius_mirror_resync only copies those. There is one mirror per
+ * process.
+ */
+#define BIUS_MIRROR_MAX_REPLICAS 8
+
+enum bius_mirror_state {
+    BIUS_MIRROR_IN_SYNC = 0,
+    BIUS_MIRROR_FAILED = 1,
+    BIUS_MIRROR_RESYNCING = 2,
+};
+
+struct bius_mirror_options {
+    unsigned long disk_size;
+    /*
+     * Replicas which must succeed before a write completes, the others finishing in the
+     * background. 0 waits for every replica in service, and needs one of them to succeed.
+     */
+    unsigned int write_quorum;
+    /* Granularity of the dirty regions, a power of two. 0 picks 1 MiB. */
+    size_t region_size;
+    /* Threads issuing writes to each replica, 0 picks 4 */
+    unsigned int threads_per_replica;
+};
+
+struct bius_mirror_replica_stats {
+    enum bius_mirror_state state;
+    unsigned long reads;
+    /* Writes, discards and flushes */
+    unsigned long writes;
+    unsigned long errors;
+    /* Regions to copy at the next resync */
+    unsigned long dirty_regions;
+    unsigned long resynced_regions;
+};
+
+struct bius_mirror_stats {
+    unsigned int nr_replicas;
+    struct bius_mirror_replica_stats replicas[BIUS_MIRROR_MAX_REPLICAS];
+};
+
+int bius_mirror_create(const struct bius_operations *replicas, unsigned int nr_replicas, const struct bius_mirror_options *options, struct bius_operations *out_operations);
+/* Stops I/O to a replica, e.g. before taking it away. The last in-sync replica cannot be failed. */
+int bius_mirror_fail_replica(unsigned int replica);
+/*
+ * Copies to a failed replica the regions written without it, or the whole device if full is set,
+ * e.g. for a replacement, and puts it back in service. Requests are served meanwhile.
+ */
+int bius_mirror_resync(unsigned int replica, bool full);
+void bius_mirror_get_stats(struct bius_mirror_stats *out_stats);
+/* Waits for the writes still in flight and releases the mirror */
+int bius_mirror_destroy();
+
+/*
+ * Striping over targets given as bius_operations, each holding every n-th stripe of the device,
+ * so that large requests are served by all targets in parallel. Requests are split per target and
+ * complete when every part did; flushes go to all targets. There is one striped device per
+ * process.
+ */
+#define BIUS_STRIPE_MAX_TARGETS 16
+
+struct bius_stripe_options {
+    /* Size of each target, of which a last partial stripe is not used */
+    unsigned long target_size;
+    /* Bytes of a target before moving to the next, a multiple of SECTOR_SIZE. 0 for 64 KiB. */
+    size_t stripe_size;
+    /* 0 for 4 */
+    unsigned int threads_per_target;
+};
+
+int bius_stripe_create(const struct bius_operations *targets, unsigned int nr_targets, const struct bius_stripe_options *options, struct bius_operations *out_operations, unsigned long *out_disk_size);
+int bius_stripe_destroy();
+
+/*
+ * Reed-Solomon erasure coding. Each stripe has data_chunks chunks of data followed by
+ * parity_chunks chunks of parity, and any data_chunks of them recover the others. A single parity
+ * chunk is the XOR of the data. Chunks are the length given, computed with SSSE3 or AVX2 when
+ * available.
+ */
+#define BIUS_ERASURE_MAX_CHUNKS 16
+
+/* chunks holds the data followed by the parity to compute */
+int bius_erasure_encode(unsigned int data_chunks, unsigned int parity_chunks, void *const *chunks, size_t length);
+/* Rebuilds in place the chunks, data or parity, not marked present */
+int bius_erasure_decode(unsigned int data_chunks, unsigned int parity_chunks, void *const *chunks, const bool *present, size_t length);
+
+/*
+ * Erasure-coded device over targets given as bius_operations, with parity_targets chunks of each
+ * stripe being parity, rotated over the targets. Serves reads and writes with up to
+ * parity_targets targets failed, rebuilding what a failed target held when it is read. There is
+ * one erasure-coded device per process.
+ */
+struct bius_erasure_options {
+    /* Size of each target, of which a last partial chunk is not used */
+    unsigned long target_size;
+    unsigned int parity_targets;
+    /* Bytes of a stripe on one target, a multiple of SECTOR_SIZE. 0 for 64 KiB. */
+    size_t chunk_size;
+    /*
+     * Stripes buffering partial writes until they are complete, when they are written without
+     * reading anything, or evicted. With 0, partial writes go to the targets directly. With a
+     * cache, the device must have a volatile write cache, which flushes write back.
+     */
+    unsigned int cache_stripes;
+};
+
+struct bius_erasure_stats {
+    unsigned long full_stripe_writes;
+    /* Partial stripe writes updating the parity from the old data and parity */
+    unsigned long read_modify_writes;
+    /* Partial stripe writes of data on a failed target, re-encoding the whole stripe */
+    unsigned long reconstruct_writes;
+    /* Reads of chunks rebuilt from the others */
+    unsigned long degraded_reads;
+    unsigned int failed_targets;
+};
+
+int bius_erasure_create(const struct bius_operations *targets, unsigned int nr_targets, const struct bius_erasure_options *options, struct bius_operations *out_operations, unsigned long *out_disk_size);
+/* Stops I/O to a target, e.g. to try degraded mode. There is no way back. */
+int bius_erasure_fail_target(unsigned int target);
+void bius_erasure_get_stats(struct bius_erasure_stats *out_stats);
+/* Writes back the stripe cache and releases the device */
+int bius_erasure_destroy();
+
+/*
+ * Integrity checking wrapping another bius_operations, for conventional devices. The CRC32C of
+ * every block written is kept in a table file, and reads of blocks not matching it fail with
+ * BLK_STS_PROTECTION instead of returning corrupted data. A scrubber reads the whole device in the
+ * background to find corruption before it is read, and gives a checksum to blocks which have none,
+ * such as those of a backend holding data before its table was created. Checksums are durable once
+ * flushed. There is one integrity layer per process.
+ */
+#define BIUS_INTEGRITY_BLOCK_SIZE 4096
+
+struct bius_integrity_options {
+    /* A multiple of BIUS_INTEGRITY_BLOCK_SIZE */
+    unsigned long disk_size;
+    /* Created if missing, and only valid with the backend it was created with */
+    const char *table_file;
+    /* Bytes per second read by the scrubber, 0 disables it */
+    unsigned long scrub_rate;
+};
+
+struct bius_integrity_stats {
+    /* Blocks read, by requests or the scrubber, matching their checksum */
+    unsigned long verified_blocks;
+    /* Blocks read without a checksum: never written, discarded, or written at a crash */
+    unsigned long unverified_blocks;
+    /* Blocks read not matching their checksum, each time they are read */
+    unsigned long mismatched_blocks;
+    unsigned long last_mismatch_offset;
+    unsigned long scrubbed_blocks;
+    /* Blocks given a checksum by the scrubber */
+    unsigned long seeded_blocks;
+    unsigned long scrub_passes;
+    /* Bytes checksummed by requests and the scrubber, and the nanoseconds it took */
+    unsigned long checksum_bytes;
+    unsigned long checksum_ns;
+};
+
+int bius_integrity_create(const struct bius_operations *backend, const struct bius_integrity_options *options, struct bius_operations *out_operations);
+void bius_integrity_get_stats(struct bius_integrity_stats *out_stats);
+/* Stops the scrubber, flushes the backend and the checksums, and releases the layer */
+int bius_integrity_destroy();
+
+/*
+ * Transparent encryption wrapping another bius_operations with XTS-AES, in the format of dm-crypt
+ * with aes-xts-plain64: 512-byte sectors, each with its number as tweak. Uses AES-NI or VAES when
+ * the CPU has them, and splits large requests between helper threads. There is one encryption
+ * layer per process.
+ */
+struct bius_crypt_options {
+    /* 32 bytes for AES-128, 64 for AES-256, the data key then the tweak key, which must differ */
+    const void *key;
+    size_t key_size;
+    /* Threads ciphering a request, the caller included. 0 for one per online CPU, 1 for none. */
+    unsigned int threads;
+    /* Passes discards to the backend, showing which blocks are unused */
+    bool allow_discards;
+};
+
+int bius_crypt_create(const struct bius_operations *backend, const struct bius_crypt_options *options, struct bius_operations *out_operations);
+/* Stops the helper threads and wipes the key */
+int bius_crypt_destroy();
+
+/*
+ * Write-ahead log wrapping another bius_operations, for conventional devices taking many small
+ * synchronous writes. Writes up to small_write_size are appended to a log file and complete once
+ * durable there, concurrent ones sharing a single fdatasync, and a background thread copies them
+ * to the backend. Larger writes, discards and zeroing go to the backend and are durable once
+ * flushed, so that a flush only flushes the backend after them. The log is replayed when the
+ * layer is created after a crash. There is one log per process.
+ */
+#define BIUS_WAL_BLOCK_SIZE 4096
+
+struct bius_wal_options {
+    /* A multiple of BIUS_WAL_BLOCK_SIZE */
+    unsigned long disk_size;
+    /* Created if missing, and only valid with the backend it was created with */
+    const char *log_file;
+    /* Bytes of records when the log is created, a multiple of BIUS_WAL_BLOCK_SIZE. 0 for 64 MiB. */
+    unsigned long log_size;
+    /* Largest write going through the log. 0 for 64 KiB. */
+    size_t small_write_size;
+};
+
+struct bius_wal_stats {
+    unsigned long logged_writes;
+    /* Syncs of the log, each completing the writes logged before it started */
+    unsigned long commits;
+    unsigned long direct_writes;
+    /* Direct writes which waited for blocks in the log to be checkpointed */
+    unsigned long drains;
+    /* Blocks read from the log rather than the backend */
+    unsigned long log_read_blocks;
+    unsigned long checkpoints;
+    unsigned long checkpointed_blocks;
+    /* Writes which waited for room in the log */
+    unsigned long space_waits;
+};
+
+int bius_wal_create(const struct bius_operations *backend, const struct bius_wal_options *options, struct bius_operations *out_operations);
+void bius_wal_get_stats(struct bius_wal_stats *out_stats);
+/* Checkpoints the whole log, flushes the backend, and releases the layer */
+int bius_wal_destroy();
+
+/*
+ * Per-opcode statistics of the worker threads. Latencies are in nanoseconds and kept in
+ * log-linear histograms: values below BIUS_HISTOGRAM_SUB_BUCKETS have their own bucket, above
+ * that every power of two is split into BIUS_HISTOGRAM_SUB_BUCKETS buckets (12.5% precision).
+ * backend is the time spent in bius_operations, transport the time spent receiving write
+ * payloads and sending replies.
+ */
+#define BIUS_STATS_NR_OPCODES 18
+#define BIUS_HISTOGRAM_SUB_BUCKETS 8
+#define BIUS_HISTOGRAM_BUCKETS 320
+
+struct bius_histogram {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[BIUS_HISTOGRAM_BUCKETS];
+};
+
+struct bius_opcode_stats {
+    unsigned long requests;
+    unsigned long bytes;
+    unsigned long errors;
+    struct bius_histogram backend;
+    struct bius_histogram transport;
+};
+
+struct bius_stats {
+    struct bius_opcode_stats opcodes[BIUS_STATS_NR_OPCODES];
+};
+
+/* Sums the statistics of all worker threads of the current or last bius_main */
+void bius_get_stats(struct bius_stats *out_stats);
+/* Returns an upper bound of the given percentile (0 to 100) of histogram */
+unsigned long bius_histogram_percentile(const struct bius_histogram *histogram, double percentile);
+/* Writes stats as one line of JSON */
+void bius_print_stats(FILE *out, const struct bius_stats *stats);
+/* Makes bius_main print statistics to out every interval_ms milliseconds and on exit. 0 disables. */
+void bius_set_stats_dump(FILE *out, unsigned int interval_ms);
+
 int bius_main(const struct bius_operations *operations, const struct bius_block_device_options *options);
+int bius_main_with_transport(const struct bius_operations *operations, const struct bius_block_device_options *options, const struct bius_transport *transport);
 
 #endif
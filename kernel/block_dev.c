@@ -5,6 +5,7 @@
 #include "block_dev.h"
 #include "char_dev.h"
 #include "request.h"
+#include "trace.h"
 #include "utils.h"
 
 atomic64_t next_request_id = ATOMIC64_INIT(0);
@@ -21,6 +22,8 @@ static inline bius_req_t to_bius_request(unsigned int op) {
             return BIUS_FLUSH;
         case REQ_OP_DISCARD:
             return BIUS_DISCARD;
+        case REQ_OP_WRITE_ZEROES:
+            return BIUS_WRITE_ZEROES;
         case REQ_OP_ZONE_OPEN:
         case REQ_OP_ZONE_CLOSE:
         case REQ_OP_ZONE_FINISH:
@@ -39,6 +42,8 @@ static inline bius_req_t to_bius_request(unsigned int op) {
 static void bius_blk_request_end(struct bius_request *request) {
     struct request *rq = blk_mq_rq_from_pdu(request);
 
+    trace_bius_request_end(request);
+
     if (request->type == BIUS_ZONE_APPEND)
         rq->bio->bi_iter.bi_sector = request->pos / SECTOR_SIZE;
 
@@ -69,11 +74,9 @@ static blk_status_t bius_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_m
         return BLK_STS_NOTSUPP;
     }
 
-    spin_lock(&device->pending_lock);
-    list_add_tail(&bius_request->list, &device->pending_requests);
-    spin_unlock(&device->pending_lock);
-
-    wake_up(&device->wait_queue);
+    bius_stats_queued(device->stats, bius_request);
+    trace_bius_request_queue(bius_request);
+    bius_enqueue_request(device, bius_get_queue(device, hctx->numa_node, blk_rq_pos(rq)), bius_request);
 
     return BLK_STS_OK;
 }
@@ -88,24 +91,114 @@ static int bius_init_hctx(struct blk_mq_hw_ctx *hctx, void *driver_data, unsigne
     return 0;
 }
 
+/* Maps CPUs only to hctxs of their own node, so that hctx->numa_node picks the queue of the submitter's node */
+static int bius_map_queues(struct blk_mq_tag_set *set) {
+    struct blk_mq_queue_map *qmap = &set->map[HCTX_TYPE_DEFAULT];
+    unsigned int queues_per_node = qmap->nr_queues / nr_node_ids;
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        int node = cpu_to_node(cpu);
+
+        if (node == NUMA_NO_NODE)
+            node = 0;
+        qmap->mq_map[cpu] = qmap->queue_offset + node + nr_node_ids * (cpu % queues_per_node);
+    }
+
+    return 0;
+}
+
 static const struct blk_mq_ops bius_mq_ops = {
     .queue_rq = bius_queue_rq,
     .complete = bius_complete_rq,
     .init_hctx = bius_init_hctx,
+    .map_queues = bius_map_queues,
 };
 
-static void initialize_tag_set(struct blk_mq_tag_set *tag_set, struct bius_block_device *device) {
+/* Returns a queue with a connection, preferring queue. Returns queue itself if there is none. */
+static struct bius_queue *bius_find_served_queue(struct bius_block_device *device, struct bius_queue *queue) {
+    if (READ_ONCE(queue->num_connection) > 0)
+        return queue;
+
+    for (int i = 0; i < device->nr_queues; i++) {
+        if (READ_ONCE(device->queues[i].num_connection) > 0)
+            return &device->queues[i];
+    }
+
+    return queue;
+}
+
+void bius_enqueue_request(struct bius_block_device *device, struct bius_queue *queue, struct bius_request *request) {
+    spin_lock(&queue->pending_lock);
+    /* Checked under the lock, as bius_detach_queue() hands over what is queued once it reaches 0 */
+    while (unlikely(queue->num_connection == 0)) {
+        struct bius_queue *served_queue = bius_find_served_queue(device, queue);
+
+        if (served_queue == queue)
+            break;
+        spin_unlock(&queue->pending_lock);
+        queue = served_queue;
+        spin_lock(&queue->pending_lock);
+    }
+    list_add_tail(&request->list, &queue->pending_requests);
+    queue->nr_pending++;
+    spin_unlock(&queue->pending_lock);
+
+    wake_up(&queue->wait_queue);
+}
+
+/* Picks the queue a new connection opened by the current task drains */
+struct bius_queue *bius_attach_queue(struct bius_block_device *device) {
+    struct bius_queue *queue;
+
+    spin_lock(&device->connection_lock);
+    device->num_connection++;
+    if (device->model != BLK_ZONED_NONE)
+        queue = &device->queues[device->next_queue++ % device->nr_queues];
+    else
+        /* The queue of the node when workers are pinned, otherwise the only one */
+        queue = &device->queues[numa_node_id() % device->nr_queues];
+    spin_unlock(&device->connection_lock);
+
+    spin_lock(&queue->pending_lock);
+    queue->num_connection++;
+    spin_unlock(&queue->pending_lock);
+
+    return queue;
+}
+
+/* Hands requests left in queue to another queue when its last connection goes away */
+void bius_detach_queue(struct bius_block_device *device, struct bius_queue *queue) {
+    struct bius_request *request, *next;
+    LIST_HEAD(orphans);
+
+    spin_lock(&queue->pending_lock);
+    if (--queue->num_connection == 0) {
+        list_splice_init(&queue->pending_requests, &orphans);
+        queue->nr_pending = 0;
+    }
+    spin_unlock(&queue->pending_lock);
+
+    list_for_each_entry_safe(request, next, &orphans, list) {
+        list_del(&request->list);
+        bius_enqueue_request(device, bius_find_served_queue(device, queue), request);
+    }
+}
+
+static void initialize_tag_set(struct blk_mq_tag_set *tag_set, struct bius_block_device *device, const struct bius_block_device_options *options) {
     memset(tag_set, 0, sizeof(struct blk_mq_tag_set));
     tag_set->ops = &bius_mq_ops;
-    tag_set->nr_hw_queues = 4;
+    tag_set->nr_hw_queues = roundup(4, nr_node_ids);
     tag_set->queue_depth = 128;
-    tag_set->numa_node = NUMA_NO_NODE;
+    /* Without a node, blk-mq allocates the tags of each hctx on the node of its CPUs */
+    tag_set->numa_node = options->thread_pinning == BIUS_PIN_NODE ? options->numa_node : NUMA_NO_NODE;
     tag_set->cmd_size = sizeof(struct bius_request);
     tag_set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
     tag_set->driver_data = device;
 }
 
 static void bius_report_zones_request_end(struct bius_request *request) {
+    trace_bius_request_end(request);
     up(&request->sem);
 }
 
@@ -129,11 +222,9 @@ static int bius_report_zones(struct gendisk *disk, sector_t sector, unsigned int
     request.on_request_end = bius_report_zones_request_end;
     sema_init(&request.sem, 0);
 
-    spin_lock(&device->pending_lock);
-    list_add_tail(&request.list, &device->pending_requests);
-    spin_unlock(&device->pending_lock);
-
-    wake_up(&device->wait_queue);
+    bius_stats_queued(device->stats, &request);
+    trace_bius_request_queue(&request);
+    bius_enqueue_request(device, bius_get_queue(device, NUMA_NO_NODE, sector), &request);
 
     result = down_killable(&request.sem);
     if (result < 0)
@@ -172,16 +263,49 @@ int create_block_device(struct bius_block_device_options *options, struct bius_b
     struct bius_block_device *bius_device;
     int ret = 0;
 
-    bius_device = kmalloc(sizeof(struct bius_block_device), GFP_KERNEL);
+    /* Comes from userspace, and blk-mq allocates the tags on it */
+    if (options->thread_pinning == BIUS_PIN_NODE &&
+        (options->numa_node < 0 || options->numa_node >= nr_node_ids || !node_online(options->numa_node)))
+        return -EINVAL;
+#ifndef CONFIG_BIUS_DATAMAP
+    /* The mapping code was not built, see config.h */
+    if (options->data_map)
+        return -EOPNOTSUPP;
+#endif
+
+    bius_device = kzalloc(sizeof(struct bius_block_device), GFP_KERNEL);
     if (bius_device == NULL)
         return -ENOMEM;
     init_bius_block_device(bius_device);
+    bius_stats_init(bius_device);
     bius_device->model = options->model;
+    bius_data_path_init(&bius_device->data_path, options->data_map);
+
+    /* Unpinned workers move between nodes, and all share a queue so as to split requests evenly */
+    if (options->model == BLK_ZONED_NONE && options->thread_pinning != BIUS_PIN_NONE)
+        bius_device->nr_queues = nr_node_ids;
+    else if (options->model == BLK_ZONED_NONE)
+        bius_device->nr_queues = 1;
+    else
+        bius_device->nr_queues = max_t(unsigned int, options->num_threads, 1);
+    bius_device->queues = kcalloc(bius_device->nr_queues, sizeof(struct bius_queue), GFP_KERNEL);
+    if (bius_device->queues == NULL) {
+        ret = -ENOMEM;
+        goto out_put_device;
+    }
+    for (int i = 0; i < bius_device->nr_queues; i++)
+        init_bius_queue(&bius_device->queues[i]);
+
+    bius_device->stats = alloc_percpu(struct bius_cpu_stats);
+    if (bius_device->stats == NULL) {
+        ret = -ENOMEM;
+        goto out_put_device;
+    }
 
     ret = register_blkdev(0, options->disk_name);
     if (ret < 0) {
         printk("bius: register_blkdev failed: %d\n", ret);
-        goto out_free_device;
+        goto out_put_device;
     }
     bius_device->major = ret;
 
@@ -191,7 +315,7 @@ int create_block_device(struct bius_block_device_options *options, struct bius_b
         goto out_unregister;
     }
 
-    initialize_tag_set(&bius_device->tag_set, bius_device);
+    initialize_tag_set(&bius_device->tag_set, bius_device, options);
     ret = blk_mq_alloc_tag_set(&bius_device->tag_set);
     if (ret < 0) {
         printk("bius: blk_mq_alloc_tag_set failed: %d\n", ret);
@@ -208,14 +332,25 @@ int create_block_device(struct bius_block_device_options *options, struct bius_b
 
     blk_queue_flag_set(QUEUE_FLAG_NONROT, bius_device->disk->queue);
     blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, bius_device->disk->queue);
-    bius_device->disk->queue->limits.discard_granularity = 0;
     bius_device->disk->queue->limits.discard_alignment = 0;
-    blk_queue_max_discard_sectors(bius_device->disk->queue, 0);
+    if (options->discard) {
+        bius_device->disk->queue->limits.discard_granularity = PAGE_SIZE;
+        blk_queue_max_discard_sectors(bius_device->disk->queue, BIUS_MAX_SIZE_PER_COMMAND / SECTOR_SIZE);
+        blk_queue_flag_set(QUEUE_FLAG_DISCARD, bius_device->disk->queue);
+    } else {
+        bius_device->disk->queue->limits.discard_granularity = 0;
+        blk_queue_max_discard_sectors(bius_device->disk->queue, 0);
+    }
+    if (options->write_zeroes)
+        blk_queue_max_write_zeroes_sectors(bius_device->disk->queue, BIUS_MAX_SIZE_PER_COMMAND / SECTOR_SIZE);
     blk_queue_max_segments(bius_device->disk->queue, BIUS_MAX_SEGMENTS);
     bius_device->disk->queue->limits.max_dev_sectors = BIUS_MAX_SIZE_PER_COMMAND / SECTOR_SIZE;
     blk_queue_max_hw_sectors(bius_device->disk->queue, BIUS_MAX_SIZE_PER_COMMAND / SECTOR_SIZE);
     blk_queue_chunk_sectors(bius_device->disk->queue, BIUS_MAX_SIZE_PER_COMMAND / SECTOR_SIZE);
     blk_queue_io_min(bius_device->disk->queue, 512 * 1024);
+    /* FUA is emulated by the block layer with a flush after the write */
+    if (options->volatile_write_cache)
+        blk_queue_write_cache(bius_device->q, true, false);
 
     strncpy(bius_device->disk->disk_name, options->disk_name, DISK_NAME_LEN);
     bius_device->disk->major = bius_device->major;
@@ -237,6 +372,10 @@ int create_block_device(struct bius_block_device_options *options, struct bius_b
 
     add_disk(bius_device->disk);
 
+    ret = bius_stats_add(bius_device);
+    if (ret < 0)
+        printk("bius: creating statistics in sysfs failed: %d\n", ret);
+
     spin_lock(&disk_list_lock);
     list_add_tail(&bius_device->disk_list, &all_disk_list);
     spin_unlock(&disk_list_lock);
@@ -253,8 +392,8 @@ out_put_disk:
 out_unregister:
     unregister_blkdev(bius_device->major, options->disk_name);
 
-out_free_device:
-    kfree(bius_device);
+out_put_device:
+    kobject_put(&bius_device->stats_kobj);
 
     return ret;
 }
@@ -270,15 +409,25 @@ void remove_block_device(const char *name) {
     list_del(&bius_device->disk_list);
     spin_unlock(&disk_list_lock);
 
-    list_for_each_entry(request, &bius_device->pending_requests, list) {
-        struct request *rq = blk_mq_rq_from_pdu(request);
-        blk_mq_end_request(rq, BLK_STS_IOERR);
+    for (int i = 0; i < bius_device->nr_queues; i++) {
+        list_for_each_entry(request, &bius_device->queues[i].pending_requests, list) {
+            struct request *rq = blk_mq_rq_from_pdu(request);
+            blk_mq_end_request(rq, BLK_STS_IOERR);
+        }
     }
 
+    bius_stats_exit(bius_device);
     del_gendisk(bius_device->disk);
     blk_mq_free_tag_set(&bius_device->tag_set);
     put_disk(bius_device->disk);
     unregister_blkdev(bius_device->major, name);
+    kobject_put(&bius_device->stats_kobj);
+}
+
+void bius_free_block_device(struct bius_block_device *device) {
+    free_percpu(device->stats);
+    kfree(device->queues);
+    kfree(device);
 }
 
 static int bius_do_revalidate(void *arg) {
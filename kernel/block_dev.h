@@ -5,6 +5,20 @@
 #include <linux/blk-mq.h>
 
 #include <bius/command_header.h>
+#include "data_path.h"
+#include "request.h"
+#include "stats.h"
+
+/* Dispatch queue. Each connection drains exactly one of them. */
+struct bius_queue {
+    struct list_head pending_requests;
+    spinlock_t pending_lock;
+    wait_queue_head_t wait_queue;
+    /* Number of connections draining this queue, protected by pending_lock */
+    unsigned int num_connection;
+    /* Length of pending_requests, protected by pending_lock */
+    unsigned int nr_pending;
+};
 
 struct bius_block_device {
     int major;
@@ -15,26 +29,65 @@ struct bius_block_device {
 
     spinlock_t connection_lock;
     unsigned int num_connection;
+    unsigned int next_queue;
+    /* bius_connections attached to this device, protected by connection_lock */
+    struct list_head connections;
 
-    struct list_head pending_requests;
-    spinlock_t pending_lock;
-    wait_queue_head_t wait_queue;
+    /*
+     * Zoned devices hash requests to queues by zone, so that a zone is served by one connection.
+     * Other devices have a queue per NUMA node, served by the connections opened on that node, when
+     * their workers are pinned, and a single queue otherwise.
+     */
+    struct bius_queue *queues;
+    unsigned int nr_queues;
+
+    /* Copy or map, see data_path.h */
+    struct bius_data_path data_path;
+
+    struct bius_cpu_stats __percpu *stats;
+    /* /sys/block/<disk>/bius */
+    struct kobject stats_kobj;
 
     struct list_head disk_list;
 };
 
 int create_block_device(struct bius_block_device_options *options, struct bius_block_device **out_device);
 void remove_block_device(const char *name);
+/* Release of stats_kobj, see bius_stats_init */
+void bius_free_block_device(struct bius_block_device *device);
 void bius_revalidate(struct bius_block_device *device);
 struct bius_block_device *get_block_device(const char *disk_name);
 
+static inline void init_bius_queue(struct bius_queue *queue) {
+    INIT_LIST_HEAD(&queue->pending_requests);
+    spin_lock_init(&queue->pending_lock);
+    init_waitqueue_head(&queue->wait_queue);
+    queue->num_connection = 0;
+    queue->nr_pending = 0;
+}
+
 static inline void init_bius_block_device(struct bius_block_device *device) {
     spin_lock_init(&device->connection_lock);
     device->num_connection = 0;
-    INIT_LIST_HEAD(&device->pending_requests);
-    spin_lock_init(&device->pending_lock);
-    init_waitqueue_head(&device->wait_queue);
+    device->next_queue = 0;
+    INIT_LIST_HEAD(&device->connections);
+    device->queues = NULL;
+    device->nr_queues = 0;
+    device->stats = NULL;
     INIT_LIST_HEAD(&device->disk_list);
 }
 
+static inline struct bius_queue *bius_get_queue(struct bius_block_device *device, int node, sector_t sector) {
+    if (device->model != BLK_ZONED_NONE)
+        return &device->queues[blk_queue_zone_no(device->q, sector) % device->nr_queues];
+
+    if (node == NUMA_NO_NODE)
+        node = numa_node_id();
+    return &device->queues[node % device->nr_queues];
+}
+
+void bius_enqueue_request(struct bius_block_device *device, struct bius_queue *queue, struct bius_request *request);
+struct bius_queue *bius_attach_queue(struct bius_block_device *device);
+void bius_detach_queue(struct bius_block_device *device, struct bius_queue *queue);
+
 #endif
@@ -7,16 +7,16 @@
 #include "connection.h"
 #include "command.h"
 #include "data_mapping.h"
+#include "trace.h"
 #include "utils.h"
 
+#ifdef CONFIG_BIUS_DATAMAP
 void *zero_page = NULL;
 unsigned long zero_page_pfn = 0;
+#endif
 
 static int bius_dev_open(struct inode *inode, struct file *file) {
     struct bius_connection *connection;
-#ifdef CONFIG_BIUS_DATAMAP
-    int error = 0;
-#endif
 
     connection = kmalloc(sizeof(struct bius_connection), GFP_KERNEL);
     if (connection == NULL)
@@ -25,23 +25,24 @@ static int bius_dev_open(struct inode *inode, struct file *file) {
     init_bius_connection(connection);
     connection->block_dev = NULL;
     file->private_data = connection;
-
-#ifdef CONFIG_BIUS_DATAMAP
-    connection->reserved_pages = kmalloc(PAGE_SIZE * BIUS_NUM_RESERVED_PAGES, GFP_KERNEL);
-    if (connection->reserved_pages == NULL) {
-        error = -ENOMEM;
-        goto out_free;
-    }
-    connection->reserved_pages_pfn = PHYS_PFN(virt_to_phys(connection->reserved_pages));
-#endif
+    /* libbius polls for more requests with RWF_NOWAIT to coalesce them */
+    file->f_mode |= FMODE_NOWAIT;
 
     return 0;
+}
 
-#ifdef CONFIG_BIUS_DATAMAP
-out_free:
-    kfree(connection);
-    return error;
-#endif
+/* Time spent moving the data of request, also counted per path */
+static inline void bius_add_data_path_time(struct bius_request *request, u64 start) {
+    request->data_path_ns += ktime_get_ns() - start;
+}
+
+static void bius_account_data_path(struct bius_block_device *device, struct bius_request *request) {
+    if (request->data_mapped)
+        this_cpu_add(device->stats->mapped_ns, request->data_path_ns);
+    else
+        this_cpu_add(device->stats->copied_ns, request->data_path_ns);
+
+    bius_data_path_record(&device->data_path, request->data_mapped, request->length, request->data_path_ns);
 }
 
 static ssize_t bius_dev_read(struct kiocb *iocb, struct iov_iter *to) {
@@ -49,6 +50,7 @@ static ssize_t bius_dev_read(struct kiocb *iocb, struct iov_iter *to) {
     ssize_t ret;
     struct bius_connection *connection = get_bius_connection(iocb->ki_filp);
     struct bius_block_device *block_dev = connection->block_dev;
+    struct bius_queue *queue = connection->queue;
     struct bius_request *request;
     size_t user_buffer_size = iov_iter_count(to);
 
@@ -60,9 +62,12 @@ static ssize_t bius_dev_read(struct kiocb *iocb, struct iov_iter *to) {
     printd("bius: dev_read: size = %ld\n", user_buffer_size);
 
     if (connection->sending) {
+        u64 start = ktime_get_ns();
+
         request = connection->sending;
 
         total_read = bius_send_data(request, user_buffer_size, to);
+        bius_add_data_path_time(request, start);
 
         if (request_io_done(request))
             connection->sending = NULL;
@@ -74,42 +79,58 @@ static ssize_t bius_dev_read(struct kiocb *iocb, struct iov_iter *to) {
         return -EINVAL;
 
     while (1) {
-        spin_lock(&block_dev->pending_lock);
-        if (!list_empty(&block_dev->pending_requests))
+        spin_lock(&queue->pending_lock);
+        if (!list_empty(&queue->pending_requests))
             break;
 
-        spin_unlock(&block_dev->pending_lock);
-        ret = wait_event_interruptible_exclusive(block_dev->wait_queue, !list_empty(&block_dev->pending_requests));
+        spin_unlock(&queue->pending_lock);
+        if ((iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK))
+            return -EAGAIN;
+
+        ret = wait_event_interruptible_exclusive(queue->wait_queue, !list_empty(&queue->pending_requests));
 
         if (ret)
             return ret;
     }
 
-    request = list_entry(block_dev->pending_requests.next, struct bius_request, list);
+    request = list_entry(queue->pending_requests.next, struct bius_request, list);
     list_del(&request->list);
-    spin_unlock(&block_dev->pending_lock);
+    queue->nr_pending--;
+    spin_unlock(&queue->pending_lock);
+
+    bius_stats_dispatched(block_dev->stats, request);
+    trace_bius_request_dequeue(request);
 
     printd("bius: sending request: id = %llu, type = %d, pos = %lld, length = %lu\n", request->id, request->type, request->pos, request->length);
 
+    request->data_mapped = false;
+    request->data_path_ns = 0;
     if (request_may_have_data(request->type) && request->length > 0) {
 #ifdef CONFIG_BIUS_DATAMAP
-        if (request->length > BIUS_MAP_DATA_THRESHOLD) {
+        request->data_mapped = connection->vma && bius_should_map_data(&block_dev->data_path, request->length);
+#endif
+
+        if (request->data_mapped) {
+            u64 start = ktime_get_ns();
+
             ret = bius_map_data(request, connection);
             if (ret < 0) {
                 printk("bius: bius_map_data failed: %ld\n", ret);
                 end_blk_request(request, BLK_STS_IOERR);
                 return ret;
             }
-        } else if (request_is_write(request->type)) {
-            request->map_data = request->length;
-            connection->sending = request;
-        }
-#else
-        if (request_is_write(request->type)) {
-            request->map_data = request->length;
-            connection->sending = request;
+            bius_add_data_path_time(request, start);
+            trace_bius_request_map(request);
+            this_cpu_inc(block_dev->stats->mapped);
+            this_cpu_add(block_dev->stats->mapped_bytes, request->length);
+        } else {
+            if (request_is_write(request->type)) {
+                request->map_data = request->length;
+                connection->sending = request;
+            }
+            this_cpu_inc(block_dev->stats->copied);
+            this_cpu_add(block_dev->stats->copied_bytes, request->length);
         }
-#endif
     }
 
     ret = bius_send_command(connection, request, to);
@@ -120,9 +141,24 @@ static ssize_t bius_dev_read(struct kiocb *iocb, struct iov_iter *to) {
     }
 
     total_read += ret;
+    trace_bius_request_send(request);
+
+    /* Append the payload of a copied write if the buffer has room, saving userspace a read */
+    if (connection->sending == request && iov_iter_count(to) > 0) {
+        u64 start = ktime_get_ns();
+
+        ret = bius_send_data(request, iov_iter_count(to), to);
+        bius_add_data_path_time(request, start);
+        if (ret > 0) {
+            total_read += ret;
+            if (request_io_done(request))
+                connection->sending = NULL;
+        }
+    }
 
     spin_lock(&connection->waiting_lock);
     list_add_tail(&request->list, &connection->waiting_requests);
+    connection->nr_waiting++;
     spin_unlock(&connection->waiting_lock);
 
     return total_read;
@@ -169,12 +205,13 @@ static ssize_t handle_initialization(struct bius_connection *connection, struct
         return -EINVAL;
     }
 
+    connection->queue = bius_attach_queue(device);
+    connection->block_dev = device;
+
     spin_lock(&device->connection_lock);
-    device->num_connection++;
+    list_add_tail(&connection->device_list, &device->connections);
     spin_unlock(&device->connection_lock);
 
-    connection->block_dev = device;
-
     return sizeof(struct bius_u2k_header);
 }
 
@@ -200,8 +237,10 @@ static ssize_t bius_dev_write(struct kiocb *iocb, struct iov_iter *from) {
 
     spin_lock(&connection->waiting_lock);
     request = get_request_by_id(&connection->waiting_requests, header.id);
-    if (request)
+    if (request) {
         list_del(&request->list);
+        connection->nr_waiting--;
+    }
     spin_unlock(&connection->waiting_lock);
 
     if (!request)
@@ -210,13 +249,16 @@ static ssize_t bius_dev_write(struct kiocb *iocb, struct iov_iter *from) {
         connection->sending = NULL;
 
     total_written += ret;
+    bius_stats_replied(connection->block_dev->stats, request);
+    trace_bius_request_reply(request, header.reply);
 
     printd("bius: received response: id = %llu, reply = %ld\n", header.id, header.reply);
 
     if (is_blk_request(request->type)) {
-#ifdef CONFIG_BIUS_DATAMAP
+        u64 start = ktime_get_ns();
+
         if (header.reply == BLK_STS_OK && request->type == BIUS_READ) {
-            if (request->length <= BIUS_MAP_DATA_THRESHOLD) {
+            if (request->map_type == BIUS_DATAMAP_UNMAPPED) {
                 void __user *data = (void __user *)header.user_data;
 
                 ret = bius_receive_data(request, data);
@@ -230,17 +272,10 @@ static ssize_t bius_dev_write(struct kiocb *iocb, struct iov_iter *from) {
         }
 
         bius_unmap_data(request, connection);
-#else
-        if (header.reply == BLK_STS_OK && request->type == BIUS_READ) {
-            void __user *data = (void __user *)header.user_data;
+        bius_add_data_path_time(request, start);
 
-            ret = bius_receive_data(request, data);
-            if (ret < 0) {
-                end_blk_request(request, BLK_STS_IOERR);
-                return ret;
-            }
-        }
-#endif
+        if (header.reply == BLK_STS_OK && request_may_have_data(request->type) && request->length > 0)
+            bius_account_data_path(connection->block_dev, request);
 
         if (request->type == BIUS_ZONE_APPEND)
             request->pos = (loff_t)header.user_data;
@@ -277,7 +312,10 @@ static int bius_dev_release(struct inode *inode, struct file *file) {
     if (device) {
         bool remove_device = false;
 
+        bius_detach_queue(device, connection->queue);
+
         spin_lock(&device->connection_lock);
+        list_del(&connection->device_list);
         device->num_connection--;
         remove_device = device->num_connection == 0;
         spin_unlock(&device->connection_lock);
@@ -288,6 +326,7 @@ static int bius_dev_release(struct inode *inode, struct file *file) {
 
 #ifdef CONFIG_BIUS_DATAMAP
     kfree(connection->reserved_pages);
+    kvfree(connection->ptes);
 #endif
     kfree(connection);
     return 0;
@@ -305,6 +344,19 @@ static int bius_dev_mmap(struct file *file, struct vm_area_struct *vma) {
         return -EINVAL;
     }
 
+    /* Only connections which map data need these, and they are kept until release */
+    if (connection->reserved_pages == NULL) {
+        connection->reserved_pages = kmalloc(PAGE_SIZE * BIUS_NUM_RESERVED_PAGES, GFP_KERNEL);
+        if (connection->reserved_pages == NULL)
+            return -ENOMEM;
+        connection->reserved_pages_pfn = PHYS_PFN(virt_to_phys(connection->reserved_pages));
+    }
+    if (connection->ptes == NULL) {
+        connection->ptes = kvmalloc_array(BIUS_PTES_PER_COMMAND, sizeof(pte_t *), GFP_KERNEL);
+        if (connection->ptes == NULL)
+            return -ENOMEM;
+    }
+
     connection->vma = vma;
     vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP | VM_PFNMAP | VM_IO;
     vma->vm_private_data = connection;
@@ -13,12 +13,19 @@
 
 struct bius_connection {
     struct bius_block_device *block_dev;
+    /* Queue of block_dev this connection receives requests from */
+    struct bius_queue *queue;
+    /* Entry of block_dev->connections */
+    struct list_head device_list;
     /* List of requests waiting for userspace response */
     struct list_head waiting_requests;
     spinlock_t waiting_lock;
+    /* Length of waiting_requests, protected by waiting_lock */
+    unsigned int nr_waiting;
 #ifdef CONFIG_BIUS_DATAMAP
+    /* Set up by mmap, data is only mapped for connections having vma */
     struct vm_area_struct *vma;
-    pte_t *ptes[BIUS_PTES_PER_COMMAND];
+    pte_t **ptes;
     char *reserved_pages;
     unsigned long reserved_pages_pfn;
 #endif
@@ -32,8 +39,13 @@ static inline struct bius_connection *get_bius_connection(struct file *file) {
 static inline void init_bius_connection(struct bius_connection *connection) {
     INIT_LIST_HEAD(&connection->waiting_requests);
     spin_lock_init(&connection->waiting_lock);
+    connection->nr_waiting = 0;
+    connection->queue = NULL;
+    INIT_LIST_HEAD(&connection->device_list);
 #ifdef CONFIG_BIUS_DATAMAP
     connection->vma = NULL;
+    connection->ptes = NULL;
+    connection->reserved_pages = NULL;
 #endif
     connection->sending = NULL;
 }
@@ -218,11 +218,12 @@ void bius_copy_in_misaligned_pages(struct bius_request *request, struct bius_con
 
 void bius_unmap_data(struct bius_request *request, struct bius_connection *connection) {
     struct vm_area_struct *vma = connection->vma;
-    unsigned long addr = vma->vm_start;
+    unsigned long addr;
     int mapped_pages = request->mapped_size / PAGE_SIZE;
 
     if (request->map_type == BIUS_DATAMAP_UNMAPPED)
         return;
+    addr = vma->vm_start;
 
     for (int i = 0; i < mapped_pages; i++, addr += PAGE_SIZE) {
         set_pte_at(vma->vm_mm, addr, connection->ptes[i], pte_mkspecial(pfn_pte(zero_page_pfn, PAGE_READONLY)));
@@ -12,6 +12,17 @@ void bius_vm_open(struct vm_area_struct *vma);
 int bius_map_data(struct bius_request *request, struct bius_connection *connection);
 void bius_copy_in_misaligned_pages(struct bius_request *request, struct bius_connection *connection);
 void bius_unmap_data(struct bius_request *request, struct bius_connection *connection);
+#else
+/* Without the mapping code, requests are always copied */
+static inline int bius_map_data(struct bius_request *request, struct bius_connection *connection) {
+    return -EOPNOTSUPP;
+}
+
+static inline void bius_copy_in_misaligned_pages(struct bius_request *request, struct bius_connection *connection) {
+}
+
+static inline void bius_unmap_data(struct bius_request *request, struct bius_connection *connection) {
+}
 #endif
 
 #endif
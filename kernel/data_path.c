@@ -0,0 +1,70 @@
+#include <linux/math64.h>
+#include "data_path.h"
+
+void bius_data_path_init(struct bius_data_path *path, bool enabled) {
+    memset(path, 0, sizeof(struct bius_data_path));
+    spin_lock_init(&path->lock);
+    path->enabled = enabled;
+    path->threshold_shift = clamp_t(unsigned int, ilog2(BIUS_MAP_DATA_THRESHOLD), BIUS_MIN_MAP_SHIFT, BIUS_MAX_MAP_SHIFT);
+    atomic_set(&path->explore_counter, 0);
+}
+
+bool bius_should_map_data(struct bius_data_path *path, size_t length) {
+    unsigned long override = READ_ONCE(path->threshold_override);
+    unsigned int threshold = READ_ONCE(path->threshold_shift);
+    unsigned int size_class = order_base_2(length);
+    bool map = size_class > threshold;
+
+    if (!READ_ONCE(path->enabled))
+        return false;
+    if (override)
+        return length > override;
+
+    /* Keep the cost of both paths known next to the threshold */
+    if ((size_class == threshold || size_class == threshold + 1) &&
+        atomic_inc_return(&path->explore_counter) % BIUS_EXPLORE_INTERVAL == 0)
+        map = !map;
+
+    return map;
+}
+
+static inline u64 update_cost(u64 cost, u64 sample) {
+    return cost ? cost - cost / 8 + sample / 8 : sample;
+}
+
+/* a is cheaper than b by more than 1/8, so that noise does not move the threshold back and forth */
+static inline bool clearly_cheaper(u64 a, u64 b) {
+    return a && b && a + a / 8 < b;
+}
+
+void bius_data_path_record(struct bius_data_path *path, bool mapped, size_t length, u64 ns) {
+    unsigned int size_class = order_base_2(length);
+    unsigned int threshold = READ_ONCE(path->threshold_shift);
+    u64 cost;
+
+    /* Only the classes around the threshold decide where it goes */
+    if (length == 0 || READ_ONCE(path->threshold_override) || (size_class != threshold && size_class != threshold + 1))
+        return;
+
+    cost = div64_u64(ns * 1000, length);
+
+    spin_lock(&path->lock);
+    if (mapped)
+        path->map_cost[size_class] = update_cost(path->map_cost[size_class], cost);
+    else
+        path->copy_cost[size_class] = update_cost(path->copy_cost[size_class], cost);
+
+    threshold = path->threshold_shift;
+    if (threshold > BIUS_MIN_MAP_SHIFT && clearly_cheaper(path->map_cost[threshold], path->copy_cost[threshold]))
+        WRITE_ONCE(path->threshold_shift, threshold - 1);
+    else if (threshold < BIUS_MAX_MAP_SHIFT && clearly_cheaper(path->copy_cost[threshold + 1], path->map_cost[threshold + 1]))
+        WRITE_ONCE(path->threshold_shift, threshold + 1);
+    spin_unlock(&path->lock);
+}
+
+/* Length above which requests are currently mapped */
+unsigned long bius_data_path_threshold(struct bius_data_path *path) {
+    unsigned long override = READ_ONCE(path->threshold_override);
+
+    return override ? override : 1lu << READ_ONCE(path->threshold_shift);
+}
@@ -0,0 +1,40 @@
+#ifndef BIUS_DATA_PATH_H
+#define BIUS_DATA_PATH_H
+
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/log2.h>
+#include <bius/config.h>
+
+/* Size class k holds the lengths in (2^(k-1), 2^k] */
+#define BIUS_SIZE_CLASSES 32
+#define BIUS_MIN_MAP_SHIFT PAGE_SHIFT
+#define BIUS_MAX_MAP_SHIFT 27
+/* Every BIUS_EXPLORE_INTERVAL-th request next to the threshold takes the other path */
+#define BIUS_EXPLORE_INTERVAL 32
+
+/*
+ * Chooses between copying data through read()/write() and mapping it into userspace. The cost
+ * of both paths is measured in the two size classes around the threshold, and the threshold
+ * moves a class at a time towards the path measured cheaper.
+ */
+struct bius_data_path {
+    spinlock_t lock;
+    /* Mapping allowed at all, initialized from bius_block_device_options.data_map */
+    bool enabled;
+    /* Requests of more than 1 << threshold_shift bytes are mapped */
+    unsigned int threshold_shift;
+    /* Fixed threshold in bytes set through sysfs, 0 to adapt threshold_shift */
+    unsigned long threshold_override;
+    atomic_t explore_counter;
+    /* EWMA of the cost in ps per byte of each path by size class, 0 when not measured */
+    u64 copy_cost[BIUS_SIZE_CLASSES];
+    u64 map_cost[BIUS_SIZE_CLASSES];
+};
+
+void bius_data_path_init(struct bius_data_path *path, bool enabled);
+bool bius_should_map_data(struct bius_data_path *path, size_t length);
+void bius_data_path_record(struct bius_data_path *path, bool mapped, size_t length, u64 ns);
+unsigned long bius_data_path_threshold(struct bius_data_path *path);
+
+#endif
@@ -2,6 +2,9 @@
 #include "block_dev.h"
 #include "char_dev.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 static int __init bius_init(void)
 {
     return bius_dev_init();
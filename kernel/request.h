@@ -14,6 +14,12 @@ struct bius_request {
     loff_t pos;
     size_t length;
     struct list_head list;
+    /* ktime_get_ns() when queued and when handed to userspace, for statistics */
+    u64 queued_ns;
+    u64 dispatched_ns;
+    /* Path chosen for the data and time spent moving it, for the copy/map threshold */
+    bool data_mapped;
+    u64 data_path_ns;
     union {
         struct {
             struct bio *bio;
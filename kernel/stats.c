@@ -0,0 +1,233 @@
+#include <linux/sysfs.h>
+#include "block_dev.h"
+#include "connection.h"
+#include "stats.h"
+
+static const char *bius_opcode_names[BIUS_NR_OPCODES] = {
+    [BIUS_READ] = "read",
+    [BIUS_WRITE] = "write",
+    [BIUS_DISCARD] = "discard",
+    [BIUS_WRITE_ZEROES] = "write_zeroes",
+    [BIUS_FLUSH] = "flush",
+    [BIUS_REPORT_ZONES] = "report_zones",
+    [BIUS_ZONE_OPEN] = "zone_open",
+    [BIUS_ZONE_CLOSE] = "zone_close",
+    [BIUS_ZONE_FINISH] = "zone_finish",
+    [BIUS_ZONE_APPEND] = "zone_append",
+    [BIUS_ZONE_RESET] = "zone_reset",
+    [BIUS_ZONE_RESET_ALL] = "zone_reset_all",
+};
+
+static inline struct bius_block_device *to_bius_block_device(struct kobject *kobj) {
+    return container_of(kobj, struct bius_block_device, stats_kobj);
+}
+
+static void bius_sum_stats(struct bius_block_device *device, struct bius_cpu_stats *sum) {
+    int cpu;
+
+    memset(sum, 0, sizeof(struct bius_cpu_stats));
+    for_each_possible_cpu(cpu) {
+        struct bius_cpu_stats *stats = per_cpu_ptr(device->stats, cpu);
+
+        for (int i = 0; i < BIUS_NR_OPCODES; i++) {
+            sum->requests[i] += stats->requests[i];
+            sum->bytes[i] += stats->bytes[i];
+        }
+        sum->mapped += stats->mapped;
+        sum->copied += stats->copied;
+        sum->mapped_bytes += stats->mapped_bytes;
+        sum->copied_bytes += stats->copied_bytes;
+        sum->mapped_ns += stats->mapped_ns;
+        sum->copied_ns += stats->copied_ns;
+        for (int i = 0; i < BIUS_LATENCY_BUCKETS; i++) {
+            sum->queue_wait[i] += stats->queue_wait[i];
+            sum->service_time[i] += stats->service_time[i];
+        }
+    }
+}
+
+static ssize_t bius_show_histogram(char *buf, const u64 *histogram) {
+    ssize_t length = 0;
+
+    for (int i = 0; i < BIUS_LATENCY_BUCKETS; i++)
+        length += sysfs_emit_at(buf, length, "%lu %llu\n", 1lu << i, histogram[i]);
+
+    return length;
+}
+
+static ssize_t requests_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct bius_cpu_stats sum;
+    ssize_t length = 0;
+
+    bius_sum_stats(to_bius_block_device(kobj), &sum);
+    for (int i = 0; i < BIUS_NR_OPCODES; i++) {
+        if (bius_opcode_names[i])
+            length += sysfs_emit_at(buf, length, "%s %llu %llu\n", bius_opcode_names[i], sum.requests[i], sum.bytes[i]);
+    }
+
+    return length;
+}
+
+static ssize_t data_path_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct bius_cpu_stats sum;
+
+    bius_sum_stats(to_bius_block_device(kobj), &sum);
+    return sysfs_emit(buf, "mapped %llu %llu %llu\ncopied %llu %llu %llu\n",
+                      sum.mapped, sum.mapped_bytes, sum.mapped_ns, sum.copied, sum.copied_bytes, sum.copied_ns);
+}
+
+static ssize_t datamap_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%d\n", READ_ONCE(to_bius_block_device(kobj)->data_path.enabled));
+}
+
+/* Only connections which mapped the data area when connecting can map data */
+static ssize_t datamap_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+    bool enabled;
+    int ret;
+
+    ret = kstrtobool(buf, &enabled);
+    if (ret)
+        return ret;
+#ifndef CONFIG_BIUS_DATAMAP
+    if (enabled)
+        return -EOPNOTSUPP;
+#endif
+
+    WRITE_ONCE(to_bius_block_device(kobj)->data_path.enabled, enabled);
+    return count;
+}
+
+static ssize_t map_threshold_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%lu\n", bius_data_path_threshold(&to_bius_block_device(kobj)->data_path));
+}
+
+static ssize_t map_threshold_override_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(to_bius_block_device(kobj)->data_path.threshold_override));
+}
+
+/* 0 lets the threshold adapt again */
+static ssize_t map_threshold_override_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+    unsigned long threshold;
+    int ret;
+
+    ret = kstrtoul(buf, 0, &threshold);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(to_bius_block_device(kobj)->data_path.threshold_override, threshold);
+    return count;
+}
+
+/* Measured cost of each path in ps per byte by size class, 0 when not measured */
+static ssize_t data_path_cost_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct bius_data_path *path = &to_bius_block_device(kobj)->data_path;
+    ssize_t length = 0;
+
+    spin_lock(&path->lock);
+    for (int i = BIUS_MIN_MAP_SHIFT; i <= BIUS_MAX_MAP_SHIFT; i++)
+        length += sysfs_emit_at(buf, length, "%lu %llu %llu\n", 1lu << i, path->copy_cost[i], path->map_cost[i]);
+    spin_unlock(&path->lock);
+
+    return length;
+}
+
+static ssize_t queue_wait_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct bius_cpu_stats sum;
+
+    bius_sum_stats(to_bius_block_device(kobj), &sum);
+    return bius_show_histogram(buf, sum.queue_wait);
+}
+
+static ssize_t service_time_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct bius_cpu_stats sum;
+
+    bius_sum_stats(to_bius_block_device(kobj), &sum);
+    return bius_show_histogram(buf, sum.service_time);
+}
+
+static ssize_t connections_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(to_bius_block_device(kobj)->num_connection));
+}
+
+static ssize_t pending_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct bius_block_device *device = to_bius_block_device(kobj);
+    ssize_t length = 0;
+
+    for (int i = 0; i < device->nr_queues; i++)
+        length += sysfs_emit_at(buf, length, "%u%c", READ_ONCE(device->queues[i].nr_pending), i + 1 < device->nr_queues ? ' ' : '\n');
+
+    return length;
+}
+
+static ssize_t inflight_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct bius_block_device *device = to_bius_block_device(kobj);
+    struct bius_connection *connection;
+    ssize_t length = 0;
+
+    spin_lock(&device->connection_lock);
+    list_for_each_entry(connection, &device->connections, device_list)
+        length += sysfs_emit_at(buf, length, "%u ", READ_ONCE(connection->nr_waiting));
+    spin_unlock(&device->connection_lock);
+
+    if (length > 0)
+        buf[length - 1] = '\n';
+
+    return length;
+}
+
+static struct kobj_attribute requests_attribute = __ATTR_RO(requests);
+static struct kobj_attribute data_path_attribute = __ATTR_RO(data_path);
+static struct kobj_attribute datamap_attribute = __ATTR_RW(datamap);
+static struct kobj_attribute map_threshold_attribute = __ATTR_RO(map_threshold);
+static struct kobj_attribute map_threshold_override_attribute = __ATTR_RW(map_threshold_override);
+static struct kobj_attribute data_path_cost_attribute = __ATTR_RO(data_path_cost);
+static struct kobj_attribute queue_wait_us_attribute = __ATTR_RO(queue_wait_us);
+static struct kobj_attribute service_time_us_attribute = __ATTR_RO(service_time_us);
+static struct kobj_attribute connections_attribute = __ATTR_RO(connections);
+static struct kobj_attribute pending_attribute = __ATTR_RO(pending);
+static struct kobj_attribute inflight_attribute = __ATTR_RO(inflight);
+
+static struct attribute *bius_stats_attrs[] = {
+    &requests_attribute.attr,
+    &data_path_attribute.attr,
+    &datamap_attribute.attr,
+    &map_threshold_attribute.attr,
+    &map_threshold_override_attribute.attr,
+    &data_path_cost_attribute.attr,
+    &queue_wait_us_attribute.attr,
+    &service_time_us_attribute.attr,
+    &connections_attribute.attr,
+    &pending_attribute.attr,
+    &inflight_attribute.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(bius_stats);
+
+/* Frees the device, which sysfs files opened before its removal may still have used */
+static void bius_stats_release(struct kobject *kobj) {
+    bius_free_block_device(to_bius_block_device(kobj));
+}
+
+static struct kobj_type bius_stats_ktype = {
+    .sysfs_ops = &kobj_sysfs_ops,
+    .release = bius_stats_release,
+    .default_groups = bius_stats_groups,
+};
+
+/* From then on, the device is freed by the last kobject_put() of its stats_kobj */
+void bius_stats_init(struct bius_block_device *device) {
+    kobject_init(&device->stats_kobj, &bius_stats_ktype);
+}
+
+/* Creates /sys/block/<disk>/bius. Must be called after add_disk. */
+int bius_stats_add(struct bius_block_device *device) {
+    return kobject_add(&device->stats_kobj, &disk_to_dev(device->disk)->kobj, "bius");
+}
+
+void bius_stats_exit(struct bius_block_device *device) {
+    /* bius_stats_add failed */
+    if (!device->stats_kobj.state_in_sysfs)
+        return;
+
+    kobject_del(&device->stats_kobj);
+}
@@ -0,0 +1,64 @@
+#ifndef BIUS_STATS_H
+#define BIUS_STATS_H
+
+#include <linux/percpu.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include "request.h"
+
+/* Opcodes are the REQ_OP_* values, all below 32 */
+#define BIUS_NR_OPCODES 32
+/* Bucket i counts latencies in [2^(i-1), 2^i) us, the last bucket everything above */
+#define BIUS_LATENCY_BUCKETS 24
+
+struct bius_cpu_stats {
+    u64 requests[BIUS_NR_OPCODES];
+    u64 bytes[BIUS_NR_OPCODES];
+    /* Requests with data, by the way the data reached userspace, with their bytes and time spent */
+    u64 mapped;
+    u64 copied;
+    u64 mapped_bytes;
+    u64 copied_bytes;
+    u64 mapped_ns;
+    u64 copied_ns;
+    /* Time from bius_queue_rq to dequeue by a connection */
+    u64 queue_wait[BIUS_LATENCY_BUCKETS];
+    /* Time from dequeue to the reply of userspace */
+    u64 service_time[BIUS_LATENCY_BUCKETS];
+};
+
+struct bius_block_device;
+
+void bius_stats_init(struct bius_block_device *device);
+int bius_stats_add(struct bius_block_device *device);
+void bius_stats_exit(struct bius_block_device *device);
+
+static inline unsigned int bius_latency_bucket(u64 ns) {
+    u64 us = ns / NSEC_PER_USEC;
+
+    if (us == 0)
+        return 0;
+
+    return min_t(unsigned int, ilog2(us) + 1, BIUS_LATENCY_BUCKETS - 1);
+}
+
+static inline void bius_stats_queued(struct bius_cpu_stats __percpu *stats, struct bius_request *request) {
+    unsigned int opcode = (unsigned int)request->type % BIUS_NR_OPCODES;
+
+    this_cpu_inc(stats->requests[opcode]);
+    if (request_may_have_data(request->type))
+        this_cpu_add(stats->bytes[opcode], request->length);
+    request->queued_ns = ktime_get_ns();
+}
+
+static inline void bius_stats_dispatched(struct bius_cpu_stats __percpu *stats, struct bius_request *request) {
+    request->dispatched_ns = ktime_get_ns();
+    this_cpu_inc(stats->queue_wait[bius_latency_bucket(request->dispatched_ns - request->queued_ns)]);
+}
+
+static inline void bius_stats_replied(struct bius_cpu_stats __percpu *stats, struct bius_request *request) {
+    this_cpu_inc(stats->service_time[bius_latency_bucket(ktime_get_ns() - request->dispatched_ns)]);
+}
+
+#endif
@@ -0,0 +1,114 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bius
+
+#if !defined(BIUS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define BIUS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "request.h"
+
+/*
+ * Lifecycle of a request: queue (bius_queue_rq or report_zones) -> dequeue (bius_dev_read) ->
+ * map (bius_map_data, DATAMAP only) -> send (header copied to userspace) -> reply
+ * (bius_dev_write) -> end (completion to the block layer).
+ */
+
+DECLARE_EVENT_CLASS(bius_request_class,
+    TP_PROTO(struct bius_request *request),
+    TP_ARGS(request),
+
+    TP_STRUCT__entry(
+        __field(u64, id)
+        __field(int, opcode)
+        __field(loff_t, pos)
+        __field(size_t, length)
+        __field(int, map_type)
+    ),
+
+    TP_fast_assign(
+        __entry->id = request->id;
+        __entry->opcode = request->type;
+        __entry->pos = request->pos;
+        __entry->length = request->length;
+        __entry->map_type = is_blk_request(request->type) ? request->map_type : BIUS_DATAMAP_UNMAPPED;
+    ),
+
+    TP_printk("id=%llu opcode=%d pos=%lld length=%zu map_type=%d",
+              __entry->id, __entry->opcode, __entry->pos, __entry->length, __entry->map_type)
+);
+
+DEFINE_EVENT(bius_request_class, bius_request_queue,
+    TP_PROTO(struct bius_request *request),
+    TP_ARGS(request)
+);
+
+DEFINE_EVENT(bius_request_class, bius_request_dequeue,
+    TP_PROTO(struct bius_request *request),
+    TP_ARGS(request)
+);
+
+DEFINE_EVENT(bius_request_class, bius_request_map,
+    TP_PROTO(struct bius_request *request),
+    TP_ARGS(request)
+);
+
+DEFINE_EVENT(bius_request_class, bius_request_send,
+    TP_PROTO(struct bius_request *request),
+    TP_ARGS(request)
+);
+
+TRACE_EVENT(bius_request_reply,
+    TP_PROTO(struct bius_request *request, long reply),
+    TP_ARGS(request, reply),
+
+    TP_STRUCT__entry(
+        __field(u64, id)
+        __field(int, opcode)
+        __field(size_t, length)
+        __field(int, map_type)
+        __field(long, reply)
+    ),
+
+    TP_fast_assign(
+        __entry->id = request->id;
+        __entry->opcode = request->type;
+        __entry->length = request->length;
+        __entry->map_type = is_blk_request(request->type) ? request->map_type : BIUS_DATAMAP_UNMAPPED;
+        __entry->reply = reply;
+    ),
+
+    TP_printk("id=%llu opcode=%d length=%zu map_type=%d reply=%ld",
+              __entry->id, __entry->opcode, __entry->length, __entry->map_type, __entry->reply)
+);
+
+/* Without map_type, which bius_unmap_data() reset before the end; reply has it */
+TRACE_EVENT(bius_request_end,
+    TP_PROTO(struct bius_request *request),
+    TP_ARGS(request),
+
+    TP_STRUCT__entry(
+        __field(u64, id)
+        __field(int, opcode)
+        __field(loff_t, pos)
+        __field(size_t, length)
+    ),
+
+    TP_fast_assign(
+        __entry->id = request->id;
+        __entry->opcode = request->type;
+        __entry->pos = request->pos;
+        __entry->length = request->length;
+    ),
+
+    TP_printk("id=%llu opcode=%d pos=%lld length=%zu",
+              __entry->id, __entry->opcode, __entry->pos, __entry->length)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>
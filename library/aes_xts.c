@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include "aes_xts.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+/*
+ * Block j of a sector is E(K1, P ^ T) ^ T, where T is E(K2, sector number) times alpha^j in
+ * GF(2^128). AES-NI runs a round of one block per instruction with a latency of several cycles,
+ * so eight blocks are kept in flight, and VAES runs two blocks per instruction. The tweaks of a
+ * group of blocks are each computed from the first one with a carry-less multiply, rather than
+ * one after another, and the tweaks of eight sectors are encrypted together. Without AES-NI, a
+ * byte-wise implementation of FIPS-197 is used. Hosts are little endian.
+ */
+
+#define AES_BLOCK_SIZE 16
+#define AES_XTS_BLOCKS_PER_SECTOR (AES_XTS_SECTOR_SIZE / AES_BLOCK_SIZE)
+/* Blocks in flight, and sectors whose tweaks are encrypted together */
+#define AES_XTS_PARALLEL 8
+/* Reduction of the bits shifted out of a tweak, x^128 = x^7 + x^2 + x + 1 */
+#define AES_XTS_POLY 0x87
+
+typedef void (*xts_fn)(const struct aes_xts_key *key, uint8_t *dst, const uint8_t *src, size_t nr_sectors, uint64_t sector, bool decrypt);
+
+static uint8_t sbox[256];
+static uint8_t inverse_sbox[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static inline uint8_t rotate_left(uint8_t value, int bits) {
+    return value << bits | value >> (8 - bits);
+}
+
+static inline uint8_t xtime(uint8_t value) {
+    return value << 1 ^ (value & 0x80 ? 0x1b : 0);
+}
+
+static uint8_t multiply(uint8_t a, uint8_t b) {
+    uint8_t product = 0;
+
+    for (; b != 0; b >>= 1, a = xtime(a)) {
+        if (b & 1)
+            product ^= a;
+    }
+
+    return product;
+}
+
+static void init_tables() {
+    uint8_t p = 1, q = 1;
+
+    /* p runs through the multiplicative group as powers of 3, q through their inverses */
+    do {
+        p ^= xtime(p);
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        if (q & 0x80)
+            q ^= 0x09;
+        sbox[p] = q ^ rotate_left(q, 1) ^ rotate_left(q, 2) ^ rotate_left(q, 3) ^ rotate_left(q, 4) ^ 0x63;
+    } while (p != 1);
+    sbox[0] = 0x63;
+
+    for (int i = 0; i < 256; i++)
+        inverse_sbox[sbox[i]] = i;
+}
+
+static void mix_columns(uint8_t *state) {
+    for (int column = 0; column < 16; column += 4) {
+        uint8_t *a = state + column;
+        const uint8_t a0 = a[0];
+        const uint8_t all = a[0] ^ a[1] ^ a[2] ^ a[3];
+
+        a[0] ^= all ^ xtime(a[0] ^ a[1]);
+        a[1] ^= all ^ xtime(a[1] ^ a[2]);
+        a[2] ^= all ^ xtime(a[2] ^ a[3]);
+        a[3] ^= all ^ xtime(a[3] ^ a0);
+    }
+}
+
+static void inverse_mix_columns(uint8_t *state) {
+    for (int column = 0; column < 16; column += 4) {
+        uint8_t a[4];
+
+        memcpy(a, state + column, 4);
+        for (int i = 0; i < 4; i++)
+            state[column + i] = multiply(a[i], 14) ^ multiply(a[(i + 1) % 4], 11) ^ multiply(a[(i + 2) % 4], 13) ^ multiply(a[(i + 3) % 4], 9);
+    }
+}
+
+/* Row r of the state is bytes r, r + 4, r + 8 and r + 12, and ShiftRows takes them from column c + r */
+static void encrypt_block_scalar(const uint8_t (*keys)[16], int rounds, uint8_t *block) {
+    uint8_t state[AES_BLOCK_SIZE];
+
+    for (int i = 0; i < AES_BLOCK_SIZE; i++)
+        state[i] = block[i] ^ keys[0][i];
+
+    for (int round = 1; round <= rounds; round++) {
+        uint8_t shifted[AES_BLOCK_SIZE];
+
+        for (int i = 0; i < AES_BLOCK_SIZE; i++)
+            shifted[i] = sbox[state[(i + 4 * (i % 4)) % AES_BLOCK_SIZE]];
+        if (round < rounds)
+            mix_columns(shifted);
+        for (int i = 0; i < AES_BLOCK_SIZE; i++)
+            state[i] = shifted[i] ^ keys[round][i];
+    }
+
+    memcpy(block, state, AES_BLOCK_SIZE);
+}
+
+static void decrypt_block_scalar(const uint8_t (*keys)[16], int rounds, uint8_t *block) {
+    uint8_t state[AES_BLOCK_SIZE];
+
+    for (int i = 0; i < AES_BLOCK_SIZE; i++)
+        state[i] = block[i] ^ keys[rounds][i];
+
+    for (int round = rounds - 1; round >= 0; round--) {
+        uint8_t shifted[AES_BLOCK_SIZE];
+
+        for (int i = 0; i < AES_BLOCK_SIZE; i++)
+            shifted[(i + 4 * (i % 4)) % AES_BLOCK_SIZE] = inverse_sbox[state[i]];
+        for (int i = 0; i < AES_BLOCK_SIZE; i++)
+            state[i] = shifted[i] ^ keys[round][i];
+        if (round > 0)
+            inverse_mix_columns(state);
+    }
+
+    memcpy(block, state, AES_BLOCK_SIZE);
+}
+
+static void expand_key(const uint8_t *key, int key_words, uint8_t (*round_keys)[16], int rounds) {
+    uint8_t *words = round_keys[0];
+    uint8_t round_constant = 1;
+
+    memcpy(words, key, 4 * key_words);
+    for (int i = key_words; i < 4 * (rounds + 1); i++) {
+        uint8_t word[4];
+
+        memcpy(word, words + 4 * (i - 1), 4);
+        if (i % key_words == 0) {
+            const uint8_t first = word[0];
+
+            word[0] = sbox[word[1]] ^ round_constant;
+            word[1] = sbox[word[2]];
+            word[2] = sbox[word[3]];
+            word[3] = sbox[first];
+            round_constant = xtime(round_constant);
+        } else if (key_words > 6 && i % key_words == 4) {
+            for (int j = 0; j < 4; j++)
+                word[j] = sbox[word[j]];
+        }
+
+        for (int j = 0; j < 4; j++)
+            words[4 * i + j] = words[4 * (i - key_words) + j] ^ word[j];
+    }
+}
+
+static inline void multiply_alpha(uint64_t *tweak) {
+    const uint64_t carry = tweak[1] >> 63;
+
+    tweak[1] = tweak[1] << 1 | tweak[0] >> 63;
+    tweak[0] = tweak[0] << 1 ^ (carry ? AES_XTS_POLY : 0);
+}
+
+static void xts_scalar(const struct aes_xts_key *key, uint8_t *dst, const uint8_t *src, size_t nr_sectors, uint64_t sector, bool decrypt) {
+    for (size_t i = 0; i < nr_sectors; i++) {
+        uint64_t tweak[2] = {sector + i, 0};
+
+        encrypt_block_scalar(key->tweak, key->rounds, (uint8_t *)tweak);
+        for (int j = 0; j < AES_XTS_BLOCKS_PER_SECTOR; j++) {
+            uint64_t block[2];
+
+            memcpy(block, src, AES_BLOCK_SIZE);
+            block[0] ^= tweak[0];
+            block[1] ^= tweak[1];
+            if (decrypt)
+                decrypt_block_scalar(key->encrypt, key->rounds, (uint8_t *)block);
+            else
+                encrypt_block_scalar(key->encrypt, key->rounds, (uint8_t *)block);
+            block[0] ^= tweak[0];
+            block[1] ^= tweak[1];
+            memcpy(dst, block, AES_BLOCK_SIZE);
+
+            multiply_alpha(tweak);
+            src += AES_BLOCK_SIZE;
+            dst += AES_BLOCK_SIZE;
+        }
+    }
+}
+
+#ifdef __x86_64__
+/*
+ * tweak times x^power, power below 57: each half shifted, the bits leaving the low half entering
+ * the high one, and those leaving the high half reduced into the low one
+ */
+__attribute__((target("aes,pclmul")))
+static inline __m128i multiply_alpha_power_128(__m128i tweak, int power) {
+    const __m128i top = _mm_srli_epi64(tweak, 64 - power);
+    const __m128i reduced = _mm_clmulepi64_si128(top, _mm_cvtsi32_si128(AES_XTS_POLY), 0x01);
+
+    return _mm_xor_si128(_mm_xor_si128(_mm_slli_epi64(tweak, power), _mm_slli_si128(top, 8)), reduced);
+}
+
+/* Tweaks of count sectors, AES_XTS_PARALLEL at most */
+__attribute__((target("aes,pclmul")))
+static inline void encrypt_tweaks(const __m128i *keys, int rounds, uint64_t sector, size_t count, __m128i *tweaks) {
+    #pragma GCC unroll 8
+    for (size_t i = 0; i < AES_XTS_PARALLEL; i++)
+        tweaks[i] = _mm_xor_si128(_mm_set_epi64x(0, sector + (i < count ? i : 0)), keys[0]);
+    for (int round = 1; round < rounds; round++) {
+        #pragma GCC unroll 8
+        for (int i = 0; i < AES_XTS_PARALLEL; i++)
+            tweaks[i] = _mm_aesenc_si128(tweaks[i], keys[round]);
+    }
+    #pragma GCC unroll 8
+    for (int i = 0; i < AES_XTS_PARALLEL; i++)
+        tweaks[i] = _mm_aesenclast_si128(tweaks[i], keys[rounds]);
+}
+
+__attribute__((target("aes,pclmul"), always_inline))
+static inline void xts_aesni_sectors(const struct aes_xts_key *key, uint8_t *dst, const uint8_t *src, size_t nr_sectors, uint64_t sector, const bool decrypt) {
+    const uint8_t (*cipher_keys)[16] = decrypt ? key->decrypt : key->encrypt;
+    const int rounds = key->rounds;
+    __m128i keys[AES_MAX_ROUNDS + 1];
+    __m128i tweak_keys[AES_MAX_ROUNDS + 1];
+
+    for (int i = 0; i <= rounds; i++) {
+        keys[i] = _mm_loadu_si128((const __m128i *)cipher_keys[i]);
+        tweak_keys[i] = _mm_loadu_si128((const __m128i *)key->tweak[i]);
+    }
+
+    for (size_t first = 0; first < nr_sectors; first += AES_XTS_PARALLEL) {
+        const size_t count = nr_sectors - first < AES_XTS_PARALLEL ? nr_sectors - first : AES_XTS_PARALLEL;
+        __m128i sector_tweaks[AES_XTS_PARALLEL];
+
+        encrypt_tweaks(tweak_keys, rounds, sector + first, count, sector_tweaks);
+
+        for (size_t i = 0; i < count; i++) {
+            __m128i tweak = sector_tweaks[i];
+
+            for (int j = 0; j < AES_XTS_BLOCKS_PER_SECTOR; j += AES_XTS_PARALLEL) {
+                __m128i tweaks[AES_XTS_PARALLEL];
+                __m128i blocks[AES_XTS_PARALLEL];
+
+                tweaks[0] = tweak;
+                #pragma GCC unroll 8
+                for (int k = 1; k < AES_XTS_PARALLEL; k++)
+                    tweaks[k] = multiply_alpha_power_128(tweak, k);
+                tweak = multiply_alpha_power_128(tweak, AES_XTS_PARALLEL);
+
+                #pragma GCC unroll 8
+                for (int k = 0; k < AES_XTS_PARALLEL; k++)
+                    blocks[k] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)src + k), tweaks[k]), keys[0]);
+                for (int round = 1; round < rounds; round++) {
+                    #pragma GCC unroll 8
+                    for (int k = 0; k < AES_XTS_PARALLEL; k++)
+                        blocks[k] = decrypt ? _mm_aesdec_si128(blocks[k], keys[round]) : _mm_aesenc_si128(blocks[k], keys[round]);
+                }
+                #pragma GCC unroll 8
+                for (int k = 0; k < AES_XTS_PARALLEL; k++) {
+                    blocks[k] = decrypt ? _mm_aesdeclast_si128(blocks[k], keys[rounds]) : _mm_aesenclast_si128(blocks[k], keys[rounds]);
+                    _mm_storeu_si128((__m128i *)dst + k, _mm_xor_si128(blocks[k], tweaks[k]));
+                }
+
+                src += AES_XTS_PARALLEL * AES_BLOCK_SIZE;
+                dst += AES_XTS_PARALLEL * AES_BLOCK_SIZE;
+            }
+        }
+    }
+}
+
+__attribute__((target("aes,pclmul")))
+static void xts_aesni(const struct aes_xts_key *key, uint8_t *dst, const uint8_t *src, size_t nr_sectors, uint64_t sector, bool decrypt) {
+    if (decrypt)
+        xts_aesni_sectors(key, dst, src, nr_sectors, sector, true);
+    else
+        xts_aesni_sectors(key, dst, src, nr_sectors, sector, false);
+}
+
+/* As multiply_alpha_power_128, on the two tweaks of each register */
+__attribute__((target("avx2,vaes,vpclmulqdq,aes,pclmul")))
+static inline __m256i multiply_alpha_power_256(__m256i tweaks, int power) {
+    const __m256i top = _mm256_srli_epi64(tweaks, 64 - power);
+    const __m256i reduced = _mm256_clmulepi64_epi128(top, _mm256_set1_epi64x(AES_XTS_POLY), 0x01);
+
+    return _mm256_xor_si256(_mm256_xor_si256(_mm256_slli_epi64(tweaks, power), _mm256_slli_si256(top, 8)), reduced);
+}
+
+__attribute__((target("avx2,vaes,vpclmulqdq,aes,pclmul"), always_inline))
+static inline void xts_vaes_sectors(const struct aes_xts_key *key, uint8_t *dst, const uint8_t *src, size_t nr_sectors, uint64_t sector, const bool decrypt) {
+    const uint8_t (*cipher_keys)[16] = decrypt ? key->decrypt : key->encrypt;
+    const int rounds = key->rounds;
+    __m256i keys[AES_MAX_ROUNDS + 1];
+    __m128i tweak_keys[AES_MAX_ROUNDS + 1];
+
+    for (int i = 0; i <= rounds; i++) {
+        keys[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cipher_keys[i]));
+        tweak_keys[i] = _mm_loadu_si128((const __m128i *)key->tweak[i]);
+    }
+
+    for (size_t first = 0; first < nr_sectors; first += AES_XTS_PARALLEL) {
+        const size_t count = nr_sectors - first < AES_XTS_PARALLEL ? nr_sectors - first : AES_XTS_PARALLEL;
+        __m128i sector_tweaks[AES_XTS_PARALLEL];
+
+        encrypt_tweaks(tweak_keys, rounds, sector + first, count, sector_tweaks);
+
+        for (size_t i = 0; i < count; i++) {
+            /* Tweaks of blocks 0 and 1, then of each following pair */
+            __m256i tweak = _mm256_inserti128_si256(_mm256_castsi128_si256(sector_tweaks[i]), multiply_alpha_power_128(sector_tweaks[i], 1), 1);
+
+            for (int j = 0; j < AES_XTS_BLOCKS_PER_SECTOR; j += 2 * AES_XTS_PARALLEL) {
+                __m256i tweaks[AES_XTS_PARALLEL];
+                __m256i blocks[AES_XTS_PARALLEL];
+
+                tweaks[0] = tweak;
+                #pragma GCC unroll 8
+                for (int k = 1; k < AES_XTS_PARALLEL; k++)
+                    tweaks[k] = multiply_alpha_power_256(tweak, 2 * k);
+                tweak = multiply_alpha_power_256(tweak, 2 * AES_XTS_PARALLEL);
+
+                #pragma GCC unroll 8
+                for (int k = 0; k < AES_XTS_PARALLEL; k++)
+                    blocks[k] = _mm256_xor_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)src + k), tweaks[k]), keys[0]);
+                for (int round = 1; round < rounds; round++) {
+                    #pragma GCC unroll 8
+                    for (int k = 0; k < AES_XTS_PARALLEL; k++)
+                        blocks[k] = decrypt ? _mm256_aesdec_epi128(blocks[k], keys[round]) : _mm256_aesenc_epi128(blocks[k], keys[round]);
+                }
+                #pragma GCC unroll 8
+                for (int k = 0; k < AES_XTS_PARALLEL; k++) {
+                    blocks[k] = decrypt ? _mm256_aesdeclast_epi128(blocks[k], keys[rounds]) : _mm256_aesenclast_epi128(blocks[k], keys[rounds]);
+                    _mm256_storeu_si256((__m256i *)dst + k, _mm256_xor_si256(blocks[k], tweaks[k]));
+                }
+
+                src += 2 * AES_XTS_PARALLEL * AES_BLOCK_SIZE;
+                dst += 2 * AES_XTS_PARALLEL * AES_BLOCK_SIZE;
+            }
+        }
+    }
+}
+
+__attribute__((target("avx2,vaes,vpclmulqdq,aes,pclmul")))
+static void xts_vaes(const struct aes_xts_key *key, uint8_t *dst, const uint8_t *src, size_t nr_sectors, uint64_t sector, bool decrypt) {
+    if (decrypt)
+        xts_vaes_sectors(key, dst, src, nr_sectors, sector, true);
+    else
+        xts_vaes_sectors(key, dst, src, nr_sectors, sector, false);
+}
+#endif
+
+static xts_fn xts_function;
+
+static xts_fn select_xts() {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("vaes") && __builtin_cpu_supports("vpclmulqdq"))
+        return xts_vaes;
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul"))
+        return xts_aesni;
+#endif
+    return xts_scalar;
+}
+
+static inline void xts(const struct aes_xts_key *key, void *dst, const void *src, size_t length, uint64_t sector, bool decrypt) {
+    xts_fn function = __atomic_load_n(&xts_function, __ATOMIC_RELAXED);
+
+    /* Racing threads select the same function */
+    if (function == NULL) {
+        function = select_xts();
+        __atomic_store_n(&xts_function, function, __ATOMIC_RELAXED);
+    }
+
+    function(key, dst, src, length / AES_XTS_SECTOR_SIZE, sector, decrypt);
+}
+
+int aes_xts_set_key(struct aes_xts_key *key, const void *bytes, size_t size) {
+    const uint8_t *data_key = bytes;
+    const uint8_t *tweak_key = data_key + size / 2;
+
+    if (size != 32 && size != 64)
+        return -EINVAL;
+    /* Equal halves make XTS leak more than it should, and are refused by FIPS 140 */
+    if (memcmp(data_key, tweak_key, size / 2) == 0)
+        return -EINVAL;
+
+    pthread_once(&tables_once, init_tables);
+    key->rounds = size == 32 ? 10 : 14;
+    expand_key(data_key, size / 8, key->encrypt, key->rounds);
+    expand_key(tweak_key, size / 8, key->tweak, key->rounds);
+
+    /* The equivalent inverse cipher, which AESDEC implements, takes the round keys reversed and through InvMixColumns */
+    memcpy(key->decrypt[0], key->encrypt[key->rounds], AES_BLOCK_SIZE);
+    for (int i = 1; i < key->rounds; i++) {
+        memcpy(key->decrypt[i], key->encrypt[key->rounds - i], AES_BLOCK_SIZE);
+        inverse_mix_columns(key->decrypt[i]);
+    }
+    memcpy(key->decrypt[key->rounds], key->encrypt[0], AES_BLOCK_SIZE);
+
+    return 0;
+}
+
+void aes_xts_encrypt(const struct aes_xts_key *key, void *dst, const void *src, size_t length, uint64_t sector) {
+    xts(key, dst, src, length, sector, false);
+}
+
+void aes_xts_decrypt(const struct aes_xts_key *key, void *dst, const void *src, size_t length, uint64_t sector) {
+    xts(key, dst, src, length, sector, true);
+}
@@ -0,0 +1,29 @@
+#ifndef AES_XTS_H
+#define AES_XTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * XTS-AES of IEEE 1619 over 512-byte sectors, the tweak of each being its number in little
+ * endian, as aes-xts-plain64 of dm-crypt. Every implementation gives the same bytes.
+ */
+
+#define AES_XTS_SECTOR_SIZE 512
+#define AES_MAX_ROUNDS 14
+
+struct aes_xts_key {
+    /* Round keys of the data key, for AESENC then for AESDEC, and of the tweak key */
+    uint8_t encrypt[AES_MAX_ROUNDS + 1][16];
+    uint8_t decrypt[AES_MAX_ROUNDS + 1][16];
+    uint8_t tweak[AES_MAX_ROUNDS + 1][16];
+    int rounds;
+};
+
+/* 32 bytes for XTS-AES-128, 64 for XTS-AES-256, the data key then the tweak key, which must differ */
+int aes_xts_set_key(struct aes_xts_key *key, const void *bytes, size_t size);
+/* length is a multiple of AES_XTS_SECTOR_SIZE, sector the number of the first one. dst may be src. */
+void aes_xts_encrypt(const struct aes_xts_key *key, void *dst, const void *src, size_t length, uint64_t sector);
+void aes_xts_decrypt(const struct aes_xts_key *key, void *dst, const void *src, size_t length, uint64_t sector);
+
+#endif
@@ -0,0 +1,835 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Write-back block cache in front of another bius_operations. Cached blocks live in T1 (seen
+ * once) and T2 (seen again). With BIUS_CACHE_ARC, evicted blocks are remembered in the ghost
+ * lists B1 and B2, and hits on them adapt the target size p of T1. With BIUS_CACHE_LRU, only T1
+ * is used. Dirty blocks are kept in the order they were first dirtied, so that a flush writes
+ * back exactly the blocks dirtied before it.
+ *
+ * A single lock protects the metadata. Entries are marked busy while their data is transferred
+ * from or to the backend, which is done without the lock.
+ */
+
+#define CACHE_MAX_BATCH BIUS_MAX_IOV
+
+enum cache_list {
+    CACHE_FREE,
+    CACHE_T1,
+    CACHE_T2,
+    CACHE_B1,
+    CACHE_B2,
+    CACHE_NR_LISTS,
+};
+
+struct cache_entry {
+    uint64_t block;
+    struct cache_entry *hash_next;
+    /* Position in lists[list], LRU first */
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    /* Position in the dirty list, ordered by dirty_seq */
+    struct cache_entry *dirty_prev;
+    struct cache_entry *dirty_next;
+    enum cache_list list;
+    /* Cached data for entries in T1 and T2, NULL for ghosts */
+    char *data;
+    uint64_t dirty_seq;
+    bool busy;
+    bool dirty;
+};
+
+struct cache_list_head {
+    struct cache_entry head;
+    size_t length;
+};
+
+static struct cache {
+    struct bius_operations backend;
+    struct bius_cache_options options;
+    uint64_t nr_blocks;
+    size_t nr_slots;
+    char *slot_area;
+    char **free_slots;
+    size_t nr_free_slots;
+    struct cache_entry *entries;
+    struct cache_entry **hash;
+    unsigned int hash_shift;
+    struct cache_list_head lists[CACHE_NR_LISTS];
+    struct cache_entry dirty_head;
+    /* ARC target length of T1 */
+    size_t p;
+    size_t nr_dirty;
+    size_t dirty_background;
+    size_t dirty_limit;
+    uint64_t dirty_seq;
+    struct bius_cache_stats stats;
+    pthread_mutex_t lock;
+    pthread_cond_t io_done;
+    pthread_cond_t flusher_wakeup;
+    pthread_t flusher;
+    bool flusher_running;
+    bool created;
+} cache;
+
+/* Block following the last read of this thread, to detect sequential streams */
+static __thread uint64_t next_sequential_block = UINT64_MAX;
+
+static inline size_t hash_index(uint64_t block) {
+    return (block * 0x9e3779b97f4a7c15lu) >> cache.hash_shift;
+}
+
+static struct cache_entry *hash_lookup(uint64_t block) {
+    struct cache_entry *entry;
+
+    for (entry = cache.hash[hash_index(block)]; entry != NULL; entry = entry->hash_next) {
+        if (entry->block == block)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void hash_insert(struct cache_entry *entry) {
+    size_t index = hash_index(entry->block);
+
+    entry->hash_next = cache.hash[index];
+    cache.hash[index] = entry;
+}
+
+static void hash_remove(struct cache_entry *entry) {
+    struct cache_entry **prev;
+
+    for (prev = &cache.hash[hash_index(entry->block)]; *prev != entry; prev = &(*prev)->hash_next);
+    *prev = entry->hash_next;
+}
+
+static void list_init(struct cache_list_head *list) {
+    list->head.prev = &list->head;
+    list->head.next = &list->head;
+    list->length = 0;
+}
+
+static void list_remove(struct cache_entry *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    cache.lists[entry->list].length--;
+}
+
+static void list_add_mru(enum cache_list list, struct cache_entry *entry) {
+    struct cache_entry *head = &cache.lists[list].head;
+
+    entry->list = list;
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+    cache.lists[list].length++;
+}
+
+static inline void list_move_mru(enum cache_list list, struct cache_entry *entry) {
+    list_remove(entry);
+    list_add_mru(list, entry);
+}
+
+/* Returns the least recently used entry of list which is not busy */
+static struct cache_entry *list_lru(enum cache_list list) {
+    struct cache_entry *head = &cache.lists[list].head;
+    struct cache_entry *entry;
+
+    for (entry = head->next; entry != head; entry = entry->next) {
+        if (!entry->busy)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void mark_dirty(struct cache_entry *entry) {
+    if (entry->dirty)
+        return;
+
+    entry->dirty = true;
+    entry->dirty_seq = ++cache.dirty_seq;
+    entry->dirty_prev = cache.dirty_head.dirty_prev;
+    entry->dirty_next = &cache.dirty_head;
+    cache.dirty_head.dirty_prev->dirty_next = entry;
+    cache.dirty_head.dirty_prev = entry;
+    cache.nr_dirty++;
+}
+
+static void mark_clean(struct cache_entry *entry) {
+    if (!entry->dirty)
+        return;
+
+    entry->dirty = false;
+    entry->dirty_prev->dirty_next = entry->dirty_next;
+    entry->dirty_next->dirty_prev = entry->dirty_prev;
+    cache.nr_dirty--;
+}
+
+/* Drops a resident or ghost entry from the cache */
+static void free_entry(struct cache_entry *entry) {
+    mark_clean(entry);
+    if (entry->data)
+        cache.free_slots[cache.nr_free_slots++] = entry->data;
+    entry->data = NULL;
+    hash_remove(entry);
+    list_move_mru(CACHE_FREE, entry);
+}
+
+/* Returns an unused entry for block, inserted in the hash table but in no list */
+static struct cache_entry *new_entry(uint64_t block) {
+    struct cache_entry *entry = cache.lists[CACHE_FREE].head.next;
+
+    /* Entries are twice the slots, so without a free entry there is a ghost to forget */
+    if (cache.lists[CACHE_FREE].length == 0) {
+        bool forget_b1 = cache.lists[CACHE_B2].length == 0 ||
+                         (cache.lists[CACHE_B1].length > 0 && cache.lists[CACHE_T1].length + cache.lists[CACHE_B1].length >= cache.nr_slots);
+
+        entry = cache.lists[forget_b1 ? CACHE_B1 : CACHE_B2].head.next;
+        hash_remove(entry);
+    }
+
+    list_remove(entry);
+    entry->block = block;
+    entry->data = NULL;
+    entry->busy = false;
+    entry->dirty = false;
+    hash_insert(entry);
+
+    return entry;
+}
+
+static void policy_hit(struct cache_entry *entry) {
+    list_move_mru(cache.options.policy == BIUS_CACHE_ARC ? CACHE_T2 : CACHE_T1, entry);
+}
+
+/* Adapts p on a miss which hit a ghost */
+static void policy_adapt(struct cache_entry *ghost) {
+    size_t b1 = cache.lists[CACHE_B1].length;
+    size_t b2 = cache.lists[CACHE_B2].length;
+
+    if (ghost == NULL)
+        return;
+
+    if (ghost->list == CACHE_B1) {
+        cache.p = min(cache.p + (b2 > b1 ? b2 / b1 : 1), cache.nr_slots);
+    } else if (ghost->list == CACHE_B2) {
+        size_t delta = b1 > b2 ? b1 / b2 : 1;
+        cache.p = cache.p > delta ? cache.p - delta : 0;
+    }
+}
+
+static struct cache_entry *choose_victim(bool hit_b2) {
+    struct cache_entry *t1 = list_lru(CACHE_T1);
+    struct cache_entry *t2;
+    size_t t1_length = cache.lists[CACHE_T1].length;
+
+    if (cache.options.policy != BIUS_CACHE_ARC)
+        return t1;
+
+    t2 = list_lru(CACHE_T2);
+    if (t1 && t1_length > 0 && (t1_length > cache.p || (hit_b2 && t1_length == cache.p)))
+        return t1;
+
+    return t2 ? t2 : t1;
+}
+
+/* Takes the slot of a clean victim, which becomes a ghost or is freed */
+static char *demote(struct cache_entry *victim) {
+    char *slot = victim->data;
+
+    victim->data = NULL;
+    if (cache.options.policy == BIUS_CACHE_ARC) {
+        list_move_mru(victim->list == CACHE_T1 ? CACHE_B1 : CACHE_B2, victim);
+    } else {
+        hash_remove(victim);
+        list_move_mru(CACHE_FREE, victim);
+    }
+
+    return slot;
+}
+
+static int compare_block(const void *a, const void *b) {
+    const struct cache_entry *x = *(struct cache_entry * const *)a;
+    const struct cache_entry *y = *(struct cache_entry * const *)b;
+
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+static blk_status_t write_run(struct cache_entry **run, int count) {
+    const size_t block_size = cache.options.block_size;
+    blk_status_t result = BLK_STS_OK;
+
+    if (cache.backend.write_iov) {
+        struct iovec iov[CACHE_MAX_BATCH];
+
+        for (int i = 0; i < count; i++) {
+            iov[i].iov_base = run[i]->data;
+            iov[i].iov_len = block_size;
+        }
+        return cache.backend.write_iov(iov, count, run[0]->block * block_size);
+    }
+
+    for (int i = 0; i < count && result == BLK_STS_OK; i++)
+        result = cache.backend.write(run[i]->data, run[i]->block * block_size, block_size);
+
+    return result;
+}
+
+/* Writes back dirty entries which are not busy. Drops the lock while writing. */
+static blk_status_t writeback(struct cache_entry **batch, int count) {
+    blk_status_t result = BLK_STS_OK;
+
+    for (int i = 0; i < count; i++)
+        batch[i]->busy = true;
+    qsort(batch, count, sizeof(struct cache_entry *), compare_block);
+
+    pthread_mutex_unlock(&cache.lock);
+    for (int i = 0, j; i < count && result == BLK_STS_OK; i = j) {
+        for (j = i + 1; j < count && batch[j]->block == batch[j - 1]->block + 1; j++);
+        result = write_run(batch + i, j - i);
+    }
+    pthread_mutex_lock(&cache.lock);
+
+    for (int i = 0; i < count; i++) {
+        batch[i]->busy = false;
+        if (result == BLK_STS_OK)
+            mark_clean(batch[i]);
+    }
+    if (result == BLK_STS_OK)
+        cache.stats.writebacks += count;
+    pthread_cond_broadcast(&cache.io_done);
+
+    return result;
+}
+
+/* Writes back dirty entries, oldest first, while their dirty_seq <= max_seq and more than goal are dirty */
+static blk_status_t writeback_dirty(uint64_t max_seq, size_t goal) {
+    while (cache.nr_dirty > goal) {
+        struct cache_entry *batch[CACHE_MAX_BATCH];
+        struct cache_entry *entry;
+        bool busy_found = false;
+        int count = 0;
+
+        for (entry = cache.dirty_head.dirty_next; entry != &cache.dirty_head && entry->dirty_seq <= max_seq && count < CACHE_MAX_BATCH; entry = entry->dirty_next) {
+            if (entry->busy)
+                busy_found = true;
+            else
+                batch[count++] = entry;
+        }
+
+        if (count > 0) {
+            blk_status_t result = writeback(batch, count);
+            if (result != BLK_STS_OK)
+                return result;
+        } else if (busy_found) {
+            /* Being written back by another thread */
+            pthread_cond_wait(&cache.io_done, &cache.lock);
+        } else {
+            break;
+        }
+    }
+
+    return BLK_STS_OK;
+}
+
+/*
+ * Returns a free slot. Returns NULL with *out_result BLK_STS_OK if the lock was dropped on the
+ * way, in which case the caller must look its block up again.
+ */
+static char *take_slot(bool hit_b2, blk_status_t *out_result) {
+    struct cache_entry *victim;
+
+    *out_result = BLK_STS_OK;
+    if (cache.nr_free_slots > 0)
+        return cache.free_slots[--cache.nr_free_slots];
+
+    victim = choose_victim(hit_b2);
+    if (victim == NULL) {
+        pthread_cond_wait(&cache.io_done, &cache.lock);
+        return NULL;
+    }
+
+    if (victim->dirty) {
+        *out_result = writeback(&victim, 1);
+        return NULL;
+    }
+
+    return demote(victim);
+}
+
+/* Like take_slot, but gives up instead of waiting or writing back */
+static char *take_slot_nowait() {
+    struct cache_entry *victim;
+
+    if (cache.nr_free_slots > 0)
+        return cache.free_slots[--cache.nr_free_slots];
+
+    victim = choose_victim(false);
+    if (victim == NULL || victim->dirty)
+        return NULL;
+
+    return demote(victim);
+}
+
+static blk_status_t read_entries(struct cache_entry **batch, int count) {
+    const size_t block_size = cache.options.block_size;
+    off64_t offset = batch[0]->block * block_size;
+    blk_status_t result;
+    char *buffer;
+
+    if (cache.backend.read_iov) {
+        struct iovec iov[CACHE_MAX_BATCH];
+
+        for (int i = 0; i < count; i++) {
+            iov[i].iov_base = batch[i]->data;
+            iov[i].iov_len = block_size;
+        }
+        return cache.backend.read_iov(iov, count, offset);
+    }
+
+    if (count == 1)
+        return cache.backend.read(batch[0]->data, offset, block_size);
+
+    /* One backend call for the whole run, through a bounce buffer */
+    buffer = malloc(count * block_size);
+    if (buffer == NULL)
+        return BLK_STS_RESOURCE;
+
+    result = cache.backend.read(buffer, offset, count * block_size);
+    for (int i = 0; i < count && result == BLK_STS_OK; i++)
+        memcpy(batch[i]->data, buffer + i * block_size, block_size);
+    free(buffer);
+
+    return result;
+}
+
+/* Reads entry, which was just inserted, and up to readahead blocks following it from the backend */
+static blk_status_t fill_entries(struct cache_entry *entry, unsigned int readahead) {
+    struct cache_entry *batch[CACHE_MAX_BATCH];
+    blk_status_t result;
+    int count = 1;
+
+    batch[0] = entry;
+    entry->busy = true;
+
+    for (uint64_t block = entry->block + 1; count <= readahead && count < CACHE_MAX_BATCH && block < cache.nr_blocks; block++) {
+        struct cache_entry *next = hash_lookup(block);
+        char *slot;
+
+        if (next && next->data)
+            break;
+
+        slot = take_slot_nowait();
+        if (slot == NULL)
+            break;
+
+        if (next)
+            list_remove(next);
+        else
+            next = new_entry(block);
+        next->data = slot;
+        next->busy = true;
+        list_add_mru(CACHE_T1, next);
+        batch[count++] = next;
+    }
+
+    pthread_mutex_unlock(&cache.lock);
+    result = read_entries(batch, count);
+    pthread_mutex_lock(&cache.lock);
+
+    for (int i = 0; i < count; i++) {
+        batch[i]->busy = false;
+        if (result != BLK_STS_OK)
+            free_entry(batch[i]);
+    }
+    if (result == BLK_STS_OK) {
+        cache.stats.misses++;
+        cache.stats.readahead += count - 1;
+    }
+    pthread_cond_broadcast(&cache.io_done);
+
+    return result;
+}
+
+/*
+ * Returns the resident entry of block, which is not busy. If the block was not cached, it is
+ * read from the backend if fill is set, together with up to readahead blocks following it.
+ */
+static blk_status_t get_entry(uint64_t block, bool fill, unsigned int readahead, struct cache_entry **out_entry) {
+    bool adapted = false;
+
+    while (1) {
+        struct cache_entry *entry = hash_lookup(block);
+        blk_status_t result;
+        char *slot;
+
+        if (entry && entry->busy) {
+            pthread_cond_wait(&cache.io_done, &cache.lock);
+            continue;
+        }
+
+        if (entry && entry->data) {
+            policy_hit(entry);
+            cache.stats.hits++;
+            *out_entry = entry;
+            return BLK_STS_OK;
+        }
+
+        if (!adapted) {
+            policy_adapt(entry);
+            adapted = true;
+        }
+
+        slot = take_slot(entry && entry->list == CACHE_B2, &result);
+        if (result != BLK_STS_OK)
+            return result;
+        if (slot == NULL)
+            continue;
+
+        if (entry) {
+            /* Ghost hit, the block was cached recently */
+            list_remove(entry);
+            entry->data = slot;
+            list_add_mru(CACHE_T2, entry);
+        } else {
+            entry = new_entry(block);
+            entry->data = slot;
+            list_add_mru(CACHE_T1, entry);
+        }
+
+        if (fill) {
+            result = fill_entries(entry, readahead);
+            if (result != BLK_STS_OK)
+                return result;
+        } else {
+            cache.stats.misses++;
+        }
+
+        *out_entry = entry;
+        return BLK_STS_OK;
+    }
+}
+
+static blk_status_t cache_read(void *data, off64_t offset, size_t length) {
+    const size_t block_size = cache.options.block_size;
+    const uint64_t first_block = offset / block_size;
+    const uint64_t end_block = (offset + length + block_size - 1) / block_size;
+    const bool sequential = first_block == next_sequential_block;
+    blk_status_t result = BLK_STS_OK;
+    char *dest = data;
+
+    pthread_mutex_lock(&cache.lock);
+    for (uint64_t block = first_block; block < end_block && result == BLK_STS_OK; block++) {
+        size_t block_offset = offset % block_size;
+        size_t size = min(length, block_size - block_offset);
+        /* Blocks of the rest of the request are always read in the same backend call */
+        unsigned int readahead = end_block - block - 1;
+        struct cache_entry *entry;
+
+        if (sequential)
+            readahead += cache.options.readahead_blocks;
+
+        result = get_entry(block, true, readahead, &entry);
+        if (result == BLK_STS_OK)
+            memcpy(dest, entry->data + block_offset, size);
+
+        dest += size;
+        offset += size;
+        length -= size;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    next_sequential_block = end_block;
+
+    return result;
+}
+
+static blk_status_t cache_write(const void *data, off64_t offset, size_t length) {
+    const size_t block_size = cache.options.block_size;
+    blk_status_t result = BLK_STS_OK;
+    const char *src = data;
+
+    pthread_mutex_lock(&cache.lock);
+    while (length > 0 && result == BLK_STS_OK) {
+        uint64_t block = offset / block_size;
+        size_t block_offset = offset % block_size;
+        size_t size = min(length, block_size - block_offset);
+        struct cache_entry *entry;
+
+        /* Throttle writers when the flusher cannot keep up */
+        if (cache.nr_dirty >= cache.dirty_limit) {
+            result = writeback_dirty(UINT64_MAX, cache.dirty_limit - 1);
+            if (result != BLK_STS_OK)
+                break;
+        }
+
+        result = get_entry(block, size != block_size, 0, &entry);
+        if (result == BLK_STS_OK) {
+            memcpy(entry->data + block_offset, src, size);
+            mark_dirty(entry);
+        }
+
+        src += size;
+        offset += size;
+        length -= size;
+    }
+
+    if (cache.nr_dirty > cache.dirty_background)
+        pthread_cond_signal(&cache.flusher_wakeup);
+    pthread_mutex_unlock(&cache.lock);
+
+    return result;
+}
+
+/* Drops the cached blocks of a range about to be discarded or zeroed in the backend */
+static blk_status_t invalidate_range(off64_t offset, size_t length) {
+    const size_t block_size = cache.options.block_size;
+    blk_status_t result = BLK_STS_OK;
+    off64_t position = offset;
+    size_t remaining = length;
+
+    pthread_mutex_lock(&cache.lock);
+    while (remaining > 0 && result == BLK_STS_OK) {
+        uint64_t block = position / block_size;
+        size_t size = min(remaining, block_size - position % block_size);
+        struct cache_entry *entry = hash_lookup(block);
+
+        if (entry && entry->busy) {
+            pthread_cond_wait(&cache.io_done, &cache.lock);
+            continue;
+        }
+
+        /* The rest of a partially discarded block must reach the backend first */
+        if (entry && entry->data && entry->dirty && size != block_size) {
+            result = writeback(&entry, 1);
+            continue;
+        }
+
+        if (entry && entry->data)
+            free_entry(entry);
+
+        position += size;
+        remaining -= size;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    return result;
+}
+
+static blk_status_t cache_discard(off64_t offset, size_t length) {
+    blk_status_t result = invalidate_range(offset, length);
+
+    if (result == BLK_STS_OK && cache.backend.discard)
+        result = cache.backend.discard(offset, length);
+
+    return result;
+}
+
+static blk_status_t cache_write_zeroes(off64_t offset, size_t length) {
+    blk_status_t result = invalidate_range(offset, length);
+
+    if (result == BLK_STS_OK)
+        result = cache.backend.write_zeroes(offset, length);
+
+    return result;
+}
+
+static blk_status_t cache_flush() {
+    blk_status_t result;
+
+    pthread_mutex_lock(&cache.lock);
+    result = writeback_dirty(cache.dirty_seq, 0);
+    pthread_mutex_unlock(&cache.lock);
+
+    if (result == BLK_STS_OK && cache.backend.flush)
+        result = cache.backend.flush();
+
+    return result;
+}
+
+static void *flusher_main(void *arg) {
+    const unsigned int interval_ms = cache.options.writeback_interval_ms;
+    uint64_t previous_seq = 0;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&cache.lock);
+    while (cache.flusher_running) {
+        blk_status_t result;
+
+        if (interval_ms > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += interval_ms / 1000;
+            deadline.tv_nsec += (interval_ms % 1000) * 1000000l;
+            if (deadline.tv_nsec >= 1000000000l) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000l;
+            }
+            pthread_cond_timedwait(&cache.flusher_wakeup, &cache.lock, &deadline);
+        } else {
+            pthread_cond_wait(&cache.flusher_wakeup, &cache.lock);
+        }
+
+        /* Blocks dirtied before the previous round, then whatever exceeds the background limit */
+        result = writeback_dirty(previous_seq, 0);
+        if (result == BLK_STS_OK)
+            result = writeback_dirty(UINT64_MAX, cache.dirty_background);
+        if (result != BLK_STS_OK)
+            fprintf(stderr, "cache writeback failed: %d\n", result);
+        if (interval_ms > 0)
+            previous_seq = cache.dirty_seq;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    return NULL;
+}
+
+static int map_slot_area(size_t size) {
+    int fd;
+
+    if (cache.options.backing_file == NULL) {
+        cache.slot_area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        return cache.slot_area == MAP_FAILED ? -errno : 0;
+    }
+
+    fd = open(cache.options.backing_file, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return -errno;
+    if (ftruncate(fd, size) < 0) {
+        int error = -errno;
+        close(fd);
+        return error;
+    }
+
+    cache.slot_area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return cache.slot_area == MAP_FAILED ? -errno : 0;
+}
+
+int bius_cache_create(const struct bius_operations *backend, const struct bius_cache_options *options, struct bius_operations *out_operations) {
+    const size_t block_size = options->block_size;
+    size_t nr_entries;
+    size_t nr_buckets;
+    int result;
+
+    if (cache.created)
+        return -EBUSY;
+    if (backend->read == NULL || backend->write == NULL)
+        return -EINVAL;
+    if (block_size < SECTOR_SIZE || (block_size & (block_size - 1)) != 0 || options->disk_size % block_size != 0)
+        return -EINVAL;
+    if (options->capacity < block_size * 4 || (options->policy != BIUS_CACHE_LRU && options->policy != BIUS_CACHE_ARC))
+        return -EINVAL;
+
+    memset(&cache, 0, sizeof(cache));
+    memcpy(&cache.backend, backend, sizeof(struct bius_operations));
+    memcpy(&cache.options, options, sizeof(struct bius_cache_options));
+    cache.nr_blocks = options->disk_size / block_size;
+    cache.nr_slots = options->capacity / block_size;
+    cache.dirty_background = cache.nr_slots / 2;
+    cache.dirty_limit = cache.nr_slots * 3 / 4;
+    nr_entries = options->policy == BIUS_CACHE_ARC ? cache.nr_slots * 2 : cache.nr_slots;
+    for (nr_buckets = 1, cache.hash_shift = 64; nr_buckets < nr_entries; nr_buckets *= 2, cache.hash_shift--);
+
+    result = map_slot_area(cache.nr_slots * block_size);
+    if (result < 0)
+        return result;
+
+    cache.free_slots = malloc(sizeof(char *) * cache.nr_slots);
+    cache.entries = calloc(nr_entries, sizeof(struct cache_entry));
+    cache.hash = calloc(nr_buckets, sizeof(struct cache_entry *));
+    if (cache.free_slots == NULL || cache.entries == NULL || cache.hash == NULL) {
+        result = -ENOMEM;
+        goto out_free;
+    }
+
+    for (size_t i = 0; i < cache.nr_slots; i++)
+        cache.free_slots[i] = cache.slot_area + (cache.nr_slots - 1 - i) * block_size;
+    cache.nr_free_slots = cache.nr_slots;
+
+    for (int i = 0; i < CACHE_NR_LISTS; i++)
+        list_init(&cache.lists[i]);
+    for (size_t i = 0; i < nr_entries; i++)
+        list_add_mru(CACHE_FREE, &cache.entries[i]);
+    cache.dirty_head.dirty_prev = &cache.dirty_head;
+    cache.dirty_head.dirty_next = &cache.dirty_head;
+
+    pthread_mutex_init(&cache.lock, NULL);
+    pthread_cond_init(&cache.io_done, NULL);
+    pthread_cond_init(&cache.flusher_wakeup, NULL);
+
+    cache.flusher_running = true;
+    result = pthread_create(&cache.flusher, NULL, flusher_main, NULL);
+    if (result != 0) {
+        result = -result;
+        goto out_free;
+    }
+
+    memset(out_operations, 0, sizeof(struct bius_operations));
+    out_operations->read = cache_read;
+    out_operations->write = cache_write;
+    out_operations->discard = cache_discard;
+    out_operations->flush = cache_flush;
+    if (backend->write_zeroes)
+        out_operations->write_zeroes = cache_write_zeroes;
+    cache.created = true;
+
+    return 0;
+
+out_free:
+    free(cache.free_slots);
+    free(cache.entries);
+    free(cache.hash);
+    munmap(cache.slot_area, cache.nr_slots * block_size);
+
+    return result;
+}
+
+void bius_cache_get_stats(struct bius_cache_stats *out_stats) {
+    pthread_mutex_lock(&cache.lock);
+    memcpy(out_stats, &cache.stats, sizeof(struct bius_cache_stats));
+    out_stats->dirty_blocks = cache.nr_dirty;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+int bius_cache_destroy() {
+    blk_status_t result;
+
+    if (!cache.created)
+        return -EINVAL;
+
+    pthread_mutex_lock(&cache.lock);
+    cache.flusher_running = false;
+    pthread_cond_signal(&cache.flusher_wakeup);
+    pthread_mutex_unlock(&cache.lock);
+    pthread_join(cache.flusher, NULL);
+
+    result = cache_flush();
+
+    pthread_mutex_destroy(&cache.lock);
+    pthread_cond_destroy(&cache.io_done);
+    pthread_cond_destroy(&cache.flusher_wakeup);
+    free(cache.free_slots);
+    free(cache.entries);
+    free(cache.hash);
+    munmap(cache.slot_area, cache.nr_slots * cache.options.block_size);
+    cache.created = false;
+
+    return result == BLK_STS_OK ? 0 : -EIO;
+}
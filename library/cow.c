@@ -0,0 +1,710 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Copy-on-write volumes. A volume is a delta file layered over a parent, which is either a base
+ * image (a raw file or block device, only ever read) or another delta frozen as a snapshot.
+ * Blocks never written to the volume are read from the parent chain, so volumes of the same base
+ * share its page cache and only take the space of what they changed.
+ *
+ * A delta file holds a header of COW_HEADER_SIZE bytes, the mapping table with a 32-bit entry per
+ * block of the volume, then the data blocks. Entry 0 means the block is in the parent,
+ * COW_ZERO_ENTRY that it reads as zeros, and any other value p that it is data block p - 1.
+ *
+ * Table changes are written at flush, after the data they point to is synced, so that a crash
+ * never maps a block to data which did not reach the disk. Data blocks allocated after the last
+ * flush are unreferenced after a crash, and reused since allocation restarts after the highest
+ * referenced one.
+ */
+
+#define COW_MAGIC 0x31574f4353554942lu /* "BIUSCOW1" */
+#define COW_VERSION 1
+#define COW_HEADER_SIZE 4096
+#define COW_PARENT_MAX 3072
+#define COW_ZERO_ENTRY UINT32_MAX
+#define COW_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define COW_MAX_DEPTH 64
+/* Table entries written back together, a page of them */
+#define COW_TABLE_PAGE_ENTRIES 1024
+
+struct cow_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t disk_size;
+    uint64_t table_offset;
+    uint64_t data_offset;
+    /* Absolute path of the parent, empty if the volume starts zeroed */
+    char parent[COW_PARENT_MAX];
+};
+
+struct cow_layer {
+    int fd;
+    /* NULL for a base image */
+    uint32_t *table;
+    uint64_t nr_blocks;
+    uint64_t table_offset;
+    uint64_t data_offset;
+    /* Size of a base image, reads beyond it give zeros */
+    uint64_t size;
+    struct cow_layer *parent;
+};
+
+static struct cow {
+    char path[PATH_MAX];
+    uint64_t block_size;
+    uint64_t disk_size;
+    uint64_t nr_blocks;
+    /* Layer of the volume itself, the only one written */
+    struct cow_layer *top;
+    uint32_t next_data_block;
+    /* Table pages of top changed since the last flush, a bit each */
+    uint64_t *dirty_pages;
+    /* I/O holds it shared, a snapshot holds it exclusive to replace top */
+    pthread_rwlock_t layers_lock;
+    /* Serializes allocation and entry changes of the blocks hashed to each */
+    struct block_locks block_locks;
+    pthread_mutex_t flush_lock;
+    struct bius_cow_stats stats;
+    bool opened;
+} cow;
+
+static inline size_t nr_dirty_words() {
+    return (cow.nr_blocks + COW_TABLE_PAGE_ENTRIES - 1) / COW_TABLE_PAGE_ENTRIES / 64 + 1;
+}
+
+static int read_header(int fd, struct cow_header *header) {
+    int result = pread_full(fd, (char *)header, sizeof(struct cow_header), 0);
+
+    if (result < 0)
+        return result;
+
+    return header->magic == COW_MAGIC ? 0 : -EINVAL;
+}
+
+static int get_base_size(int fd, uint64_t *out_size) {
+    struct stat stat;
+
+    if (fstat(fd, &stat) < 0)
+        return -errno;
+
+    if (S_ISBLK(stat.st_mode))
+        return ioctl(fd, BLKGETSIZE64, out_size) < 0 ? -errno : 0;
+
+    *out_size = stat.st_size;
+    return 0;
+}
+
+static void close_layers(struct cow_layer *layer) {
+    while (layer) {
+        struct cow_layer *parent = layer->parent;
+
+        close(layer->fd);
+        free(layer->table);
+        free(layer);
+        layer = parent;
+    }
+}
+
+/* Opens the chain of layers from path. Deltas below the top must have block_size blocks. */
+static int open_layers(const char *path, bool top, uint64_t block_size, int depth, struct cow_layer **out_layer) {
+    struct cow_header header;
+    struct cow_layer *layer;
+    int result;
+
+    if (depth >= COW_MAX_DEPTH)
+        return -ELOOP;
+
+    layer = calloc(1, sizeof(struct cow_layer));
+    if (layer == NULL)
+        return -ENOMEM;
+
+    layer->fd = open(path, top ? O_RDWR : O_RDONLY);
+    if (layer->fd < 0) {
+        result = -errno;
+        free(layer);
+        return result;
+    }
+
+    result = read_header(layer->fd, &header);
+    if (result == -EINVAL && !top) {
+        /* Not a delta, so a base image */
+        result = get_base_size(layer->fd, &layer->size);
+        if (result < 0)
+            goto out_close;
+
+        *out_layer = layer;
+        return 0;
+    } else if (result < 0) {
+        goto out_close;
+    }
+
+    if (header.version != COW_VERSION || (!top && header.block_size != block_size)) {
+        result = -EINVAL;
+        goto out_close;
+    }
+
+    layer->nr_blocks = header.disk_size / header.block_size;
+    layer->table_offset = header.table_offset;
+    layer->data_offset = header.data_offset;
+    layer->table = malloc(sizeof(uint32_t) * layer->nr_blocks);
+    if (layer->table == NULL) {
+        result = -ENOMEM;
+        goto out_close;
+    }
+
+    result = pread_full(layer->fd, (char *)layer->table, sizeof(uint32_t) * layer->nr_blocks, layer->table_offset);
+    if (result < 0)
+        goto out_close;
+
+    if (top) {
+        cow.block_size = header.block_size;
+        cow.disk_size = header.disk_size;
+        cow.nr_blocks = layer->nr_blocks;
+    }
+
+    header.parent[COW_PARENT_MAX - 1] = '\0';
+    if (header.parent[0] != '\0') {
+        result = open_layers(header.parent, false, header.block_size, depth + 1, &layer->parent);
+        if (result < 0)
+            goto out_close;
+    }
+
+    *out_layer = layer;
+    return 0;
+
+out_close:
+    close_layers(layer);
+    return result;
+}
+
+static blk_status_t base_read(struct cow_layer *layer, char *data, uint64_t offset, size_t length) {
+    size_t size = offset < layer->size ? min(length, layer->size - offset) : 0;
+
+    if (size > 0 && pread_full(layer->fd, data, size, offset) < 0) {
+        fprintf(stderr, "cow: reading base image failed: %s\n", strerror(errno));
+        return BLK_STS_IOERR;
+    }
+    memset(data + size, 0, length - size);
+
+    return BLK_STS_OK;
+}
+
+static inline uint32_t get_entry(struct cow_layer *layer, uint64_t block) {
+    return block < layer->nr_blocks ? __atomic_load_n(&layer->table[block], __ATOMIC_ACQUIRE) : COW_ZERO_ENTRY;
+}
+
+/* Reads the volume as seen from layer, resolving runs of blocks found the same way at once */
+static blk_status_t layer_read(struct cow_layer *layer, char *data, uint64_t offset, size_t length) {
+    const uint64_t block_size = cow.block_size;
+
+    if (layer == NULL) {
+        memset(data, 0, length);
+        return BLK_STS_OK;
+    } else if (layer->table == NULL) {
+        return base_read(layer, data, offset, length);
+    }
+
+    while (length > 0) {
+        uint64_t block = offset / block_size;
+        uint32_t entry = get_entry(layer, block);
+        size_t size = min(length, block_size - offset % block_size);
+        blk_status_t result = BLK_STS_OK;
+
+        for (uint32_t n = 1; size < length; n++) {
+            uint32_t next = get_entry(layer, block + n);
+
+            if (entry == 0 || entry == COW_ZERO_ENTRY ? next != entry : next != entry + n)
+                break;
+            size += min(length - size, block_size);
+        }
+
+        if (entry == 0) {
+            result = layer_read(layer->parent, data, offset, size);
+        } else if (entry == COW_ZERO_ENTRY) {
+            memset(data, 0, size);
+        } else if (pread_full(layer->fd, data, size, layer->data_offset + (entry - 1) * block_size + offset % block_size) < 0) {
+            fprintf(stderr, "cow: reading delta failed: %s\n", strerror(errno));
+            result = BLK_STS_IOERR;
+        }
+
+        if (result != BLK_STS_OK)
+            return result;
+
+        data += size;
+        offset += size;
+        length -= size;
+    }
+
+    return BLK_STS_OK;
+}
+
+static inline void set_entry(uint64_t block, uint32_t entry) {
+    uint64_t page = block / COW_TABLE_PAGE_ENTRIES;
+
+    __atomic_store_n(&cow.top->table[block], entry, __ATOMIC_RELEASE);
+    __atomic_fetch_or(&cow.dirty_pages[page / 64], 1lu << (page % 64), __ATOMIC_RELEASE);
+}
+
+/* Writes size bytes of data at block_offset in block, zeros if data is NULL */
+static blk_status_t write_block(uint64_t block, const char *data, size_t block_offset, size_t size) {
+    const uint64_t block_size = cow.block_size;
+    struct cow_layer *top = cow.top;
+    blk_status_t result = BLK_STS_OK;
+    char *buffer = NULL;
+    uint32_t entry;
+
+    lock_blocks(&cow.block_locks, block, block, true);
+    entry = top->table[block];
+
+    if (entry != 0 && entry != COW_ZERO_ENTRY) {
+        uint64_t position = top->data_offset + (entry - 1) * block_size + block_offset;
+
+        if (data == NULL)
+            data = buffer = calloc(1, size);
+        if (data == NULL || pwrite_full(top->fd, data, size, position) < 0)
+            result = BLK_STS_IOERR;
+        goto out_unlock;
+    }
+
+    /* First write to the block in this layer: copy it up, merged with the new data */
+    buffer = malloc(block_size);
+    if (buffer == NULL) {
+        result = BLK_STS_RESOURCE;
+        goto out_unlock;
+    }
+
+    if (size != block_size) {
+        result = layer_read(top, buffer, block * block_size, block_size);
+        if (result != BLK_STS_OK)
+            goto out_unlock;
+        add_stat(&cow.stats.copied_blocks, 1);
+    }
+    if (data)
+        memcpy(buffer + block_offset, data, size);
+    else
+        memset(buffer + block_offset, 0, size);
+
+    entry = __atomic_fetch_add(&cow.next_data_block, 1, __ATOMIC_RELAXED) + 1;
+    if (entry == COW_ZERO_ENTRY || pwrite_full(top->fd, buffer, block_size, top->data_offset + (entry - 1) * block_size) < 0) {
+        result = BLK_STS_IOERR;
+        goto out_unlock;
+    }
+    set_entry(block, entry);
+    add_stat(&cow.stats.allocated_blocks, 1);
+
+out_unlock:
+    unlock_blocks(&cow.block_locks, block, block);
+    free(buffer);
+    if (result == BLK_STS_IOERR)
+        fprintf(stderr, "cow: writing delta failed: %s\n", strerror(errno));
+
+    return result;
+}
+
+/* Makes whole blocks read as zeros without data, giving back the space of their data */
+static blk_status_t zero_block(uint64_t block) {
+    const uint64_t block_size = cow.block_size;
+    struct cow_layer *top = cow.top;
+    uint32_t entry;
+
+    lock_blocks(&cow.block_locks, block, block, true);
+    entry = top->table[block];
+    if (entry != COW_ZERO_ENTRY)
+        set_entry(block, COW_ZERO_ENTRY);
+    unlock_blocks(&cow.block_locks, block, block);
+
+    if (entry != 0 && entry != COW_ZERO_ENTRY) {
+        fallocate(top->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, top->data_offset + (entry - 1) * block_size, block_size);
+        add_stat(&cow.stats.allocated_blocks, -1);
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t cow_read(void *data, off64_t offset, size_t length) {
+    blk_status_t result;
+
+    pthread_rwlock_rdlock(&cow.layers_lock);
+    result = layer_read(cow.top, data, offset, length);
+    pthread_rwlock_unlock(&cow.layers_lock);
+
+    return result;
+}
+
+/* Writes data over the range, or zeros if data is NULL */
+static blk_status_t cow_update(const char *data, off64_t offset, size_t length) {
+    const uint64_t block_size = cow.block_size;
+    blk_status_t result = BLK_STS_OK;
+
+    pthread_rwlock_rdlock(&cow.layers_lock);
+    while (length > 0 && result == BLK_STS_OK) {
+        uint64_t block = offset / block_size;
+        size_t block_offset = offset % block_size;
+        size_t size = min(length, block_size - block_offset);
+
+        if (data == NULL && size == block_size)
+            result = zero_block(block);
+        else
+            result = write_block(block, data, block_offset, size);
+
+        if (data)
+            data += size;
+        offset += size;
+        length -= size;
+    }
+    pthread_rwlock_unlock(&cow.layers_lock);
+
+    return result;
+}
+
+static blk_status_t cow_write(const void *data, off64_t offset, size_t length) {
+    return cow_update(data, offset, length);
+}
+
+static blk_status_t cow_discard(off64_t offset, size_t length) {
+    return cow_update(NULL, offset, length);
+}
+
+/*
+ * Syncs the data of top, then writes its changed table pages. The pages are copied before the
+ * sync, so that every entry written points at data the sync covers; entries changing later dirty
+ * their page again for the next flush. Called with layers_lock held.
+ */
+static blk_status_t flush_top() {
+    struct cow_layer *top = cow.top;
+    const size_t nr_words = nr_dirty_words();
+    uint64_t *dirty = malloc(sizeof(uint64_t) * nr_words);
+    uint32_t *pages = NULL;
+    size_t nr_pages = 0;
+    size_t n = 0;
+
+    if (dirty == NULL)
+        return BLK_STS_RESOURCE;
+
+    pthread_mutex_lock(&cow.flush_lock);
+    for (size_t word = 0; word < nr_words; word++) {
+        dirty[word] = __atomic_exchange_n(&cow.dirty_pages[word], 0, __ATOMIC_ACQUIRE);
+        nr_pages += __builtin_popcountl(dirty[word]);
+    }
+
+    if (nr_pages > 0) {
+        pages = malloc(sizeof(uint32_t) * COW_TABLE_PAGE_ENTRIES * nr_pages);
+        if (pages == NULL) {
+            errno = ENOMEM;
+            goto out_error;
+        }
+    }
+
+    for (size_t word = 0; word < nr_words; word++) {
+        for (uint64_t bits = dirty[word]; bits; bits &= bits - 1, n++) {
+            uint64_t first = (word * 64 + __builtin_ctzl(bits)) * COW_TABLE_PAGE_ENTRIES;
+            size_t count = min(cow.nr_blocks - first, COW_TABLE_PAGE_ENTRIES);
+
+            for (size_t i = 0; i < count; i++)
+                pages[n * COW_TABLE_PAGE_ENTRIES + i] = __atomic_load_n(&top->table[first + i], __ATOMIC_RELAXED);
+        }
+    }
+
+    if (fdatasync(top->fd) < 0)
+        goto out_error;
+
+    n = 0;
+    for (size_t word = 0; word < nr_words; word++) {
+        for (uint64_t bits = dirty[word]; bits; bits &= bits - 1, n++) {
+            uint64_t first = (word * 64 + __builtin_ctzl(bits)) * COW_TABLE_PAGE_ENTRIES;
+            size_t count = min(cow.nr_blocks - first, COW_TABLE_PAGE_ENTRIES);
+
+            if (pwrite_full(top->fd, (const char *)&pages[n * COW_TABLE_PAGE_ENTRIES], sizeof(uint32_t) * count, top->table_offset + sizeof(uint32_t) * first) < 0)
+                goto out_error;
+        }
+    }
+
+    if (nr_pages > 0 && fdatasync(top->fd) < 0)
+        goto out_error;
+    pthread_mutex_unlock(&cow.flush_lock);
+    free(pages);
+    free(dirty);
+
+    return BLK_STS_OK;
+
+out_error:
+    fprintf(stderr, "cow: flush failed: %s\n", strerror(errno));
+    /* The next flush writes the pages again */
+    for (size_t word = 0; word < nr_words; word++)
+        __atomic_fetch_or(&cow.dirty_pages[word], dirty[word], __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cow.flush_lock);
+    free(pages);
+    free(dirty);
+    return BLK_STS_IOERR;
+}
+
+static blk_status_t cow_flush() {
+    blk_status_t result;
+
+    pthread_rwlock_rdlock(&cow.layers_lock);
+    result = flush_top();
+    pthread_rwlock_unlock(&cow.layers_lock);
+
+    return result;
+}
+
+static int create_delta(const char *path, const char *parent, uint64_t block_size, uint64_t disk_size) {
+    struct cow_header header;
+    uint64_t table_size = sizeof(uint32_t) * (disk_size / block_size);
+    int fd;
+    int result = 0;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = COW_MAGIC;
+    header.version = COW_VERSION;
+    header.block_size = block_size;
+    header.disk_size = disk_size;
+    header.table_offset = COW_HEADER_SIZE;
+    header.data_offset = (COW_HEADER_SIZE + table_size + block_size - 1) / block_size * block_size;
+    if (parent)
+        strncpy(header.parent, parent, COW_PARENT_MAX - 1);
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return -errno;
+
+    /* The table stays a hole until blocks are written */
+    if (pwrite_full(fd, (const char *)&header, sizeof(header), 0) < 0 || ftruncate(fd, header.data_offset) < 0 || fsync(fd) < 0) {
+        result = -errno;
+        unlink(path);
+    }
+    close(fd);
+
+    return result;
+}
+
+int bius_cow_create_volume(const char *path, const char *parent, const struct bius_cow_options *options) {
+    char parent_path[PATH_MAX];
+    uint64_t block_size = options->block_size ? options->block_size : COW_DEFAULT_BLOCK_SIZE;
+    uint64_t disk_size = options->disk_size;
+
+    if (parent) {
+        struct cow_header header;
+        uint64_t parent_size;
+        int fd, result;
+
+        if (realpath(parent, parent_path) == NULL)
+            return -errno;
+        if (strlen(parent_path) >= COW_PARENT_MAX)
+            return -ENAMETOOLONG;
+
+        fd = open(parent_path, O_RDONLY);
+        if (fd < 0)
+            return -errno;
+
+        result = read_header(fd, &header);
+        if (result == 0) {
+            /* Clone of a snapshot, which must use the same blocks */
+            if (options->block_size && options->block_size != header.block_size)
+                result = -EINVAL;
+            block_size = header.block_size;
+            parent_size = header.disk_size;
+        } else if (result == -EINVAL) {
+            result = get_base_size(fd, &parent_size);
+        }
+        close(fd);
+        if (result < 0)
+            return result;
+
+        if (disk_size == 0)
+            disk_size = parent_size;
+    }
+
+    if (block_size < SECTOR_SIZE || (block_size & (block_size - 1)) != 0)
+        return -EINVAL;
+    if (disk_size == 0 || disk_size % block_size != 0 || disk_size / block_size >= COW_ZERO_ENTRY)
+        return -EINVAL;
+
+    return create_delta(path, parent ? parent_path : NULL, block_size, disk_size);
+}
+
+/* Allocation continues after the highest data block referenced by top */
+static void init_top() {
+    uint32_t highest = 0;
+
+    memset(cow.dirty_pages, 0, sizeof(uint64_t) * nr_dirty_words());
+    cow.stats.allocated_blocks = 0;
+    for (uint64_t i = 0; i < cow.nr_blocks; i++) {
+        uint32_t entry = cow.top->table[i];
+
+        if (entry != 0 && entry != COW_ZERO_ENTRY) {
+            highest = entry > highest ? entry : highest;
+            cow.stats.allocated_blocks++;
+        }
+    }
+    cow.next_data_block = highest;
+}
+
+int bius_cow_open(const char *path, struct bius_operations *out_operations, unsigned long *out_disk_size) {
+    pthread_rwlockattr_t attr;
+    int result;
+
+    if (cow.opened)
+        return -EBUSY;
+    if (strlen(path) >= PATH_MAX)
+        return -ENAMETOOLONG;
+
+    memset(&cow, 0, sizeof(cow));
+    strcpy(cow.path, path);
+
+    result = open_layers(path, true, 0, 0, &cow.top);
+    if (result < 0)
+        return result;
+
+    cow.dirty_pages = calloc(nr_dirty_words(), sizeof(uint64_t));
+    if (cow.dirty_pages == NULL) {
+        close_layers(cow.top);
+        return -ENOMEM;
+    }
+    init_top();
+
+    /* Otherwise a steady stream of I/O keeps snapshots waiting */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&cow.layers_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&cow.flush_lock, NULL);
+    init_block_locks(&cow.block_locks, 1);
+
+    memset(out_operations, 0, sizeof(struct bius_operations));
+    out_operations->read = cow_read;
+    out_operations->write = cow_write;
+    out_operations->discard = cow_discard;
+    out_operations->write_zeroes = cow_discard;
+    out_operations->flush = cow_flush;
+    *out_disk_size = cow.disk_size;
+    cow.opened = true;
+
+    return 0;
+}
+
+/*
+ * Freezes the volume as it is now into snapshot_path, and continues it in a new delta at its own
+ * path on top of the snapshot. Both must be on the same file system.
+ */
+int bius_cow_snapshot(const char *snapshot_path) {
+    char parent_path[PATH_MAX];
+    struct cow_layer *layer;
+    int depth = 0;
+    int result;
+
+    if (!cow.opened)
+        return -EINVAL;
+
+    pthread_rwlock_wrlock(&cow.layers_lock);
+    /* The new delta goes on top of every layer, and open_layers refuses chains that deep */
+    for (layer = cow.top; layer; layer = layer->parent)
+        depth++;
+    if (depth >= COW_MAX_DEPTH) {
+        result = -ELOOP;
+        goto out_unlock;
+    }
+
+    if (flush_top() != BLK_STS_OK) {
+        result = -EIO;
+        goto out_unlock;
+    }
+
+    if (rename(cow.path, snapshot_path) < 0) {
+        result = -errno;
+        goto out_unlock;
+    }
+    if (realpath(snapshot_path, parent_path) == NULL) {
+        result = -errno;
+        goto out_rename;
+    } else if (strlen(parent_path) >= COW_PARENT_MAX) {
+        result = -ENAMETOOLONG;
+        goto out_rename;
+    }
+
+    result = create_delta(cow.path, parent_path, cow.block_size, cow.disk_size);
+    if (result < 0)
+        goto out_rename;
+
+    result = -ENOMEM;
+    layer = calloc(1, sizeof(struct cow_layer));
+    if (layer == NULL)
+        goto out_unlink;
+    layer->table = calloc(cow.nr_blocks, sizeof(uint32_t));
+    if (layer->table == NULL)
+        goto out_free;
+
+    layer->fd = open(cow.path, O_RDWR);
+    if (layer->fd < 0) {
+        result = -errno;
+        goto out_free;
+    }
+    layer->nr_blocks = cow.nr_blocks;
+    layer->table_offset = COW_HEADER_SIZE;
+    layer->data_offset = (COW_HEADER_SIZE + sizeof(uint32_t) * cow.nr_blocks + cow.block_size - 1) / cow.block_size * cow.block_size;
+    layer->parent = cow.top;
+
+    cow.top = layer;
+    init_top();
+    cow.stats.snapshots++;
+    pthread_rwlock_unlock(&cow.layers_lock);
+
+    return 0;
+
+out_free:
+    free(layer->table);
+    free(layer);
+out_unlink:
+    unlink(cow.path);
+out_rename:
+    rename(snapshot_path, cow.path);
+out_unlock:
+    pthread_rwlock_unlock(&cow.layers_lock);
+    return result;
+}
+
+void bius_cow_get_stats(struct bius_cow_stats *out_stats) {
+    struct cow_layer *layer;
+
+    pthread_rwlock_rdlock(&cow.layers_lock);
+    out_stats->allocated_blocks = __atomic_load_n(&cow.stats.allocated_blocks, __ATOMIC_RELAXED);
+    out_stats->copied_blocks = __atomic_load_n(&cow.stats.copied_blocks, __ATOMIC_RELAXED);
+    out_stats->snapshots = cow.stats.snapshots;
+    out_stats->layers = 0;
+    for (layer = cow.top; layer; layer = layer->parent)
+        out_stats->layers++;
+    pthread_rwlock_unlock(&cow.layers_lock);
+}
+
+int bius_cow_close() {
+    blk_status_t result;
+
+    if (!cow.opened)
+        return -EINVAL;
+
+    result = cow_flush();
+
+    close_layers(cow.top);
+    free(cow.dirty_pages);
+    pthread_rwlock_destroy(&cow.layers_lock);
+    pthread_mutex_destroy(&cow.flush_lock);
+    destroy_block_locks(&cow.block_locks);
+    cow.opened = false;
+
+    return result == BLK_STS_OK ? 0 : -EIO;
+}
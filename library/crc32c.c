@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <string.h>
+#include "crc32c.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+/*
+ * The SSE4.2 crc32 instruction takes 8 bytes per cycle but has a latency of 3 cycles, so inputs of
+ * three lanes or more are computed as three interleaved lanes, then combined: the CRC of a lane
+ * followed by another is its CRC times x^(8 * CRC32C_LANE) plus the CRC of the other, a product
+ * done by PCLMULQDQ and one more crc32. Without them, tables process 8 bytes per step.
+ */
+
+/* Bit-reversed polynomial */
+#define CRC32C_POLY 0x82f63b78u
+/* Three lanes and 16 bytes make a 4 KiB block */
+#define CRC32C_LANE 1360
+/* x^(8 * CRC32C_LANE - 33) mod the polynomial, bit-reversed, the 33 accounting for crc32 and PCLMULQDQ */
+#define CRC32C_LANE_SHIFT 0x3f70cc6fu
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *data, size_t length);
+
+static uint32_t tables[8][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_tables() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        tables[0][i] = crc;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        for (int j = 1; j < 8; j++)
+            tables[j][i] = (tables[j - 1][i] >> 8) ^ tables[0][tables[j - 1][i] & 0xff];
+    }
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const uint8_t *data, size_t length) {
+    pthread_once(&tables_once, init_tables);
+
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+
+        /* Little endian, as on every architecture this is built for */
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = tables[7][word & 0xff] ^ tables[6][(word >> 8) & 0xff] ^
+              tables[5][(word >> 16) & 0xff] ^ tables[4][(word >> 24) & 0xff] ^
+              tables[3][(word >> 32) & 0xff] ^ tables[2][(word >> 40) & 0xff] ^
+              tables[1][(word >> 48) & 0xff] ^ tables[0][word >> 56];
+    }
+
+    for (; length > 0; data++, length--)
+        crc = (crc >> 8) ^ tables[0][(crc ^ *data) & 0xff];
+
+    return crc;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t shift_lane(uint32_t crc) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(CRC32C_LANE_SHIFT), 0);
+
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+    uint64_t word;
+
+    for (; length >= 3 * CRC32C_LANE; data += 3 * CRC32C_LANE, length -= 3 * CRC32C_LANE) {
+        uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            memcpy(&word, data + i, sizeof(word));
+            crc0 = _mm_crc32_u64(crc0, word);
+            memcpy(&word, data + CRC32C_LANE + i, sizeof(word));
+            crc1 = _mm_crc32_u64(crc1, word);
+            memcpy(&word, data + 2 * CRC32C_LANE + i, sizeof(word));
+            crc2 = _mm_crc32_u64(crc2, word);
+        }
+
+        crc = shift_lane(shift_lane(crc0) ^ crc1) ^ crc2;
+    }
+
+    for (; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+
+    for (; length > 0; data++, length--)
+        crc = _mm_crc32_u8(crc, *data);
+
+    return crc;
+}
+#endif
+
+static crc32c_fn crc32c_function;
+
+static crc32c_fn select_crc32c() {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul"))
+        return crc32c_sse42;
+#endif
+    return crc32c_scalar;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    crc32c_fn function = __atomic_load_n(&crc32c_function, __ATOMIC_RELAXED);
+
+    /* Racing threads select the same function */
+    if (function == NULL) {
+        function = select_crc32c();
+        __atomic_store_n(&crc32c_function, function, __ATOMIC_RELAXED);
+    }
+
+    return ~function(~crc, data, length);
+}
@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli), the checksum of iSCSI, ext4 and Btrfs. crc is the value returned for the
+ * data before, 0 to start. Every implementation gives the same value, checksums can be persisted.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+#endif
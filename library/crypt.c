@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include "libbius.h"
+#include "aes_xts.h"
+#include "utils.h"
+
+/*
+ * Transparent encryption with XTS-AES, in the format of dm-crypt with aes-xts-plain64. Reads are
+ * decrypted in place in the buffers they were read into. Write data is const, and the pages of the
+ * writer on data mapped devices, so it is encrypted into a per-thread bounce buffer, written a
+ * window at a time. Ciphering of CRYPT_MIN_PART bytes or more is split between helper threads and
+ * the caller, which runs the last part.
+ */
+
+#define CRYPT_BOUNCE_SIZE (2 * 1024 * 1024)
+/* Smaller parts cost more to hand over than to cipher */
+#define CRYPT_MIN_PART (64 * 1024)
+#define CRYPT_MAX_THREADS 64
+
+/* A range ciphered from src to dst, which may be the same */
+struct crypt_piece {
+    const uint8_t *src;
+    uint8_t *dst;
+    size_t length;
+    uint64_t sector;
+};
+
+struct crypt_job;
+
+struct crypt_part {
+    struct crypt_job *job;
+    /* Range of the pieces of the job, taken back to back */
+    size_t start;
+    size_t length;
+    struct crypt_part *next;
+};
+
+struct crypt_job {
+    const struct crypt_piece *pieces;
+    bool decrypt;
+    unsigned int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct crypt_part parts[CRYPT_MAX_THREADS + 1];
+};
+
+/* Not named crypt, which unistd.h declares */
+static struct {
+    struct bius_operations backend;
+    struct aes_xts_key key;
+    pthread_key_t bounce_key;
+    /* Parts queued to the helper threads in FIFO order */
+    struct crypt_part *head;
+    struct crypt_part *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_t threads[CRYPT_MAX_THREADS];
+    unsigned int nr_threads;
+    bool stopping;
+    bool created;
+} encryption;
+
+static inline size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t length = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+
+    return length;
+}
+
+/* Whether no sector straddles two segments */
+static inline bool sector_aligned(const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len % AES_XTS_SECTOR_SIZE != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static uint8_t *get_bounce() {
+    uint8_t *bounce = pthread_getspecific(encryption.bounce_key);
+
+    if (bounce == NULL) {
+        bounce = aligned_alloc(4096, CRYPT_BOUNCE_SIZE);
+        if (bounce && pthread_setspecific(encryption.bounce_key, bounce) != 0) {
+            free(bounce);
+            bounce = NULL;
+        }
+    }
+
+    return bounce;
+}
+
+static void run_part(const struct crypt_piece *pieces, bool decrypt, size_t start, size_t length) {
+    for (; length > 0; pieces++) {
+        size_t count;
+
+        if (start >= pieces->length) {
+            start -= pieces->length;
+            continue;
+        }
+
+        count = min(pieces->length - start, length);
+        if (decrypt)
+            aes_xts_decrypt(&encryption.key, pieces->dst + start, pieces->src + start, count, pieces->sector + start / AES_XTS_SECTOR_SIZE);
+        else
+            aes_xts_encrypt(&encryption.key, pieces->dst + start, pieces->src + start, count, pieces->sector + start / AES_XTS_SECTOR_SIZE);
+        start = 0;
+        length -= count;
+    }
+}
+
+static void complete_part(struct crypt_part *part) {
+    struct crypt_job *job = part->job;
+
+    pthread_mutex_lock(&job->lock);
+    if (--job->pending == 0)
+        pthread_cond_signal(&job->done);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *helper_main(void *arg) {
+    pthread_mutex_lock(&encryption.lock);
+    for (;;) {
+        struct crypt_part *part;
+
+        while (encryption.head == NULL) {
+            if (__atomic_load_n(&encryption.stopping, __ATOMIC_RELAXED))
+                goto out_unlock;
+            pthread_cond_wait(&encryption.wakeup, &encryption.lock);
+        }
+
+        part = encryption.head;
+        encryption.head = part->next;
+        if (encryption.head == NULL)
+            encryption.tail = NULL;
+        pthread_mutex_unlock(&encryption.lock);
+
+        run_part(part->job->pieces, part->job->decrypt, part->start, part->length);
+        complete_part(part);
+        pthread_mutex_lock(&encryption.lock);
+    }
+
+out_unlock:
+    pthread_mutex_unlock(&encryption.lock);
+    return NULL;
+}
+
+/* Ciphers the pieces, each a multiple of AES_XTS_SECTOR_SIZE long */
+static void cipher(const struct crypt_piece *pieces, int nr_pieces, bool decrypt) {
+    struct crypt_job job = {
+        .pieces = pieces,
+        .decrypt = decrypt,
+    };
+    size_t sectors = 0;
+    unsigned int nr_parts;
+
+    for (int i = 0; i < nr_pieces; i++)
+        sectors += pieces[i].length / AES_XTS_SECTOR_SIZE;
+    nr_parts = min(encryption.nr_threads + 1, sectors * AES_XTS_SECTOR_SIZE / CRYPT_MIN_PART);
+
+    if (nr_parts <= 1) {
+        run_part(pieces, decrypt, 0, sectors * AES_XTS_SECTOR_SIZE);
+        return;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+    job.pending = nr_parts;
+
+    for (unsigned int i = 0; i < nr_parts; i++) {
+        struct crypt_part *part = &job.parts[i];
+
+        part->job = &job;
+        part->start = sectors * i / nr_parts * AES_XTS_SECTOR_SIZE;
+        part->length = sectors * (i + 1) / nr_parts * AES_XTS_SECTOR_SIZE - part->start;
+        part->next = i + 2 < nr_parts ? &job.parts[i + 1] : NULL;
+    }
+
+    /* Every part but the last goes to the helpers at once */
+    pthread_mutex_lock(&encryption.lock);
+    if (encryption.tail)
+        encryption.tail->next = &job.parts[0];
+    else
+        encryption.head = &job.parts[0];
+    encryption.tail = &job.parts[nr_parts - 2];
+    pthread_cond_broadcast(&encryption.wakeup);
+    pthread_mutex_unlock(&encryption.lock);
+
+    run_part(pieces, decrypt, job.parts[nr_parts - 1].start, job.parts[nr_parts - 1].length);
+    complete_part(&job.parts[nr_parts - 1]);
+
+    pthread_mutex_lock(&job.lock);
+    while (job.pending > 0)
+        pthread_cond_wait(&job.done, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.done);
+}
+
+/* Copies length bytes between buffer and iov starting position bytes into it */
+static void copy_iov(const struct iovec *iov, size_t position, uint8_t *buffer, size_t length, bool to_iov) {
+    for (; length > 0; iov++) {
+        size_t count;
+
+        if (position >= iov->iov_len) {
+            position -= iov->iov_len;
+            continue;
+        }
+
+        count = min(iov->iov_len - position, length);
+        if (to_iov)
+            memcpy((uint8_t *)iov->iov_base + position, buffer, count);
+        else
+            memcpy(buffer, (uint8_t *)iov->iov_base + position, count);
+        buffer += count;
+        position = 0;
+        length -= count;
+    }
+}
+
+/* Decrypts the segments in place, BIUS_MAX_IOV at a time */
+static void decrypt_segments(const struct iovec *iov, int iovcnt, uint64_t offset) {
+    struct crypt_piece pieces[BIUS_MAX_IOV];
+
+    while (iovcnt > 0) {
+        int count = min(iovcnt, BIUS_MAX_IOV);
+
+        for (int i = 0; i < count; i++) {
+            pieces[i].src = iov[i].iov_base;
+            pieces[i].dst = iov[i].iov_base;
+            pieces[i].length = iov[i].iov_len;
+            pieces[i].sector = offset / AES_XTS_SECTOR_SIZE;
+            offset += iov[i].iov_len;
+        }
+
+        cipher(pieces, count, true);
+        iov += count;
+        iovcnt -= count;
+    }
+}
+
+/* Sectors straddling segments cannot be decrypted in place, these are read through the bounce buffer */
+static blk_status_t read_bounced(const struct iovec *iov, uint64_t offset, size_t length) {
+    uint8_t *bounce = get_bounce();
+
+    if (bounce == NULL)
+        return BLK_STS_RESOURCE;
+
+    for (size_t done = 0; done < length;) {
+        const size_t window = min(length - done, CRYPT_BOUNCE_SIZE);
+        struct crypt_piece piece = {bounce, bounce, window, (offset + done) / AES_XTS_SECTOR_SIZE};
+        blk_status_t result = encryption.backend.read(bounce, offset + done, window);
+
+        if (result != BLK_STS_OK)
+            return result;
+        cipher(&piece, 1, true);
+        copy_iov(iov, done, bounce, window, true);
+        done += window;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t read_segments(const struct iovec *iov, int iovcnt, uint64_t offset) {
+    const size_t length = iov_length(iov, iovcnt);
+    const uint64_t start = offset;
+    blk_status_t result = BLK_STS_OK;
+
+    if (offset % AES_XTS_SECTOR_SIZE != 0 || length % AES_XTS_SECTOR_SIZE != 0)
+        return BLK_STS_IOERR;
+    if (!sector_aligned(iov, iovcnt))
+        return read_bounced(iov, offset, length);
+
+    if (encryption.backend.read_iov) {
+        for (int i = 0; i < iovcnt && result == BLK_STS_OK; i += BIUS_MAX_IOV) {
+            result = encryption.backend.read_iov(iov + i, min(iovcnt - i, BIUS_MAX_IOV), offset);
+            offset += iov_length(iov + i, min(iovcnt - i, BIUS_MAX_IOV));
+        }
+    } else {
+        for (int i = 0; i < iovcnt && result == BLK_STS_OK; i++) {
+            result = encryption.backend.read(iov[i].iov_base, offset, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+    }
+
+    if (result == BLK_STS_OK)
+        decrypt_segments(iov, iovcnt, start);
+
+    return result;
+}
+
+/*
+ * Encrypts a window of the request into bounce, from iov starting at *iov_offset in the segment
+ * at *iov, and moves them past it. Stops at BIUS_MAX_IOV segments, at a sector boundary since
+ * segments are whole sectors. Returns the length of the window.
+ */
+static size_t encrypt_window(const struct iovec **iov, size_t *iov_offset, size_t remaining, uint8_t *bounce, uint64_t sector) {
+    struct crypt_piece pieces[BIUS_MAX_IOV];
+    size_t window = 0;
+    int nr_pieces = 0;
+
+    remaining = min(remaining, CRYPT_BOUNCE_SIZE);
+    while (window < remaining && nr_pieces < BIUS_MAX_IOV) {
+        const size_t count = min((*iov)->iov_len - *iov_offset, remaining - window);
+
+        pieces[nr_pieces].src = (const uint8_t *)(*iov)->iov_base + *iov_offset;
+        pieces[nr_pieces].dst = bounce + window;
+        pieces[nr_pieces].length = count;
+        pieces[nr_pieces].sector = sector + window / AES_XTS_SECTOR_SIZE;
+        nr_pieces++;
+
+        window += count;
+        *iov_offset += count;
+        if (*iov_offset == (*iov)->iov_len) {
+            (*iov)++;
+            *iov_offset = 0;
+        }
+    }
+
+    cipher(pieces, nr_pieces, false);
+    return window;
+}
+
+static blk_status_t write_segments(const struct iovec *iov, int iovcnt, uint64_t offset) {
+    const size_t length = iov_length(iov, iovcnt);
+    const bool aligned = sector_aligned(iov, iovcnt);
+    uint8_t *bounce = get_bounce();
+    size_t iov_offset = 0;
+
+    if (offset % AES_XTS_SECTOR_SIZE != 0 || length % AES_XTS_SECTOR_SIZE != 0)
+        return BLK_STS_IOERR;
+    if (bounce == NULL)
+        return BLK_STS_RESOURCE;
+
+    for (size_t done = 0; done < length;) {
+        const uint64_t sector = (offset + done) / AES_XTS_SECTOR_SIZE;
+        size_t window;
+        blk_status_t result;
+
+        if (aligned) {
+            window = encrypt_window(&iov, &iov_offset, length - done, bounce, sector);
+        } else {
+            struct crypt_piece piece = {bounce, bounce, min(length - done, CRYPT_BOUNCE_SIZE), sector};
+
+            window = piece.length;
+            copy_iov(iov, done, bounce, window, false);
+            cipher(&piece, 1, false);
+        }
+
+        result = encryption.backend.write(bounce, offset + done, window);
+        if (result != BLK_STS_OK)
+            return result;
+        done += window;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t crypt_read(void *data, off64_t offset, size_t length) {
+    struct crypt_piece piece = {data, data, length, offset / AES_XTS_SECTOR_SIZE};
+    blk_status_t result;
+
+    if (offset % AES_XTS_SECTOR_SIZE != 0 || length % AES_XTS_SECTOR_SIZE != 0)
+        return BLK_STS_IOERR;
+
+    result = encryption.backend.read(data, offset, length);
+    if (result == BLK_STS_OK)
+        cipher(&piece, 1, true);
+
+    return result;
+}
+
+static blk_status_t crypt_write(const void *data, off64_t offset, size_t length) {
+    struct iovec iov = {(void *)data, length};
+
+    return write_segments(&iov, 1, offset);
+}
+
+static blk_status_t crypt_read_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    return read_segments(iov, iovcnt, offset);
+}
+
+static blk_status_t crypt_write_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    return write_segments(iov, iovcnt, offset);
+}
+
+static blk_status_t crypt_discard(off64_t offset, size_t length) {
+    return encryption.backend.discard(offset, length);
+}
+
+static blk_status_t crypt_flush() {
+    return encryption.backend.flush ? encryption.backend.flush() : BLK_STS_OK;
+}
+
+static void stop_threads() {
+    __atomic_store_n(&encryption.stopping, true, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&encryption.lock);
+    pthread_cond_broadcast(&encryption.wakeup);
+    pthread_mutex_unlock(&encryption.lock);
+    for (unsigned int i = 0; i < encryption.nr_threads; i++)
+        pthread_join(encryption.threads[i], NULL);
+}
+
+static void release() {
+    stop_threads();
+    pthread_mutex_destroy(&encryption.lock);
+    pthread_cond_destroy(&encryption.wakeup);
+    pthread_key_delete(encryption.bounce_key);
+    /* Round keys would give the key back */
+    explicit_bzero(&encryption.key, sizeof(encryption.key));
+}
+
+int bius_crypt_create(const struct bius_operations *backend, const struct bius_crypt_options *options, struct bius_operations *out_operations) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int nr_threads = options->threads ? options->threads : (online > 1 ? online : 1);
+    int result;
+
+    if (encryption.created)
+        return -EBUSY;
+    if (backend->read == NULL || backend->write == NULL)
+        return -EINVAL;
+    if (options->allow_discards && backend->discard == NULL)
+        return -EINVAL;
+
+    memset(&encryption, 0, sizeof(encryption));
+    result = aes_xts_set_key(&encryption.key, options->key, options->key_size);
+    if (result < 0)
+        return result;
+    /* The caller runs one part itself */
+    nr_threads = min(nr_threads - 1, CRYPT_MAX_THREADS);
+    memcpy(&encryption.backend, backend, sizeof(struct bius_operations));
+
+    result = -pthread_key_create(&encryption.bounce_key, free);
+    if (result < 0)
+        goto out_wipe;
+    pthread_mutex_init(&encryption.lock, NULL);
+    pthread_cond_init(&encryption.wakeup, NULL);
+
+    for (; encryption.nr_threads < nr_threads; encryption.nr_threads++) {
+        result = pthread_create(&encryption.threads[encryption.nr_threads], NULL, helper_main, NULL);
+        if (result != 0) {
+            result = -result;
+            goto out_release;
+        }
+    }
+
+    memset(out_operations, 0, sizeof(struct bius_operations));
+    out_operations->read = crypt_read;
+    out_operations->write = crypt_write;
+    out_operations->read_iov = crypt_read_iov;
+    out_operations->write_iov = crypt_write_iov;
+    out_operations->flush = crypt_flush;
+    if (options->allow_discards)
+        out_operations->discard = crypt_discard;
+    encryption.created = true;
+
+    return 0;
+
+out_release:
+    release();
+    return result;
+
+out_wipe:
+    explicit_bzero(&encryption.key, sizeof(encryption.key));
+    return result;
+}
+
+int bius_crypt_destroy() {
+    if (!encryption.created)
+        return -EINVAL;
+
+    /* Every job was waited for by its caller, the queue is empty */
+    release();
+    encryption.created = false;
+
+    return 0;
+}
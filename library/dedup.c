@@ -0,0 +1,769 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "libbius.h"
+#include "fingerprint.h"
+#include "utils.h"
+
+/*
+ * Deduplicating block store. Blocks written are fingerprinted and looked up in an index of the
+ * blocks already stored: a block found there only gains a reference, without any I/O, others are
+ * appended to the data log. The store file holds a header of DEDUP_PAGE_SIZE bytes, the map with
+ * a 32-bit entry per logical block, then the log. Map entry 0 means the block reads as zeros, any
+ * other value p that it is log block p - 1. The log is made of segments of DEDUP_SEGMENT_BLOCKS
+ * data blocks, each preceded by a summary holding their fingerprints.
+ *
+ * The index, the reference counts and the free log blocks are rebuilt from the map and the
+ * summaries at open. A flush syncs the data and summaries before writing the changed map pages,
+ * so that the map never references data which did not reach the disk. Log blocks losing their
+ * last reference are only reused once a flush has made that durable, and reads in flight
+ * meanwhile still find their data.
+ */
+
+#define DEDUP_MAGIC 0x3150444453554942lu /* "BIUSDDP1" */
+#define DEDUP_VERSION 1
+#define DEDUP_PAGE_SIZE 4096
+#define DEDUP_DEFAULT_BLOCK_SIZE 4096
+#define DEDUP_MAX_BLOCK_SIZE (1024 * 1024)
+/* Map entries and fingerprints written back together, a page of them */
+#define DEDUP_MAP_PAGE_ENTRIES (DEDUP_PAGE_SIZE / sizeof(uint32_t))
+#define DEDUP_SEGMENT_BLOCKS (DEDUP_PAGE_SIZE / sizeof(struct fingerprint))
+#define DEDUP_MAX_LOG_BLOCKS (UINT32_MAX - 1)
+#define DEDUP_NUM_LOCKS 1024
+
+struct dedup_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t disk_size;
+    uint64_t map_offset;
+    uint64_t log_offset;
+};
+
+struct block_list {
+    uint32_t *blocks;
+    size_t length;
+    size_t capacity;
+};
+
+static struct dedup {
+    int fd;
+    bool verify;
+    uint64_t block_size;
+    uint64_t disk_size;
+    uint64_t nr_blocks;
+    uint64_t map_offset;
+    uint64_t log_offset;
+    /* Summary followed by the data blocks */
+    uint64_t summary_size;
+    uint64_t segment_size;
+    uint32_t *map;
+    /* Map pages changed since the last flush, a bit each */
+    uint64_t *dirty_map_pages;
+    /* Fingerprint and references of each log block, in the layout of the summaries */
+    struct fingerprint *fingerprints;
+    uint32_t *refcounts;
+    /* Summaries changed since the last flush, a bit each */
+    uint64_t *dirty_segments;
+    uint32_t log_capacity;
+    uint32_t log_blocks;
+    struct block_list free_blocks;
+    /* Log blocks which lost their last reference since the last flush */
+    struct block_list released_blocks;
+    /* Open addressing with linear probing, tag << 32 | log block + 1, 0 if empty */
+    uint64_t *index;
+    uint64_t index_mask;
+    /* Protects everything above but the data */
+    pthread_mutex_t lock;
+    /* I/O holds it shared, a flush holds it exclusive while it takes its copy of the metadata */
+    pthread_rwlock_t io_lock;
+    /* Serializes writes to the logical blocks hashed to each */
+    pthread_mutex_t block_locks[DEDUP_NUM_LOCKS];
+    pthread_mutex_t flush_lock;
+    struct bius_dedup_stats stats;
+    bool opened;
+} dedup;
+
+static inline size_t nr_map_pages() {
+    return (dedup.nr_blocks + DEDUP_MAP_PAGE_ENTRIES - 1) / DEDUP_MAP_PAGE_ENTRIES;
+}
+
+static inline uint64_t summary_position(uint64_t segment) {
+    return dedup.log_offset + segment * dedup.segment_size;
+}
+
+static inline uint64_t log_position(uint32_t block) {
+    return summary_position(block / DEDUP_SEGMENT_BLOCKS) + dedup.summary_size + (block % DEDUP_SEGMENT_BLOCKS) * dedup.block_size;
+}
+
+static bool push_block(struct block_list *list, uint32_t block) {
+    if (list->length == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        uint32_t *blocks = realloc(list->blocks, sizeof(uint32_t) * capacity);
+
+        if (blocks == NULL)
+            return false;
+        list->blocks = blocks;
+        list->capacity = capacity;
+    }
+
+    list->blocks[list->length++] = block;
+    return true;
+}
+
+static inline bool is_zero(const char *data, size_t length) {
+    return data[0] == 0 && memcmp(data, data + 1, length - 1) == 0;
+}
+
+static inline uint64_t index_home(const struct fingerprint *print) {
+    return print->low & dedup.index_mask;
+}
+
+/* Returns the log block + 1 holding data of fingerprint print, 0 if none. Called with lock held. */
+static uint32_t index_lookup(const struct fingerprint *print) {
+    const uint32_t tag = print->high >> 32;
+
+    for (uint64_t i = index_home(print);; i = (i + 1) & dedup.index_mask) {
+        uint64_t slot = dedup.index[i];
+
+        if (slot == 0)
+            return 0;
+        if (slot >> 32 == tag && fingerprint_equal(&dedup.fingerprints[(uint32_t)slot - 1], print))
+            return (uint32_t)slot;
+    }
+}
+
+static void index_insert(uint32_t block) {
+    const struct fingerprint *print = &dedup.fingerprints[block];
+    uint64_t i;
+
+    for (i = index_home(print); dedup.index[i] != 0; i = (i + 1) & dedup.index_mask);
+    dedup.index[i] = (print->high >> 32) << 32 | (block + 1);
+}
+
+/* Removes block if indexed, shifting back the entries after it instead of leaving a tombstone */
+static void index_remove(uint32_t block) {
+    uint64_t i;
+
+    for (i = index_home(&dedup.fingerprints[block]); (uint32_t)dedup.index[i] != block + 1; i = (i + 1) & dedup.index_mask) {
+        if (dedup.index[i] == 0)
+            return;
+    }
+
+    for (uint64_t j = (i + 1) & dedup.index_mask; dedup.index[j] != 0; j = (j + 1) & dedup.index_mask) {
+        uint64_t home = index_home(&dedup.fingerprints[(uint32_t)dedup.index[j] - 1]);
+
+        /* The entry at j may move to i if its home is not cyclically in (i, j] */
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            dedup.index[i] = dedup.index[j];
+            i = j;
+        }
+    }
+    dedup.index[i] = 0;
+}
+
+/* Makes room for the fingerprints and references of more log blocks */
+static int grow_log() {
+    uint64_t capacity = dedup.log_capacity ? (uint64_t)dedup.log_capacity * 2 : DEDUP_SEGMENT_BLOCKS * 64;
+    size_t old_words = dedup.log_capacity / DEDUP_SEGMENT_BLOCKS / 64;
+    struct fingerprint *fingerprints;
+    uint32_t *refcounts;
+    uint64_t *dirty_segments;
+
+    /* Whole words of dirty_segments */
+    capacity = min(capacity, (uint64_t)UINT32_MAX / (DEDUP_SEGMENT_BLOCKS * 64) * (DEDUP_SEGMENT_BLOCKS * 64));
+    if (capacity <= dedup.log_capacity)
+        return -ENOSPC;
+
+    fingerprints = realloc(dedup.fingerprints, sizeof(struct fingerprint) * capacity);
+    if (fingerprints == NULL)
+        return -ENOMEM;
+    dedup.fingerprints = fingerprints;
+
+    refcounts = realloc(dedup.refcounts, sizeof(uint32_t) * capacity);
+    if (refcounts == NULL)
+        return -ENOMEM;
+    dedup.refcounts = refcounts;
+
+    dirty_segments = realloc(dedup.dirty_segments, sizeof(uint64_t) * (capacity / DEDUP_SEGMENT_BLOCKS / 64));
+    if (dirty_segments == NULL)
+        return -ENOMEM;
+    dedup.dirty_segments = dirty_segments;
+
+    memset(dedup.fingerprints + dedup.log_capacity, 0, sizeof(struct fingerprint) * (capacity - dedup.log_capacity));
+    memset(dedup.refcounts + dedup.log_capacity, 0, sizeof(uint32_t) * (capacity - dedup.log_capacity));
+    memset(dedup.dirty_segments + old_words, 0, sizeof(uint64_t) * (capacity / DEDUP_SEGMENT_BLOCKS / 64 - old_words));
+    dedup.log_capacity = capacity;
+
+    return 0;
+}
+
+/* Returns a log block for new data, UINT32_MAX if there is none. Called with lock held. */
+static uint32_t allocate_block() {
+    if (dedup.free_blocks.length > 0)
+        return dedup.free_blocks.blocks[--dedup.free_blocks.length];
+
+    if (dedup.log_blocks >= DEDUP_MAX_LOG_BLOCKS || (dedup.log_blocks == dedup.log_capacity && grow_log() < 0))
+        return UINT32_MAX;
+
+    return dedup.log_blocks++;
+}
+
+static void release_block(uint32_t block) {
+    if (--dedup.refcounts[block] > 0)
+        return;
+
+    index_remove(block);
+    dedup.stats.stored_blocks--;
+    /* Failing only leaks the space until the store is opened again */
+    push_block(&dedup.released_blocks, block);
+}
+
+/* Points logical block at entry, which already holds a reference for it. Called with lock held. */
+static void set_mapping(uint64_t block, uint32_t entry) {
+    uint32_t old = dedup.map[block];
+    uint64_t page = block / DEDUP_MAP_PAGE_ENTRIES;
+
+    __atomic_store_n(&dedup.map[block], entry, __ATOMIC_RELEASE);
+    dedup.dirty_map_pages[page / 64] |= 1lu << (page % 64);
+    dedup.stats.mapped_blocks += (entry != 0) - (old != 0);
+    if (old != 0)
+        release_block(old - 1);
+}
+
+/* Reads the logical range, resolving runs of blocks contiguous in the log at once */
+static blk_status_t read_range(char *data, uint64_t offset, size_t length) {
+    const uint64_t block_size = dedup.block_size;
+
+    while (length > 0) {
+        uint64_t block = offset / block_size;
+        uint32_t entry = __atomic_load_n(&dedup.map[block], __ATOMIC_ACQUIRE);
+        size_t size = min(length, block_size - offset % block_size);
+
+        for (uint32_t n = 1; size < length; n++) {
+            uint32_t next = __atomic_load_n(&dedup.map[block + n], __ATOMIC_ACQUIRE);
+
+            if (entry == 0 ? next != 0 : next != entry + n || (entry - 1 + n) % DEDUP_SEGMENT_BLOCKS == 0)
+                break;
+            size += min(length - size, block_size);
+        }
+
+        if (entry == 0) {
+            memset(data, 0, size);
+        } else if (pread_full(dedup.fd, data, size, log_position(entry - 1) + offset % block_size) < 0) {
+            fprintf(stderr, "dedup: reading log failed: %s\n", strerror(errno));
+            return BLK_STS_IOERR;
+        }
+
+        data += size;
+        offset += size;
+        length -= size;
+    }
+
+    return BLK_STS_OK;
+}
+
+/* Whether log block + 1 entry really holds data. Takes a reference on it, kept if it does. */
+static bool verify_entry(uint32_t entry, const char *data, char *buffer) {
+    bool equal;
+
+    dedup.refcounts[entry - 1]++;
+    pthread_mutex_unlock(&dedup.lock);
+    equal = pread_full(dedup.fd, buffer, dedup.block_size, log_position(entry - 1)) == 0 && memcmp(buffer, data, dedup.block_size) == 0;
+    pthread_mutex_lock(&dedup.lock);
+
+    if (!equal)
+        release_block(entry - 1);
+
+    return equal;
+}
+
+/* Makes logical block hold data, a whole block. Called with the lock of the block held. */
+static blk_status_t store_block(uint64_t block, const char *data, char *buffer) {
+    struct fingerprint print;
+    uint32_t entry;
+    uint32_t new_block;
+    bool collided = false;
+
+    if (is_zero(data, dedup.block_size)) {
+        pthread_mutex_lock(&dedup.lock);
+        set_mapping(block, 0);
+        dedup.stats.zero_blocks++;
+        pthread_mutex_unlock(&dedup.lock);
+        return BLK_STS_OK;
+    }
+
+    fingerprint(data, dedup.block_size, &print);
+
+    pthread_mutex_lock(&dedup.lock);
+    entry = index_lookup(&print);
+    if (entry != 0 && (!dedup.verify || verify_entry(entry, data, buffer))) {
+        if (!dedup.verify)
+            dedup.refcounts[entry - 1]++;
+        goto out_deduplicated;
+    }
+    collided = entry != 0;
+
+    new_block = allocate_block();
+    pthread_mutex_unlock(&dedup.lock);
+    if (new_block == UINT32_MAX)
+        return BLK_STS_NOSPC;
+
+    if (pwrite_full(dedup.fd, data, dedup.block_size, log_position(new_block)) < 0) {
+        fprintf(stderr, "dedup: writing log failed: %s\n", strerror(errno));
+        pthread_mutex_lock(&dedup.lock);
+        push_block(&dedup.free_blocks, new_block);
+        pthread_mutex_unlock(&dedup.lock);
+        return BLK_STS_IOERR;
+    }
+
+    pthread_mutex_lock(&dedup.lock);
+    /* The same data may have been stored by another writer meanwhile */
+    entry = collided ? 0 : index_lookup(&print);
+    if (entry != 0 && !dedup.verify) {
+        /* Never referenced, so reusable right away */
+        push_block(&dedup.free_blocks, new_block);
+        dedup.refcounts[entry - 1]++;
+        goto out_deduplicated;
+    }
+
+    dedup.fingerprints[new_block] = print;
+    dedup.refcounts[new_block] = 1;
+    dedup.dirty_segments[new_block / DEDUP_SEGMENT_BLOCKS / 64] |= 1lu << (new_block / DEDUP_SEGMENT_BLOCKS % 64);
+    /* A colliding block stays out of the index, which keeps a fingerprint once */
+    if (entry == 0 && !collided)
+        index_insert(new_block);
+    set_mapping(block, new_block + 1);
+    dedup.stats.stored_blocks++;
+    dedup.stats.appended_blocks++;
+    pthread_mutex_unlock(&dedup.lock);
+
+    return BLK_STS_OK;
+
+out_deduplicated:
+    set_mapping(block, entry);
+    dedup.stats.deduplicated_blocks++;
+    pthread_mutex_unlock(&dedup.lock);
+
+    return BLK_STS_OK;
+}
+
+/* Writes size bytes of data at block_offset in block, zeros if data is NULL */
+static blk_status_t write_block(uint64_t block, const char *data, size_t block_offset, size_t size, char *buffer) {
+    const uint64_t block_size = dedup.block_size;
+    pthread_mutex_t *lock = &dedup.block_locks[block % DEDUP_NUM_LOCKS];
+    char *merged = buffer + block_size;
+    blk_status_t result;
+
+    pthread_mutex_lock(lock);
+    if (data && size == block_size) {
+        result = store_block(block, data, buffer);
+    } else if (data == NULL && size == block_size) {
+        pthread_mutex_lock(&dedup.lock);
+        set_mapping(block, 0);
+        pthread_mutex_unlock(&dedup.lock);
+        result = BLK_STS_OK;
+    } else {
+        result = read_range(merged, block * block_size, block_size);
+        if (result == BLK_STS_OK) {
+            if (data)
+                memcpy(merged + block_offset, data, size);
+            else
+                memset(merged + block_offset, 0, size);
+            result = store_block(block, merged, buffer);
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    return result;
+}
+
+static blk_status_t dedup_read(void *data, off64_t offset, size_t length) {
+    blk_status_t result;
+
+    pthread_rwlock_rdlock(&dedup.io_lock);
+    result = read_range(data, offset, length);
+    pthread_rwlock_unlock(&dedup.io_lock);
+
+    return result;
+}
+
+/* Writes data over the range, or zeros if data is NULL */
+static blk_status_t dedup_update(const char *data, off64_t offset, size_t length) {
+    const uint64_t block_size = dedup.block_size;
+    blk_status_t result = BLK_STS_OK;
+    /* Data compared on verify, then a block being merged */
+    char *buffer = malloc(2 * block_size);
+
+    if (buffer == NULL)
+        return BLK_STS_RESOURCE;
+
+    pthread_rwlock_rdlock(&dedup.io_lock);
+    while (length > 0 && result == BLK_STS_OK) {
+        size_t block_offset = offset % block_size;
+        size_t size = min(length, block_size - block_offset);
+
+        result = write_block(offset / block_size, data, block_offset, size, buffer);
+
+        if (data)
+            data += size;
+        offset += size;
+        length -= size;
+    }
+    pthread_rwlock_unlock(&dedup.io_lock);
+    free(buffer);
+
+    return result;
+}
+
+static blk_status_t dedup_write(const void *data, off64_t offset, size_t length) {
+    return dedup_update(data, offset, length);
+}
+
+static blk_status_t dedup_discard(off64_t offset, size_t length) {
+    return dedup_update(NULL, offset, length);
+}
+
+/* Appends a copy of each page marked in dirty, clearing it, to pages and positions */
+static size_t copy_dirty_pages(uint64_t *dirty, size_t nr_words, const char *source, size_t source_length,
+                               uint64_t (*position)(uint64_t page), char *pages, uint64_t *positions) {
+    size_t count = 0;
+
+    for (size_t word = 0; word < nr_words; word++) {
+        while (dirty[word]) {
+            uint64_t page = word * 64 + __builtin_ctzl(dirty[word]);
+            size_t length = min(source_length - page * DEDUP_PAGE_SIZE, DEDUP_PAGE_SIZE);
+
+            memset(pages + count * DEDUP_PAGE_SIZE, 0, DEDUP_PAGE_SIZE);
+            memcpy(pages + count * DEDUP_PAGE_SIZE, source + page * DEDUP_PAGE_SIZE, length);
+            positions[count++] = position(page);
+            dirty[word] &= dirty[word] - 1;
+        }
+    }
+
+    return count;
+}
+
+static uint64_t map_page_position(uint64_t page) {
+    return dedup.map_offset + page * DEDUP_PAGE_SIZE;
+}
+
+static size_t count_bits(const uint64_t *bits, size_t nr_words) {
+    size_t count = 0;
+
+    for (size_t word = 0; word < nr_words; word++)
+        count += __builtin_popcountl(bits[word]);
+
+    return count;
+}
+
+static int write_pages(const char *pages, const uint64_t *positions, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int result = pwrite_full(dedup.fd, pages + i * DEDUP_PAGE_SIZE, DEDUP_PAGE_SIZE, positions[i]);
+
+        if (result < 0)
+            return result;
+    }
+
+    return 0;
+}
+
+/*
+ * Copies the changed summaries and map pages with I/O stopped, which keeps every mapping in the
+ * copy pointing at data already written. The summaries are synced with that data before the map
+ * pages are written.
+ */
+static blk_status_t dedup_flush() {
+    const size_t nr_map_words = (nr_map_pages() + 63) / 64;
+    struct block_list released = {0};
+    size_t nr_segment_words;
+    size_t nr_summaries, nr_pages;
+    uint64_t *positions = NULL;
+    char *pages = NULL;
+    blk_status_t result = BLK_STS_IOERR;
+
+    pthread_mutex_lock(&dedup.flush_lock);
+    pthread_rwlock_wrlock(&dedup.io_lock);
+    pthread_mutex_lock(&dedup.lock);
+
+    nr_segment_words = dedup.log_capacity / DEDUP_SEGMENT_BLOCKS / 64;
+    nr_summaries = count_bits(dedup.dirty_segments, nr_segment_words);
+    nr_pages = nr_summaries + count_bits(dedup.dirty_map_pages, nr_map_words);
+    if (nr_pages > 0) {
+        pages = malloc(DEDUP_PAGE_SIZE * nr_pages);
+        positions = malloc(sizeof(uint64_t) * nr_pages);
+    }
+    if (nr_pages > 0 && (pages == NULL || positions == NULL)) {
+        pthread_mutex_unlock(&dedup.lock);
+        pthread_rwlock_unlock(&dedup.io_lock);
+        result = BLK_STS_RESOURCE;
+        goto out_free;
+    }
+
+    copy_dirty_pages(dedup.dirty_segments, nr_segment_words, (const char *)dedup.fingerprints,
+                     sizeof(struct fingerprint) * dedup.log_capacity, summary_position, pages, positions);
+    copy_dirty_pages(dedup.dirty_map_pages, nr_map_words, (const char *)dedup.map, sizeof(uint32_t) * dedup.nr_blocks,
+                     map_page_position, pages + DEDUP_PAGE_SIZE * nr_summaries, positions + nr_summaries);
+    released = dedup.released_blocks;
+    memset(&dedup.released_blocks, 0, sizeof(struct block_list));
+
+    pthread_mutex_unlock(&dedup.lock);
+    pthread_rwlock_unlock(&dedup.io_lock);
+
+    if (write_pages(pages, positions, nr_summaries) < 0 || fdatasync(dedup.fd) < 0)
+        goto out_error;
+    if (nr_pages > nr_summaries) {
+        if (write_pages(pages + DEDUP_PAGE_SIZE * nr_summaries, positions + nr_summaries, nr_pages - nr_summaries) < 0 || fdatasync(dedup.fd) < 0)
+            goto out_error;
+    }
+
+    /* No mapping on disk references them anymore */
+    for (size_t i = 0; i < released.length; i++)
+        fallocate(dedup.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, log_position(released.blocks[i]), dedup.block_size);
+
+    pthread_mutex_lock(&dedup.lock);
+    for (size_t i = 0; i < released.length; i++)
+        push_block(&dedup.free_blocks, released.blocks[i]);
+    pthread_mutex_unlock(&dedup.lock);
+    result = BLK_STS_OK;
+    goto out_free;
+
+out_error:
+    fprintf(stderr, "dedup: flush failed: %s\n", strerror(errno));
+    /* Written again by the next flush */
+    pthread_mutex_lock(&dedup.lock);
+    for (size_t i = 0; i < nr_pages; i++) {
+        uint64_t page = i < nr_summaries ? (positions[i] - dedup.log_offset) / dedup.segment_size
+                                         : (positions[i] - dedup.map_offset) / DEDUP_PAGE_SIZE;
+        uint64_t *dirty = i < nr_summaries ? dedup.dirty_segments : dedup.dirty_map_pages;
+
+        dirty[page / 64] |= 1lu << (page % 64);
+    }
+    for (size_t i = 0; i < released.length; i++)
+        push_block(&dedup.released_blocks, released.blocks[i]);
+    pthread_mutex_unlock(&dedup.lock);
+
+out_free:
+    free(released.blocks);
+    free(pages);
+    free(positions);
+    pthread_mutex_unlock(&dedup.flush_lock);
+
+    return result;
+}
+
+static inline uint64_t round_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static inline uint64_t get_log_offset(uint64_t block_size, uint64_t nr_blocks) {
+    return round_up(DEDUP_PAGE_SIZE + sizeof(uint32_t) * nr_blocks, block_size > DEDUP_PAGE_SIZE ? block_size : DEDUP_PAGE_SIZE);
+}
+
+static inline bool valid_geometry(uint64_t block_size, uint64_t disk_size) {
+    if (block_size < SECTOR_SIZE || block_size > DEDUP_MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0)
+        return false;
+
+    return disk_size != 0 && disk_size % block_size == 0 && disk_size / block_size < UINT32_MAX;
+}
+
+int bius_dedup_create(const char *path, const struct bius_dedup_options *options) {
+    struct dedup_header header;
+    uint64_t block_size = options->block_size ? options->block_size : DEDUP_DEFAULT_BLOCK_SIZE;
+    int fd;
+    int result = 0;
+
+    if (!valid_geometry(block_size, options->disk_size))
+        return -EINVAL;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = DEDUP_MAGIC;
+    header.version = DEDUP_VERSION;
+    header.block_size = block_size;
+    header.disk_size = options->disk_size;
+    header.map_offset = DEDUP_PAGE_SIZE;
+    header.log_offset = get_log_offset(block_size, options->disk_size / block_size);
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return -errno;
+
+    /* The map stays a hole until blocks are written */
+    if (pwrite_full(fd, (const char *)&header, sizeof(header), 0) < 0 || ftruncate(fd, header.log_offset) < 0 || fsync(fd) < 0) {
+        result = -errno;
+        unlink(path);
+    }
+    close(fd);
+
+    return result;
+}
+
+/* Rebuilds the references, free blocks and index from the map and the summaries */
+static int load_log() {
+    uint32_t highest = 0;
+
+    for (uint64_t i = 0; i < dedup.nr_blocks; i++)
+        highest = dedup.map[i] > highest ? dedup.map[i] : highest;
+
+    dedup.log_blocks = highest;
+    while (dedup.log_capacity < dedup.log_blocks) {
+        int result = grow_log();
+
+        if (result < 0)
+            return result;
+    }
+
+    /* Blocks after the highest referenced one were written after the last flush */
+    for (uint64_t segment = 0; segment * DEDUP_SEGMENT_BLOCKS < dedup.log_blocks; segment++) {
+        int result = pread_full(dedup.fd, (char *)(dedup.fingerprints + segment * DEDUP_SEGMENT_BLOCKS), DEDUP_PAGE_SIZE, summary_position(segment));
+
+        if (result < 0)
+            return result;
+    }
+
+    for (uint64_t i = 0; i < dedup.nr_blocks; i++) {
+        if (dedup.map[i] != 0) {
+            dedup.stats.mapped_blocks++;
+            dedup.refcounts[dedup.map[i] - 1]++;
+        }
+    }
+
+    for (uint32_t block = 0; block < dedup.log_blocks; block++) {
+        if (dedup.refcounts[block] == 0) {
+            if (!push_block(&dedup.free_blocks, block))
+                return -ENOMEM;
+            continue;
+        }
+
+        if (index_lookup(&dedup.fingerprints[block]) == 0)
+            index_insert(block);
+        dedup.stats.stored_blocks++;
+    }
+
+    return 0;
+}
+
+static void free_store() {
+    free(dedup.map);
+    free(dedup.dirty_map_pages);
+    free(dedup.fingerprints);
+    free(dedup.refcounts);
+    free(dedup.dirty_segments);
+    free(dedup.free_blocks.blocks);
+    free(dedup.released_blocks.blocks);
+    free(dedup.index);
+    close(dedup.fd);
+}
+
+int bius_dedup_open(const char *path, bool verify, struct bius_operations *out_operations, unsigned long *out_disk_size) {
+    struct dedup_header header;
+    pthread_rwlockattr_t attr;
+    uint64_t index_size = 1024;
+    int result;
+
+    if (dedup.opened)
+        return -EBUSY;
+
+    memset(&dedup, 0, sizeof(dedup));
+    dedup.verify = verify;
+    dedup.fd = open(path, O_RDWR);
+    if (dedup.fd < 0)
+        return -errno;
+
+    result = pread_full(dedup.fd, (char *)&header, sizeof(header), 0);
+    if (result < 0)
+        goto out_free;
+    if (header.magic != DEDUP_MAGIC || header.version != DEDUP_VERSION || !valid_geometry(header.block_size, header.disk_size)) {
+        result = -EINVAL;
+        goto out_free;
+    }
+
+    dedup.block_size = header.block_size;
+    dedup.disk_size = header.disk_size;
+    dedup.nr_blocks = header.disk_size / header.block_size;
+    dedup.map_offset = header.map_offset;
+    dedup.log_offset = header.log_offset;
+    dedup.summary_size = round_up(DEDUP_PAGE_SIZE, dedup.block_size);
+    dedup.segment_size = dedup.summary_size + DEDUP_SEGMENT_BLOCKS * dedup.block_size;
+    if (dedup.map_offset != DEDUP_PAGE_SIZE || dedup.log_offset != get_log_offset(dedup.block_size, dedup.nr_blocks)) {
+        result = -EINVAL;
+        goto out_free;
+    }
+
+    /* Every indexed block is mapped, so the index stays at most 3/4 full */
+    while (index_size < dedup.nr_blocks + dedup.nr_blocks / 3 + 1)
+        index_size *= 2;
+
+    result = -ENOMEM;
+    dedup.map = malloc(sizeof(uint32_t) * dedup.nr_blocks);
+    dedup.dirty_map_pages = calloc((nr_map_pages() + 63) / 64, sizeof(uint64_t));
+    dedup.index = calloc(index_size, sizeof(uint64_t));
+    if (dedup.map == NULL || dedup.dirty_map_pages == NULL || dedup.index == NULL)
+        goto out_free;
+    dedup.index_mask = index_size - 1;
+
+    result = pread_full(dedup.fd, (char *)dedup.map, sizeof(uint32_t) * dedup.nr_blocks, dedup.map_offset);
+    if (result < 0)
+        goto out_free;
+
+    result = load_log();
+    if (result < 0)
+        goto out_free;
+
+    /* Otherwise a steady stream of I/O keeps flushes waiting */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&dedup.io_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&dedup.lock, NULL);
+    pthread_mutex_init(&dedup.flush_lock, NULL);
+    for (int i = 0; i < DEDUP_NUM_LOCKS; i++)
+        pthread_mutex_init(&dedup.block_locks[i], NULL);
+
+    memset(out_operations, 0, sizeof(struct bius_operations));
+    out_operations->read = dedup_read;
+    out_operations->write = dedup_write;
+    out_operations->discard = dedup_discard;
+    out_operations->write_zeroes = dedup_discard;
+    out_operations->flush = dedup_flush;
+    *out_disk_size = dedup.disk_size;
+    dedup.opened = true;
+
+    return 0;
+
+out_free:
+    free_store();
+    return result;
+}
+
+void bius_dedup_get_stats(struct bius_dedup_stats *out_stats) {
+    pthread_mutex_lock(&dedup.lock);
+    memcpy(out_stats, &dedup.stats, sizeof(struct bius_dedup_stats));
+    pthread_mutex_unlock(&dedup.lock);
+}
+
+int bius_dedup_close() {
+    blk_status_t result;
+
+    if (!dedup.opened)
+        return -EINVAL;
+
+    result = dedup_flush();
+
+    free_store();
+    pthread_rwlock_destroy(&dedup.io_lock);
+    pthread_mutex_destroy(&dedup.lock);
+    pthread_mutex_destroy(&dedup.flush_lock);
+    for (int i = 0; i < DEDUP_NUM_LOCKS; i++)
+        pthread_mutex_destroy(&dedup.block_locks[i]);
+    dedup.opened = false;
+
+    return result == BLK_STS_OK ? 0 : -EIO;
+}
@@ -0,0 +1,882 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include "libbius.h"
+#include "gf256.h"
+#include "utils.h"
+
+/*
+ * Reed-Solomon coding over k data and m parity chunks per stripe. Parity row r has coefficients
+ * 1 / ((k + r) ^ j) for data chunk j, a Cauchy matrix, so any k chunks of a stripe recover it.
+ * Columns are scaled so that the first row is all ones: the first parity is the XOR of the data,
+ * as with RAID-5, and every square submatrix stays invertible.
+ *
+ * The backend places chunk i of stripe s on target (i + s) % n at offset s * chunk_size, which
+ * rotates parity over the targets. Writes of whole stripes are encoded directly. Partial ones are
+ * buffered in a stripe cache, if enabled, until their stripe is complete or gets evicted; parity
+ * is then updated from the difference with the old data, only reading the ranges written. Reads of
+ * a failed target are rebuilt from the other chunks of their stripe.
+ *
+ * As with RAID-5 without a journal, a crash between the writes of a stripe leaves its parity
+ * inconsistent, which only matters if a target then fails.
+ */
+
+#define ERASURE_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define ERASURE_NUM_STRIPE_LOCKS 1024
+
+static void build_coefficients(unsigned int data_chunks, unsigned int parity_chunks, uint8_t *coefficients) {
+    for (unsigned int r = 0; r < parity_chunks; r++) {
+        for (unsigned int j = 0; j < data_chunks; j++)
+            coefficients[r * data_chunks + j] = gf256_inverse((data_chunks + r) ^ j);
+    }
+
+    for (unsigned int j = 0; j < data_chunks; j++) {
+        uint8_t scale = gf256_inverse(coefficients[j]);
+
+        for (unsigned int r = 0; r < parity_chunks; r++)
+            coefficients[r * data_chunks + j] = gf256_mul(coefficients[r * data_chunks + j], scale);
+    }
+}
+
+static inline void encode(unsigned int data_chunks, unsigned int parity_chunks, const uint8_t *coefficients, uint8_t *const *chunks, size_t length) {
+    gf256_dot_product(chunks + data_chunks, parity_chunks, (const uint8_t *const *)chunks, data_chunks, coefficients, length);
+}
+
+/* Rebuilds the wanted chunks from the first data_chunks present ones. Returns -1 if too few are. */
+static int reconstruct(unsigned int data_chunks, unsigned int parity_chunks, const uint8_t *coefficients, uint8_t *const *chunks, const bool *present, const unsigned int *wanted, unsigned int nr_wanted, size_t length) {
+    const unsigned int k = data_chunks;
+    unsigned int sources[BIUS_ERASURE_MAX_CHUNKS];
+    const uint8_t *source_chunks[BIUS_ERASURE_MAX_CHUNKS];
+    uint8_t *wanted_chunks[BIUS_ERASURE_MAX_CHUNKS];
+    uint8_t matrix[BIUS_ERASURE_MAX_CHUNKS * BIUS_ERASURE_MAX_CHUNKS] = {0};
+    uint8_t inverse[BIUS_ERASURE_MAX_CHUNKS * BIUS_ERASURE_MAX_CHUNKS];
+    uint8_t rows[BIUS_ERASURE_MAX_CHUNKS * BIUS_ERASURE_MAX_CHUNKS];
+    unsigned int nr_sources = 0;
+
+    for (unsigned int i = 0; i < data_chunks + parity_chunks && nr_sources < k; i++) {
+        if (present[i]) {
+            source_chunks[nr_sources] = chunks[i];
+            sources[nr_sources++] = i;
+        }
+    }
+    if (nr_sources < k)
+        return -1;
+
+    /* Rows of the generator matrix giving the sources from the data */
+    for (unsigned int s = 0; s < k; s++) {
+        for (unsigned int j = 0; j < k; j++) {
+            if (sources[s] < k)
+                matrix[s * k + j] = sources[s] == j;
+            else
+                matrix[s * k + j] = coefficients[(sources[s] - k) * k + j];
+        }
+    }
+    if (gf256_invert_matrix(matrix, inverse, k) < 0)
+        return -1;
+
+    /* Rows of the wanted chunks applied to the data, the data being the inverse applied to sources */
+    for (unsigned int w = 0; w < nr_wanted; w++) {
+        wanted_chunks[w] = chunks[wanted[w]];
+        for (unsigned int s = 0; s < k; s++) {
+            uint8_t sum = 0;
+
+            for (unsigned int j = 0; j < k; j++) {
+                uint8_t generator = wanted[w] < k ? wanted[w] == j : coefficients[(wanted[w] - k) * k + j];
+
+                sum ^= gf256_mul(generator, inverse[j * k + s]);
+            }
+            rows[w * k + s] = sum;
+        }
+    }
+
+    gf256_dot_product(wanted_chunks, nr_wanted, source_chunks, k, rows, length);
+    return 0;
+}
+
+static inline bool valid_code(unsigned int data_chunks, unsigned int parity_chunks) {
+    return data_chunks > 0 && parity_chunks > 0 && data_chunks + parity_chunks <= BIUS_ERASURE_MAX_CHUNKS;
+}
+
+int bius_erasure_encode(unsigned int data_chunks, unsigned int parity_chunks, void *const *chunks, size_t length) {
+    uint8_t coefficients[BIUS_ERASURE_MAX_CHUNKS * BIUS_ERASURE_MAX_CHUNKS];
+
+    if (!valid_code(data_chunks, parity_chunks))
+        return -EINVAL;
+
+    build_coefficients(data_chunks, parity_chunks, coefficients);
+    encode(data_chunks, parity_chunks, coefficients, (uint8_t *const *)chunks, length);
+
+    return 0;
+}
+
+int bius_erasure_decode(unsigned int data_chunks, unsigned int parity_chunks, void *const *chunks, const bool *present, size_t length) {
+    uint8_t coefficients[BIUS_ERASURE_MAX_CHUNKS * BIUS_ERASURE_MAX_CHUNKS];
+    unsigned int wanted[BIUS_ERASURE_MAX_CHUNKS];
+    unsigned int nr_wanted = 0;
+
+    if (!valid_code(data_chunks, parity_chunks))
+        return -EINVAL;
+
+    for (unsigned int i = 0; i < data_chunks + parity_chunks; i++) {
+        if (!present[i])
+            wanted[nr_wanted++] = i;
+    }
+    if (nr_wanted == 0)
+        return 0;
+
+    build_coefficients(data_chunks, parity_chunks, coefficients);
+    if (reconstruct(data_chunks, parity_chunks, coefficients, (uint8_t *const *)chunks, present, wanted, nr_wanted, length) < 0)
+        return -EIO;
+
+    return 0;
+}
+
+struct erasure_cache_entry {
+    uint64_t stripe;
+    /* Flush generation when it was first written */
+    unsigned long generation;
+    uint8_t *data;
+    /* Bit per sector of data */
+    uint64_t *dirty;
+    unsigned int nr_dirty;
+    /* Being written back by get_entry(), which holds its stripe's lock until it is removed */
+    bool evicting;
+    struct erasure_cache_entry *hash_next;
+    struct erasure_cache_entry *prev;
+    struct erasure_cache_entry *next;
+};
+
+struct erasure_target {
+    struct bius_operations ops;
+    bool failed;
+};
+
+static struct {
+    struct erasure_target targets[BIUS_ERASURE_MAX_CHUNKS];
+    unsigned int nr_targets;
+    unsigned int data_chunks;
+    unsigned int parity_chunks;
+    uint8_t coefficients[BIUS_ERASURE_MAX_CHUNKS * BIUS_ERASURE_MAX_CHUNKS];
+    uint64_t chunk_size;
+    /* Data bytes of a stripe */
+    uint64_t stripe_size;
+    uint64_t nr_stripes;
+    unsigned int nr_failed;
+    pthread_rwlock_t stripe_locks[ERASURE_NUM_STRIPE_LOCKS];
+    /* Per-thread buffer of the size of a stripe with twice its parity */
+    pthread_key_t scratch_key;
+
+    /* Stripe cache, entries and their lists being protected by cache_lock */
+    pthread_mutex_t cache_lock;
+    struct erasure_cache_entry *entries;
+    unsigned int nr_entries;
+    struct erasure_cache_entry **buckets;
+    uint64_t nr_buckets;
+    /* In use, most recently used first */
+    struct erasure_cache_entry *lru_head;
+    struct erasure_cache_entry *lru_tail;
+    struct erasure_cache_entry *free_entries;
+    unsigned long generation;
+    /* Set when an eviction failed to write back, reported by the next flush covering generation */
+    bool writeback_error;
+    unsigned long writeback_error_generation;
+
+    struct bius_erasure_stats stats;
+    bool created;
+} erasure;
+
+static inline pthread_rwlock_t *stripe_lock(uint64_t stripe) {
+    return &erasure.stripe_locks[stripe % ERASURE_NUM_STRIPE_LOCKS];
+}
+
+static inline struct erasure_target *chunk_target(uint64_t stripe, unsigned int chunk) {
+    return &erasure.targets[(chunk + stripe) % erasure.nr_targets];
+}
+
+static inline uint8_t coefficient(unsigned int parity, unsigned int data) {
+    return erasure.coefficients[parity * erasure.data_chunks + data];
+}
+
+static inline unsigned int nr_failed() {
+    return __atomic_load_n(&erasure.nr_failed, __ATOMIC_SEQ_CST);
+}
+
+static void fail_target(struct erasure_target *target) {
+    if (__atomic_exchange_n(&target->failed, true, __ATOMIC_SEQ_CST))
+        return;
+
+    __atomic_fetch_add(&erasure.nr_failed, 1, __ATOMIC_SEQ_CST);
+    fprintf(stderr, "erasure: target %ld failed\n", target - erasure.targets);
+}
+
+static blk_status_t read_target(struct erasure_target *target, void *data, uint64_t offset, size_t length) {
+    blk_status_t result;
+
+    if (__atomic_load_n(&target->failed, __ATOMIC_SEQ_CST))
+        return BLK_STS_IOERR;
+
+    result = target->ops.read(data, offset, length);
+    if (result != BLK_STS_OK)
+        fail_target(target);
+
+    return result;
+}
+
+/* A write missing on a failed target is recovered from the other chunks, up to parity_chunks */
+static blk_status_t write_target(struct erasure_target *target, const void *data, uint64_t offset, size_t length) {
+    if (__atomic_load_n(&target->failed, __ATOMIC_SEQ_CST) || target->ops.write(data, offset, length) != BLK_STS_OK)
+        fail_target(target);
+
+    return nr_failed() <= erasure.parity_chunks ? BLK_STS_OK : BLK_STS_IOERR;
+}
+
+static uint8_t *get_scratch() {
+    uint8_t *scratch = pthread_getspecific(erasure.scratch_key);
+
+    if (scratch == NULL) {
+        scratch = malloc(erasure.stripe_size + 2 * erasure.parity_chunks * erasure.chunk_size);
+        if (scratch && pthread_setspecific(erasure.scratch_key, scratch) != 0) {
+            free(scratch);
+            scratch = NULL;
+        }
+    }
+
+    return scratch;
+}
+
+/* Reads a range of a chunk, rebuilding it from the others of its stripe if its target failed */
+static blk_status_t read_chunk(uint64_t stripe, unsigned int chunk, void *data, uint64_t chunk_offset, size_t length) {
+    const uint64_t offset = stripe * erasure.chunk_size + chunk_offset;
+    uint8_t *chunks[BIUS_ERASURE_MAX_CHUNKS] = {0};
+    bool present[BIUS_ERASURE_MAX_CHUNKS] = {0};
+    unsigned int nr_present = 0;
+    uint8_t *buffer;
+    blk_status_t result = BLK_STS_IOERR;
+
+    if (read_target(chunk_target(stripe, chunk), data, offset, length) == BLK_STS_OK)
+        return BLK_STS_OK;
+
+    buffer = malloc(erasure.data_chunks * length);
+    if (buffer == NULL)
+        return BLK_STS_RESOURCE;
+
+    for (unsigned int i = 0; i < erasure.nr_targets && nr_present < erasure.data_chunks; i++) {
+        if (i == chunk)
+            continue;
+        chunks[i] = buffer + nr_present * length;
+        if (read_target(chunk_target(stripe, i), chunks[i], offset, length) == BLK_STS_OK) {
+            present[i] = true;
+            nr_present++;
+        }
+    }
+
+    chunks[chunk] = data;
+    if (reconstruct(erasure.data_chunks, erasure.parity_chunks, erasure.coefficients, chunks, present, &chunk, 1, length) == 0) {
+        add_stat(&erasure.stats.degraded_reads, 1);
+        result = BLK_STS_OK;
+    }
+
+    free(buffer);
+    return result;
+}
+
+/* Reads a range of the data of a stripe from the targets */
+static blk_status_t read_stripe(uint64_t stripe, char *data, uint64_t stripe_offset, size_t length) {
+    while (length > 0) {
+        unsigned int chunk = stripe_offset / erasure.chunk_size;
+        uint64_t chunk_offset = stripe_offset % erasure.chunk_size;
+        size_t piece = min(erasure.chunk_size - chunk_offset, length);
+        blk_status_t result = read_chunk(stripe, chunk, data, chunk_offset, piece);
+
+        if (result != BLK_STS_OK)
+            return result;
+
+        data += piece;
+        stripe_offset += piece;
+        length -= piece;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t write_full_stripe(uint64_t stripe, const uint8_t *data) {
+    uint8_t *chunks[BIUS_ERASURE_MAX_CHUNKS];
+    uint8_t *parity = get_scratch();
+
+    if (parity == NULL)
+        return BLK_STS_RESOURCE;
+    parity += erasure.stripe_size;
+
+    for (unsigned int i = 0; i < erasure.data_chunks; i++)
+        chunks[i] = (uint8_t *)data + i * erasure.chunk_size;
+    for (unsigned int r = 0; r < erasure.parity_chunks; r++)
+        chunks[erasure.data_chunks + r] = parity + r * erasure.chunk_size;
+    encode(erasure.data_chunks, erasure.parity_chunks, erasure.coefficients, chunks, erasure.chunk_size);
+
+    for (unsigned int i = 0; i < erasure.nr_targets; i++) {
+        blk_status_t result = write_target(chunk_target(stripe, i), chunks[i], stripe * erasure.chunk_size, erasure.chunk_size);
+
+        if (result != BLK_STS_OK)
+            return result;
+    }
+
+    add_stat(&erasure.stats.full_stripe_writes, 1);
+    return BLK_STS_OK;
+}
+
+/* Without a target to read the old data or parity from, the whole stripe is read and re-encoded */
+static blk_status_t reconstruct_write(uint64_t stripe, const char *data, uint64_t stripe_offset, size_t length) {
+    uint8_t *buffer = get_scratch();
+    blk_status_t result;
+
+    if (buffer == NULL)
+        return BLK_STS_RESOURCE;
+
+    result = read_stripe(stripe, (char *)buffer, 0, erasure.stripe_size);
+    if (result != BLK_STS_OK)
+        return result;
+    memcpy(buffer + stripe_offset, data, length);
+
+    result = write_full_stripe(stripe, buffer);
+    if (result == BLK_STS_OK) {
+        add_stat(&erasure.stats.full_stripe_writes, -1);
+        add_stat(&erasure.stats.reconstruct_writes, 1);
+    }
+
+    return result;
+}
+
+/*
+ * Writes part of a stripe, adding to each parity its coefficient times the difference between
+ * the new and old data. Only the range written is read from the data chunks, and the range of
+ * chunk offsets it covers from the parity chunks. A failed target only forces reading the whole
+ * stripe if it holds data written; a failed parity is left out.
+ */
+static blk_status_t write_partial_stripe(uint64_t stripe, const char *data, uint64_t stripe_offset, size_t length) {
+    const uint64_t first_chunk = stripe_offset / erasure.chunk_size;
+    const uint64_t last_chunk = (stripe_offset + length - 1) / erasure.chunk_size;
+    const uint64_t base = stripe * erasure.chunk_size;
+    /* Chunk offsets written, all of them once two chunks are */
+    const uint64_t low = first_chunk == last_chunk ? stripe_offset % erasure.chunk_size : 0;
+    const uint64_t high = first_chunk == last_chunk ? low + length : erasure.chunk_size;
+    uint8_t *scratch = get_scratch();
+    uint8_t *delta;
+    uint8_t *parity_delta;
+    uint8_t *parity;
+    bool parity_read[BIUS_ERASURE_MAX_CHUNKS] = {0};
+
+    if (scratch == NULL)
+        return BLK_STS_RESOURCE;
+
+    delta = scratch;
+    parity_delta = scratch + erasure.stripe_size;
+    parity = parity_delta + erasure.parity_chunks * erasure.chunk_size;
+    for (unsigned int r = 0; r < erasure.parity_chunks; r++)
+        memset(parity_delta + r * erasure.chunk_size + low, 0, high - low);
+
+    for (uint64_t offset = stripe_offset; offset < stripe_offset + length;) {
+        unsigned int chunk = offset / erasure.chunk_size;
+        uint64_t chunk_offset = offset % erasure.chunk_size;
+        size_t piece = min(erasure.chunk_size - chunk_offset, stripe_offset + length - offset);
+        uint8_t *old = delta + (offset - stripe_offset);
+        const uint8_t *new = (const uint8_t *)data + (offset - stripe_offset);
+
+        if (read_target(chunk_target(stripe, chunk), old, base + chunk_offset, piece) != BLK_STS_OK)
+            return reconstruct_write(stripe, data, stripe_offset, length);
+
+        gf256_mul_add(old, new, 1, piece);
+        for (unsigned int r = 0; r < erasure.parity_chunks; r++)
+            gf256_mul_add(parity_delta + r * erasure.chunk_size + chunk_offset, old, coefficient(r, chunk), piece);
+
+        offset += piece;
+    }
+
+    /* A parity target failing now is rebuilt from the others, like a failed write */
+    for (unsigned int r = 0; r < erasure.parity_chunks; r++) {
+        uint8_t *old = parity + r * erasure.chunk_size + low;
+
+        if (read_target(chunk_target(stripe, erasure.data_chunks + r), old, base + low, high - low) != BLK_STS_OK)
+            continue;
+        gf256_mul_add(old, parity_delta + r * erasure.chunk_size + low, 1, high - low);
+        parity_read[r] = true;
+    }
+    if (nr_failed() > erasure.parity_chunks)
+        return BLK_STS_IOERR;
+
+    for (uint64_t offset = stripe_offset; offset < stripe_offset + length;) {
+        unsigned int chunk = offset / erasure.chunk_size;
+        uint64_t chunk_offset = offset % erasure.chunk_size;
+        size_t piece = min(erasure.chunk_size - chunk_offset, stripe_offset + length - offset);
+        blk_status_t result = write_target(chunk_target(stripe, chunk), data + (offset - stripe_offset), base + chunk_offset, piece);
+
+        if (result != BLK_STS_OK)
+            return result;
+        offset += piece;
+    }
+
+    for (unsigned int r = 0; r < erasure.parity_chunks; r++) {
+        blk_status_t result;
+
+        if (!parity_read[r])
+            continue;
+        result = write_target(chunk_target(stripe, erasure.data_chunks + r), parity + r * erasure.chunk_size + low, base + low, high - low);
+        if (result != BLK_STS_OK)
+            return result;
+    }
+
+    add_stat(&erasure.stats.read_modify_writes, 1);
+    return BLK_STS_OK;
+}
+
+static inline unsigned int sectors_per_stripe() {
+    return erasure.stripe_size / SECTOR_SIZE;
+}
+
+static inline bool sector_dirty(struct erasure_cache_entry *entry, uint64_t sector) {
+    return entry->dirty[sector / 64] & (1lu << (sector % 64));
+}
+
+static struct erasure_cache_entry *lookup_entry(uint64_t stripe) {
+    struct erasure_cache_entry *entry = erasure.buckets[stripe & (erasure.nr_buckets - 1)];
+
+    while (entry && entry->stripe != stripe)
+        entry = entry->hash_next;
+
+    return entry;
+}
+
+static void unlink_lru(struct erasure_cache_entry *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        erasure.lru_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        erasure.lru_tail = entry->prev;
+}
+
+static void push_lru(struct erasure_cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = erasure.lru_head;
+    if (erasure.lru_head)
+        erasure.lru_head->prev = entry;
+    else
+        erasure.lru_tail = entry;
+    erasure.lru_head = entry;
+}
+
+/* Takes the entry out of the cache, its stripe's lock being held */
+static void remove_entry(struct erasure_cache_entry *entry) {
+    struct erasure_cache_entry **link = &erasure.buckets[entry->stripe & (erasure.nr_buckets - 1)];
+
+    while (*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    unlink_lru(entry);
+}
+
+static void release_entry(struct erasure_cache_entry *entry) {
+    pthread_mutex_lock(&erasure.cache_lock);
+    entry->next = erasure.free_entries;
+    erasure.free_entries = entry;
+    pthread_mutex_unlock(&erasure.cache_lock);
+}
+
+/* Writes the dirty sectors of an entry taken out of the cache to the targets */
+static blk_status_t write_back(struct erasure_cache_entry *entry) {
+    const uint64_t nr_sectors = sectors_per_stripe();
+    blk_status_t result = BLK_STS_OK;
+
+    if (entry->nr_dirty == nr_sectors)
+        return write_full_stripe(entry->stripe, entry->data);
+
+    for (uint64_t sector = 0; sector < nr_sectors && result == BLK_STS_OK;) {
+        uint64_t end;
+
+        if (!sector_dirty(entry, sector)) {
+            sector++;
+            continue;
+        }
+        for (end = sector; end < nr_sectors && sector_dirty(entry, end); end++);
+
+        result = write_partial_stripe(entry->stripe, (const char *)entry->data + sector * SECTOR_SIZE, sector * SECTOR_SIZE, (end - sector) * SECTOR_SIZE);
+        sector = end;
+    }
+
+    return result;
+}
+
+/*
+ * Writes back an entry marked evicting, then takes it out of the cache, returning with cache_lock
+ * held. It stays visible until then, so that a flush covering it waits on its stripe's lock.
+ */
+static void write_back_evicted(struct erasure_cache_entry *entry) {
+    const bool failed = write_back(entry) != BLK_STS_OK;
+
+    if (failed)
+        fprintf(stderr, "erasure: writing back stripe %lu failed\n", entry->stripe);
+
+    pthread_mutex_lock(&erasure.cache_lock);
+    if (failed && (!erasure.writeback_error || entry->generation < erasure.writeback_error_generation)) {
+        erasure.writeback_error = true;
+        erasure.writeback_error_generation = entry->generation;
+    }
+    remove_entry(entry);
+    entry->evicting = false;
+}
+
+/*
+ * Entry of the stripe, whose lock is held, allocating it if needed. Evicts the least recently used
+ * entry whose stripe is not locked if the cache is full, or returns NULL if there is none.
+ */
+static struct erasure_cache_entry *get_entry(uint64_t stripe) {
+    struct erasure_cache_entry *entry;
+
+    pthread_mutex_lock(&erasure.cache_lock);
+    entry = lookup_entry(stripe);
+    if (entry) {
+        unlink_lru(entry);
+        push_lru(entry);
+        pthread_mutex_unlock(&erasure.cache_lock);
+        return entry;
+    }
+
+    entry = erasure.free_entries;
+    if (entry) {
+        erasure.free_entries = entry->next;
+    } else {
+        /* Blocking on another stripe's lock with ours held could deadlock */
+        for (entry = erasure.lru_tail; entry; entry = entry->prev) {
+            if (!entry->evicting && pthread_rwlock_trywrlock(stripe_lock(entry->stripe)) == 0)
+                break;
+        }
+        if (entry == NULL) {
+            pthread_mutex_unlock(&erasure.cache_lock);
+            return NULL;
+        }
+        entry->evicting = true;
+        pthread_mutex_unlock(&erasure.cache_lock);
+
+        write_back_evicted(entry);
+        pthread_rwlock_unlock(stripe_lock(entry->stripe));
+    }
+
+    entry->stripe = stripe;
+    entry->generation = erasure.generation;
+    entry->nr_dirty = 0;
+    memset(entry->dirty, 0, (sectors_per_stripe() + 63) / 64 * sizeof(uint64_t));
+    entry->hash_next = erasure.buckets[stripe & (erasure.nr_buckets - 1)];
+    erasure.buckets[stripe & (erasure.nr_buckets - 1)] = entry;
+    push_lru(entry);
+    pthread_mutex_unlock(&erasure.cache_lock);
+
+    return entry;
+}
+
+static blk_status_t erasure_read(void *data, off64_t offset, size_t length) {
+    while (length > 0) {
+        const uint64_t stripe = offset / erasure.stripe_size;
+        const uint64_t stripe_offset = offset % erasure.stripe_size;
+        const size_t piece = min(erasure.stripe_size - stripe_offset, length);
+        struct erasure_cache_entry *entry = NULL;
+        uint64_t first = stripe_offset / SECTOR_SIZE;
+        uint64_t last = (stripe_offset + piece) / SECTOR_SIZE;
+        uint64_t sector;
+        blk_status_t result = BLK_STS_OK;
+
+        pthread_rwlock_rdlock(stripe_lock(stripe));
+        if (erasure.entries) {
+            pthread_mutex_lock(&erasure.cache_lock);
+            entry = lookup_entry(stripe);
+            pthread_mutex_unlock(&erasure.cache_lock);
+        }
+
+        /* Only what the cache does not hold is read, then overlaid with what it does */
+        for (sector = first; entry && sector < last && sector_dirty(entry, sector); sector++);
+        if (entry == NULL || sector < last)
+            result = read_stripe(stripe, data, stripe_offset, piece);
+        for (sector = first; entry && sector < last && result == BLK_STS_OK; sector++) {
+            if (sector_dirty(entry, sector))
+                memcpy(data + (sector - first) * SECTOR_SIZE, entry->data + sector * SECTOR_SIZE, SECTOR_SIZE);
+        }
+        pthread_rwlock_unlock(stripe_lock(stripe));
+
+        if (result != BLK_STS_OK)
+            return result;
+
+        data += piece;
+        offset += piece;
+        length -= piece;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t write_stripe(uint64_t stripe, const char *data, uint64_t stripe_offset, size_t length) {
+    struct erasure_cache_entry *entry = NULL;
+
+    if (length == erasure.stripe_size) {
+        /* Replaces whatever the cache holds */
+        if (erasure.entries) {
+            pthread_mutex_lock(&erasure.cache_lock);
+            entry = lookup_entry(stripe);
+            if (entry)
+                remove_entry(entry);
+            pthread_mutex_unlock(&erasure.cache_lock);
+            if (entry)
+                release_entry(entry);
+        }
+        return write_full_stripe(stripe, (const uint8_t *)data);
+    }
+
+    if (erasure.entries)
+        entry = get_entry(stripe);
+    if (entry == NULL)
+        return write_partial_stripe(stripe, data, stripe_offset, length);
+
+    memcpy(entry->data + stripe_offset, data, length);
+    for (uint64_t sector = stripe_offset / SECTOR_SIZE; sector < (stripe_offset + length) / SECTOR_SIZE; sector++) {
+        if (!sector_dirty(entry, sector)) {
+            entry->dirty[sector / 64] |= 1lu << (sector % 64);
+            entry->nr_dirty++;
+        }
+    }
+
+    /* Complete stripes need no reads, there is no reason to keep them */
+    if (entry->nr_dirty == sectors_per_stripe()) {
+        blk_status_t result;
+
+        pthread_mutex_lock(&erasure.cache_lock);
+        remove_entry(entry);
+        pthread_mutex_unlock(&erasure.cache_lock);
+        result = write_full_stripe(stripe, entry->data);
+        release_entry(entry);
+        return result;
+    }
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t erasure_write(const void *data, off64_t offset, size_t length) {
+    while (length > 0) {
+        const uint64_t stripe = offset / erasure.stripe_size;
+        const uint64_t stripe_offset = offset % erasure.stripe_size;
+        const size_t piece = min(erasure.stripe_size - stripe_offset, length);
+        blk_status_t result;
+
+        pthread_rwlock_wrlock(stripe_lock(stripe));
+        result = write_stripe(stripe, data, stripe_offset, piece);
+        pthread_rwlock_unlock(stripe_lock(stripe));
+
+        if (result != BLK_STS_OK)
+            return result;
+
+        data += piece;
+        offset += piece;
+        length -= piece;
+    }
+
+    return BLK_STS_OK;
+}
+
+/*
+ * Writes back the entries written before the call, waiting for those being evicted, and reports
+ * the evictions of such entries that failed.
+ */
+static blk_status_t flush_cache() {
+    uint64_t *stripes;
+    unsigned int nr_stripes = 0;
+    unsigned long generation;
+    blk_status_t result = BLK_STS_OK;
+
+    if (erasure.entries == NULL)
+        return BLK_STS_OK;
+
+    stripes = malloc(sizeof(uint64_t) * erasure.nr_entries);
+    if (stripes == NULL)
+        return BLK_STS_RESOURCE;
+
+    pthread_mutex_lock(&erasure.cache_lock);
+    generation = erasure.generation++;
+    for (struct erasure_cache_entry *entry = erasure.lru_head; entry; entry = entry->next) {
+        if (entry->generation <= generation)
+            stripes[nr_stripes++] = entry->stripe;
+    }
+    pthread_mutex_unlock(&erasure.cache_lock);
+
+    for (unsigned int i = 0; i < nr_stripes; i++) {
+        struct erasure_cache_entry *entry;
+
+        pthread_rwlock_wrlock(stripe_lock(stripes[i]));
+        pthread_mutex_lock(&erasure.cache_lock);
+        entry = lookup_entry(stripes[i]);
+        if (entry)
+            remove_entry(entry);
+        pthread_mutex_unlock(&erasure.cache_lock);
+
+        if (entry) {
+            if (write_back(entry) != BLK_STS_OK)
+                result = BLK_STS_IOERR;
+            release_entry(entry);
+        }
+        pthread_rwlock_unlock(stripe_lock(stripes[i]));
+    }
+
+    pthread_mutex_lock(&erasure.cache_lock);
+    if (erasure.writeback_error && erasure.writeback_error_generation <= generation) {
+        erasure.writeback_error = false;
+        result = BLK_STS_IOERR;
+    }
+    pthread_mutex_unlock(&erasure.cache_lock);
+
+    free(stripes);
+    return result;
+}
+
+static blk_status_t erasure_flush() {
+    blk_status_t result = flush_cache();
+
+    for (unsigned int i = 0; i < erasure.nr_targets; i++) {
+        struct erasure_target *target = &erasure.targets[i];
+
+        if (__atomic_load_n(&target->failed, __ATOMIC_SEQ_CST) || target->ops.flush == NULL)
+            continue;
+        if (target->ops.flush() != BLK_STS_OK)
+            fail_target(target);
+    }
+
+    return nr_failed() <= erasure.parity_chunks ? result : BLK_STS_IOERR;
+}
+
+static void free_cache() {
+    for (unsigned int i = 0; i < erasure.nr_entries && erasure.entries; i++) {
+        free(erasure.entries[i].data);
+        free(erasure.entries[i].dirty);
+    }
+    free(erasure.entries);
+    free(erasure.buckets);
+    erasure.entries = NULL;
+}
+
+static int init_cache(unsigned int nr_entries) {
+    erasure.nr_buckets = 1;
+    while (erasure.nr_buckets < 2 * nr_entries)
+        erasure.nr_buckets *= 2;
+
+    erasure.nr_entries = nr_entries;
+    erasure.entries = calloc(nr_entries, sizeof(struct erasure_cache_entry));
+    erasure.buckets = calloc(erasure.nr_buckets, sizeof(struct erasure_cache_entry *));
+    if (erasure.entries == NULL || erasure.buckets == NULL)
+        goto out_free;
+
+    for (unsigned int i = 0; i < nr_entries; i++) {
+        struct erasure_cache_entry *entry = &erasure.entries[i];
+
+        entry->data = malloc(erasure.stripe_size);
+        entry->dirty = malloc((sectors_per_stripe() + 63) / 64 * sizeof(uint64_t));
+        if (entry->data == NULL || entry->dirty == NULL)
+            goto out_free;
+        entry->next = erasure.free_entries;
+        erasure.free_entries = entry;
+    }
+
+    return 0;
+
+out_free:
+    free_cache();
+    return -ENOMEM;
+}
+
+int bius_erasure_create(const struct bius_operations *targets, unsigned int nr_targets, const struct bius_erasure_options *options, struct bius_operations *out_operations, unsigned long *out_disk_size) {
+    const uint64_t chunk_size = options->chunk_size ? options->chunk_size : ERASURE_DEFAULT_CHUNK_SIZE;
+    int result;
+
+    if (erasure.created)
+        return -EBUSY;
+    if (options->parity_targets == 0 || options->parity_targets >= nr_targets || nr_targets > BIUS_ERASURE_MAX_CHUNKS)
+        return -EINVAL;
+    if (chunk_size % SECTOR_SIZE != 0 || options->target_size / chunk_size == 0)
+        return -EINVAL;
+    for (unsigned int i = 0; i < nr_targets; i++) {
+        if (targets[i].read == NULL || targets[i].write == NULL)
+            return -EINVAL;
+    }
+
+    memset(&erasure, 0, sizeof(erasure));
+    for (unsigned int i = 0; i < nr_targets; i++)
+        memcpy(&erasure.targets[i].ops, &targets[i], sizeof(struct bius_operations));
+    erasure.nr_targets = nr_targets;
+    erasure.parity_chunks = options->parity_targets;
+    erasure.data_chunks = nr_targets - options->parity_targets;
+    build_coefficients(erasure.data_chunks, erasure.parity_chunks, erasure.coefficients);
+    erasure.chunk_size = chunk_size;
+    erasure.stripe_size = erasure.data_chunks * chunk_size;
+    erasure.nr_stripes = options->target_size / chunk_size;
+
+    if (options->cache_stripes > 0) {
+        result = init_cache(options->cache_stripes);
+        if (result < 0)
+            return result;
+    }
+
+    result = -pthread_key_create(&erasure.scratch_key, free);
+    if (result < 0) {
+        free_cache();
+        return result;
+    }
+
+    for (int i = 0; i < ERASURE_NUM_STRIPE_LOCKS; i++)
+        pthread_rwlock_init(&erasure.stripe_locks[i], NULL);
+    pthread_mutex_init(&erasure.cache_lock, NULL);
+
+    memset(out_operations, 0, sizeof(struct bius_operations));
+    out_operations->read = erasure_read;
+    out_operations->write = erasure_write;
+    out_operations->flush = erasure_flush;
+    *out_disk_size = erasure.nr_stripes * erasure.stripe_size;
+    erasure.created = true;
+
+    return 0;
+}
+
+int bius_erasure_fail_target(unsigned int target) {
+    if (!erasure.created || target >= erasure.nr_targets)
+        return -EINVAL;
+
+    fail_target(&erasure.targets[target]);
+    return 0;
+}
+
+void bius_erasure_get_stats(struct bius_erasure_stats *out_stats) {
+    out_stats->full_stripe_writes = __atomic_load_n(&erasure.stats.full_stripe_writes, __ATOMIC_RELAXED);
+    out_stats->read_modify_writes = __atomic_load_n(&erasure.stats.read_modify_writes, __ATOMIC_RELAXED);
+    out_stats->reconstruct_writes = __atomic_load_n(&erasure.stats.reconstruct_writes, __ATOMIC_RELAXED);
+    out_stats->degraded_reads = __atomic_load_n(&erasure.stats.degraded_reads, __ATOMIC_RELAXED);
+    out_stats->failed_targets = nr_failed();
+}
+
+int bius_erasure_destroy() {
+    int result = 0;
+
+    if (!erasure.created)
+        return -EINVAL;
+
+    if (flush_cache() != BLK_STS_OK)
+        result = -EIO;
+
+    free_cache();
+    for (int i = 0; i < ERASURE_NUM_STRIPE_LOCKS; i++)
+        pthread_rwlock_destroy(&erasure.stripe_locks[i]);
+    pthread_mutex_destroy(&erasure.cache_lock);
+    /* Buffers of threads still alive stay allocated until they exit */
+    pthread_key_delete(erasure.scratch_key);
+    erasure.created = false;
+
+    return result;
+}
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "fingerprint.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+/*
+ * Multiply-accumulate hash in the manner of XXH3: eight 64-bit lanes each take a word of every
+ * 64-byte stripe, mixed with a secret word chosen by the stripe's position, and are scrambled
+ * every FINGERPRINT_BLOCK bytes. Lanes are independent, so SSE2 and AVX2 process two and four of
+ * them per instruction and reach memory bandwidth on a single core.
+ */
+
+#define FINGERPRINT_LANES 8
+#define FINGERPRINT_STRIPES_PER_BLOCK 16
+#define FINGERPRINT_BLOCK (FINGERPRINT_STRIPE * FINGERPRINT_STRIPES_PER_BLOCK)
+/* Secret words used by the scramble, after the ones of the stripes */
+#define FINGERPRINT_SCRAMBLE_SECRET FINGERPRINT_STRIPES_PER_BLOCK
+
+#define PRIME32_1 0x9e3779b1u
+#define PRIME32_2 0x85ebca77u
+#define PRIME32_3 0xc2b2ae3du
+#define PRIME64_1 0x9e3779b185ebca87lu
+#define PRIME64_2 0xc2b2ae3d27d4eb4flu
+#define PRIME64_3 0x165667b19e3779f9lu
+#define PRIME64_4 0x85ebca77c2b2ae63lu
+#define PRIME64_5 0x27d4eb2f165667c5lu
+
+static const uint64_t secret[FINGERPRINT_SCRAMBLE_SECRET + FINGERPRINT_LANES] = {
+    0x498698587de5cceclu, 0x766252e443bccf30lu, 0x6531848da9e8848elu, 0x063d18a1fe4013d5lu,
+    0xdeb6e473d7c2ed4dlu, 0xe5084353e837f268lu, 0x308a04fcc937da98lu, 0xda141de15a002803lu,
+    0x69f01f920eda9208lu, 0x6d1ca39d5d8a1f80lu, 0x3ac9f2a5245f7806lu, 0x3ea83604eccc636dlu,
+    0x14eaaecf5ab049f0lu, 0xa3def1f78e0ab46clu, 0x3a1aa740625952eclu, 0xadb8984f17aad294lu,
+    0x5c5a095c79b7cc28lu, 0x7ecc30f28eb9e261lu, 0x0a282bc1ef925bdalu, 0x90817bc5c32efa6elu,
+    0x3f2eeece2b50b52alu, 0x7d8542ae7e53e31elu, 0xb9efda7c231a6da4lu, 0x3174edae7f532303lu,
+};
+
+/* Accumulates stripes, scrambling after each full block */
+typedef void (*accumulate_fn)(uint64_t *acc, const char *data, size_t nr_stripes);
+
+#ifndef __x86_64__
+static void accumulate_scalar(uint64_t *acc, const char *data, size_t nr_stripes) {
+    for (size_t stripe = 0; stripe < nr_stripes; stripe++) {
+        const uint64_t *key = secret + stripe % FINGERPRINT_STRIPES_PER_BLOCK;
+
+        for (int i = 0; i < FINGERPRINT_LANES; i++) {
+            uint64_t word;
+            uint64_t mixed;
+
+            memcpy(&word, data + stripe * FINGERPRINT_STRIPE + i * sizeof(uint64_t), sizeof(uint64_t));
+            mixed = word ^ key[i];
+            acc[i ^ 1] += word;
+            acc[i] += (mixed & 0xffffffff) * (mixed >> 32);
+        }
+
+        if (stripe % FINGERPRINT_STRIPES_PER_BLOCK == FINGERPRINT_STRIPES_PER_BLOCK - 1) {
+            for (int i = 0; i < FINGERPRINT_LANES; i++) {
+                acc[i] ^= acc[i] >> 47;
+                acc[i] ^= secret[FINGERPRINT_SCRAMBLE_SECRET + i];
+                acc[i] *= PRIME32_1;
+            }
+        }
+    }
+}
+#else
+static void accumulate_sse2(uint64_t *acc, const char *data, size_t nr_stripes) {
+    __m128i lanes[FINGERPRINT_LANES / 2];
+
+    for (int i = 0; i < FINGERPRINT_LANES / 2; i++)
+        lanes[i] = _mm_loadu_si128((const __m128i *)acc + i);
+
+    for (size_t stripe = 0; stripe < nr_stripes; stripe++) {
+        const __m128i *key = (const __m128i *)(secret + stripe % FINGERPRINT_STRIPES_PER_BLOCK);
+        const __m128i *words = (const __m128i *)(data + stripe * FINGERPRINT_STRIPE);
+
+        for (int i = 0; i < FINGERPRINT_LANES / 2; i++) {
+            __m128i word = _mm_loadu_si128(words + i);
+            __m128i mixed = _mm_xor_si128(word, _mm_loadu_si128(key + i));
+            /* Low half of each lane times its high half */
+            __m128i product = _mm_mul_epu32(mixed, _mm_srli_epi64(mixed, 32));
+
+            lanes[i] = _mm_add_epi64(lanes[i], _mm_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2)));
+            lanes[i] = _mm_add_epi64(lanes[i], product);
+        }
+
+        if (stripe % FINGERPRINT_STRIPES_PER_BLOCK == FINGERPRINT_STRIPES_PER_BLOCK - 1) {
+            const __m128i prime = _mm_set1_epi32(PRIME32_1);
+
+            for (int i = 0; i < FINGERPRINT_LANES / 2; i++) {
+                __m128i lane = _mm_xor_si128(lanes[i], _mm_srli_epi64(lanes[i], 47));
+
+                lane = _mm_xor_si128(lane, _mm_loadu_si128((const __m128i *)(secret + FINGERPRINT_SCRAMBLE_SECRET) + i));
+                lanes[i] = _mm_add_epi64(_mm_mul_epu32(lane, prime), _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(lane, 32), prime), 32));
+            }
+        }
+    }
+
+    for (int i = 0; i < FINGERPRINT_LANES / 2; i++)
+        _mm_storeu_si128((__m128i *)acc + i, lanes[i]);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t *acc, const char *data, size_t nr_stripes) {
+    __m256i lanes[FINGERPRINT_LANES / 4];
+
+    for (int i = 0; i < FINGERPRINT_LANES / 4; i++)
+        lanes[i] = _mm256_loadu_si256((const __m256i *)acc + i);
+
+    for (size_t stripe = 0; stripe < nr_stripes; stripe++) {
+        const __m256i *key = (const __m256i *)(secret + stripe % FINGERPRINT_STRIPES_PER_BLOCK);
+        const __m256i *words = (const __m256i *)(data + stripe * FINGERPRINT_STRIPE);
+
+        for (int i = 0; i < FINGERPRINT_LANES / 4; i++) {
+            __m256i word = _mm256_loadu_si256(words + i);
+            __m256i mixed = _mm256_xor_si256(word, _mm256_loadu_si256(key + i));
+            __m256i product = _mm256_mul_epu32(mixed, _mm256_srli_epi64(mixed, 32));
+
+            /* Swapping within 128-bit halves pairs lane i with lane i ^ 1 */
+            lanes[i] = _mm256_add_epi64(lanes[i], _mm256_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2)));
+            lanes[i] = _mm256_add_epi64(lanes[i], product);
+        }
+
+        if (stripe % FINGERPRINT_STRIPES_PER_BLOCK == FINGERPRINT_STRIPES_PER_BLOCK - 1) {
+            const __m256i prime = _mm256_set1_epi32(PRIME32_1);
+
+            for (int i = 0; i < FINGERPRINT_LANES / 4; i++) {
+                __m256i lane = _mm256_xor_si256(lanes[i], _mm256_srli_epi64(lanes[i], 47));
+
+                lane = _mm256_xor_si256(lane, _mm256_loadu_si256((const __m256i *)(secret + FINGERPRINT_SCRAMBLE_SECRET) + i));
+                lanes[i] = _mm256_add_epi64(_mm256_mul_epu32(lane, prime), _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(lane, 32), prime), 32));
+            }
+        }
+    }
+
+    for (int i = 0; i < FINGERPRINT_LANES / 4; i++)
+        _mm256_storeu_si256((__m256i *)acc + i, lanes[i]);
+}
+#endif
+
+static accumulate_fn accumulate;
+
+static accumulate_fn select_accumulate() {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return accumulate_avx2;
+    return accumulate_sse2;
+#else
+    return accumulate_scalar;
+#endif
+}
+
+static inline uint64_t multiply_fold(uint64_t a, uint64_t b) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t avalanche(uint64_t value) {
+    value ^= value >> 37;
+    value *= PRIME64_3;
+    return value ^ (value >> 32);
+}
+
+/* Folds the lanes into 64 bits, keyed by secret words from key_start */
+static uint64_t merge(const uint64_t *acc, int key_start, uint64_t value) {
+    for (int i = 0; i < FINGERPRINT_LANES; i += 2)
+        value += multiply_fold(acc[i] ^ secret[key_start + i], acc[i + 1] ^ secret[key_start + i + 1]);
+
+    return avalanche(value);
+}
+
+void fingerprint(const void *data, size_t length, struct fingerprint *out) {
+    uint64_t acc[FINGERPRINT_LANES] = {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1,
+    };
+    accumulate_fn function = __atomic_load_n(&accumulate, __ATOMIC_RELAXED);
+
+    /* Racing threads select the same function */
+    if (function == NULL) {
+        function = select_accumulate();
+        __atomic_store_n(&accumulate, function, __ATOMIC_RELAXED);
+    }
+
+    function(acc, data, length / FINGERPRINT_STRIPE);
+
+    out->low = merge(acc, 1, length * PRIME64_1);
+    out->high = merge(acc, 9, ~(length * PRIME64_2));
+}
@@ -0,0 +1,28 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * 128-bit content fingerprints of blocks. Not cryptographic: accidental collisions are negligible,
+ * crafted ones are not, so users which must not trust their data compare contents on a match.
+ * Every implementation gives the same value, fingerprints can be persisted.
+ */
+
+#define FINGERPRINT_STRIPE 64
+
+struct fingerprint {
+    uint64_t low;
+    uint64_t high;
+};
+
+/* length must be a multiple of FINGERPRINT_STRIPE */
+void fingerprint(const void *data, size_t length, struct fingerprint *out);
+
+static inline bool fingerprint_equal(const struct fingerprint *a, const struct fingerprint *b) {
+    return a->low == b->low && a->high == b->high;
+}
+
+#endif
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <pthread.h>
+#include "gf256.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+/*
+ * Products by a constant c are looked up per nibble: c * x = low[x & 15] ^ high[x >> 4], with two
+ * 16-entry tables. PSHUFB does 16 such lookups per instruction, 32 with AVX2. Dot products keep
+ * the sums of up to four outputs in registers, so that sources are loaded once rather than once
+ * per output, and outputs written once. SSSE3 is not part of the x86-64 baseline, so the scalar
+ * version is kept there too.
+ */
+
+/* Outputs summed per pass over the sources */
+#define GF256_OUTPUTS_PER_PASS 4
+
+#define GF256_POLYNOMIAL 0x11d
+
+static uint8_t exp_table[512];
+static uint8_t log_table[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_tables() {
+    unsigned int value = 1;
+
+    for (int i = 0; i < 255; i++) {
+        exp_table[i] = value;
+        exp_table[i + 255] = value;
+        log_table[value] = i;
+        value <<= 1;
+        if (value & 0x100)
+            value ^= GF256_POLYNOMIAL;
+    }
+    /* Sums of two logarithms index up to 508 */
+    exp_table[510] = exp_table[0];
+    exp_table[511] = exp_table[1];
+}
+
+static inline uint8_t mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0)
+        return 0;
+    return exp_table[log_table[a] + log_table[b]];
+}
+
+uint8_t gf256_mul(uint8_t a, uint8_t b) {
+    pthread_once(&tables_once, init_tables);
+    return mul(a, b);
+}
+
+uint8_t gf256_inverse(uint8_t a) {
+    pthread_once(&tables_once, init_tables);
+    return exp_table[255 - log_table[a]];
+}
+
+int gf256_invert_matrix(const uint8_t *matrix, uint8_t *out, int n) {
+    uint8_t work[n * n];
+
+    pthread_once(&tables_once, init_tables);
+    memcpy(work, matrix, n * n);
+    memset(out, 0, n * n);
+    for (int i = 0; i < n; i++)
+        out[i * n + i] = 1;
+
+    /* Gauss-Jordan elimination, rows added to each other being XOR */
+    for (int column = 0; column < n; column++) {
+        int pivot = column;
+        uint8_t scale;
+
+        while (pivot < n && work[pivot * n + column] == 0)
+            pivot++;
+        if (pivot == n)
+            return -1;
+
+        if (pivot != column) {
+            for (int i = 0; i < n; i++) {
+                uint8_t swap = work[pivot * n + i];
+
+                work[pivot * n + i] = work[column * n + i];
+                work[column * n + i] = swap;
+                swap = out[pivot * n + i];
+                out[pivot * n + i] = out[column * n + i];
+                out[column * n + i] = swap;
+            }
+        }
+
+        scale = gf256_inverse(work[column * n + column]);
+        for (int i = 0; i < n; i++) {
+            work[column * n + i] = mul(work[column * n + i], scale);
+            out[column * n + i] = mul(out[column * n + i], scale);
+        }
+
+        for (int row = 0; row < n; row++) {
+            uint8_t factor = work[row * n + column];
+
+            if (row == column || factor == 0)
+                continue;
+            for (int i = 0; i < n; i++) {
+                work[row * n + i] ^= mul(factor, work[column * n + i]);
+                out[row * n + i] ^= mul(factor, out[column * n + i]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Multiplies the first length bytes, a multiple of the vector size for the SIMD versions */
+typedef void (*mul_add_fn)(uint8_t *dst, const uint8_t *src, const uint8_t *low, const uint8_t *high, size_t length);
+
+static void mul_add_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *low, const uint8_t *high, size_t length) {
+    for (size_t i = 0; i < length; i++)
+        dst[i] ^= low[src[i] & 15] ^ high[src[i] >> 4];
+}
+
+/*
+ * Computes bytes [start, length) of up to GF256_OUTPUTS_PER_PASS outputs. tables holds the low
+ * and high nibble tables of each coefficient, 32 bytes per output and source.
+ */
+typedef void (*dot_product_fn)(uint8_t *const *outputs, unsigned int nr_outputs, const uint8_t *const *sources, unsigned int nr_sources, const uint8_t *tables, size_t start, size_t length);
+
+static void dot_product_scalar(uint8_t *const *outputs, unsigned int nr_outputs, const uint8_t *const *sources, unsigned int nr_sources, const uint8_t *tables, size_t start, size_t length) {
+    for (unsigned int r = 0; r < nr_outputs; r++) {
+        memset(outputs[r] + start, 0, length - start);
+        for (unsigned int j = 0; j < nr_sources; j++) {
+            const uint8_t *table = tables + (r * nr_sources + j) * 32;
+
+            mul_add_scalar(outputs[r] + start, sources[j] + start, table, table + 16, length - start);
+        }
+    }
+}
+
+#ifdef __x86_64__
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t *low, const uint8_t *high, size_t length) {
+    const __m128i low_table = _mm_loadu_si128((const __m128i *)low);
+    const __m128i high_table = _mm_loadu_si128((const __m128i *)high);
+    const __m128i mask = _mm_set1_epi8(15);
+
+    for (size_t i = 0; i < length; i += 16) {
+        __m128i value = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i low_nibbles = _mm_and_si128(value, mask);
+        __m128i high_nibbles = _mm_and_si128(_mm_srli_epi64(value, 4), mask);
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low_table, low_nibbles), _mm_shuffle_epi8(high_table, high_nibbles));
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), product));
+    }
+}
+
+__attribute__((target("avx2")))
+static void mul_add_avx2(uint8_t *dst, const uint8_t *src, const uint8_t *low, const uint8_t *high, size_t length) {
+    /* VPSHUFB looks up within each 128-bit half, so both get the table */
+    const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)low));
+    const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)high));
+    const __m256i mask = _mm256_set1_epi8(15);
+
+    for (size_t i = 0; i < length; i += 32) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i low_nibbles = _mm256_and_si256(value, mask);
+        __m256i high_nibbles = _mm256_and_si256(_mm256_srli_epi64(value, 4), mask);
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low_table, low_nibbles), _mm256_shuffle_epi8(high_table, high_nibbles));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), product));
+    }
+}
+
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i accumulate_ssse3(__m128i sum, const uint8_t *table, __m128i low_nibbles, __m128i high_nibbles) {
+    sum = _mm_xor_si128(sum, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)table), low_nibbles));
+    return _mm_xor_si128(sum, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(table + 16)), high_nibbles));
+}
+
+/*
+ * Inlined with a constant number of outputs, whose sums are separate variables so that they stay
+ * in registers.
+ */
+__attribute__((target("ssse3"), always_inline))
+static inline void dot_product_ssse3_n(uint8_t *const *outputs, const unsigned int nr_outputs, const uint8_t *const *sources, unsigned int nr_sources, const uint8_t *tables, size_t start, size_t length) {
+    const __m128i mask = _mm_set1_epi8(15);
+    const size_t stride = nr_sources * 32;
+
+    for (size_t i = start; i < length; i += 16) {
+        __m128i sum0 = _mm_setzero_si128();
+        __m128i sum1 = _mm_setzero_si128();
+        __m128i sum2 = _mm_setzero_si128();
+        __m128i sum3 = _mm_setzero_si128();
+
+        for (unsigned int j = 0; j < nr_sources; j++) {
+            const uint8_t *table = tables + j * 32;
+            __m128i value = _mm_loadu_si128((const __m128i *)(sources[j] + i));
+            __m128i low_nibbles = _mm_and_si128(value, mask);
+            __m128i high_nibbles = _mm_and_si128(_mm_srli_epi64(value, 4), mask);
+
+            sum0 = accumulate_ssse3(sum0, table, low_nibbles, high_nibbles);
+            if (nr_outputs > 1)
+                sum1 = accumulate_ssse3(sum1, table + stride, low_nibbles, high_nibbles);
+            if (nr_outputs > 2)
+                sum2 = accumulate_ssse3(sum2, table + 2 * stride, low_nibbles, high_nibbles);
+            if (nr_outputs > 3)
+                sum3 = accumulate_ssse3(sum3, table + 3 * stride, low_nibbles, high_nibbles);
+        }
+
+        _mm_storeu_si128((__m128i *)(outputs[0] + i), sum0);
+        if (nr_outputs > 1)
+            _mm_storeu_si128((__m128i *)(outputs[1] + i), sum1);
+        if (nr_outputs > 2)
+            _mm_storeu_si128((__m128i *)(outputs[2] + i), sum2);
+        if (nr_outputs > 3)
+            _mm_storeu_si128((__m128i *)(outputs[3] + i), sum3);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void dot_product_ssse3(uint8_t *const *outputs, unsigned int nr_outputs, const uint8_t *const *sources, unsigned int nr_sources, const uint8_t *tables, size_t start, size_t length) {
+    switch (nr_outputs) {
+        case 1:
+            return dot_product_ssse3_n(outputs, 1, sources, nr_sources, tables, start, length);
+        case 2:
+            return dot_product_ssse3_n(outputs, 2, sources, nr_sources, tables, start, length);
+        case 3:
+            return dot_product_ssse3_n(outputs, 3, sources, nr_sources, tables, start, length);
+        default:
+            return dot_product_ssse3_n(outputs, 4, sources, nr_sources, tables, start, length);
+    }
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i accumulate_avx2(__m256i sum, const uint8_t *table, __m256i low_nibbles, __m256i high_nibbles) {
+    sum = _mm256_xor_si256(sum, _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table)), low_nibbles));
+    return _mm256_xor_si256(sum, _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(table + 16))), high_nibbles));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void dot_product_avx2_n(uint8_t *const *outputs, const unsigned int nr_outputs, const uint8_t *const *sources, unsigned int nr_sources, const uint8_t *tables, size_t start, size_t length) {
+    const __m256i mask = _mm256_set1_epi8(15);
+    const size_t stride = nr_sources * 32;
+
+    for (size_t i = start; i < length; i += 32) {
+        __m256i sum0 = _mm256_setzero_si256();
+        __m256i sum1 = _mm256_setzero_si256();
+        __m256i sum2 = _mm256_setzero_si256();
+        __m256i sum3 = _mm256_setzero_si256();
+
+        for (unsigned int j = 0; j < nr_sources; j++) {
+            const uint8_t *table = tables + j * 32;
+            __m256i value = _mm256_loadu_si256((const __m256i *)(sources[j] + i));
+            __m256i low_nibbles = _mm256_and_si256(value, mask);
+            __m256i high_nibbles = _mm256_and_si256(_mm256_srli_epi64(value, 4), mask);
+
+            sum0 = accumulate_avx2(sum0, table, low_nibbles, high_nibbles);
+            if (nr_outputs > 1)
+                sum1 = accumulate_avx2(sum1, table + stride, low_nibbles, high_nibbles);
+            if (nr_outputs > 2)
+                sum2 = accumulate_avx2(sum2, table + 2 * stride, low_nibbles, high_nibbles);
+            if (nr_outputs > 3)
+                sum3 = accumulate_avx2(sum3, table + 3 * stride, low_nibbles, high_nibbles);
+        }
+
+        _mm256_storeu_si256((__m256i *)(outputs[0] + i), sum0);
+        if (nr_outputs > 1)
+            _mm256_storeu_si256((__m256i *)(outputs[1] + i), sum1);
+        if (nr_outputs > 2)
+            _mm256_storeu_si256((__m256i *)(outputs[2] + i), sum2);
+        if (nr_outputs > 3)
+            _mm256_storeu_si256((__m256i *)(outputs[3] + i), sum3);
+    }
+}
+
+__attribute__((target("avx2")))
+static void dot_product_avx2(uint8_t *const *outputs, unsigned int nr_outputs, const uint8_t *const *sources, unsigned int nr_sources, const uint8_t *tables, size_t start, size_t length) {
+    switch (nr_outputs) {
+        case 1:
+            return dot_product_avx2_n(outputs, 1, sources, nr_sources, tables, start, length);
+        case 2:
+            return dot_product_avx2_n(outputs, 2, sources, nr_sources, tables, start, length);
+        case 3:
+            return dot_product_avx2_n(outputs, 3, sources, nr_sources, tables, start, length);
+        default:
+            return dot_product_avx2_n(outputs, 4, sources, nr_sources, tables, start, length);
+    }
+}
+#endif
+
+static mul_add_fn mul_add_vector;
+static dot_product_fn dot_product_vector;
+static size_t vector_size;
+
+static void select_mul_add() {
+    mul_add_vector = mul_add_scalar;
+    dot_product_vector = dot_product_scalar;
+    vector_size = 1;
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mul_add_vector = mul_add_avx2;
+        dot_product_vector = dot_product_avx2;
+        vector_size = 32;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        mul_add_vector = mul_add_ssse3;
+        dot_product_vector = dot_product_ssse3;
+        vector_size = 16;
+    }
+#endif
+}
+
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+void gf256_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coefficient, size_t length) {
+    uint8_t low[16];
+    uint8_t high[16];
+    size_t vector_length;
+
+    if (coefficient == 0)
+        return;
+
+    /* Plain XOR, e.g. single parity */
+    if (coefficient == 1) {
+        size_t i = 0;
+
+        for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+            uint64_t a;
+            uint64_t b;
+
+            memcpy(&a, dst + i, sizeof(uint64_t));
+            memcpy(&b, src + i, sizeof(uint64_t));
+            a ^= b;
+            memcpy(dst + i, &a, sizeof(uint64_t));
+        }
+        for (; i < length; i++)
+            dst[i] ^= src[i];
+        return;
+    }
+
+    pthread_once(&select_once, select_mul_add);
+    pthread_once(&tables_once, init_tables);
+
+    for (int i = 0; i < 16; i++) {
+        low[i] = mul(coefficient, i);
+        high[i] = mul(coefficient, i << 4);
+    }
+
+    vector_length = length - length % vector_size;
+    mul_add_vector(dst, src, low, high, vector_length);
+    mul_add_scalar(dst + vector_length, src + vector_length, low, high, length - vector_length);
+}
+
+void gf256_dot_product(uint8_t *const *outputs, unsigned int nr_outputs, const uint8_t *const *sources, unsigned int nr_sources, const uint8_t *coefficients, size_t length) {
+    uint8_t tables[GF256_OUTPUTS_PER_PASS * GF256_MAX_SOURCES * 32];
+    size_t vector_length;
+
+    pthread_once(&select_once, select_mul_add);
+    pthread_once(&tables_once, init_tables);
+    vector_length = length - length % vector_size;
+
+    for (unsigned int first = 0; first < nr_outputs; first += GF256_OUTPUTS_PER_PASS) {
+        unsigned int count = nr_outputs - first < GF256_OUTPUTS_PER_PASS ? nr_outputs - first : GF256_OUTPUTS_PER_PASS;
+
+        for (unsigned int r = 0; r < count; r++) {
+            for (unsigned int j = 0; j < nr_sources; j++) {
+                uint8_t coefficient = coefficients[(first + r) * nr_sources + j];
+                uint8_t *table = tables + (r * nr_sources + j) * 32;
+
+                for (int i = 0; i < 16; i++) {
+                    table[i] = mul(coefficient, i);
+                    table[16 + i] = mul(coefficient, i << 4);
+                }
+            }
+        }
+
+        dot_product_vector(outputs + first, count, sources, nr_sources, tables, 0, vector_length);
+        dot_product_scalar(outputs + first, count, sources, nr_sources, tables, vector_length, length);
+    }
+}
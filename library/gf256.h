@@ -0,0 +1,28 @@
+#ifndef GF256_H
+#define GF256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Arithmetic in GF(2^8) modulo x^8 + x^4 + x^3 + x^2 + 1, as used by Reed-Solomon codes. Addition
+ * is XOR. Every implementation of the region functions gives the same bytes.
+ */
+
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+/* a must not be 0 */
+uint8_t gf256_inverse(uint8_t a);
+/* Inverts the n x n row-major matrix into out. Returns -1 if it is singular. */
+int gf256_invert_matrix(const uint8_t *matrix, uint8_t *out, int n);
+
+#define GF256_MAX_SOURCES 32
+
+/* dst ^= coefficient * src, byte-wise */
+void gf256_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coefficient, size_t length);
+/*
+ * outputs[r] = sum of coefficients[r * nr_sources + j] * sources[j], byte-wise, reading each
+ * source once per four outputs. At most GF256_MAX_SOURCES sources, outputs not overlapping them.
+ */
+void gf256_dot_product(uint8_t *const *outputs, unsigned int nr_outputs, const uint8_t *const *sources, unsigned int nr_sources, const uint8_t *coefficients, size_t length);
+
+#endif
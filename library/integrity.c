@@ -0,0 +1,730 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "libbius.h"
+#include "crc32c.h"
+#include "utils.h"
+
+/*
+ * Integrity layer. The table file holds a header page, the intent bitmap with a bit per region of
+ * INTEGRITY_REGION_BLOCKS blocks, then the CRC32C of every block of the device, 0 for blocks
+ * without one (a CRC of 0 is stored as 1). Reads verify the blocks they touch, writes update their
+ * checksums, and blocks only partly written are read and verified first, then checksummed whole.
+ *
+ * The table is written back by flushes, once the backend was flushed. Before a region is written
+ * its bit in the intent bitmap is set and synced, and flushes clear the bits of regions not written
+ * since the previous flush. After a crash, the checksums of regions marked may not match what their
+ * writes left on the backend, so they are dropped at open, to be recomputed by the scrubber, rather
+ * than failing reads of good data.
+ */
+
+#define INTEGRITY_MAGIC 0x3143524353554942lu /* "BIUSCRC1" */
+#define INTEGRITY_VERSION 1
+#define INTEGRITY_PAGE_SIZE 4096
+#define INTEGRITY_BLOCK_SIZE BIUS_INTEGRITY_BLOCK_SIZE
+#define INTEGRITY_PAGE_ENTRIES (INTEGRITY_PAGE_SIZE / sizeof(uint32_t))
+#define INTEGRITY_PAGE_BITS (INTEGRITY_PAGE_SIZE * 8)
+/* 1 MiB regions */
+#define INTEGRITY_REGION_BLOCKS 256
+/* Blocks sharing a lock, which is also what the scrubber reads at once */
+#define INTEGRITY_LOCK_BLOCKS 16
+/* A scrubber late by more than this starts pacing again rather than catching up */
+#define INTEGRITY_MAX_SCRUB_DELAY_NS 1000000000lu
+
+struct integrity_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t disk_size;
+    uint64_t intent_offset;
+    uint64_t table_offset;
+};
+
+enum modification {
+    MODIFY_WRITE,
+    MODIFY_WRITE_ZEROES,
+    MODIFY_DISCARD,
+};
+
+static struct integrity {
+    struct bius_operations backend;
+    int fd;
+    uint64_t disk_size;
+    uint64_t nr_blocks;
+    uint64_t nr_regions;
+    uint64_t nr_intent_pages;
+    uint64_t nr_table_pages;
+    uint64_t intent_offset;
+    uint64_t table_offset;
+    /* Checksum of each block, accessed atomically as the scrubber fills it in under a shared lock */
+    uint32_t *table;
+    /* Table pages changed since they were last written, a bit each */
+    uint64_t *dirty_table_pages;
+    /* Regions marked in the file. Set under intent_lock once durable, cleared by flushes. */
+    uint64_t *intent;
+    /* Regions written since the last flush started */
+    uint64_t *written;
+    uint32_t zero_checksum;
+    pthread_mutex_t intent_lock;
+    /* Modifications hold it shared, a flush exclusive while it looks at written */
+    pthread_rwlock_t io_lock;
+    /* Reads and the scrubber hold them shared, modifications exclusive */
+    struct block_locks block_locks;
+    pthread_mutex_t flush_lock;
+    /* Bytes per second */
+    unsigned long scrub_rate;
+    bool scrubbing;
+    pthread_t scrubber;
+    pthread_mutex_t scrub_lock;
+    pthread_cond_t scrub_wakeup;
+    struct bius_integrity_stats stats;
+    bool created;
+} integrity;
+
+static inline bool test_bit(const uint64_t *bitmap, uint64_t bit) {
+    return __atomic_load_n(&bitmap[bit / 64], __ATOMIC_RELAXED) & (1lu << (bit % 64));
+}
+
+static inline void set_bit(uint64_t *bitmap, uint64_t bit) {
+    __atomic_fetch_or(&bitmap[bit / 64], 1lu << (bit % 64), __ATOMIC_RELAXED);
+}
+
+static inline uint32_t load_checksum(uint64_t block) {
+    return __atomic_load_n(&integrity.table[block], __ATOMIC_RELAXED);
+}
+
+static inline void store_checksum(uint64_t block, uint32_t checksum) {
+    __atomic_store_n(&integrity.table[block], checksum, __ATOMIC_RELAXED);
+    set_bit(integrity.dirty_table_pages, block / INTEGRITY_PAGE_ENTRIES);
+}
+
+static inline uint32_t block_checksum(const char *data) {
+    uint32_t checksum = crc32c(0, data, INTEGRITY_BLOCK_SIZE);
+
+    return checksum != 0 ? checksum : 1;
+}
+
+static void report_mismatch(uint64_t block) {
+    add_stat(&integrity.stats.mismatched_blocks, 1);
+    __atomic_store_n(&integrity.stats.last_mismatch_offset, block * INTEGRITY_BLOCK_SIZE, __ATOMIC_RELAXED);
+    fprintf(stderr, "integrity: block at %lu does not match its checksum\n", block * INTEGRITY_BLOCK_SIZE);
+}
+
+/*
+ * Verifies count blocks read at block first, with their locks held. Blocks without a checksum are
+ * given one if seed is set, otherwise they are taken as they are.
+ */
+static blk_status_t verify_blocks(const char *data, uint64_t first, uint64_t count, bool seed) {
+    const uint64_t start = now_ns();
+    unsigned long verified = 0, unverified = 0, seeded = 0;
+    blk_status_t result = BLK_STS_OK;
+
+    for (uint64_t i = 0; i < count; i++) {
+        const uint32_t expected = load_checksum(first + i);
+
+        if (expected == 0 && !seed) {
+            unverified++;
+        } else if (expected == 0) {
+            store_checksum(first + i, block_checksum(data + i * INTEGRITY_BLOCK_SIZE));
+            seeded++;
+        } else if (block_checksum(data + i * INTEGRITY_BLOCK_SIZE) == expected) {
+            verified++;
+        } else {
+            report_mismatch(first + i);
+            result = BLK_STS_PROTECTION;
+        }
+    }
+
+    add_stat(&integrity.stats.checksum_ns, now_ns() - start);
+    add_stat(&integrity.stats.checksum_bytes, (count - unverified) * INTEGRITY_BLOCK_SIZE);
+    add_stat(&integrity.stats.verified_blocks, verified);
+    add_stat(&integrity.stats.unverified_blocks, unverified);
+    add_stat(&integrity.stats.seeded_blocks, seeded);
+
+    return result;
+}
+
+static void update_checksums(const char *data, uint64_t first, uint64_t count) {
+    const uint64_t start = now_ns();
+
+    for (uint64_t i = 0; i < count; i++)
+        store_checksum(first + i, block_checksum(data + i * INTEGRITY_BLOCK_SIZE));
+
+    add_stat(&integrity.stats.checksum_ns, now_ns() - start);
+    add_stat(&integrity.stats.checksum_bytes, count * INTEGRITY_BLOCK_SIZE);
+}
+
+static void set_checksums(uint64_t first, uint64_t count, uint32_t checksum) {
+    for (uint64_t i = 0; i < count; i++)
+        store_checksum(first + i, checksum);
+}
+
+static blk_status_t read_block(char *buffer, uint64_t block) {
+    blk_status_t result = integrity.backend.read(buffer, block * INTEGRITY_BLOCK_SIZE, INTEGRITY_BLOCK_SIZE);
+
+    if (result != BLK_STS_OK)
+        return result;
+
+    return verify_blocks(buffer, block, 1, false);
+}
+
+/* Whether the first block of [offset, offset + length) is only partly in it */
+static inline bool head_partial(off64_t offset, size_t length) {
+    return offset % INTEGRITY_BLOCK_SIZE != 0 || length < INTEGRITY_BLOCK_SIZE;
+}
+
+/* Whether the last block is only partly in it, and not also the first block */
+static inline bool tail_partial(off64_t offset, size_t length) {
+    const uint64_t end = offset + length;
+
+    return end % INTEGRITY_BLOCK_SIZE != 0 && offset / INTEGRITY_BLOCK_SIZE != (end - 1) / INTEGRITY_BLOCK_SIZE;
+}
+
+/* Whole blocks of a request, as the first one and their count */
+static inline uint64_t first_whole_block(off64_t offset) {
+    return (offset + INTEGRITY_BLOCK_SIZE - 1) / INTEGRITY_BLOCK_SIZE;
+}
+
+static inline uint64_t nr_whole_blocks(off64_t offset, size_t length) {
+    const uint64_t first = first_whole_block(offset);
+    const uint64_t end = (offset + length) / INTEGRITY_BLOCK_SIZE;
+
+    return end > first ? end - first : 0;
+}
+
+/* Blocks partly read are read whole and fail if they do not match, even outside the request */
+static blk_status_t integrity_read(void *data, off64_t offset, size_t length) {
+    const uint64_t first = offset / INTEGRITY_BLOCK_SIZE;
+    const uint64_t last = (offset + length - 1) / INTEGRITY_BLOCK_SIZE;
+    const uint64_t whole_first = first_whole_block(offset);
+    const uint64_t nr_whole = nr_whole_blocks(offset, length);
+    char block[INTEGRITY_BLOCK_SIZE];
+    blk_status_t result = BLK_STS_OK;
+
+    lock_blocks(&integrity.block_locks, first, last, false);
+
+    if (head_partial(offset, length)) {
+        const uint64_t block_offset = offset % INTEGRITY_BLOCK_SIZE;
+
+        result = read_block(block, first);
+        if (result != BLK_STS_OK)
+            goto out;
+        memcpy(data, block + block_offset, min(length, INTEGRITY_BLOCK_SIZE - block_offset));
+    }
+
+    if (nr_whole > 0) {
+        char *whole = (char *)data + (whole_first * INTEGRITY_BLOCK_SIZE - offset);
+
+        result = integrity.backend.read(whole, whole_first * INTEGRITY_BLOCK_SIZE, nr_whole * INTEGRITY_BLOCK_SIZE);
+        if (result != BLK_STS_OK)
+            goto out;
+        result = verify_blocks(whole, whole_first, nr_whole, false);
+        if (result != BLK_STS_OK)
+            goto out;
+    }
+
+    if (tail_partial(offset, length)) {
+        result = read_block(block, last);
+        if (result != BLK_STS_OK)
+            goto out;
+        memcpy((char *)data + (last * INTEGRITY_BLOCK_SIZE - offset), block, offset + length - last * INTEGRITY_BLOCK_SIZE);
+    }
+
+out:
+    unlock_blocks(&integrity.block_locks, first, last);
+    return result;
+}
+
+/* Marks the regions of blocks [first, last] in the file before they are modified */
+static int mark_intent(uint64_t first, uint64_t last) {
+    const uint64_t first_region = first / INTEGRITY_REGION_BLOCKS;
+    const uint64_t last_region = last / INTEGRITY_REGION_BLOCKS;
+    const uint64_t first_page = first_region / INTEGRITY_PAGE_BITS;
+    const size_t size = (last_region / INTEGRITY_PAGE_BITS - first_page + 1) * INTEGRITY_PAGE_SIZE;
+    bool marked = true;
+    uint64_t *pages;
+    int result = 0;
+
+    for (uint64_t region = first_region; region <= last_region; region++) {
+        set_bit(integrity.written, region);
+        marked = marked && test_bit(integrity.intent, region);
+    }
+    if (marked)
+        return 0;
+
+    pthread_mutex_lock(&integrity.intent_lock);
+    pages = malloc(size);
+    if (pages == NULL) {
+        result = -ENOMEM;
+        goto out;
+    }
+
+    /* Marked in memory only once durable, as writes seeing the marks do not wait for them */
+    memcpy(pages, (char *)integrity.intent + first_page * INTEGRITY_PAGE_SIZE, size);
+    for (uint64_t region = first_region; region <= last_region; region++)
+        set_bit(pages, region - first_page * INTEGRITY_PAGE_BITS);
+    result = pwrite_full(integrity.fd, (const char *)pages, size, integrity.intent_offset + first_page * INTEGRITY_PAGE_SIZE);
+    if (result == 0 && fdatasync(integrity.fd) < 0)
+        result = -errno;
+    if (result == 0) {
+        for (uint64_t region = first_region; region <= last_region; region++)
+            set_bit(integrity.intent, region);
+    }
+
+out:
+    pthread_mutex_unlock(&integrity.intent_lock);
+    free(pages);
+    if (result < 0)
+        fprintf(stderr, "integrity: writing the intent bitmap failed: %s\n", strerror(-result));
+
+    return result;
+}
+
+/*
+ * Writes, writes zeros or discards, keeping the checksums of blocks partly modified. Discarded data
+ * is undefined, so every block touched by a discard loses its checksum.
+ */
+static blk_status_t modify(const void *data, off64_t offset, size_t length, enum modification modification) {
+    const uint64_t first = offset / INTEGRITY_BLOCK_SIZE;
+    const uint64_t last = (offset + length - 1) / INTEGRITY_BLOCK_SIZE;
+    const uint64_t whole_first = first_whole_block(offset);
+    const uint64_t nr_whole = nr_whole_blocks(offset, length);
+    const bool merge_head = modification != MODIFY_DISCARD && head_partial(offset, length);
+    const bool merge_tail = modification != MODIFY_DISCARD && tail_partial(offset, length);
+    char head[INTEGRITY_BLOCK_SIZE];
+    char tail[INTEGRITY_BLOCK_SIZE];
+    blk_status_t result;
+
+    pthread_rwlock_rdlock(&integrity.io_lock);
+    if (mark_intent(first, last) < 0) {
+        pthread_rwlock_unlock(&integrity.io_lock);
+        return BLK_STS_IOERR;
+    }
+    lock_blocks(&integrity.block_locks, first, last, true);
+
+    if (merge_head) {
+        const uint64_t block_offset = offset % INTEGRITY_BLOCK_SIZE;
+        const size_t head_length = min(length, INTEGRITY_BLOCK_SIZE - block_offset);
+
+        result = read_block(head, first);
+        if (result != BLK_STS_OK)
+            goto out;
+        if (modification == MODIFY_WRITE)
+            memcpy(head + block_offset, data, head_length);
+        else
+            memset(head + block_offset, 0, head_length);
+    }
+
+    if (merge_tail) {
+        const size_t tail_length = offset + length - last * INTEGRITY_BLOCK_SIZE;
+
+        result = read_block(tail, last);
+        if (result != BLK_STS_OK)
+            goto out;
+        if (modification == MODIFY_WRITE)
+            memcpy(tail, (const char *)data + (last * INTEGRITY_BLOCK_SIZE - offset), tail_length);
+        else
+            memset(tail, 0, tail_length);
+    }
+
+    if (modification == MODIFY_WRITE)
+        result = integrity.backend.write(data, offset, length);
+    else if (modification == MODIFY_WRITE_ZEROES)
+        result = integrity.backend.write_zeroes(offset, length);
+    else
+        result = integrity.backend.discard(offset, length);
+
+    /* What a failed request left is unknown */
+    if (result != BLK_STS_OK || modification == MODIFY_DISCARD) {
+        set_checksums(first, last - first + 1, 0);
+        goto out;
+    }
+
+    if (merge_head)
+        update_checksums(head, first, 1);
+    if (nr_whole > 0 && modification == MODIFY_WRITE)
+        update_checksums((const char *)data + (whole_first * INTEGRITY_BLOCK_SIZE - offset), whole_first, nr_whole);
+    else if (nr_whole > 0)
+        set_checksums(whole_first, nr_whole, integrity.zero_checksum);
+    if (merge_tail)
+        update_checksums(tail, last, 1);
+
+out:
+    unlock_blocks(&integrity.block_locks, first, last);
+    pthread_rwlock_unlock(&integrity.io_lock);
+
+    return result;
+}
+
+static blk_status_t integrity_write(const void *data, off64_t offset, size_t length) {
+    return modify(data, offset, length, MODIFY_WRITE);
+}
+
+static blk_status_t integrity_write_zeroes(off64_t offset, size_t length) {
+    return modify(NULL, offset, length, MODIFY_WRITE_ZEROES);
+}
+
+static blk_status_t integrity_discard(off64_t offset, size_t length) {
+    return modify(NULL, offset, length, MODIFY_DISCARD);
+}
+
+/* Writes the changed table pages and syncs them */
+static int write_table() {
+    const size_t nr_words = (integrity.nr_table_pages + 63) / 64;
+    uint32_t page[INTEGRITY_PAGE_ENTRIES];
+
+    for (size_t word = 0; word < nr_words; word++) {
+        uint64_t dirty = __atomic_exchange_n(&integrity.dirty_table_pages[word], 0, __ATOMIC_RELAXED);
+
+        while (dirty != 0) {
+            const uint64_t index = word * 64 + __builtin_ctzl(dirty);
+            const uint64_t first = index * INTEGRITY_PAGE_ENTRIES;
+            const uint64_t count = min(INTEGRITY_PAGE_ENTRIES, integrity.nr_blocks - first);
+
+            for (uint64_t i = 0; i < count; i++)
+                page[i] = load_checksum(first + i);
+            if (pwrite_full(integrity.fd, (const char *)page, sizeof(uint32_t) * count, integrity.table_offset + index * INTEGRITY_PAGE_SIZE) < 0) {
+                /* Written again by the next flush */
+                __atomic_fetch_or(&integrity.dirty_table_pages[word], dirty, __ATOMIC_RELAXED);
+                return -errno;
+            }
+            dirty &= dirty - 1;
+        }
+    }
+
+    return fdatasync(integrity.fd) < 0 ? -errno : 0;
+}
+
+/* Clears the marks of regions not written since the flush started, with the table written */
+static void clear_intent() {
+    const size_t nr_words = (integrity.nr_regions + 63) / 64;
+    uint64_t first_page = UINT64_MAX, last_page = 0;
+
+    pthread_rwlock_wrlock(&integrity.io_lock);
+    for (size_t word = 0; word < nr_words; word++) {
+        const uint64_t cleared = integrity.intent[word] & ~integrity.written[word];
+
+        if (cleared != 0) {
+            __atomic_fetch_and(&integrity.intent[word], ~cleared, __ATOMIC_RELAXED);
+            first_page = min(first_page, word * 64 / INTEGRITY_PAGE_BITS);
+            last_page = word * 64 / INTEGRITY_PAGE_BITS;
+        }
+    }
+    pthread_rwlock_unlock(&integrity.io_lock);
+
+    if (first_page == UINT64_MAX)
+        return;
+
+    /* Not synced: a mark surviving a crash only costs recomputing the checksums of its region */
+    pthread_mutex_lock(&integrity.intent_lock);
+    pwrite_full(integrity.fd, (const char *)integrity.intent + first_page * INTEGRITY_PAGE_SIZE,
+                (last_page - first_page + 1) * INTEGRITY_PAGE_SIZE, integrity.intent_offset + first_page * INTEGRITY_PAGE_SIZE);
+    pthread_mutex_unlock(&integrity.intent_lock);
+}
+
+static blk_status_t integrity_flush() {
+    blk_status_t result = BLK_STS_OK;
+    int error;
+
+    pthread_mutex_lock(&integrity.flush_lock);
+
+    /* Regions written from now on keep their marks */
+    pthread_rwlock_wrlock(&integrity.io_lock);
+    memset(integrity.written, 0, sizeof(uint64_t) * ((integrity.nr_regions + 63) / 64));
+    pthread_rwlock_unlock(&integrity.io_lock);
+
+    if (integrity.backend.flush)
+        result = integrity.backend.flush();
+    if (result != BLK_STS_OK)
+        goto out;
+
+    error = write_table();
+    if (error < 0) {
+        fprintf(stderr, "integrity: writing the checksums failed: %s\n", strerror(-error));
+        result = BLK_STS_IOERR;
+        goto out;
+    }
+    clear_intent();
+
+out:
+    pthread_mutex_unlock(&integrity.flush_lock);
+    return result;
+}
+
+static void scrub(char *buffer, uint64_t first, uint64_t count) {
+    blk_status_t result;
+
+    lock_blocks(&integrity.block_locks, first, first + count - 1, false);
+    result = integrity.backend.read(buffer, first * INTEGRITY_BLOCK_SIZE, count * INTEGRITY_BLOCK_SIZE);
+    if (result == BLK_STS_OK)
+        verify_blocks(buffer, first, count, true);
+    else
+        fprintf(stderr, "integrity: scrubbing at %lu failed: %d\n", first * INTEGRITY_BLOCK_SIZE, result);
+    unlock_blocks(&integrity.block_locks, first, first + count - 1);
+
+    add_stat(&integrity.stats.scrubbed_blocks, count);
+}
+
+static void *scrubber_main(void *arg) {
+    char *buffer = malloc(INTEGRITY_LOCK_BLOCKS * INTEGRITY_BLOCK_SIZE);
+    uint64_t block = 0;
+    uint64_t start = now_ns();
+    uint64_t scrubbed_bytes = 0;
+
+    if (buffer == NULL) {
+        fprintf(stderr, "integrity: no memory to scrub\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&integrity.scrub_lock);
+    while (integrity.scrubbing) {
+        const uint64_t due = start + (unsigned __int128)scrubbed_bytes * 1000000000lu / integrity.scrub_rate;
+        const uint64_t now = now_ns();
+        /* Batches follow the locks, so that each takes only one */
+        const uint64_t count = min(INTEGRITY_LOCK_BLOCKS - block % INTEGRITY_LOCK_BLOCKS, integrity.nr_blocks - block);
+
+        if (now < due) {
+            struct timespec deadline = {
+                .tv_sec = due / 1000000000lu,
+                .tv_nsec = due % 1000000000lu,
+            };
+
+            pthread_cond_timedwait(&integrity.scrub_wakeup, &integrity.scrub_lock, &deadline);
+            continue;
+        }
+        if (now - due > INTEGRITY_MAX_SCRUB_DELAY_NS) {
+            start = now;
+            scrubbed_bytes = 0;
+        }
+        pthread_mutex_unlock(&integrity.scrub_lock);
+
+        scrub(buffer, block, count);
+        scrubbed_bytes += count * INTEGRITY_BLOCK_SIZE;
+        block += count;
+        if (block == integrity.nr_blocks) {
+            block = 0;
+            add_stat(&integrity.stats.scrub_passes, 1);
+        }
+
+        pthread_mutex_lock(&integrity.scrub_lock);
+    }
+    pthread_mutex_unlock(&integrity.scrub_lock);
+
+    free(buffer);
+    return NULL;
+}
+
+static int create_table(const struct bius_integrity_options *options) {
+    struct integrity_header header = {
+        .magic = INTEGRITY_MAGIC,
+        .version = INTEGRITY_VERSION,
+        .block_size = INTEGRITY_BLOCK_SIZE,
+        .disk_size = options->disk_size,
+        .intent_offset = integrity.intent_offset,
+        .table_offset = integrity.table_offset,
+    };
+    int result;
+
+    /* Sparse, every block starts without a checksum and no region marked */
+    if (ftruncate(integrity.fd, integrity.table_offset + integrity.nr_table_pages * INTEGRITY_PAGE_SIZE) < 0)
+        return -errno;
+    result = pwrite_full(integrity.fd, (const char *)&header, sizeof(header), 0);
+    if (result < 0)
+        return result;
+
+    return fsync(integrity.fd) < 0 ? -errno : 0;
+}
+
+static int check_table(const struct bius_integrity_options *options) {
+    struct integrity_header header;
+    int result;
+
+    result = pread_full(integrity.fd, (char *)&header, sizeof(header), 0);
+    if (result < 0)
+        return result;
+    if (header.magic != INTEGRITY_MAGIC || header.version != INTEGRITY_VERSION || header.block_size != INTEGRITY_BLOCK_SIZE ||
+        header.disk_size != options->disk_size || header.intent_offset != integrity.intent_offset ||
+        header.table_offset != integrity.table_offset)
+        return -EINVAL;
+
+    return 0;
+}
+
+/* Drops the checksums of the regions marked, written when the process last stopped */
+static int recover() {
+    unsigned long nr_marked = 0;
+    int result;
+
+    for (uint64_t region = 0; region < integrity.nr_regions; region++) {
+        const uint64_t first = region * INTEGRITY_REGION_BLOCKS;
+
+        if (!test_bit(integrity.intent, region))
+            continue;
+        set_checksums(first, min(INTEGRITY_REGION_BLOCKS, integrity.nr_blocks - first), 0);
+        nr_marked++;
+    }
+    if (nr_marked == 0)
+        return 0;
+
+    fprintf(stderr, "integrity: %lu regions were being written when last stopped, their checksums are dropped\n", nr_marked);
+    result = write_table();
+    if (result < 0)
+        return result;
+
+    memset(integrity.intent, 0, integrity.nr_intent_pages * INTEGRITY_PAGE_SIZE);
+    result = pwrite_full(integrity.fd, (const char *)integrity.intent, integrity.nr_intent_pages * INTEGRITY_PAGE_SIZE, integrity.intent_offset);
+    if (result < 0)
+        return result;
+
+    return fdatasync(integrity.fd) < 0 ? -errno : 0;
+}
+
+static void free_integrity() {
+    free(integrity.table);
+    free(integrity.dirty_table_pages);
+    free(integrity.intent);
+    free(integrity.written);
+    close(integrity.fd);
+}
+
+int bius_integrity_create(const struct bius_operations *backend, const struct bius_integrity_options *options, struct bius_operations *out_operations) {
+    char zeros[INTEGRITY_BLOCK_SIZE] = {0};
+    pthread_rwlockattr_t rwlock_attr;
+    pthread_condattr_t cond_attr;
+    struct stat table_stat;
+    int result;
+
+    if (integrity.created)
+        return -EBUSY;
+    if (backend->read == NULL || backend->write == NULL || options->table_file == NULL ||
+        options->disk_size == 0 || options->disk_size % INTEGRITY_BLOCK_SIZE != 0)
+        return -EINVAL;
+
+    memset(&integrity, 0, sizeof(integrity));
+    integrity.backend = *backend;
+    integrity.disk_size = options->disk_size;
+    integrity.nr_blocks = options->disk_size / INTEGRITY_BLOCK_SIZE;
+    integrity.nr_regions = (integrity.nr_blocks + INTEGRITY_REGION_BLOCKS - 1) / INTEGRITY_REGION_BLOCKS;
+    integrity.nr_intent_pages = (integrity.nr_regions + INTEGRITY_PAGE_BITS - 1) / INTEGRITY_PAGE_BITS;
+    integrity.nr_table_pages = (integrity.nr_blocks + INTEGRITY_PAGE_ENTRIES - 1) / INTEGRITY_PAGE_ENTRIES;
+    integrity.intent_offset = INTEGRITY_PAGE_SIZE;
+    integrity.table_offset = integrity.intent_offset + integrity.nr_intent_pages * INTEGRITY_PAGE_SIZE;
+    integrity.scrub_rate = options->scrub_rate;
+
+    integrity.fd = open(options->table_file, O_RDWR | O_CREAT, 0600);
+    if (integrity.fd < 0)
+        return -errno;
+
+    result = -ENOMEM;
+    integrity.table = malloc(integrity.nr_table_pages * INTEGRITY_PAGE_SIZE);
+    integrity.dirty_table_pages = calloc((integrity.nr_table_pages + 63) / 64, sizeof(uint64_t));
+    integrity.intent = malloc(integrity.nr_intent_pages * INTEGRITY_PAGE_SIZE);
+    integrity.written = calloc((integrity.nr_regions + 63) / 64, sizeof(uint64_t));
+    if (integrity.table == NULL || integrity.dirty_table_pages == NULL || integrity.intent == NULL || integrity.written == NULL)
+        goto out_free;
+
+    if (fstat(integrity.fd, &table_stat) < 0) {
+        result = -errno;
+        goto out_free;
+    }
+    result = table_stat.st_size == 0 ? create_table(options) : check_table(options);
+    if (result < 0)
+        goto out_free;
+
+    result = pread_full(integrity.fd, (char *)integrity.intent, integrity.nr_intent_pages * INTEGRITY_PAGE_SIZE, integrity.intent_offset);
+    if (result < 0)
+        goto out_free;
+    result = pread_full(integrity.fd, (char *)integrity.table, integrity.nr_table_pages * INTEGRITY_PAGE_SIZE, integrity.table_offset);
+    if (result < 0)
+        goto out_free;
+    result = recover();
+    if (result < 0)
+        goto out_free;
+
+    integrity.zero_checksum = block_checksum(zeros);
+    /* Otherwise a steady stream of writes keeps flushes waiting */
+    pthread_rwlockattr_init(&rwlock_attr);
+    pthread_rwlockattr_setkind_np(&rwlock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&integrity.io_lock, &rwlock_attr);
+    pthread_rwlockattr_destroy(&rwlock_attr);
+    init_block_locks(&integrity.block_locks, INTEGRITY_LOCK_BLOCKS);
+    pthread_mutex_init(&integrity.intent_lock, NULL);
+    pthread_mutex_init(&integrity.flush_lock, NULL);
+    pthread_mutex_init(&integrity.scrub_lock, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&integrity.scrub_wakeup, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    if (integrity.scrub_rate > 0) {
+        integrity.scrubbing = true;
+        result = -pthread_create(&integrity.scrubber, NULL, scrubber_main, NULL);
+        if (result < 0)
+            goto out_free;
+    }
+
+    memset(out_operations, 0, sizeof(struct bius_operations));
+    out_operations->read = integrity_read;
+    out_operations->write = integrity_write;
+    out_operations->flush = integrity_flush;
+    if (backend->discard)
+        out_operations->discard = integrity_discard;
+    if (backend->write_zeroes)
+        out_operations->write_zeroes = integrity_write_zeroes;
+    integrity.created = true;
+
+    return 0;
+
+out_free:
+    free_integrity();
+    return result;
+}
+
+void bius_integrity_get_stats(struct bius_integrity_stats *out_stats) {
+    out_stats->verified_blocks = __atomic_load_n(&integrity.stats.verified_blocks, __ATOMIC_RELAXED);
+    out_stats->unverified_blocks = __atomic_load_n(&integrity.stats.unverified_blocks, __ATOMIC_RELAXED);
+    out_stats->mismatched_blocks = __atomic_load_n(&integrity.stats.mismatched_blocks, __ATOMIC_RELAXED);
+    out_stats->last_mismatch_offset = __atomic_load_n(&integrity.stats.last_mismatch_offset, __ATOMIC_RELAXED);
+    out_stats->scrubbed_blocks = __atomic_load_n(&integrity.stats.scrubbed_blocks, __ATOMIC_RELAXED);
+    out_stats->seeded_blocks = __atomic_load_n(&integrity.stats.seeded_blocks, __ATOMIC_RELAXED);
+    out_stats->scrub_passes = __atomic_load_n(&integrity.stats.scrub_passes, __ATOMIC_RELAXED);
+    out_stats->checksum_bytes = __atomic_load_n(&integrity.stats.checksum_bytes, __ATOMIC_RELAXED);
+    out_stats->checksum_ns = __atomic_load_n(&integrity.stats.checksum_ns, __ATOMIC_RELAXED);
+}
+
+int bius_integrity_destroy() {
+    blk_status_t result;
+
+    if (!integrity.created)
+        return -EINVAL;
+
+    if (integrity.scrub_rate > 0) {
+        pthread_mutex_lock(&integrity.scrub_lock);
+        integrity.scrubbing = false;
+        pthread_cond_signal(&integrity.scrub_wakeup);
+        pthread_mutex_unlock(&integrity.scrub_lock);
+        pthread_join(integrity.scrubber, NULL);
+    }
+
+    result = integrity_flush();
+
+    destroy_block_locks(&integrity.block_locks);
+    pthread_rwlock_destroy(&integrity.io_lock);
+    pthread_mutex_destroy(&integrity.intent_lock);
+    pthread_mutex_destroy(&integrity.flush_lock);
+    pthread_mutex_destroy(&integrity.scrub_lock);
+    pthread_cond_destroy(&integrity.scrub_wakeup);
+    free_integrity();
+    integrity.created = false;
+
+    return result == BLK_STS_OK ? 0 : -EIO;
+}
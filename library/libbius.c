@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,17 +12,104 @@
 #include <bius/command_header.h>
 #include <bius/map_type.h>
 #include "libbius.h"
+#include "stats.h"
+#include "topology.h"
 #include "utils.h"
 
 #define PAGE_SIZE 4096
 #define DATA_MAP_AREA_SIZE (BIUS_MAX_SIZE_PER_COMMAND + PAGE_SIZE)
 
+/* Requests up to COALESCE_MAX_LENGTH are coalesced, at most COALESCE_MAX_REQUESTS at once */
+#define COALESCE_MAX_REQUESTS 32
+#define COALESCE_MAX_LENGTH (64 * 1024)
+
 struct thread_parameter {
     const struct bius_operations *operations;
     const struct bius_block_device_options *options;
+    const struct bius_transport *transport;
+    unsigned int thread_index;
+};
+
+/*
+ * Flushes of all the workers. Rounds run one at a time, and a flush completes with the first round
+ * starting after it arrived, so that it covers every write completed before it.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    unsigned long started;
+    unsigned long completed;
+    bool running;
+    /* Last round that failed, 0 for none, and its result */
+    unsigned long failed_round;
+    blk_status_t failed_result;
+} flush_group = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* One connection to the kernel, i.e. one open of /dev/bius for the char dev transport */
+struct connection {
+    const struct bius_transport *transport;
+    int handle;
+};
+
+static int char_dev_open(void *context) {
+    return open("/dev/bius", O_RDWR);
+}
+
+static ssize_t char_dev_read(void *context, int handle, void *buffer, size_t size) {
+    return read(handle, buffer, size);
+}
+
+static ssize_t char_dev_read_nowait(void *context, int handle, void *buffer, size_t size) {
+    struct iovec iov = {
+        .iov_base = buffer,
+        .iov_len = size,
+    };
+
+    return preadv2(handle, &iov, 1, -1, RWF_NOWAIT);
+}
+
+static ssize_t char_dev_write(void *context, int handle, const void *buffer, size_t size) {
+    return write(handle, buffer, size);
+}
+
+static void *char_dev_map(void *context, int handle, size_t size) {
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+}
+
+static void char_dev_close(void *context, int handle) {
+    close(handle);
+}
+
+const struct bius_transport bius_char_dev_transport = {
+    .open = char_dev_open,
+    .read = char_dev_read,
+    .read_nowait = char_dev_read_nowait,
+    .write = char_dev_write,
+    .map = char_dev_map,
+    .close = char_dev_close,
 };
 
-static void create_block_device(int fd, const struct bius_block_device_options *options) {
+static inline ssize_t connection_read(struct connection *connection, void *buffer, size_t size) {
+    return connection->transport->read(connection->transport->context, connection->handle, buffer, size);
+}
+
+static inline ssize_t connection_write(struct connection *connection, const void *buffer, size_t size) {
+    return connection->transport->write(connection->transport->context, connection->handle, buffer, size);
+}
+
+static void open_connection(struct connection *connection, const struct bius_transport *transport) {
+    connection->transport = transport;
+    connection->handle = transport->open(transport->context);
+    if (connection->handle < 0) {
+        fprintf(stderr, "Transport open failed: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static void create_block_device(struct connection *connection, const struct bius_block_device_options *options) {
     struct bius_u2k_header u2k = {
         .id = 0,
         .u2k_type = BIUS_CREATE,
@@ -29,13 +117,13 @@ static void create_block_device(int fd, const struct bius_block_device_options *
         .user_data = (uint64_t)options,
     };
 
-    if (write(fd, &u2k, sizeof(u2k)) < 0) {
+    if (connection_write(connection, &u2k, sizeof(u2k)) < 0) {
         fprintf(stderr, "Create block device failed: %s\n", strerror(errno));
         exit(1);
     }
 }
 
-static void connect_block_device(int fd, const struct bius_block_device_options *options) {
+static void connect_block_device(struct connection *connection, const struct bius_block_device_options *options) {
     struct bius_u2k_header u2k = {
         .id = 0,
         .u2k_type = BIUS_CONNECT,
@@ -43,18 +131,31 @@ static void connect_block_device(int fd, const struct bius_block_device_options
         .user_data = (uint64_t)options->disk_name,
     };
 
-    if (write(fd, &u2k, sizeof(u2k)) < 0) {
+    if (connection_write(connection, &u2k, sizeof(u2k)) < 0) {
         fprintf(stderr, "Connect block device failed: %s\n", strerror(errno));
         exit(1);
     }
 }
 
-static inline int read_command(int fd, struct bius_k2u_header *header) {
-    ssize_t result = read(fd, header, sizeof(struct bius_k2u_header));
+/*
+ * Reads a command into header. The kernel appends the payload of small writes when there is
+ * room, so the read goes to payload - sizeof(header), which must be writable, and up to
+ * payload_capacity bytes of payload land in payload. Their count is stored in out_inline_length.
+ */
+static inline int read_command(struct connection *connection, struct bius_k2u_header *header, char *payload, size_t payload_capacity, size_t *out_inline_length) {
+    char *receive_address = payload - sizeof(struct bius_k2u_header);
+    ssize_t result = connection_read(connection, receive_address, sizeof(struct bius_k2u_header) + payload_capacity);
+
+    *out_inline_length = 0;
+    if (result >= (ssize_t)sizeof(struct bius_k2u_header)) {
+        memcpy(header, receive_address, sizeof(struct bius_k2u_header));
+        *out_inline_length = result - sizeof(struct bius_k2u_header);
+    }
+
     if (result < 0) {
         fprintf(stderr, "Command reading failed: %s\n", strerror(errno));
     } else if (result == 0) {
-        fprintf(stderr, "EOF returned while reading\n");
+        printd("EOF returned while reading\n");
     } else if (result < sizeof(struct bius_k2u_header)) {
         fprintf(stderr, "Read size is smaller than header: %ld\n", result);
         result = -1;
@@ -63,8 +164,16 @@ static inline int read_command(int fd, struct bius_k2u_header *header) {
     return result;
 }
 
-static inline int write_command(int fd, const struct bius_u2k_header *header) {
-    ssize_t result = write(fd, header, sizeof(struct bius_u2k_header));
+/* Returns the header size if a request was pending, 0 otherwise */
+static inline int try_read_command(struct connection *connection, struct bius_k2u_header *header) {
+    ssize_t result = connection->transport->read_nowait(connection->transport->context, connection->handle, header, sizeof(struct bius_k2u_header));
+
+    /* Errors other than EAGAIN are reported by the next blocking read */
+    return result == sizeof(struct bius_k2u_header) ? result : 0;
+}
+
+static inline int write_command(struct connection *connection, const struct bius_u2k_header *header) {
+    ssize_t result = connection_write(connection, header, sizeof(struct bius_u2k_header));
     if (result < 0) {
         fprintf(stderr, "Reply writing failed: %s\n", strerror(errno));
     } else if (result == 0) {
@@ -77,7 +186,8 @@ static inline int write_command(int fd, const struct bius_u2k_header *header) {
     return result;
 }
 
-static inline void handle_copy_in(int fd, struct bius_k2u_header *header, char *buffer) {
+/* inline_length bytes of the payload of a write were already received into buffer */
+static inline void handle_copy_in(struct connection *connection, struct bius_k2u_header *header, char *buffer, size_t inline_length) {
     if (request_may_have_data(header->opcode) && header->data_map_type == BIUS_DATAMAP_UNMAPPED) {
         header->data_map_type = BIUS_DATAMAP_SIMPLE;
         header->data_address = (unsigned long)buffer;
@@ -85,10 +195,10 @@ static inline void handle_copy_in(int fd, struct bius_k2u_header *header, char *
 
         if (request_is_write(header->opcode)) {
             const size_t size = header->length;
-            ssize_t total_read = 0;
+            ssize_t total_read = inline_length;
 
             while (total_read < size) {
-                ssize_t read_size = read(fd, buffer + total_read, size - total_read);
+                ssize_t read_size = connection_read(connection, buffer + total_read, size - total_read);
 
                 if (read_size <= 0) {
                     fprintf(stderr, "Read failed: read_size = %ld, %s\n", read_size, strerror(errno));
@@ -101,10 +211,36 @@ static inline void handle_copy_in(int fd, struct bius_k2u_header *header, char *
     }
 }
 
+/* Serves a whole segment list with one read_iov or write_iov call. Returns -1 if not possible. */
+static inline int64_t handle_datamap_list_vectored(const struct bius_k2u_header *k2u, const struct bius_operations *ops) {
+    const unsigned long *datamap_list = (const unsigned long *)k2u->mapping_data;
+    struct iovec iov[BIUS_MAX_IOV];
+    int iovcnt;
+
+    if (!(k2u->opcode == BIUS_READ && ops->read_iov) && !(k2u->opcode == BIUS_WRITE && ops->write_iov))
+        return -1;
+
+    for (iovcnt = 0; datamap_list[iovcnt * 2] != 0; iovcnt++) {
+        if (iovcnt == BIUS_MAX_IOV)
+            return -1;
+        iov[iovcnt].iov_base = (void *)datamap_list[iovcnt * 2];
+        iov[iovcnt].iov_len = datamap_list[iovcnt * 2 + 1];
+    }
+
+    if (k2u->opcode == BIUS_READ)
+        return ops->read_iov(iov, iovcnt, k2u->offset);
+    else
+        return ops->write_iov(iov, iovcnt, k2u->offset);
+}
+
 static inline int64_t handle_blk_command_with_datamap_list(const struct bius_k2u_header *k2u, const struct bius_operations *ops, unsigned long *out_user_data) {
     unsigned long *datamap_list = (unsigned long *)k2u->mapping_data;
     off64_t offset = k2u->offset;
     bool first_call = true;
+    int64_t vectored_result = handle_datamap_list_vectored(k2u, ops);
+
+    if (vectored_result >= 0)
+        return vectored_result;
 
     for (int i = 0; datamap_list[i * 2] != 0; i++) {
         void *data_address = (void *)datamap_list[i * 2];
@@ -150,6 +286,47 @@ static inline int64_t handle_blk_command_with_datamap_list(const struct bius_k2u
     return BLK_STS_OK;
 }
 
+/*
+ * The first flush finding no round running leads the next one, and flushes arriving meanwhile wait
+ * to complete with it. A later round also started after them, so they fail if any round from the
+ * first started after them to the last completed failed.
+ */
+static blk_status_t group_flush(const struct bius_operations *ops) {
+    unsigned long target;
+    blk_status_t result;
+
+    pthread_mutex_lock(&flush_group.lock);
+    /* A round running may have started before the writes this flush covers */
+    target = flush_group.started + 1;
+    while (flush_group.completed < target) {
+        unsigned long round;
+
+        if (flush_group.running) {
+            pthread_cond_wait(&flush_group.done, &flush_group.lock);
+            continue;
+        }
+
+        flush_group.running = true;
+        round = ++flush_group.started;
+        pthread_mutex_unlock(&flush_group.lock);
+
+        result = ops->flush();
+
+        pthread_mutex_lock(&flush_group.lock);
+        flush_group.running = false;
+        flush_group.completed = round;
+        if (result != BLK_STS_OK) {
+            flush_group.failed_round = round;
+            flush_group.failed_result = result;
+        }
+        pthread_cond_broadcast(&flush_group.done);
+    }
+    result = target <= flush_group.failed_round ? flush_group.failed_result : BLK_STS_OK;
+    pthread_mutex_unlock(&flush_group.lock);
+
+    return result;
+}
+
 static inline int64_t handle_blk_command(const struct bius_k2u_header *k2u, const struct bius_operations *ops, unsigned long *out_user_data) {
     if (k2u->data_map_type == BIUS_DATAMAP_LIST)
         return handle_blk_command_with_datamap_list(k2u, ops, out_user_data);
@@ -157,23 +334,36 @@ static inline int64_t handle_blk_command(const struct bius_k2u_header *k2u, cons
     switch (k2u->opcode) {
         case BIUS_READ:
             *out_user_data = (unsigned long)(k2u->data_address + k2u->mapping_data);
-            if (ops->read)
+            if (ops->read) {
                 return ops->read((void *)k2u->data_address + k2u->mapping_data, k2u->offset, k2u->length);
-            else
+            } else if (ops->read_iov) {
+                struct iovec iov = {(void *)k2u->data_address + k2u->mapping_data, k2u->length};
+                return ops->read_iov(&iov, 1, k2u->offset);
+            } else {
                 return BLK_STS_NOTSUPP;
+            }
         case BIUS_WRITE:
-            if (ops->write)
+            if (ops->write) {
                 return ops->write((void *)k2u->data_address + k2u->mapping_data, k2u->offset, k2u->length);
-            else
+            } else if (ops->write_iov) {
+                struct iovec iov = {(void *)k2u->data_address + k2u->mapping_data, k2u->length};
+                return ops->write_iov(&iov, 1, k2u->offset);
+            } else {
                 return BLK_STS_NOTSUPP;
+            }
         case BIUS_DISCARD:
             if (ops->discard)
                 return ops->discard(k2u->offset, k2u->length);
             else
                 return BLK_STS_NOTSUPP;
+        case BIUS_WRITE_ZEROES:
+            if (ops->write_zeroes)
+                return ops->write_zeroes(k2u->offset, k2u->length);
+            else
+                return BLK_STS_NOTSUPP;
         case BIUS_FLUSH:
             if (ops->flush)
-                return ops->flush();
+                return group_flush(ops);
             else
                 return BLK_STS_NOTSUPP;
         case BIUS_ZONE_OPEN:
@@ -219,34 +409,155 @@ static inline int64_t handle_blk_command(const struct bius_k2u_header *k2u, cons
     }
 }
 
-static void handle_requests(int bius_char_dev, const struct bius_operations *ops) {
+static inline void account_request(struct bius_stats *stats, const struct bius_k2u_header *k2u, int64_t reply, uint64_t received, uint64_t copied_in, uint64_t handled, uint64_t replied) {
+    struct bius_opcode_stats *opcode;
+
+    if (k2u->opcode >= BIUS_STATS_NR_OPCODES)
+        return;
+
+    opcode = &stats->opcodes[k2u->opcode];
+    stats_add(&opcode->requests, 1);
+    if (request_may_have_data(k2u->opcode))
+        stats_add(&opcode->bytes, k2u->length);
+    if (reply < 0 || (is_blk_request(k2u->opcode) && reply != BLK_STS_OK))
+        stats_add(&opcode->errors, 1);
+    histogram_record(&opcode->backend, handled - copied_in);
+    histogram_record(&opcode->transport, (copied_in - received) + (replied - handled));
+}
+
+static inline bool can_coalesce(const struct bius_k2u_header *k2u, const struct bius_operations *ops) {
+    if (k2u->data_map_type != BIUS_DATAMAP_UNMAPPED || k2u->length == 0 || k2u->length > COALESCE_MAX_LENGTH)
+        return false;
+
+    return (k2u->opcode == BIUS_READ && ops->read_iov) || (k2u->opcode == BIUS_WRITE && ops->write_iov);
+}
+
+/*
+ * Serves k2u together with the contiguous requests of the same direction already pending, with a
+ * single read_iov or write_iov call. k2u is copied in to first_buffer, which already holds
+ * inline_length bytes of its payload, and the following request i to buffers + (i - 1) *
+ * COALESCE_MAX_LENGTH. Returns true if a request which could not be coalesced was read, which is
+ * then left in k2u.
+ */
+static bool handle_coalesced(struct connection *connection, const struct bius_operations *ops, struct bius_stats *stats,
+                             struct bius_k2u_header *k2u, uint64_t *received, char *first_buffer, size_t inline_length, char *buffers) {
+    struct bius_k2u_header batch[COALESCE_MAX_REQUESTS];
+    struct iovec iov[COALESCE_MAX_REQUESTS];
+    uint64_t batch_received[COALESCE_MAX_REQUESTS];
+    struct bius_k2u_header next;
+    struct bius_u2k_header u2k;
+    uint64_t copied_in, handled;
+    bool have_next = false;
+    blk_status_t reply;
+    int count = 0;
+
+    batch[0] = *k2u;
+    batch_received[0] = *received;
+    while (1) {
+        char *buffer = count == 0 ? first_buffer : buffers + (count - 1) * COALESCE_MAX_LENGTH;
+        const struct bius_k2u_header *last = &batch[count];
+
+        handle_copy_in(connection, &batch[count], buffer, count == 0 ? inline_length : 0);
+        iov[count].iov_base = buffer;
+        iov[count].iov_len = batch[count].length;
+        count++;
+
+        if (count == COALESCE_MAX_REQUESTS || try_read_command(connection, &next) == 0)
+            break;
+
+        *received = stats_now();
+        if (!can_coalesce(&next, ops) || next.opcode != batch[0].opcode || next.offset != last->offset + last->length) {
+            *k2u = next;
+            have_next = true;
+            break;
+        }
+
+        batch[count] = next;
+        batch_received[count] = *received;
+    }
+    copied_in = stats_now();
+
+    printd("coalesced %d requests: opcode = %d, offset = %lu\n", count, batch[0].opcode, batch[0].offset);
+    if (batch[0].opcode == BIUS_READ)
+        reply = ops->read_iov(iov, count, batch[0].offset);
+    else
+        reply = ops->write_iov(iov, count, batch[0].offset);
+    handled = stats_now();
+
+    for (int i = 0; i < count; i++) {
+        u2k.id = batch[i].id;
+        u2k.reply = reply;
+        u2k.user_data = batch[i].opcode == BIUS_READ ? (uint64_t)iov[i].iov_base : 0;
+
+        if (write_command(connection, &u2k) < 0)
+            exit(1);
+
+        account_request(stats, &batch[i], reply, batch_received[i], copied_in, handled, stats_now());
+    }
+
+    return have_next;
+}
+
+static void handle_requests(struct connection *connection, const struct bius_operations *ops, struct bius_stats *stats, bool data_map) {
     struct bius_k2u_header k2u;
     struct bius_u2k_header u2k;
     struct blk_zone *zone_info = NULL;
-#ifdef CONFIG_BIUS_DATAMAP
-    void *data_area = mmap(NULL, DATA_MAP_AREA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, bius_char_dev, 0);
-    printd("mmap result = %p\n", data_area);
-    if (data_area == MAP_FAILED) {
-        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
-        exit(1);
-    }
-    size_t data_copy_buffer_size = BIUS_MAP_DATA_THRESHOLD;
-#else
+    uint64_t received, copied_in, handled;
+    void *data_area = MAP_FAILED;
+    /* The kernel moves the copy/map threshold at runtime, so any request may be copied */
     size_t data_copy_buffer_size = BIUS_MAX_SIZE_PER_COMMAND;
-#endif
-    char *data_copy_buffer = aligned_alloc(PAGE_SIZE, data_copy_buffer_size);
-    if (data_copy_buffer == NULL) {
+    /* The header is received in the end of the first page, right before the data */
+    char *receive_area = aligned_alloc(PAGE_SIZE, PAGE_SIZE + data_copy_buffer_size);
+    char *data_copy_buffer = receive_area + PAGE_SIZE;
+    char *coalesce_buffers = NULL;
+    size_t inline_length = 0;
+    bool have_next = false;
+
+    if (receive_area == NULL) {
         fprintf(stderr, "data copy buffer allocation failed: %s\n", strerror(errno));
         exit(1);
     }
 
+    /* Without the area the kernel copies all data of this connection */
+    if (data_map) {
+        data_area = connection->transport->map(connection->transport->context, connection->handle, DATA_MAP_AREA_SIZE);
+        printd("mmap result = %p\n", data_area);
+        if (data_area == MAP_FAILED)
+            fprintf(stderr, "mmap failed, copying all data: %s\n", strerror(errno));
+    }
+
+    /* Coalescing needs to know whether more requests are pending without waiting for them */
+    if (connection->transport->read_nowait && (ops->read_iov || ops->write_iov)) {
+        coalesce_buffers = aligned_alloc(PAGE_SIZE, (COALESCE_MAX_REQUESTS - 1) * COALESCE_MAX_LENGTH);
+        if (coalesce_buffers == NULL) {
+            fprintf(stderr, "coalesce buffer allocation failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
     while (1) {
-        int result = read_command(bius_char_dev, &k2u);
+        int result;
+
+        if (have_next) {
+            inline_length = 0;
+        } else {
+            result = read_command(connection, &k2u, data_copy_buffer, data_copy_buffer_size, &inline_length);
+            if (result < 0)
+                exit(1);
+            else if (result == 0)
+                break;
+            received = stats_now();
+        }
         printd("command read. id = %lu, opcode = %d, offset = %lu, length = %lu, data_address = %lx\n", k2u.id, k2u.opcode, k2u.offset, k2u.length, k2u.data_address);
-        if (result < 0)
-            exit(1);
 
-        handle_copy_in(bius_char_dev, &k2u, data_copy_buffer);
+        if (coalesce_buffers && can_coalesce(&k2u, ops)) {
+            have_next = handle_coalesced(connection, ops, stats, &k2u, &received, data_copy_buffer, inline_length, coalesce_buffers);
+            continue;
+        }
+        have_next = false;
+
+        handle_copy_in(connection, &k2u, data_copy_buffer, inline_length);
+        copied_in = stats_now();
 
         u2k.id = k2u.id;
         if (is_blk_request(k2u.opcode)) {
@@ -259,66 +570,95 @@ static void handle_requests(int bius_char_dev, const struct bius_operations *ops
             u2k.reply = ops->report_zones(k2u.offset, (int)k2u.length, zone_info) * sizeof(struct blk_zone);
             u2k.user_data = (uint64_t)zone_info;
         }
+        handled = stats_now();
 
-        result = write_command(bius_char_dev, &u2k);
+        result = write_command(connection, &u2k);
         if (result < 0)
             exit(1);
 
+        account_request(stats, &k2u, u2k.reply, received, copied_in, handled, stats_now());
+
         if (zone_info) {
             free(zone_info);
             zone_info = NULL;
         }
     }
+
+    free(receive_area);
+    free(coalesce_buffers);
+    if (data_area != MAP_FAILED)
+        munmap(data_area, DATA_MAP_AREA_SIZE);
 }
 
 static void *thread_main(void *arg) {
     struct thread_parameter *t_parameter = arg;
-    int bius_char_dev = open("/dev/bius", O_RDWR);
-    if (bius_char_dev < 0) {
-        fprintf(stderr, "char dev open failed: %s\n", strerror(errno));
+    struct connection connection;
+
+    if (pin_worker_thread(t_parameter->options, t_parameter->thread_index) < 0)
         exit(1);
-    }
 
-    connect_block_device(bius_char_dev, t_parameter->options);
-    handle_requests(bius_char_dev, t_parameter->operations);
+    open_connection(&connection, t_parameter->transport);
+    connect_block_device(&connection, t_parameter->options);
+    handle_requests(&connection, t_parameter->operations, stats_get_thread(t_parameter->thread_index), t_parameter->options->data_map);
+    connection.transport->close(connection.transport->context, connection.handle);
 
     return NULL;
 }
 
-static inline int bius_main_real(const struct bius_operations *operations, const struct bius_block_device_options *options) {
-    struct thread_parameter t_parameter = {
-        .operations = operations,
-        .options = options,
-    };
-    size_t num_threads = BIUS_DEFAULT_NUM_THREADS;
+static inline int bius_main_real(const struct bius_operations *operations, const struct bius_block_device_options *user_options, const struct bius_transport *transport) {
+    struct bius_block_device_options options_buffer;
+    struct connection connection;
+    struct bius_block_device_options *options = &options_buffer;
+    struct thread_parameter *t_parameters;
+    size_t num_threads;
     int result = 0;
     pthread_t *threads;
 
-    if (operations == NULL || options == NULL)
+    if (operations == NULL || user_options == NULL || transport == NULL)
         return -EINVAL;
-    if (options->num_threads != 0)
-        num_threads = options->num_threads;
+
+    /* Kernel creates one dispatch queue per thread for zoned devices, so it must know the real count */
+    memcpy(options, user_options, sizeof(struct bius_block_device_options));
+    if (options->num_threads == 0)
+        options->num_threads = BIUS_DEFAULT_NUM_THREADS;
+    num_threads = options->num_threads;
+    options->discard = operations->discard != NULL;
+    options->write_zeroes = operations->write_zeroes != NULL;
 
     threads = malloc(sizeof(pthread_t) * (num_threads - 1));
-    if (threads == NULL)
+    t_parameters = malloc(sizeof(struct thread_parameter) * (num_threads - 1));
+    if (threads == NULL || t_parameters == NULL) {
+        free(threads);
+        free(t_parameters);
         return -ENOMEM;
-
-    int bius_char_dev = open("/dev/bius", O_RDWR);
-    if (bius_char_dev < 0) {
-        fprintf(stderr, "char dev open failed: %s\n", strerror(errno));
-        exit(1);
     }
-    create_block_device(bius_char_dev, options);
+
+    /* The calling thread is worker 0 */
+    result = pin_worker_thread(options, 0);
+    if (result < 0)
+        goto out_free;
+
+    result = stats_start(num_threads);
+    if (result < 0)
+        goto out_free;
+
+    open_connection(&connection, transport);
+    create_block_device(&connection, options);
 
     for (int i = 0; i < num_threads - 1; i++) {
-        result = pthread_create(&threads[i], NULL, thread_main, &t_parameter);
+        t_parameters[i].operations = operations;
+        t_parameters[i].options = options;
+        t_parameters[i].transport = transport;
+        t_parameters[i].thread_index = i + 1;
+
+        result = pthread_create(&threads[i], NULL, thread_main, &t_parameters[i]);
         if (result < 0) {
             fprintf(stderr, "pthread_create failed: %s\n", strerror(result));
             goto out_free;
         }
     }
 
-    handle_requests(bius_char_dev, operations);
+    handle_requests(&connection, operations, stats_get_thread(0), options->data_map);
 
     for (int i = 0; i < num_threads - 1; i++) {
         void *thread_result;
@@ -330,14 +670,18 @@ static inline int bius_main_real(const struct bius_operations *operations, const
         }
     }
 
+    transport->close(transport->context, connection.handle);
+
 out_free:
+    stats_stop();
     free(threads);
+    free(t_parameters);
 
     return result;
 }
 
-int bius_main(const struct bius_operations *operations, const struct bius_block_device_options *options) {
-    int result = bius_main_real(operations, options);
+int bius_main_with_transport(const struct bius_operations *operations, const struct bius_block_device_options *options, const struct bius_transport *transport) {
+    int result = bius_main_real(operations, options, transport);
 
     if (result < 0) {
         errno = result;
@@ -347,3 +691,7 @@ int bius_main(const struct bius_operations *operations, const struct bius_block_
         return result;
     }
 }
+
+int bius_main(const struct bius_operations *operations, const struct bius_block_device_options *options) {
+    return bius_main_with_transport(operations, options, &bius_char_dev_transport);
+}
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <bius/config.h>
+#include <bius/command_header.h>
+#include <bius/map_type.h>
+#include "libbius.h"
+#include "utils.h"
+
+#define LOOPBACK_MAX_HANDLES 256
+
+/* Plays the kernel side of one connection */
+struct loopback_connection {
+    bool in_use;
+    bool initialized;
+    /* Request handed out last, whose write payload may still be read */
+    struct bius_k2u_header request;
+    size_t payload_sent;
+    char *payload;
+    char *sink;
+};
+
+struct loopback {
+    struct bius_loopback_options options;
+    unsigned long next_request;
+    struct bius_loopback_stats stats;
+    pthread_mutex_t lock;
+    struct loopback_connection connections[LOOPBACK_MAX_HANDLES];
+};
+
+static inline uint64_t pattern(uint64_t position) {
+    return position * 0x9e3779b97f4a7c15lu;
+}
+
+static void fill_pattern(char *buffer, uint64_t offset, size_t length) {
+    uint64_t *words = (uint64_t *)buffer;
+
+    for (size_t i = 0; i < length / sizeof(uint64_t); i++)
+        words[i] = pattern(offset + i * sizeof(uint64_t));
+}
+
+static bool check_pattern(const char *buffer, uint64_t offset, size_t length) {
+    const uint64_t *words = (const uint64_t *)buffer;
+
+    for (size_t i = 0; i < length / sizeof(uint64_t); i++) {
+        if (words[i] != pattern(offset + i * sizeof(uint64_t)))
+            return false;
+    }
+
+    return true;
+}
+
+/* Request index i is a pure function of i, so replies can be matched without tracking them */
+static void make_request(const struct bius_loopback_options *options, unsigned long index, struct bius_k2u_header *request) {
+    memset(request, 0, sizeof(struct bius_k2u_header));
+    request->id = index + 1;
+    request->opcode = options->opcode;
+    request->length = options->length;
+    request->data_map_type = BIUS_DATAMAP_UNMAPPED;
+    if (options->length > 0)
+        request->offset = index * options->length % (options->disk_size / options->length * options->length);
+}
+
+static inline struct loopback_connection *get_connection(struct loopback *loopback, int handle) {
+    if (handle < 0 || handle >= LOOPBACK_MAX_HANDLES || !loopback->connections[handle].in_use)
+        return NULL;
+
+    return &loopback->connections[handle];
+}
+
+static int loopback_open(void *context) {
+    struct loopback *loopback = context;
+    const size_t length = loopback->options.length;
+    int handle = -1;
+
+    pthread_mutex_lock(&loopback->lock);
+    for (int i = 0; i < LOOPBACK_MAX_HANDLES; i++) {
+        if (!loopback->connections[i].in_use) {
+            handle = i;
+            break;
+        }
+    }
+
+    if (handle < 0) {
+        pthread_mutex_unlock(&loopback->lock);
+        errno = EMFILE;
+        return -1;
+    }
+
+    struct loopback_connection *connection = &loopback->connections[handle];
+    memset(connection, 0, sizeof(struct loopback_connection));
+    if (length > 0) {
+        connection->payload = calloc(1, length);
+        connection->sink = malloc(length);
+        if (connection->payload == NULL || connection->sink == NULL) {
+            free(connection->payload);
+            free(connection->sink);
+            pthread_mutex_unlock(&loopback->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    connection->in_use = true;
+    pthread_mutex_unlock(&loopback->lock);
+
+    return handle;
+}
+
+static ssize_t loopback_read(void *context, int handle, void *buffer, size_t size) {
+    struct loopback *loopback = context;
+    struct loopback_connection *connection = get_connection(loopback, handle);
+    const struct bius_loopback_options *options = &loopback->options;
+    struct bius_k2u_header *request;
+    unsigned long index;
+
+    if (connection == NULL || !connection->initialized) {
+        errno = EIO;
+        return -1;
+    }
+    request = &connection->request;
+
+    /* Payload of a write, sent by the kernel after its header */
+    if (request_is_write(request->opcode) && connection->payload_sent < request->length) {
+        size_t sent = min(size, request->length - connection->payload_sent);
+
+        memcpy(buffer, connection->payload + connection->payload_sent, sent);
+        connection->payload_sent += sent;
+        return sent;
+    }
+
+    if (size < sizeof(struct bius_k2u_header)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    index = __atomic_fetch_add(&loopback->next_request, 1, __ATOMIC_RELAXED);
+    if (index >= options->num_requests)
+        return 0;
+
+    make_request(options, index, request);
+
+    connection->payload_sent = 0;
+    if (request_is_write(request->opcode) && options->verify)
+        fill_pattern(connection->payload, request->offset, request->length);
+
+    memcpy(buffer, request, sizeof(struct bius_k2u_header));
+
+    /* Like the kernel, append as much of a write payload as fits */
+    if (request_is_write(request->opcode) && size > sizeof(struct bius_k2u_header)) {
+        connection->payload_sent = min(size - sizeof(struct bius_k2u_header), request->length);
+        memcpy((char *)buffer + sizeof(struct bius_k2u_header), connection->payload, connection->payload_sent);
+    }
+
+    return sizeof(struct bius_k2u_header) + connection->payload_sent;
+}
+
+static ssize_t loopback_write(void *context, int handle, const void *buffer, size_t size) {
+    struct loopback *loopback = context;
+    struct loopback_connection *connection = get_connection(loopback, handle);
+    struct bius_k2u_header request_buffer;
+    const struct bius_k2u_header *request = &request_buffer;
+    struct bius_u2k_header reply;
+
+    if (connection == NULL || size < sizeof(struct bius_u2k_header)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&reply, buffer, sizeof(reply));
+
+    if (!connection->initialized) {
+        if (reply.u2k_type != BIUS_CREATE && reply.u2k_type != BIUS_CONNECT) {
+            errno = EINVAL;
+            return -1;
+        }
+        connection->initialized = true;
+        return sizeof(struct bius_u2k_header);
+    }
+
+    /* Several requests may be outstanding when libbius coalesces them */
+    if (reply.id == 0 || reply.id > loopback->options.num_requests) {
+        errno = EINVAL;
+        return -1;
+    }
+    make_request(&loopback->options, reply.id - 1, &request_buffer);
+
+    if (reply.reply != BLK_STS_OK) {
+        __atomic_fetch_add(&loopback->stats.failed, 1, __ATOMIC_RELAXED);
+    } else if (request->opcode == BIUS_READ && request->length > 0) {
+        /* Same copy the kernel does into the bio */
+        memcpy(connection->sink, (const void *)reply.user_data, request->length);
+        if (loopback->options.verify && !check_pattern(connection->sink, request->offset, request->length))
+            __atomic_fetch_add(&loopback->stats.mismatched, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&loopback->stats.completed, 1, __ATOMIC_RELAXED);
+
+    return sizeof(struct bius_u2k_header);
+}
+
+static void *loopback_map(void *context, int handle, size_t size) {
+    /* Requests are never data mapped, the area only has to exist */
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+
+static void loopback_close(void *context, int handle) {
+    struct loopback *loopback = context;
+    struct loopback_connection *connection = get_connection(loopback, handle);
+
+    if (connection == NULL)
+        return;
+
+    pthread_mutex_lock(&loopback->lock);
+    free(connection->payload);
+    free(connection->sink);
+    connection->in_use = false;
+    pthread_mutex_unlock(&loopback->lock);
+}
+
+int bius_loopback_create(const struct bius_loopback_options *options, struct bius_transport *out_transport) {
+    struct loopback *loopback;
+
+    if (options->length > BIUS_MAX_SIZE_PER_COMMAND || (options->length > 0 && options->disk_size < options->length))
+        return -EINVAL;
+    if (options->verify && options->length % sizeof(uint64_t) != 0)
+        return -EINVAL;
+
+    loopback = calloc(1, sizeof(struct loopback));
+    if (loopback == NULL)
+        return -ENOMEM;
+
+    memcpy(&loopback->options, options, sizeof(struct bius_loopback_options));
+    pthread_mutex_init(&loopback->lock, NULL);
+
+    out_transport->open = loopback_open;
+    out_transport->read = loopback_read;
+    /* Requests are generated on demand, so reads never wait anyway */
+    out_transport->read_nowait = loopback_read;
+    out_transport->write = loopback_write;
+    out_transport->map = loopback_map;
+    out_transport->close = loopback_close;
+    out_transport->context = loopback;
+
+    return 0;
+}
+
+void bius_loopback_get_stats(const struct bius_transport *transport, struct bius_loopback_stats *out_stats) {
+    struct loopback *loopback = transport->context;
+
+    out_stats->completed = __atomic_load_n(&loopback->stats.completed, __ATOMIC_RELAXED);
+    out_stats->failed = __atomic_load_n(&loopback->stats.failed, __ATOMIC_RELAXED);
+    out_stats->mismatched = __atomic_load_n(&loopback->stats.mismatched, __ATOMIC_RELAXED);
+}
+
+void bius_loopback_destroy(struct bius_transport *transport) {
+    struct loopback *loopback = transport->context;
+
+    pthread_mutex_destroy(&loopback->lock);
+    free(loopback);
+    transport->context = NULL;
+}
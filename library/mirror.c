@@ -0,0 +1,751 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Mirror over replicas given as bius_operations. Writes are queued to worker threads of every
+ * replica and complete once all replicas in service finished them, or once write_quorum of them
+ * succeeded if set; the others then finish in the background from a copy of the data. Reads
+ * are served directly by the in-sync replica with the fewest requests in flight.
+ *
+ * A replica failing a request, or failed by the user, stops receiving I/O and gets the regions
+ * written meanwhile marked in its dirty bitmap. A resync copies them from an in-sync replica
+ * while requests are served. While it runs, writes hold the locks of their regions until every
+ * replica finished them, so that the copy of a region never races with a write to it.
+ */
+
+#define MIRROR_DEFAULT_REGION_SIZE (1024 * 1024)
+#define MIRROR_DEFAULT_THREADS 4
+#define MIRROR_MAX_THREADS 64
+#define MIRROR_NUM_REGION_LOCKS 1024
+
+enum mirror_request_type {
+    MIRROR_WRITE,
+    MIRROR_DISCARD,
+    MIRROR_WRITE_ZEROES,
+    MIRROR_FLUSH,
+};
+
+struct mirror_request;
+struct mirror_replica;
+
+struct mirror_job {
+    struct mirror_request *request;
+    struct mirror_replica *replica;
+    /* Completed by the replica */
+    bool done;
+    /* Counted in the lag of the replica, the request having completed without it */
+    bool lagging;
+    struct mirror_job *next;
+};
+
+struct mirror_request {
+    enum mirror_request_type type;
+    const char *data;
+    uint64_t offset;
+    size_t length;
+    unsigned int acked;
+    unsigned int failed;
+    /* Jobs not finished, plus one for the submitter until it returns */
+    unsigned int references;
+    /* Counted in unlocked_requests until finished by every replica */
+    bool unlocked;
+    pthread_mutex_t lock;
+    pthread_cond_t decided;
+    /* Data owned by the request, for replicas finishing after it completed */
+    char *copy;
+    struct mirror_job jobs[];
+};
+
+struct mirror_replica {
+    struct bius_operations ops;
+    enum bius_mirror_state state;
+    /* Regions written while the replica did not receive I/O, a bit each */
+    uint64_t *dirty;
+    /* Jobs queued to the worker threads in FIFO order */
+    struct mirror_job *head;
+    struct mirror_job *tail;
+    struct mirror_request *running[MIRROR_MAX_THREADS];
+    unsigned int nr_running;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_t threads[MIRROR_MAX_THREADS];
+    unsigned int nr_threads;
+    /* Requests queued or in flight, reads included */
+    unsigned long load;
+    /* Completed writes not done by the replica yet, by region lock, which it must not be read for */
+    unsigned int lag[MIRROR_NUM_REGION_LOCKS];
+    struct bius_mirror_replica_stats stats;
+};
+
+static struct mirror {
+    struct mirror_replica replicas[BIUS_MIRROR_MAX_REPLICAS];
+    unsigned int nr_replicas;
+    unsigned int quorum;
+    uint64_t disk_size;
+    uint64_t region_size;
+    uint64_t nr_regions;
+    pthread_rwlock_t region_locks[MIRROR_NUM_REGION_LOCKS];
+    /* Set while a resync runs, which makes writes lock their regions */
+    bool resyncing;
+    unsigned long unlocked_requests;
+    /* Readers finding every replica lagging wait for a lag to drop */
+    pthread_mutex_t lag_lock;
+    pthread_cond_t lag_dropped;
+    unsigned int lag_waiters;
+    pthread_mutex_t resync_lock;
+    bool stopping;
+    bool created;
+} mirror;
+
+static inline enum bius_mirror_state get_state(struct mirror_replica *replica) {
+    return __atomic_load_n(&replica->state, __ATOMIC_SEQ_CST);
+}
+
+static inline void set_state(struct mirror_replica *replica, enum bius_mirror_state state) {
+    __atomic_store_n(&replica->state, state, __ATOMIC_SEQ_CST);
+}
+
+/* Regions of the range, limited to one per region lock */
+static inline uint64_t region_span(uint64_t offset, size_t length, uint64_t *out_first) {
+    uint64_t first = offset / mirror.region_size;
+    uint64_t last = length > 0 ? (offset + length - 1) / mirror.region_size : first;
+
+    *out_first = first;
+    return min(last - first + 1, MIRROR_NUM_REGION_LOCKS);
+}
+
+static void add_lag(struct mirror_replica *replica, struct mirror_request *request, int value) {
+    uint64_t first;
+    uint64_t count = region_span(request->offset, request->length, &first);
+    bool dropped = false;
+
+    for (uint64_t region = first; region < first + count; region++) {
+        if (__atomic_add_fetch(&replica->lag[region % MIRROR_NUM_REGION_LOCKS], value, __ATOMIC_SEQ_CST) == 0)
+            dropped = true;
+    }
+
+    if (dropped && __atomic_load_n(&mirror.lag_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&mirror.lag_lock);
+        pthread_cond_broadcast(&mirror.lag_dropped);
+        pthread_mutex_unlock(&mirror.lag_lock);
+    }
+}
+
+static bool lags(struct mirror_replica *replica, uint64_t offset, size_t length) {
+    uint64_t first;
+    uint64_t count = region_span(offset, length, &first);
+
+    for (uint64_t region = first; region < first + count; region++) {
+        if (__atomic_load_n(&replica->lag[region % MIRROR_NUM_REGION_LOCKS], __ATOMIC_SEQ_CST) > 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void mark_dirty(struct mirror_replica *replica, uint64_t offset, size_t length) {
+    uint64_t first = offset / mirror.region_size;
+    uint64_t last = length > 0 ? (offset + length - 1) / mirror.region_size : first;
+
+    for (uint64_t region = first; region <= last && region < mirror.nr_regions; region++)
+        __atomic_fetch_or(&replica->dirty[region / 64], 1lu << (region % 64), __ATOMIC_SEQ_CST);
+}
+
+static inline bool test_and_clear_dirty(struct mirror_replica *replica, uint64_t region) {
+    uint64_t bit = 1lu << (region % 64);
+
+    return __atomic_fetch_and(&replica->dirty[region / 64], ~bit, __ATOMIC_SEQ_CST) & bit;
+}
+
+/* Stops I/O to replica after it failed, the request marking what it did not write */
+static void fail_replica(struct mirror_replica *replica, struct mirror_request *request) {
+    if (request->type == MIRROR_FLUSH)
+        mark_dirty(replica, 0, mirror.disk_size);
+    else
+        mark_dirty(replica, request->offset, request->length);
+
+    if (get_state(replica) != BIUS_MIRROR_FAILED) {
+        set_state(replica, BIUS_MIRROR_FAILED);
+        fprintf(stderr, "mirror: replica %ld failed\n", replica - mirror.replicas);
+    }
+}
+
+static void put_request(struct mirror_request *request) {
+    bool last;
+
+    pthread_mutex_lock(&request->lock);
+    last = --request->references == 0;
+    pthread_mutex_unlock(&request->lock);
+    if (!last)
+        return;
+
+    if (request->unlocked)
+        __atomic_fetch_sub(&mirror.unlocked_requests, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_destroy(&request->lock);
+    pthread_cond_destroy(&request->decided);
+    free(request->copy);
+    free(request);
+}
+
+static blk_status_t execute(struct mirror_replica *replica, struct mirror_request *request) {
+    /* Jobs queued before the replica failed only mark their regions */
+    if (get_state(replica) == BIUS_MIRROR_FAILED)
+        return BLK_STS_IOERR;
+
+    switch (request->type) {
+        case MIRROR_WRITE:
+            return replica->ops.write(request->copy ? request->copy : request->data, request->offset, request->length);
+        case MIRROR_DISCARD:
+            return replica->ops.discard(request->offset, request->length);
+        case MIRROR_WRITE_ZEROES:
+            return replica->ops.write_zeroes(request->offset, request->length);
+        case MIRROR_FLUSH:
+            return replica->ops.flush ? replica->ops.flush() : BLK_STS_OK;
+    }
+
+    return BLK_STS_NOTSUPP;
+}
+
+static void complete_job(struct mirror_job *job, blk_status_t result) {
+    struct mirror_replica *replica = job->replica;
+    struct mirror_request *request = job->request;
+
+    if (result == BLK_STS_OK) {
+        add_stat(&replica->stats.writes, 1);
+    } else {
+        add_stat(&replica->stats.errors, 1);
+        fail_replica(replica, request);
+    }
+    __atomic_fetch_sub(&replica->load, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&request->lock);
+    if (result == BLK_STS_OK)
+        request->acked++;
+    else
+        request->failed++;
+    job->done = true;
+    if (job->lagging)
+        add_lag(replica, request, -1);
+    pthread_cond_signal(&request->decided);
+    pthread_mutex_unlock(&request->lock);
+
+    put_request(request);
+}
+
+/* Whether the job at the head may start: it must not overlap a running one, flushes overlap all */
+static bool can_start(struct mirror_replica *replica) {
+    struct mirror_request *next;
+
+    if (replica->head == NULL)
+        return false;
+    next = replica->head->request;
+
+    for (unsigned int i = 0; i < replica->nr_running; i++) {
+        struct mirror_request *running = replica->running[i];
+
+        if (next->type == MIRROR_FLUSH || running->type == MIRROR_FLUSH)
+            return false;
+        if (next->offset < running->offset + running->length && running->offset < next->offset + next->length)
+            return false;
+    }
+
+    return true;
+}
+
+static void *replica_main(void *arg) {
+    struct mirror_replica *replica = arg;
+
+    pthread_mutex_lock(&replica->lock);
+    for (;;) {
+        struct mirror_job *job;
+        blk_status_t result;
+
+        while (!can_start(replica)) {
+            if (replica->head == NULL && __atomic_load_n(&mirror.stopping, __ATOMIC_RELAXED))
+                goto out_unlock;
+            pthread_cond_wait(&replica->wakeup, &replica->lock);
+        }
+
+        job = replica->head;
+        replica->head = job->next;
+        if (replica->head == NULL)
+            replica->tail = NULL;
+        replica->running[replica->nr_running++] = job->request;
+        pthread_mutex_unlock(&replica->lock);
+
+        result = execute(replica, job->request);
+
+        pthread_mutex_lock(&replica->lock);
+        for (unsigned int i = 0; i < replica->nr_running; i++) {
+            if (replica->running[i] == job->request) {
+                replica->running[i] = replica->running[--replica->nr_running];
+                break;
+            }
+        }
+        /* The head may have waited for this job */
+        if (replica->head)
+            pthread_cond_broadcast(&replica->wakeup);
+        pthread_mutex_unlock(&replica->lock);
+
+        complete_job(job, result);
+        pthread_mutex_lock(&replica->lock);
+    }
+
+out_unlock:
+    pthread_mutex_unlock(&replica->lock);
+    return NULL;
+}
+
+static void queue_job(struct mirror_replica *replica, struct mirror_job *job) {
+    __atomic_fetch_add(&replica->load, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&replica->lock);
+    job->next = NULL;
+    if (replica->tail)
+        replica->tail->next = job;
+    else
+        replica->head = job;
+    replica->tail = job;
+    pthread_cond_signal(&replica->wakeup);
+    pthread_mutex_unlock(&replica->lock);
+}
+
+static void lock_regions(uint64_t offset, size_t length, bool lock) {
+    uint64_t first;
+    uint64_t count = region_span(offset, length, &first);
+
+    for (uint64_t region = first; region < first + count; region++) {
+        if (lock)
+            pthread_rwlock_rdlock(&mirror.region_locks[region % MIRROR_NUM_REGION_LOCKS]);
+        else
+            pthread_rwlock_unlock(&mirror.region_locks[region % MIRROR_NUM_REGION_LOCKS]);
+    }
+}
+
+static blk_status_t submit(enum mirror_request_type type, const void *data, uint64_t offset, size_t length) {
+    const unsigned int nr_replicas = mirror.nr_replicas;
+    const unsigned int needed = mirror.quorum ? mirror.quorum : 1;
+    struct mirror_replica *targets[BIUS_MIRROR_MAX_REPLICAS];
+    struct mirror_request *request;
+    unsigned int nr_jobs = 0;
+    bool locked = false;
+    bool wait_all;
+    blk_status_t result;
+
+    request = calloc(1, sizeof(struct mirror_request) + sizeof(struct mirror_job) * nr_replicas);
+    if (request == NULL)
+        return BLK_STS_RESOURCE;
+    request->type = type;
+    request->data = data;
+    request->offset = offset;
+    request->length = length;
+    pthread_mutex_init(&request->lock, NULL);
+    pthread_cond_init(&request->decided, NULL);
+
+    /* A resync waits for the writes which saw it was not running */
+    if (type != MIRROR_FLUSH) {
+        __atomic_fetch_add(&mirror.unlocked_requests, 1, __ATOMIC_SEQ_CST);
+        request->unlocked = true;
+        if (__atomic_load_n(&mirror.resyncing, __ATOMIC_SEQ_CST)) {
+            __atomic_fetch_sub(&mirror.unlocked_requests, 1, __ATOMIC_SEQ_CST);
+            request->unlocked = false;
+            lock_regions(offset, length, true);
+            locked = true;
+        }
+    }
+    wait_all = locked || mirror.quorum == 0;
+
+    /* The request may outlive the call, and data with it */
+    if (type == MIRROR_WRITE && !wait_all && mirror.quorum < nr_replicas) {
+        request->copy = malloc(length);
+        if (request->copy == NULL) {
+            result = BLK_STS_RESOURCE;
+            goto out_put;
+        }
+        memcpy(request->copy, data, length);
+    }
+
+    for (unsigned int i = 0; i < nr_replicas; i++) {
+        struct mirror_replica *replica = &mirror.replicas[i];
+
+        if (get_state(replica) == BIUS_MIRROR_FAILED) {
+            if (type != MIRROR_FLUSH)
+                mark_dirty(replica, offset, length);
+            request->failed++;
+        } else {
+            targets[nr_jobs++] = replica;
+        }
+    }
+
+    request->references = nr_jobs + 1;
+    for (unsigned int i = 0; i < nr_jobs; i++) {
+        request->jobs[i].request = request;
+        request->jobs[i].replica = targets[i];
+        queue_job(targets[i], &request->jobs[i]);
+    }
+
+    pthread_mutex_lock(&request->lock);
+    if (wait_all) {
+        while (request->acked + request->failed < nr_replicas)
+            pthread_cond_wait(&request->decided, &request->lock);
+    } else {
+        while (request->acked < needed && request->failed <= nr_replicas - needed)
+            pthread_cond_wait(&request->decided, &request->lock);
+    }
+    result = request->acked >= needed ? BLK_STS_OK : BLK_STS_IOERR;
+
+    /* Reads must not see the data from before the request on replicas still doing it */
+    for (unsigned int i = 0; i < nr_jobs && type != MIRROR_FLUSH; i++) {
+        if (!request->jobs[i].done) {
+            request->jobs[i].lagging = true;
+            add_lag(request->jobs[i].replica, request, 1);
+        }
+    }
+    pthread_mutex_unlock(&request->lock);
+
+    if (locked)
+        lock_regions(offset, length, false);
+    put_request(request);
+
+    return result;
+
+out_put:
+    request->references = 1;
+    put_request(request);
+    return result;
+}
+
+/* Least loaded replica in sync not tried yet which does not lag the range, if any */
+static struct mirror_replica *pick_replica(uint64_t offset, size_t length, const bool *tried, bool *out_lagging) {
+    struct mirror_replica *best = NULL;
+    unsigned long best_load = 0;
+
+    *out_lagging = false;
+    for (unsigned int i = 0; i < mirror.nr_replicas; i++) {
+        struct mirror_replica *replica = &mirror.replicas[i];
+        unsigned long load = __atomic_load_n(&replica->load, __ATOMIC_RELAXED);
+
+        if (tried[i] || get_state(replica) != BIUS_MIRROR_IN_SYNC)
+            continue;
+        if (lags(replica, offset, length)) {
+            *out_lagging = true;
+            continue;
+        }
+        if (best == NULL || load < best_load) {
+            best = replica;
+            best_load = load;
+        }
+    }
+
+    return best;
+}
+
+/* Each replica misses a different completed write, one of them finishes soon */
+static void wait_lag(uint64_t offset, size_t length, const bool *tried) {
+    bool lagging;
+
+    pthread_mutex_lock(&mirror.lag_lock);
+    /* Counted before checking again, so that a lag dropping meanwhile wakes us */
+    __atomic_fetch_add(&mirror.lag_waiters, 1, __ATOMIC_SEQ_CST);
+    while (pick_replica(offset, length, tried, &lagging) == NULL && lagging)
+        pthread_cond_wait(&mirror.lag_dropped, &mirror.lag_lock);
+    __atomic_fetch_sub(&mirror.lag_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&mirror.lag_lock);
+}
+
+static blk_status_t mirror_read(void *data, off64_t offset, size_t length) {
+    bool tried[BIUS_MIRROR_MAX_REPLICAS] = {0};
+
+    for (;;) {
+        bool lagging;
+        struct mirror_replica *best = pick_replica(offset, length, tried, &lagging);
+        blk_status_t result;
+
+        if (best == NULL && lagging) {
+            wait_lag(offset, length, tried);
+            continue;
+        } else if (best == NULL) {
+            return BLK_STS_IOERR;
+        }
+
+        __atomic_fetch_add(&best->load, 1, __ATOMIC_RELAXED);
+        result = best->ops.read(data, offset, length);
+        __atomic_fetch_sub(&best->load, 1, __ATOMIC_RELAXED);
+
+        if (result == BLK_STS_OK) {
+            add_stat(&best->stats.reads, 1);
+            return BLK_STS_OK;
+        }
+
+        /* The data of the replica is not known to be wrong, so it stays in sync */
+        add_stat(&best->stats.errors, 1);
+        tried[best - mirror.replicas] = true;
+    }
+}
+
+static blk_status_t mirror_write(const void *data, off64_t offset, size_t length) {
+    return submit(MIRROR_WRITE, data, offset, length);
+}
+
+static blk_status_t mirror_discard(off64_t offset, size_t length) {
+    return submit(MIRROR_DISCARD, NULL, offset, length);
+}
+
+static blk_status_t mirror_write_zeroes(off64_t offset, size_t length) {
+    return submit(MIRROR_WRITE_ZEROES, NULL, offset, length);
+}
+
+static blk_status_t mirror_flush() {
+    return submit(MIRROR_FLUSH, NULL, 0, 0);
+}
+
+static void stop_threads(unsigned int nr_replicas) {
+    __atomic_store_n(&mirror.stopping, true, __ATOMIC_RELAXED);
+
+    for (unsigned int i = 0; i < nr_replicas; i++) {
+        struct mirror_replica *replica = &mirror.replicas[i];
+
+        pthread_mutex_lock(&replica->lock);
+        pthread_cond_broadcast(&replica->wakeup);
+        pthread_mutex_unlock(&replica->lock);
+        for (unsigned int j = 0; j < replica->nr_threads; j++)
+            pthread_join(replica->threads[j], NULL);
+    }
+}
+
+static void free_replicas(unsigned int nr_replicas) {
+    for (unsigned int i = 0; i < nr_replicas; i++) {
+        struct mirror_replica *replica = &mirror.replicas[i];
+
+        pthread_mutex_destroy(&replica->lock);
+        pthread_cond_destroy(&replica->wakeup);
+        free(replica->dirty);
+    }
+    for (int i = 0; i < MIRROR_NUM_REGION_LOCKS; i++)
+        pthread_rwlock_destroy(&mirror.region_locks[i]);
+    pthread_mutex_destroy(&mirror.lag_lock);
+    pthread_cond_destroy(&mirror.lag_dropped);
+    pthread_mutex_destroy(&mirror.resync_lock);
+}
+
+int bius_mirror_create(const struct bius_operations *replicas, unsigned int nr_replicas, const struct bius_mirror_options *options, struct bius_operations *out_operations) {
+    const unsigned int nr_threads = options->threads_per_replica ? options->threads_per_replica : MIRROR_DEFAULT_THREADS;
+    const uint64_t region_size = options->region_size ? options->region_size : MIRROR_DEFAULT_REGION_SIZE;
+    bool discard = true;
+    bool write_zeroes = true;
+    pthread_rwlockattr_t attr;
+    unsigned int initialized;
+    int result = 0;
+
+    if (mirror.created)
+        return -EBUSY;
+    if (nr_replicas == 0 || nr_replicas > BIUS_MIRROR_MAX_REPLICAS || options->write_quorum > nr_replicas)
+        return -EINVAL;
+    if (nr_threads > MIRROR_MAX_THREADS || region_size < SECTOR_SIZE || (region_size & (region_size - 1)) != 0 || options->disk_size == 0)
+        return -EINVAL;
+    for (unsigned int i = 0; i < nr_replicas; i++) {
+        if (replicas[i].read == NULL || replicas[i].write == NULL)
+            return -EINVAL;
+        discard = discard && replicas[i].discard;
+        write_zeroes = write_zeroes && replicas[i].write_zeroes;
+    }
+
+    memset(&mirror, 0, sizeof(mirror));
+    mirror.nr_replicas = nr_replicas;
+    mirror.quorum = options->write_quorum;
+    mirror.disk_size = options->disk_size;
+    mirror.region_size = region_size;
+    mirror.nr_regions = (options->disk_size + region_size - 1) / region_size;
+
+    /* Otherwise writes to a busy region keep a resync waiting */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < MIRROR_NUM_REGION_LOCKS; i++)
+        pthread_rwlock_init(&mirror.region_locks[i], &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&mirror.lag_lock, NULL);
+    pthread_cond_init(&mirror.lag_dropped, NULL);
+    pthread_mutex_init(&mirror.resync_lock, NULL);
+
+    for (initialized = 0; initialized < nr_replicas; initialized++) {
+        struct mirror_replica *replica = &mirror.replicas[initialized];
+
+        memcpy(&replica->ops, &replicas[initialized], sizeof(struct bius_operations));
+        replica->state = BIUS_MIRROR_IN_SYNC;
+        pthread_mutex_init(&replica->lock, NULL);
+        pthread_cond_init(&replica->wakeup, NULL);
+        replica->dirty = calloc((mirror.nr_regions + 63) / 64, sizeof(uint64_t));
+        if (replica->dirty == NULL) {
+            result = -ENOMEM;
+            initialized++;
+            goto out_stop;
+        }
+    }
+
+    for (unsigned int i = 0; i < nr_replicas; i++) {
+        struct mirror_replica *replica = &mirror.replicas[i];
+
+        for (; replica->nr_threads < nr_threads; replica->nr_threads++) {
+            result = pthread_create(&replica->threads[replica->nr_threads], NULL, replica_main, replica);
+            if (result != 0) {
+                result = -result;
+                goto out_stop;
+            }
+        }
+    }
+
+    memset(out_operations, 0, sizeof(struct bius_operations));
+    out_operations->read = mirror_read;
+    out_operations->write = mirror_write;
+    out_operations->flush = mirror_flush;
+    if (discard)
+        out_operations->discard = mirror_discard;
+    if (write_zeroes)
+        out_operations->write_zeroes = mirror_write_zeroes;
+    mirror.created = true;
+
+    return 0;
+
+out_stop:
+    stop_threads(initialized);
+    free_replicas(initialized);
+    return result;
+}
+
+int bius_mirror_fail_replica(unsigned int index) {
+    unsigned int in_sync = 0;
+
+    if (!mirror.created || index >= mirror.nr_replicas)
+        return -EINVAL;
+
+    for (unsigned int i = 0; i < mirror.nr_replicas; i++)
+        in_sync += get_state(&mirror.replicas[i]) == BIUS_MIRROR_IN_SYNC;
+    if (in_sync == 1 && get_state(&mirror.replicas[index]) == BIUS_MIRROR_IN_SYNC)
+        return -EBUSY;
+
+    /* Writes in flight to it may still complete, the regions of later ones are marked */
+    set_state(&mirror.replicas[index], BIUS_MIRROR_FAILED);
+    return 0;
+}
+
+/* Copies region from an in-sync replica to target. Called with the lock of the region held. */
+static int copy_region(struct mirror_replica *target, uint64_t region, char *buffer) {
+    uint64_t offset = region * mirror.region_size;
+    size_t length = min(mirror.region_size, mirror.disk_size - offset);
+
+    if (mirror_read(buffer, offset, length) != BLK_STS_OK)
+        return -EIO;
+
+    return target->ops.write(buffer, offset, length) == BLK_STS_OK ? 0 : -EIO;
+}
+
+/*
+ * Brings a failed replica back in sync, copying the regions marked dirty, or all of them if full
+ * is set, e.g. after the replica was replaced. Requests are served meanwhile.
+ */
+int bius_mirror_resync(unsigned int index, bool full) {
+    struct mirror_replica *replica;
+    char *buffer;
+    int result = 0;
+
+    if (!mirror.created || index >= mirror.nr_replicas)
+        return -EINVAL;
+    replica = &mirror.replicas[index];
+
+    pthread_mutex_lock(&mirror.resync_lock);
+    if (get_state(replica) != BIUS_MIRROR_FAILED || __atomic_load_n(&mirror.stopping, __ATOMIC_RELAXED)) {
+        pthread_mutex_unlock(&mirror.resync_lock);
+        return -EINVAL;
+    }
+
+    buffer = malloc(mirror.region_size);
+    if (buffer == NULL) {
+        pthread_mutex_unlock(&mirror.resync_lock);
+        return -ENOMEM;
+    }
+
+    if (full)
+        mark_dirty(replica, 0, mirror.disk_size);
+
+    /* Writes from now on reach the replica, and lock their regions once the flag is seen */
+    set_state(replica, BIUS_MIRROR_RESYNCING);
+    __atomic_store_n(&mirror.resyncing, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&mirror.unlocked_requests, __ATOMIC_SEQ_CST) > 0)
+        usleep(1000);
+
+    for (uint64_t region = 0; region < mirror.nr_regions && result == 0; region++) {
+        pthread_rwlock_t *lock = &mirror.region_locks[region % MIRROR_NUM_REGION_LOCKS];
+
+        if ((replica->dirty[region / 64] & (1lu << (region % 64))) == 0)
+            continue;
+
+        pthread_rwlock_wrlock(lock);
+        if (get_state(replica) != BIUS_MIRROR_RESYNCING) {
+            result = -EIO;
+        } else if (test_and_clear_dirty(replica, region)) {
+            result = copy_region(replica, region, buffer);
+            if (result < 0)
+                mark_dirty(replica, region * mirror.region_size, 1);
+            else
+                add_stat(&replica->stats.resynced_regions, 1);
+        }
+        pthread_rwlock_unlock(lock);
+    }
+
+    if (result == 0 && replica->ops.flush && replica->ops.flush() != BLK_STS_OK)
+        result = -EIO;
+
+    /* A write which failed on the replica meanwhile has already failed it again */
+    if (result == 0 && __atomic_compare_exchange_n(&replica->state, &(enum bius_mirror_state){BIUS_MIRROR_RESYNCING},
+                                                   BIUS_MIRROR_IN_SYNC, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        fprintf(stderr, "mirror: replica %u in sync\n", index);
+    } else {
+        result = result ? result : -EIO;
+        set_state(replica, BIUS_MIRROR_FAILED);
+    }
+
+    __atomic_store_n(&mirror.resyncing, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&mirror.resync_lock);
+    free(buffer);
+
+    return result;
+}
+
+void bius_mirror_get_stats(struct bius_mirror_stats *out_stats) {
+    memset(out_stats, 0, sizeof(struct bius_mirror_stats));
+    out_stats->nr_replicas = mirror.nr_replicas;
+
+    for (unsigned int i = 0; i < mirror.nr_replicas; i++) {
+        struct mirror_replica *replica = &mirror.replicas[i];
+        struct bius_mirror_replica_stats *stats = &out_stats->replicas[i];
+
+        stats->state = get_state(replica);
+        stats->reads = __atomic_load_n(&replica->stats.reads, __ATOMIC_RELAXED);
+        stats->writes = __atomic_load_n(&replica->stats.writes, __ATOMIC_RELAXED);
+        stats->errors = __atomic_load_n(&replica->stats.errors, __ATOMIC_RELAXED);
+        stats->resynced_regions = __atomic_load_n(&replica->stats.resynced_regions, __ATOMIC_RELAXED);
+        for (uint64_t word = 0; word < (mirror.nr_regions + 63) / 64; word++)
+            stats->dirty_regions += __builtin_popcountl(__atomic_load_n(&replica->dirty[word], __ATOMIC_RELAXED));
+    }
+}
+
+int bius_mirror_destroy() {
+    if (!mirror.created)
+        return -EINVAL;
+
+    /* Workers finish the jobs still queued first */
+    stop_threads(mirror.nr_replicas);
+    free_replicas(mirror.nr_replicas);
+    mirror.created = false;
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <bius/request_type.h>
+#include "stats.h"
+#include "utils.h"
+
+static const char *opcode_names[BIUS_STATS_NR_OPCODES] = {
+    [BIUS_READ] = "read",
+    [BIUS_WRITE] = "write",
+    [BIUS_DISCARD] = "discard",
+    [BIUS_WRITE_ZEROES] = "write_zeroes",
+    [BIUS_FLUSH] = "flush",
+    [BIUS_REPORT_ZONES] = "report_zones",
+    [BIUS_ZONE_OPEN] = "zone_open",
+    [BIUS_ZONE_CLOSE] = "zone_close",
+    [BIUS_ZONE_FINISH] = "zone_finish",
+    [BIUS_ZONE_APPEND] = "zone_append",
+    [BIUS_ZONE_RESET] = "zone_reset",
+    [BIUS_ZONE_RESET_ALL] = "zone_reset_all",
+};
+
+/* Protects thread_stats against bius_get_stats racing with stats_start */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bius_stats *thread_stats;
+static unsigned int num_thread_stats;
+
+static FILE *dump_file;
+static unsigned int dump_interval_ms;
+static pthread_t dump_thread;
+static bool dump_running;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_stop = PTHREAD_COND_INITIALIZER;
+
+static unsigned long histogram_bucket_limit(unsigned int bucket) {
+    unsigned int exponent;
+
+    if (bucket < BIUS_HISTOGRAM_SUB_BUCKETS)
+        return bucket + 1;
+
+    exponent = bucket / BIUS_HISTOGRAM_SUB_BUCKETS + 2;
+    return (unsigned long)(BIUS_HISTOGRAM_SUB_BUCKETS + bucket % BIUS_HISTOGRAM_SUB_BUCKETS + 1) << (exponent - 3);
+}
+
+unsigned long bius_histogram_percentile(const struct bius_histogram *histogram, double percentile) {
+    unsigned long target = (unsigned long)(histogram->count * percentile / 100.0);
+    unsigned long seen = 0;
+
+    if (histogram->count == 0)
+        return 0;
+    if (target >= histogram->count)
+        target = histogram->count - 1;
+
+    for (int i = 0; i < BIUS_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > target)
+            return min(histogram_bucket_limit(i), histogram->max);
+    }
+
+    return histogram->max;
+}
+
+static void add_histogram(struct bius_histogram *sum, const struct bius_histogram *histogram) {
+    unsigned long max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    sum->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    sum->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+    if (max > sum->max)
+        sum->max = max;
+    for (int i = 0; i < BIUS_HISTOGRAM_BUCKETS; i++)
+        sum->buckets[i] += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+}
+
+void bius_get_stats(struct bius_stats *out_stats) {
+    memset(out_stats, 0, sizeof(struct bius_stats));
+
+    pthread_mutex_lock(&stats_lock);
+    for (unsigned int t = 0; t < num_thread_stats; t++) {
+        for (int i = 0; i < BIUS_STATS_NR_OPCODES; i++) {
+            const struct bius_opcode_stats *stats = &thread_stats[t].opcodes[i];
+            struct bius_opcode_stats *sum = &out_stats->opcodes[i];
+
+            sum->requests += __atomic_load_n(&stats->requests, __ATOMIC_RELAXED);
+            sum->bytes += __atomic_load_n(&stats->bytes, __ATOMIC_RELAXED);
+            sum->errors += __atomic_load_n(&stats->errors, __ATOMIC_RELAXED);
+            add_histogram(&sum->backend, &stats->backend);
+            add_histogram(&sum->transport, &stats->transport);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void print_histogram(FILE *out, const char *name, const struct bius_histogram *histogram) {
+    fprintf(out, "\"%s\":{\"mean\":%lu,\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}", name,
+            histogram->count ? histogram->sum / histogram->count : 0,
+            bius_histogram_percentile(histogram, 50),
+            bius_histogram_percentile(histogram, 99),
+            bius_histogram_percentile(histogram, 99.9),
+            histogram->max);
+}
+
+void bius_print_stats(FILE *out, const struct bius_stats *stats) {
+    bool first = true;
+
+    fprintf(out, "{\"time_ns\":%lu,\"opcodes\":{", stats_now());
+    for (int i = 0; i < BIUS_STATS_NR_OPCODES; i++) {
+        const struct bius_opcode_stats *opcode = &stats->opcodes[i];
+
+        if (opcode_names[i] == NULL || opcode->requests == 0)
+            continue;
+
+        fprintf(out, "%s\"%s\":{\"requests\":%lu,\"bytes\":%lu,\"errors\":%lu,", first ? "" : ",",
+                opcode_names[i], opcode->requests, opcode->bytes, opcode->errors);
+        print_histogram(out, "backend_ns", &opcode->backend);
+        fputc(',', out);
+        print_histogram(out, "transport_ns", &opcode->transport);
+        fputc('}', out);
+        first = false;
+    }
+    fprintf(out, "}}\n");
+    fflush(out);
+}
+
+void bius_set_stats_dump(FILE *out, unsigned int interval_ms) {
+    dump_file = out;
+    dump_interval_ms = out ? interval_ms : 0;
+}
+
+static void dump_stats() {
+    struct bius_stats *stats = malloc(sizeof(struct bius_stats));
+
+    if (stats == NULL)
+        return;
+
+    bius_get_stats(stats);
+    bius_print_stats(dump_file, stats);
+    free(stats);
+}
+
+static void *dump_main(void *arg) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    pthread_mutex_lock(&dump_lock);
+    while (dump_running) {
+        deadline.tv_sec += dump_interval_ms / 1000;
+        deadline.tv_nsec += (dump_interval_ms % 1000) * 1000000l;
+        if (deadline.tv_nsec >= 1000000000l) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000l;
+        }
+
+        if (pthread_cond_timedwait(&dump_stop, &dump_lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&dump_lock);
+            dump_stats();
+            pthread_mutex_lock(&dump_lock);
+        }
+    }
+    pthread_mutex_unlock(&dump_lock);
+
+    return NULL;
+}
+
+int stats_start(unsigned int num_threads) {
+    struct bius_stats *new_stats = calloc(num_threads, sizeof(struct bius_stats));
+    int result;
+
+    if (new_stats == NULL)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&stats_lock);
+    free(thread_stats);
+    thread_stats = new_stats;
+    num_thread_stats = num_threads;
+    pthread_mutex_unlock(&stats_lock);
+
+    if (dump_interval_ms == 0)
+        return 0;
+
+    dump_running = true;
+    result = pthread_create(&dump_thread, NULL, dump_main, NULL);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(result));
+        dump_running = false;
+        return -result;
+    }
+
+    return 0;
+}
+
+void stats_stop() {
+    if (!dump_running)
+        return;
+
+    pthread_mutex_lock(&dump_lock);
+    dump_running = false;
+    pthread_cond_signal(&dump_stop);
+    pthread_mutex_unlock(&dump_lock);
+
+    pthread_join(dump_thread, NULL);
+    dump_stats();
+}
+
+struct bius_stats *stats_get_thread(unsigned int thread_index) {
+    return &thread_stats[thread_index];
+}
@@ -0,0 +1,51 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Each worker thread owns one struct bius_stats and is its only writer, so updates are plain
+ * relaxed stores. bius_get_stats reads them with relaxed loads without stopping the workers.
+ */
+
+int stats_start(unsigned int num_threads);
+void stats_stop();
+struct bius_stats *stats_get_thread(unsigned int thread_index);
+
+static inline uint64_t stats_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000lu + ts.tv_nsec;
+}
+
+static inline void stats_add(unsigned long *counter, unsigned long value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int histogram_bucket(unsigned long value) {
+    unsigned int exponent;
+    unsigned int bucket;
+
+    if (value < BIUS_HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    /* 3 is log2(BIUS_HISTOGRAM_SUB_BUCKETS) */
+    exponent = 63 - __builtin_clzl(value);
+    bucket = (exponent - 2) * BIUS_HISTOGRAM_SUB_BUCKETS + ((value >> (exponent - 3)) & (BIUS_HISTOGRAM_SUB_BUCKETS - 1));
+
+    return min(bucket, BIUS_HISTOGRAM_BUCKETS - 1);
+}
+
+static inline void histogram_record(struct bius_histogram *histogram, unsigned long value) {
+    stats_add(&histogram->count, 1);
+    stats_add(&histogram->sum, value);
+    stats_add(&histogram->buckets[histogram_bucket(value)], 1);
+    if (value > histogram->max)
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include "libbius.h"
+#include "utils.h"
+
+/*
+ * Striping over targets given as bius_operations. Stripe c of the device is stripe c / n of
+ * target c % n, so the share of a request on each target is one contiguous range there, strided
+ * in the caller's buffers. A request within one stripe is passed to its target directly; a larger
+ * one is split into a part per target, run by the worker threads of the targets except for one
+ * part run by the caller, and completes when all parts did.
+ */
+
+#define STRIPE_DEFAULT_STRIPE_SIZE (64 * 1024)
+#define STRIPE_DEFAULT_THREADS 4
+#define STRIPE_MAX_THREADS 64
+
+enum stripe_request_type {
+    STRIPE_READ,
+    STRIPE_WRITE,
+    STRIPE_DISCARD,
+    STRIPE_WRITE_ZEROES,
+    STRIPE_FLUSH,
+};
+
+struct stripe_request;
+struct stripe_target;
+
+struct stripe_part {
+    struct stripe_request *request;
+    /* NULL if the request does not touch the target */
+    struct stripe_target *target;
+    uint64_t offset;
+    size_t length;
+    struct iovec *iov;
+    int iovcnt;
+    struct stripe_part *next;
+};
+
+struct stripe_request {
+    enum stripe_request_type type;
+    /* First error of the parts */
+    blk_status_t result;
+    unsigned int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct stripe_part parts[BIUS_STRIPE_MAX_TARGETS];
+};
+
+struct stripe_target {
+    struct bius_operations ops;
+    /* Parts queued to the worker threads in FIFO order */
+    struct stripe_part *head;
+    struct stripe_part *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_t threads[STRIPE_MAX_THREADS];
+    unsigned int nr_threads;
+};
+
+static struct {
+    struct stripe_target targets[BIUS_STRIPE_MAX_TARGETS];
+    unsigned int nr_targets;
+    uint64_t stripe_size;
+    uint64_t disk_size;
+    bool stopping;
+    bool created;
+} stripe;
+
+static inline size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t length = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+
+    return length;
+}
+
+/* Batches of at most BIUS_MAX_IOV segments, or one call per segment without the vectored ops */
+static blk_status_t transfer(struct stripe_target *target, bool is_write, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    blk_status_t (*transfer_iov)(const struct iovec *, int, off64_t) = is_write ? target->ops.write_iov : target->ops.read_iov;
+    blk_status_t result = BLK_STS_OK;
+
+    while (iovcnt > 0 && result == BLK_STS_OK) {
+        int count = transfer_iov ? min(iovcnt, BIUS_MAX_IOV) : 1;
+
+        if (transfer_iov)
+            result = transfer_iov(iov, count, offset);
+        else if (is_write)
+            result = target->ops.write(iov->iov_base, offset, iov->iov_len);
+        else
+            result = target->ops.read(iov->iov_base, offset, iov->iov_len);
+
+        offset += iov_length(iov, count);
+        iov += count;
+        iovcnt -= count;
+    }
+
+    return result;
+}
+
+static blk_status_t execute(struct stripe_part *part) {
+    struct stripe_target *target = part->target;
+
+    switch (part->request->type) {
+        case STRIPE_READ:
+            return transfer(target, false, part->iov, part->iovcnt, part->offset);
+        case STRIPE_WRITE:
+            return transfer(target, true, part->iov, part->iovcnt, part->offset);
+        case STRIPE_DISCARD:
+            return target->ops.discard(part->offset, part->length);
+        case STRIPE_WRITE_ZEROES:
+            return target->ops.write_zeroes(part->offset, part->length);
+        case STRIPE_FLUSH:
+            return target->ops.flush ? target->ops.flush() : BLK_STS_OK;
+    }
+
+    return BLK_STS_IOERR;
+}
+
+static void complete_part(struct stripe_part *part, blk_status_t result) {
+    struct stripe_request *request = part->request;
+
+    pthread_mutex_lock(&request->lock);
+    if (request->result == BLK_STS_OK)
+        request->result = result;
+    if (--request->pending == 0)
+        pthread_cond_signal(&request->done);
+    pthread_mutex_unlock(&request->lock);
+}
+
+static void *target_main(void *arg) {
+    struct stripe_target *target = arg;
+
+    pthread_mutex_lock(&target->lock);
+    for (;;) {
+        struct stripe_part *part;
+
+        while (target->head == NULL) {
+            if (__atomic_load_n(&stripe.stopping, __ATOMIC_RELAXED))
+                goto out_unlock;
+            pthread_cond_wait(&target->wakeup, &target->lock);
+        }
+
+        part = target->head;
+        target->head = part->next;
+        if (target->head == NULL)
+            target->tail = NULL;
+        pthread_mutex_unlock(&target->lock);
+
+        complete_part(part, execute(part));
+        pthread_mutex_lock(&target->lock);
+    }
+
+out_unlock:
+    pthread_mutex_unlock(&target->lock);
+    return NULL;
+}
+
+static void queue_part(struct stripe_part *part) {
+    struct stripe_target *target = part->target;
+
+    part->next = NULL;
+    pthread_mutex_lock(&target->lock);
+    if (target->tail)
+        target->tail->next = part;
+    else
+        target->head = part;
+    target->tail = part;
+    pthread_cond_signal(&target->wakeup);
+    pthread_mutex_unlock(&target->lock);
+}
+
+/* Target of the stripe holding offset, and the offset there */
+static inline struct stripe_target *map_offset(uint64_t offset, uint64_t *out_target_offset) {
+    uint64_t chunk = offset / stripe.stripe_size;
+
+    *out_target_offset = chunk / stripe.nr_targets * stripe.stripe_size + offset % stripe.stripe_size;
+    return &stripe.targets[chunk % stripe.nr_targets];
+}
+
+/* Requests within one stripe, which small ones almost always are */
+static blk_status_t submit_direct(enum stripe_request_type type, const struct iovec *iov, int iovcnt, uint64_t offset, size_t length) {
+    uint64_t target_offset;
+    struct stripe_target *target = map_offset(offset, &target_offset);
+
+    switch (type) {
+        case STRIPE_READ:
+            if (iovcnt == 1)
+                return target->ops.read(iov->iov_base, target_offset, length);
+            return transfer(target, false, iov, iovcnt, target_offset);
+        case STRIPE_WRITE:
+            if (iovcnt == 1)
+                return target->ops.write(iov->iov_base, target_offset, length);
+            return transfer(target, true, iov, iovcnt, target_offset);
+        case STRIPE_DISCARD:
+            return target->ops.discard(target_offset, length);
+        case STRIPE_WRITE_ZEROES:
+            return target->ops.write_zeroes(target_offset, length);
+        default:
+            return BLK_STS_IOERR;
+    }
+}
+
+/*
+ * Assigns each stripe of the range to the part of its target. Segments of iov, if given, are
+ * appended to the parts, each of which gets max_iovcnt entries of iov_buffer.
+ */
+static void split(struct stripe_request *request, const struct iovec *iov, uint64_t offset, size_t length, struct iovec *iov_buffer, int max_iovcnt) {
+    const uint64_t end = offset + length;
+    size_t iov_offset = 0;
+
+    while (offset < end) {
+        uint64_t target_offset;
+        struct stripe_target *target = map_offset(offset, &target_offset);
+        struct stripe_part *part = &request->parts[target - stripe.targets];
+        size_t remaining = min(stripe.stripe_size - offset % stripe.stripe_size, end - offset);
+
+        if (part->target == NULL) {
+            part->target = target;
+            part->offset = target_offset;
+            part->iov = iov_buffer ? iov_buffer + (target - stripe.targets) * max_iovcnt : NULL;
+        }
+        part->length += remaining;
+        offset += remaining;
+
+        while (iov && remaining > 0) {
+            char *base = (char *)iov->iov_base + iov_offset;
+            size_t segment = min(iov->iov_len - iov_offset, remaining);
+            struct iovec *last = part->iovcnt > 0 ? &part->iov[part->iovcnt - 1] : NULL;
+
+            /* Stripes of one target are only adjacent in memory with a single target */
+            if (last && (char *)last->iov_base + last->iov_len == base) {
+                last->iov_len += segment;
+            } else {
+                part->iov[part->iovcnt].iov_base = base;
+                part->iov[part->iovcnt].iov_len = segment;
+                part->iovcnt++;
+            }
+
+            remaining -= segment;
+            iov_offset += segment;
+            if (iov_offset == iov->iov_len) {
+                iov++;
+                iov_offset = 0;
+            }
+        }
+    }
+}
+
+static blk_status_t submit(enum stripe_request_type type, const struct iovec *iov, int iovcnt, uint64_t offset, size_t length) {
+    struct stripe_request request = {
+        .type = type,
+        .result = BLK_STS_OK,
+    };
+    struct iovec *iov_buffer = NULL;
+    struct stripe_part *own = NULL;
+
+    if (type == STRIPE_FLUSH) {
+        for (unsigned int i = 0; i < stripe.nr_targets; i++)
+            request.parts[i].target = &stripe.targets[i];
+    } else {
+        uint64_t first = offset / stripe.stripe_size;
+        uint64_t last = (offset + length - 1) / stripe.stripe_size;
+        int max_iovcnt;
+
+        if (length == 0)
+            return BLK_STS_OK;
+        if (first == last)
+            return submit_direct(type, iov, iovcnt, offset, length);
+
+        /* Each segment boundary adds at most one entry to one part */
+        max_iovcnt = (last - first) / stripe.nr_targets + 1 + iovcnt;
+        if (iov) {
+            iov_buffer = malloc(sizeof(struct iovec) * max_iovcnt * stripe.nr_targets);
+            if (iov_buffer == NULL)
+                return BLK_STS_RESOURCE;
+        }
+        split(&request, iov, offset, length, iov_buffer, max_iovcnt);
+    }
+
+    pthread_mutex_init(&request.lock, NULL);
+    pthread_cond_init(&request.done, NULL);
+
+    for (unsigned int i = 0; i < stripe.nr_targets; i++) {
+        if (request.parts[i].target) {
+            request.parts[i].request = &request;
+            request.pending++;
+        }
+    }
+
+    for (unsigned int i = 0; i < stripe.nr_targets; i++) {
+        struct stripe_part *part = &request.parts[i];
+
+        if (part->target == NULL)
+            continue;
+        /* Queuing the previous part only now leaves the last one to the caller */
+        if (own)
+            queue_part(own);
+        own = part;
+    }
+
+    complete_part(own, execute(own));
+
+    pthread_mutex_lock(&request.lock);
+    while (request.pending > 0)
+        pthread_cond_wait(&request.done, &request.lock);
+    pthread_mutex_unlock(&request.lock);
+
+    pthread_mutex_destroy(&request.lock);
+    pthread_cond_destroy(&request.done);
+    free(iov_buffer);
+
+    return request.result;
+}
+
+static blk_status_t stripe_read(void *data, off64_t offset, size_t length) {
+    struct iovec iov = {data, length};
+
+    return submit(STRIPE_READ, &iov, 1, offset, length);
+}
+
+static blk_status_t stripe_write(const void *data, off64_t offset, size_t length) {
+    struct iovec iov = {(void *)data, length};
+
+    return submit(STRIPE_WRITE, &iov, 1, offset, length);
+}
+
+static blk_status_t stripe_read_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    return submit(STRIPE_READ, iov, iovcnt, offset, iov_length(iov, iovcnt));
+}
+
+static blk_status_t stripe_write_iov(const struct iovec *iov, int iovcnt, off64_t offset) {
+    return submit(STRIPE_WRITE, iov, iovcnt, offset, iov_length(iov, iovcnt));
+}
+
+static blk_status_t stripe_discard(off64_t offset, size_t length) {
+    return submit(STRIPE_DISCARD, NULL, 0, offset, length);
+}
+
+static blk_status_t stripe_write_zeroes(off64_t offset, size_t length) {
+    return submit(STRIPE_WRITE_ZEROES, NULL, 0, offset, length);
+}
+
+static blk_status_t stripe_flush() {
+    return submit(STRIPE_FLUSH, NULL, 0, 0, 0);
+}
+
+static void stop_threads(unsigned int nr_targets) {
+    __atomic_store_n(&stripe.stopping, true, __ATOMIC_RELAXED);
+
+    for (unsigned int i = 0; i < nr_targets; i++) {
+        struct stripe_target *target = &stripe.targets[i];
+
+        pthread_mutex_lock(&target->lock);
+        pthread_cond_broadcast(&target->wakeup);
+        pthread_mutex_unlock(&target->lock);
+        for (unsigned int j = 0; j < target->nr_threads; j++)
+            pthread_join(target->threads[j], NULL);
+    }
+}
+
+static void free_targets(unsigned int nr_targets) {
+    for (unsigned int i = 0; i < nr_targets; i++) {
+        pthread_mutex_destroy(&stripe.targets[i].lock);
+        pthread_cond_destroy(&stripe.targets[i].wakeup);
+    }
+}
+
+int bius_stripe_create(const struct bius_operations *targets, unsigned int nr_targets, const struct bius_stripe_options *options, struct bius_operations *out_operations, unsigned long *out_disk_size) {
+    const unsigned int nr_threads = options->threads_per_target ? options->threads_per_target : STRIPE_DEFAULT_THREADS;
+    const uint64_t stripe_size = options->stripe_size ? options->stripe_size : STRIPE_DEFAULT_STRIPE_SIZE;
+    const uint64_t rows = options->target_size / stripe_size;
+    bool discard = true;
+    bool write_zeroes = true;
+    unsigned int initialized;
+    int result = 0;
+
+    if (stripe.created)
+        return -EBUSY;
+    if (nr_targets == 0 || nr_targets > BIUS_STRIPE_MAX_TARGETS || nr_threads > STRIPE_MAX_THREADS)
+        return -EINVAL;
+    if (stripe_size % SECTOR_SIZE != 0 || rows == 0)
+        return -EINVAL;
+    for (unsigned int i = 0; i < nr_targets; i++) {
+        if (targets[i].read == NULL || targets[i].write == NULL)
+            return -EINVAL;
+        discard = discard && targets[i].discard;
+        write_zeroes = write_zeroes && targets[i].write_zeroes;
+    }
+
+    memset(&stripe, 0, sizeof(stripe));
+    stripe.nr_targets = nr_targets;
+    stripe.stripe_size = stripe_size;
+    /* The last partial stripe of each target is not used */
+    stripe.disk_size = rows * stripe_size * nr_targets;
+
+    for (initialized = 0; initialized < nr_targets; initialized++) {
+        struct stripe_target *target = &stripe.targets[initialized];
+
+        memcpy(&target->ops, &targets[initialized], sizeof(struct bius_operations));
+        pthread_mutex_init(&target->lock, NULL);
+        pthread_cond_init(&target->wakeup, NULL);
+    }
+
+    for (unsigned int i = 0; i < nr_targets; i++) {
+        struct stripe_target *target = &stripe.targets[i];
+
+        for (; target->nr_threads < nr_threads; target->nr_threads++) {
+            result = pthread_create(&target->threads[target->nr_threads], NULL, target_main, target);
+            if (result != 0) {
+                result = -result;
+                goto out_stop;
+            }
+        }
+    }
+
+    memset(out_operations, 0, sizeof(struct bius_operations));
+    out_operations->read = stripe_read;
+    out_operations->write = stripe_write;
+    out_operations->read_iov = stripe_read_iov;
+    out_operations->write_iov = stripe_write_iov;
+    out_operations->flush = stripe_flush;
+    if (discard)
+        out_operations->discard = stripe_discard;
+    if (write_zeroes)
+        out_operations->write_zeroes = stripe_write_zeroes;
+    *out_disk_size = stripe.disk_size;
+    stripe.created = true;
+
+    return 0;
+
+out_stop:
+    stop_threads(nr_targets);
+    free_targets(initialized);
+    return result;
+}
+
+int bius_stripe_destroy() {
+    if (!stripe.created)
+        return -EINVAL;
+
+    /* Every part was waited for by its caller, the queues are empty */
+    stop_threads(stripe.nr_targets);
+    free_targets(stripe.nr_targets);
+    stripe.created = false;
+
+    return 0;
+}
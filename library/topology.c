@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include "topology.h"
+#include "utils.h"
+
+#define MAX_NODES 1024
+
+/* Reads a sysfs id list such as "0-3,8-11". Returns the number of ids read, or -1 on error. */
+static int read_id_list(const char *path, int *ids, int max_ids) {
+    char buffer[4096];
+    char *cursor = buffer;
+    int num_ids = 0;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Opening %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fgets(buffer, sizeof(buffer), file) == NULL) {
+        fprintf(stderr, "Reading %s failed\n", path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    while (*cursor != '\0' && *cursor != '\n') {
+        char *end;
+        long first = strtol(cursor, &end, 10);
+        long last = first;
+
+        if (end == cursor)
+            return -1;
+        if (*end == '-') {
+            cursor = end + 1;
+            last = strtol(cursor, &end, 10);
+        }
+
+        for (long id = first; id <= last && num_ids < max_ids; id++)
+            ids[num_ids++] = id;
+
+        cursor = (*end == ',') ? end + 1 : end;
+    }
+
+    return num_ids;
+}
+
+static int get_node_cpus(int node, cpu_set_t *out_cpus) {
+    char path[64];
+    int cpus[CPU_SETSIZE];
+    int num_cpus;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    num_cpus = read_id_list(path, cpus, CPU_SETSIZE);
+    if (num_cpus <= 0)
+        return -1;
+
+    CPU_ZERO(out_cpus);
+    for (int i = 0; i < num_cpus; i++)
+        CPU_SET(cpus[i], out_cpus);
+
+    return 0;
+}
+
+/*
+ * Pins the calling thread according to options->thread_pinning. Memory is allocated on the local
+ * node on first touch, so buffers allocated by the thread after this call stay on its node, and
+ * the kernel attaches the connection opened after this call to the queue of that node.
+ */
+int pin_worker_thread(const struct bius_block_device_options *options, unsigned int thread_index) {
+    int node = options->numa_node;
+    cpu_set_t cpus;
+    int result;
+
+    switch (options->thread_pinning) {
+        case BIUS_PIN_NONE:
+            return 0;
+        case BIUS_PIN_NODE:
+            break;
+        case BIUS_PIN_SPREAD: {
+            int nodes[MAX_NODES];
+            int num_nodes = read_id_list("/sys/devices/system/node/online", nodes, MAX_NODES);
+
+            if (num_nodes <= 0)
+                return -EINVAL;
+            node = nodes[thread_index % num_nodes];
+            break;
+        }
+        default:
+            fprintf(stderr, "Unknown thread pinning: %d\n", options->thread_pinning);
+            return -EINVAL;
+    }
+
+    if (get_node_cpus(node, &cpus) < 0)
+        return -EINVAL;
+
+    result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (result != 0) {
+        fprintf(stderr, "pthread_setaffinity_np failed: %s\n", strerror(result));
+        return -result;
+    }
+    printd("thread %u pinned to node %d\n", thread_index, node);
+
+    return 0;
+}
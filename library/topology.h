@@ -0,0 +1,8 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <bius/command_header.h>
+
+int pin_worker_thread(const struct bius_block_device_options *options, unsigned int thread_index);
+
+#endif
@@ -1,6 +1,14 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 #ifdef DEBUG
 #define printd(format, ...) fprintf(stderr, format, ##__VA_ARGS__)
 #else
@@ -11,4 +19,121 @@ static inline int printd(const char *format, ...) {
 
 #define min(x, y) ((x) > (y) ? (y) : (x))
 
+/* Locks hashed from block numbers, a lock covering blocks_per_lock consecutive blocks */
+#define BLOCK_NUM_LOCKS 1024
+
+struct block_locks {
+    unsigned int blocks_per_lock;
+    pthread_rwlock_t locks[BLOCK_NUM_LOCKS];
+};
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000lu + ts.tv_nsec;
+}
+
+static inline void add_stat(unsigned long *counter, long value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/* Reads beyond the end of file give zeros */
+static inline int pread_full(int fd, char *data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t result = pread(fd, data, length, offset);
+
+        if (result < 0)
+            return -errno;
+        if (result == 0) {
+            memset(data, 0, length);
+            return 0;
+        }
+
+        data += result;
+        offset += result;
+        length -= result;
+    }
+
+    return 0;
+}
+
+static inline int pwrite_full(int fd, const char *data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t result = pwrite(fd, data, length, offset);
+
+        if (result <= 0)
+            return result < 0 ? -errno : -EIO;
+
+        data += result;
+        offset += result;
+        length -= result;
+    }
+
+    return 0;
+}
+
+static inline void init_block_locks(struct block_locks *locks, unsigned int blocks_per_lock) {
+    locks->blocks_per_lock = blocks_per_lock;
+    for (int i = 0; i < BLOCK_NUM_LOCKS; i++)
+        pthread_rwlock_init(&locks->locks[i], NULL);
+}
+
+static inline void destroy_block_locks(struct block_locks *locks) {
+    for (int i = 0; i < BLOCK_NUM_LOCKS; i++)
+        pthread_rwlock_destroy(&locks->locks[i]);
+}
+
+/*
+ * Locks of the blocks in [first, last] as at most two ranges of lock indexes, in the order locks
+ * are taken: ascending, so that requests locking several never deadlock.
+ */
+static inline int lock_ranges(const struct block_locks *locks, uint64_t first, uint64_t last, unsigned int ranges[2][2]) {
+    const uint64_t first_lock = first / locks->blocks_per_lock;
+    const uint64_t last_lock = last / locks->blocks_per_lock;
+    const unsigned int start = first_lock % BLOCK_NUM_LOCKS;
+    const unsigned int end = last_lock % BLOCK_NUM_LOCKS;
+
+    if (last_lock - first_lock >= BLOCK_NUM_LOCKS - 1) {
+        ranges[0][0] = 0;
+        ranges[0][1] = BLOCK_NUM_LOCKS - 1;
+        return 1;
+    }
+    if (start <= end) {
+        ranges[0][0] = start;
+        ranges[0][1] = end;
+        return 1;
+    }
+
+    /* Wrapping around */
+    ranges[0][0] = 0;
+    ranges[0][1] = end;
+    ranges[1][0] = start;
+    ranges[1][1] = BLOCK_NUM_LOCKS - 1;
+    return 2;
+}
+
+static inline void lock_blocks(struct block_locks *locks, uint64_t first, uint64_t last, bool exclusive) {
+    unsigned int ranges[2][2];
+    const int nr_ranges = lock_ranges(locks, first, last, ranges);
+
+    for (int i = 0; i < nr_ranges; i++) {
+        for (unsigned int lock = ranges[i][0]; lock <= ranges[i][1]; lock++) {
+            if (exclusive)
+                pthread_rwlock_wrlock(&locks->locks[lock]);
+            else
+                pthread_rwlock_rdlock(&locks->locks[lock]);
+        }
+    }
+}
+
+static inline void unlock_blocks(struct block_locks *locks, uint64_t first, uint64_t last) {
+    unsigned int ranges[2][2];
+    const int nr_ranges = lock_ranges(locks, first, last, ranges);
+
+    for (int i = 0; i < nr_ranges; i++) {
+        for (unsigned int lock = ranges[i][0]; lock <= ranges[i][1]; lock++)
+            pthread_rwlock_unlock(&locks->locks[lock]);
+    }
+}
+
 #endif
@@ -0,0 +1,967 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "libbius.h"
+#include "crc32c.h"
+#include "utils.h"
+
+/*
+ * Write-ahead log. The log file holds a superblock, then a ring of records, each a header sector
+ * followed by whole blocks of the device. Positions in the log only grow, the ring offset of a
+ * position being its remainder by the ring size; a record never wraps, the end of the ring being
+ * skipped instead. Headers carry their position, so that a record left from an earlier turn of the
+ * ring is not taken for a new one. They also carry the epoch of the open which wrote them: replay
+ * stops at the first bad record and the open writes from there, so a record left past it may follow
+ * a new one exactly, and only records of that open are taken from there.
+ *
+ * Small writes reserve their record under the locks of their blocks, so that records of a block
+ * are in the order of its writes, write it, point the index at it, and wait for a sync of the log
+ * covering every record up to theirs. The first of them to find no sync running starts one, and
+ * the others wait for it or the next.
+ *
+ * The checkpointer copies the blocks still pointed at by the index to the backend, flushes it,
+ * advances the tail in the superblock, and only then drops the index entries. Other writes go to
+ * the backend directly once no block they touch is in the log, so that replaying the log after a
+ * crash never undoes them.
+ */
+
+#define WAL_MAGIC 0x314c415753554942lu /* "BIUSWAL1" */
+#define WAL_RECORD_MAGIC 0x4345525753554942lu /* "BIUSWREC" */
+#define WAL_VERSION 1
+#define WAL_BLOCK_SIZE BIUS_WAL_BLOCK_SIZE
+#define WAL_SUPERBLOCK_SIZE 4096
+#define WAL_HEADER_SIZE SECTOR_SIZE
+#define WAL_DEFAULT_LOG_SIZE (64lu * 1024 * 1024)
+#define WAL_DEFAULT_SMALL_WRITE_SIZE (64 * 1024)
+#define WAL_LOCK_BLOCKS 16
+/* Idle records are checkpointed after this, and at once past half of the log */
+#define WAL_CHECKPOINT_INTERVAL_MS 1000
+
+struct wal_superblock {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t disk_size;
+    uint64_t log_size;
+    /* Position of the first record not checkpointed */
+    uint64_t tail;
+    /* Of the last open, each one incrementing it, and where its records start */
+    uint64_t epoch;
+    uint64_t epoch_start;
+};
+
+struct wal_record {
+    uint64_t magic;
+    uint64_t position;
+    uint64_t epoch;
+    uint64_t first_block;
+    uint32_t nr_blocks;
+    /* CRC32C of the header with this field 0, then of the blocks */
+    uint32_t checksum;
+};
+
+/* Records in the log, in order */
+struct wal_descriptor {
+    uint64_t position;
+    uint64_t first_block;
+    uint32_t nr_blocks;
+    /* Written to the log file and indexed */
+    bool written;
+};
+
+/* Position of the data of a block in the log, 0 for none */
+struct wal_index_entry {
+    uint64_t block;
+    uint64_t position;
+};
+
+static struct {
+    struct bius_operations backend;
+    int fd;
+    uint64_t disk_size;
+    uint64_t log_size;
+    uint64_t epoch;
+    uint64_t epoch_start;
+    size_t small_write_size;
+    size_t max_record_size;
+    /* Reads and the checkpointer hold them shared, writes exclusive */
+    struct block_locks block_locks;
+
+    pthread_mutex_t index_lock;
+    struct wal_index_entry *index;
+    unsigned int index_shift;
+    uint64_t index_mask;
+    uint64_t nr_indexed;
+
+    /* Guards the positions and descriptors */
+    pthread_mutex_t log_lock;
+    uint64_t head;
+    uint64_t tail;
+    /* End of the records written in order from the tail */
+    uint64_t written_position;
+    struct wal_descriptor *descriptors;
+    uint64_t nr_descriptors;
+    /* Oldest, first not written, and next, counted from 0 and taken modulo nr_descriptors */
+    uint64_t front;
+    uint64_t unwritten;
+    uint64_t back;
+    unsigned int space_waiters;
+    /* Position the tail must reach for a direct write to proceed */
+    uint64_t drain_position;
+    /* Signalled when the tail advances */
+    pthread_cond_t space;
+    /* Signalled when written_position advances */
+    pthread_cond_t written;
+    pthread_cond_t checkpoint_wakeup;
+    pthread_t checkpointer;
+    bool stopping;
+
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_done;
+    uint64_t synced_position;
+    bool syncing;
+
+    pthread_key_t record_key;
+    /* Direct writes not flushed yet */
+    bool backend_dirty;
+    /* After a failure to write the log, the records following it may not be replayed */
+    bool failed;
+    struct bius_wal_stats stats;
+    bool created;
+} wal;
+
+static inline bool has_failed() {
+    return __atomic_load_n(&wal.failed, __ATOMIC_RELAXED);
+}
+
+static void fail(const char *what, int error) {
+    if (!__atomic_exchange_n(&wal.failed, true, __ATOMIC_RELAXED))
+        fprintf(stderr, "wal: %s failed: %s, writes fail from now on\n", what, strerror(-error));
+
+    /* Nobody waits for what will not happen */
+    pthread_mutex_lock(&wal.log_lock);
+    pthread_cond_broadcast(&wal.space);
+    pthread_cond_broadcast(&wal.written);
+    pthread_mutex_unlock(&wal.log_lock);
+    pthread_mutex_lock(&wal.commit_lock);
+    pthread_cond_broadcast(&wal.commit_done);
+    pthread_mutex_unlock(&wal.commit_lock);
+}
+
+static inline uint64_t file_offset(uint64_t position) {
+    return WAL_SUPERBLOCK_SIZE + position % wal.log_size;
+}
+
+static inline size_t record_size(uint32_t nr_blocks) {
+    return WAL_HEADER_SIZE + (size_t)nr_blocks * WAL_BLOCK_SIZE;
+}
+
+static inline struct wal_descriptor *descriptor(uint64_t index) {
+    return &wal.descriptors[index % wal.nr_descriptors];
+}
+
+/* Open addressing with linear probing, holding at most half as many entries as slots */
+static inline uint64_t index_slot(uint64_t block) {
+    return (block * 0x9e3779b97f4a7c15lu) >> wal.index_shift;
+}
+
+static uint64_t index_get(uint64_t block) {
+    uint64_t position = 0;
+
+    pthread_mutex_lock(&wal.index_lock);
+    for (uint64_t slot = index_slot(block); wal.index[slot].position != 0; slot = (slot + 1) & wal.index_mask) {
+        if (wal.index[slot].block == block) {
+            position = wal.index[slot].position;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wal.index_lock);
+
+    return position;
+}
+
+static void index_set(uint64_t block, uint64_t position) {
+    uint64_t slot;
+
+    pthread_mutex_lock(&wal.index_lock);
+    for (slot = index_slot(block); wal.index[slot].position != 0; slot = (slot + 1) & wal.index_mask) {
+        if (wal.index[slot].block == block)
+            break;
+    }
+    if (wal.index[slot].position == 0)
+        __atomic_store_n(&wal.nr_indexed, wal.nr_indexed + 1, __ATOMIC_RELAXED);
+    wal.index[slot].block = block;
+    wal.index[slot].position = position;
+    pthread_mutex_unlock(&wal.index_lock);
+}
+
+/* Removes the entry of block if it still points at position */
+static void index_remove(uint64_t block, uint64_t position) {
+    uint64_t slot, next;
+
+    pthread_mutex_lock(&wal.index_lock);
+    for (slot = index_slot(block); wal.index[slot].position != 0; slot = (slot + 1) & wal.index_mask) {
+        if (wal.index[slot].block == block)
+            break;
+    }
+    if (wal.index[slot].position != position)
+        goto out;
+
+    /* Moves back the following entries which could not be in their slot because of this one */
+    for (next = (slot + 1) & wal.index_mask; wal.index[next].position != 0; next = (next + 1) & wal.index_mask) {
+        const uint64_t home = index_slot(wal.index[next].block);
+        const bool stays = slot <= next ? slot < home && home <= next : slot < home || home <= next;
+
+        if (stays)
+            continue;
+        wal.index[slot] = wal.index[next];
+        slot = next;
+    }
+    wal.index[slot].position = 0;
+    __atomic_store_n(&wal.nr_indexed, wal.nr_indexed - 1, __ATOMIC_RELAXED);
+
+out:
+    pthread_mutex_unlock(&wal.index_lock);
+}
+
+static inline bool any_logged(uint64_t first, uint64_t last) {
+    if (__atomic_load_n(&wal.nr_indexed, __ATOMIC_RELAXED) == 0)
+        return false;
+
+    for (uint64_t block = first; block <= last; block++) {
+        if (index_get(block) != 0)
+            return true;
+    }
+
+    return false;
+}
+
+static char *get_record_buffer() {
+    char *buffer = pthread_getspecific(wal.record_key);
+
+    if (buffer == NULL) {
+        buffer = malloc(wal.max_record_size);
+        if (buffer && pthread_setspecific(wal.record_key, buffer) != 0) {
+            free(buffer);
+            buffer = NULL;
+        }
+    }
+
+    return buffer;
+}
+
+/* Reads with the locks of the blocks held, blocks in the log from there */
+static blk_status_t read_locked(char *data, uint64_t offset, size_t length) {
+    const uint64_t end = offset + length;
+    uint64_t backend_start = offset;
+
+    if (__atomic_load_n(&wal.nr_indexed, __ATOMIC_RELAXED) == 0)
+        return wal.backend.read(data, offset, length);
+
+    for (uint64_t current = offset; current < end;) {
+        const uint64_t block = current / WAL_BLOCK_SIZE;
+        const uint64_t segment_end = min(end, (block + 1) * WAL_BLOCK_SIZE);
+        const uint64_t position = index_get(block);
+
+        if (position != 0) {
+            if (backend_start < current) {
+                blk_status_t result = wal.backend.read(data + (backend_start - offset), backend_start, current - backend_start);
+
+                if (result != BLK_STS_OK)
+                    return result;
+            }
+            if (pread_full(wal.fd, data + (current - offset), segment_end - current, file_offset(position) + current % WAL_BLOCK_SIZE) < 0)
+                return BLK_STS_IOERR;
+            add_stat(&wal.stats.log_read_blocks, 1);
+            backend_start = segment_end;
+        }
+
+        current = segment_end;
+    }
+
+    if (backend_start < end)
+        return wal.backend.read(data + (backend_start - offset), backend_start, end - backend_start);
+
+    return BLK_STS_OK;
+}
+
+static blk_status_t wal_read(void *data, off64_t offset, size_t length) {
+    const uint64_t first = offset / WAL_BLOCK_SIZE;
+    const uint64_t last = (offset + length - 1) / WAL_BLOCK_SIZE;
+    blk_status_t result;
+
+    lock_blocks(&wal.block_locks, first, last, false);
+    result = read_locked(data, offset, length);
+    unlock_blocks(&wal.block_locks, first, last);
+
+    return result;
+}
+
+/* Where a record of size bytes would go, or UINT64_MAX without room for it. With log_lock held. */
+static uint64_t next_position(size_t size) {
+    uint64_t position = wal.head;
+
+    if (position % wal.log_size + size > wal.log_size)
+        position += wal.log_size - position % wal.log_size;
+    if (position + size - wal.tail > wal.log_size || wal.back - wal.front == wal.nr_descriptors)
+        return UINT64_MAX;
+
+    return position;
+}
+
+static inline bool checkpoint_urgent() {
+    return wal.space_waiters > 0 || wal.drain_position > wal.tail || wal.head - wal.tail > wal.log_size / 2;
+}
+
+/* Waits for the log to have room for size bytes, with no block lock held as the checkpointer takes them */
+static int wait_space(size_t size) {
+    pthread_mutex_lock(&wal.log_lock);
+    while (next_position(size) == UINT64_MAX && !has_failed()) {
+        wal.space_waiters++;
+        add_stat(&wal.stats.space_waits, 1);
+        pthread_cond_signal(&wal.checkpoint_wakeup);
+        pthread_cond_wait(&wal.space, &wal.log_lock);
+        wal.space_waiters--;
+    }
+    pthread_mutex_unlock(&wal.log_lock);
+
+    return has_failed() ? -EIO : 0;
+}
+
+/* Returns the descriptor index of a new record, or UINT64_MAX if another writer took the room */
+static uint64_t reserve(uint64_t first_block, uint32_t nr_blocks, uint64_t *out_position) {
+    uint64_t index = UINT64_MAX;
+    uint64_t position;
+
+    pthread_mutex_lock(&wal.log_lock);
+    position = next_position(record_size(nr_blocks));
+    if (position != UINT64_MAX) {
+        index = wal.back++;
+        descriptor(index)->position = position;
+        descriptor(index)->first_block = first_block;
+        descriptor(index)->nr_blocks = nr_blocks;
+        descriptor(index)->written = false;
+        wal.head = position + record_size(nr_blocks);
+        *out_position = position;
+    }
+    pthread_mutex_unlock(&wal.log_lock);
+
+    return index;
+}
+
+static void complete(uint64_t index) {
+    uint64_t unwritten;
+
+    pthread_mutex_lock(&wal.log_lock);
+    descriptor(index)->written = true;
+    unwritten = wal.unwritten;
+    for (; wal.unwritten < wal.back && descriptor(wal.unwritten)->written; wal.unwritten++)
+        wal.written_position = descriptor(wal.unwritten)->position + record_size(descriptor(wal.unwritten)->nr_blocks);
+    if (wal.unwritten != unwritten)
+        pthread_cond_broadcast(&wal.written);
+    if (checkpoint_urgent())
+        pthread_cond_signal(&wal.checkpoint_wakeup);
+    pthread_mutex_unlock(&wal.log_lock);
+}
+
+/*
+ * Waits for the log to be written, then synced, up to end. One waiter syncs while the others
+ * wait, and the writes done meanwhile are all covered by the next sync.
+ */
+static int commit(uint64_t end) {
+    int result = 0;
+
+    /* A sync started before the records up to end are written would not cover them */
+    pthread_mutex_lock(&wal.log_lock);
+    while (wal.written_position < end && !has_failed())
+        pthread_cond_wait(&wal.written, &wal.log_lock);
+    pthread_mutex_unlock(&wal.log_lock);
+
+    pthread_mutex_lock(&wal.commit_lock);
+    while (wal.synced_position < end && !has_failed()) {
+        uint64_t target;
+
+        if (wal.syncing) {
+            pthread_cond_wait(&wal.commit_done, &wal.commit_lock);
+            continue;
+        }
+
+        wal.syncing = true;
+        pthread_mutex_unlock(&wal.commit_lock);
+
+        pthread_mutex_lock(&wal.log_lock);
+        target = wal.written_position;
+        pthread_mutex_unlock(&wal.log_lock);
+        result = fdatasync(wal.fd) < 0 ? -errno : 0;
+        add_stat(&wal.stats.commits, 1);
+
+        pthread_mutex_lock(&wal.commit_lock);
+        wal.syncing = false;
+        if (result == 0 && target > wal.synced_position)
+            wal.synced_position = target;
+        pthread_cond_broadcast(&wal.commit_done);
+        if (result < 0)
+            break;
+    }
+    pthread_mutex_unlock(&wal.commit_lock);
+
+    if (result < 0)
+        fail("syncing the log", result);
+
+    return has_failed() ? -EIO : 0;
+}
+
+/* Reads the blocks of the record partly written, with their locks held */
+static blk_status_t merge_partial(char *blocks, uint64_t first, uint64_t last, off64_t offset, size_t length) {
+    blk_status_t result = BLK_STS_OK;
+
+    if (offset % WAL_BLOCK_SIZE != 0 || length < WAL_BLOCK_SIZE)
+        result = read_locked(blocks, first * WAL_BLOCK_SIZE, WAL_BLOCK_SIZE);
+    if (result == BLK_STS_OK && (offset + length) % WAL_BLOCK_SIZE != 0 && last != first)
+        result = read_locked(blocks + (last - first) * WAL_BLOCK_SIZE, last * WAL_BLOCK_SIZE, WAL_BLOCK_SIZE);
+
+    return result;
+}
+
+static blk_status_t log_write(const void *data, off64_t offset, size_t length) {
+    const uint64_t first = offset / WAL_BLOCK_SIZE;
+    const uint64_t last = (offset + length - 1) / WAL_BLOCK_SIZE;
+    const uint32_t nr_blocks = last - first + 1;
+    const size_t size = record_size(nr_blocks);
+    char *record = get_record_buffer();
+    char *blocks = record + WAL_HEADER_SIZE;
+    struct wal_record *header = (struct wal_record *)record;
+    uint64_t position, index;
+    blk_status_t result;
+    int error;
+
+    if (record == NULL)
+        return BLK_STS_RESOURCE;
+
+    for (;;) {
+        if (wait_space(size) < 0)
+            return BLK_STS_IOERR;
+
+        lock_blocks(&wal.block_locks, first, last, true);
+        result = merge_partial(blocks, first, last, offset, length);
+        if (result != BLK_STS_OK) {
+            unlock_blocks(&wal.block_locks, first, last);
+            return result;
+        }
+
+        index = reserve(first, nr_blocks, &position);
+        if (index != UINT64_MAX)
+            break;
+        unlock_blocks(&wal.block_locks, first, last);
+    }
+
+    memcpy(blocks + offset % WAL_BLOCK_SIZE, data, length);
+    memset(record, 0, WAL_HEADER_SIZE);
+    header->magic = WAL_RECORD_MAGIC;
+    header->position = position;
+    header->epoch = wal.epoch;
+    header->first_block = first;
+    header->nr_blocks = nr_blocks;
+    header->checksum = crc32c(crc32c(0, header, sizeof(*header)), blocks, size - WAL_HEADER_SIZE);
+
+    error = pwrite_full(wal.fd, record, size, file_offset(position));
+    if (error == 0) {
+        for (uint32_t i = 0; i < nr_blocks; i++)
+            index_set(first + i, position + WAL_HEADER_SIZE + i * WAL_BLOCK_SIZE);
+    }
+    complete(index);
+    unlock_blocks(&wal.block_locks, first, last);
+
+    if (error < 0) {
+        fail("writing the log", error);
+        return BLK_STS_IOERR;
+    }
+
+    add_stat(&wal.stats.logged_writes, 1);
+    return commit(position + size) < 0 ? BLK_STS_IOERR : BLK_STS_OK;
+}
+
+/* Waits for every record before the current head to be checkpointed */
+static int drain() {
+    pthread_mutex_lock(&wal.log_lock);
+    const uint64_t target = wal.head;
+
+    if (target > wal.drain_position)
+        wal.drain_position = target;
+    pthread_cond_signal(&wal.checkpoint_wakeup);
+    while (wal.tail < target && !has_failed())
+        pthread_cond_wait(&wal.space, &wal.log_lock);
+    pthread_mutex_unlock(&wal.log_lock);
+
+    return has_failed() ? -EIO : 0;
+}
+
+enum modification {
+    MODIFY_WRITE,
+    MODIFY_WRITE_ZEROES,
+    MODIFY_DISCARD,
+};
+
+/* Goes to the backend once none of the blocks is in the log, and is durable after a flush */
+static blk_status_t modify_direct(const void *data, off64_t offset, size_t length, enum modification modification) {
+    const uint64_t first = offset / WAL_BLOCK_SIZE;
+    const uint64_t last = (offset + length - 1) / WAL_BLOCK_SIZE;
+    blk_status_t result;
+
+    for (;;) {
+        lock_blocks(&wal.block_locks, first, last, true);
+        if (!any_logged(first, last))
+            break;
+        unlock_blocks(&wal.block_locks, first, last);
+
+        add_stat(&wal.stats.drains, 1);
+        if (drain() < 0)
+            return BLK_STS_IOERR;
+    }
+
+    if (modification == MODIFY_WRITE)
+        result = wal.backend.write(data, offset, length);
+    else if (modification == MODIFY_WRITE_ZEROES)
+        result = wal.backend.write_zeroes(offset, length);
+    else
+        result = wal.backend.discard(offset, length);
+    /* Only once done, so that a flush clearing it covers it */
+    __atomic_store_n(&wal.backend_dirty, true, __ATOMIC_RELAXED);
+    unlock_blocks(&wal.block_locks, first, last);
+
+    add_stat(&wal.stats.direct_writes, 1);
+    return result;
+}
+
+static blk_status_t wal_write(const void *data, off64_t offset, size_t length) {
+    if (has_failed())
+        return BLK_STS_IOERR;
+    if (length <= wal.small_write_size)
+        return log_write(data, offset, length);
+
+    return modify_direct(data, offset, length, MODIFY_WRITE);
+}
+
+static blk_status_t wal_write_zeroes(off64_t offset, size_t length) {
+    if (has_failed())
+        return BLK_STS_IOERR;
+
+    return modify_direct(NULL, offset, length, MODIFY_WRITE_ZEROES);
+}
+
+static blk_status_t wal_discard(off64_t offset, size_t length) {
+    if (has_failed())
+        return BLK_STS_IOERR;
+
+    return modify_direct(NULL, offset, length, MODIFY_DISCARD);
+}
+
+/* Logged writes are durable when they complete, only direct ones need the backend flushed */
+static blk_status_t wal_flush() {
+    blk_status_t result = BLK_STS_OK;
+
+    if (has_failed())
+        return BLK_STS_IOERR;
+
+    if (__atomic_exchange_n(&wal.backend_dirty, false, __ATOMIC_RELAXED) && wal.backend.flush) {
+        result = wal.backend.flush();
+        if (result != BLK_STS_OK)
+            __atomic_store_n(&wal.backend_dirty, true, __ATOMIC_RELAXED);
+    }
+
+    return result;
+}
+
+static int write_superblock(uint64_t tail) {
+    struct wal_superblock superblock = {
+        .magic = WAL_MAGIC,
+        .version = WAL_VERSION,
+        .block_size = WAL_BLOCK_SIZE,
+        .disk_size = wal.disk_size,
+        .log_size = wal.log_size,
+        .tail = tail,
+        .epoch = wal.epoch,
+        .epoch_start = wal.epoch_start,
+    };
+    int result = pwrite_full(wal.fd, (const char *)&superblock, sizeof(superblock), 0);
+
+    if (result < 0)
+        return result;
+
+    return fdatasync(wal.fd) < 0 ? -errno : 0;
+}
+
+/* Copies the blocks of a record still pointed at by the index to the backend */
+static blk_status_t copy_home(const struct wal_descriptor *record, char *buffer, unsigned long *out_copied) {
+    const uint64_t last = record->first_block + record->nr_blocks - 1;
+    const uint64_t data_position = record->position + WAL_HEADER_SIZE;
+    blk_status_t result = BLK_STS_OK;
+    bool loaded = false;
+    uint32_t run = 0;
+
+    lock_blocks(&wal.block_locks, record->first_block, last, false);
+    for (uint32_t i = 0; i <= record->nr_blocks && result == BLK_STS_OK; i++) {
+        const bool live = i < record->nr_blocks && index_get(record->first_block + i) == data_position + (uint64_t)i * WAL_BLOCK_SIZE;
+
+        if (live && !loaded) {
+            if (pread_full(wal.fd, buffer, (size_t)record->nr_blocks * WAL_BLOCK_SIZE, file_offset(data_position)) < 0) {
+                result = BLK_STS_IOERR;
+                break;
+            }
+            loaded = true;
+        }
+        if (live) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            const uint32_t start = i - run;
+
+            result = wal.backend.write(buffer + (size_t)start * WAL_BLOCK_SIZE, (record->first_block + start) * WAL_BLOCK_SIZE, (size_t)run * WAL_BLOCK_SIZE);
+            *out_copied += run;
+            run = 0;
+        }
+    }
+    unlock_blocks(&wal.block_locks, record->first_block, last);
+
+    return result;
+}
+
+/* Checkpoints the records written so far, and frees their room in the log */
+static int checkpoint(char *buffer) {
+    unsigned long copied = 0;
+    uint64_t front, end, tail;
+    blk_status_t status = BLK_STS_OK;
+    int result;
+
+    pthread_mutex_lock(&wal.log_lock);
+    front = wal.front;
+    end = wal.unwritten;
+    tail = end < wal.back ? descriptor(end)->position : wal.head;
+    pthread_mutex_unlock(&wal.log_lock);
+    if (front == end)
+        return 0;
+
+    for (uint64_t i = front; i < end && status == BLK_STS_OK; i++)
+        status = copy_home(descriptor(i), buffer, &copied);
+    if (status == BLK_STS_OK && copied > 0 && wal.backend.flush)
+        status = wal.backend.flush();
+    if (status != BLK_STS_OK)
+        return -EIO;
+
+    /* Past the new tail, a replay no longer writes these blocks back */
+    result = write_superblock(tail);
+    if (result < 0)
+        return result;
+
+    for (uint64_t i = front; i < end; i++) {
+        const struct wal_descriptor *record = descriptor(i);
+        const uint64_t last = record->first_block + record->nr_blocks - 1;
+
+        lock_blocks(&wal.block_locks, record->first_block, last, true);
+        for (uint32_t j = 0; j < record->nr_blocks; j++)
+            index_remove(record->first_block + j, record->position + WAL_HEADER_SIZE + (uint64_t)j * WAL_BLOCK_SIZE);
+        unlock_blocks(&wal.block_locks, record->first_block, last);
+    }
+
+    pthread_mutex_lock(&wal.log_lock);
+    wal.front = end;
+    wal.tail = tail;
+    pthread_cond_broadcast(&wal.space);
+    pthread_mutex_unlock(&wal.log_lock);
+
+    add_stat(&wal.stats.checkpointed_blocks, copied);
+    add_stat(&wal.stats.checkpoints, 1);
+    return 0;
+}
+
+static void *checkpointer_main(void *arg) {
+    char *buffer = malloc(wal.max_record_size);
+    bool due = false;
+
+    if (buffer == NULL) {
+        fail("allocating the checkpoint buffer", -ENOMEM);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&wal.log_lock);
+    while (!wal.stopping) {
+        int result;
+
+        if (wal.front == wal.unwritten || (!due && !checkpoint_urgent())) {
+            const uint64_t deadline_ns = now_ns() + WAL_CHECKPOINT_INTERVAL_MS * 1000000lu;
+            struct timespec deadline = {
+                .tv_sec = deadline_ns / 1000000000lu,
+                .tv_nsec = deadline_ns % 1000000000lu,
+            };
+
+            due = pthread_cond_timedwait(&wal.checkpoint_wakeup, &wal.log_lock, &deadline) == ETIMEDOUT;
+            continue;
+        }
+        due = false;
+        pthread_mutex_unlock(&wal.log_lock);
+
+        result = checkpoint(buffer);
+        if (result < 0) {
+            fail("checkpointing", result);
+            pthread_mutex_lock(&wal.log_lock);
+            break;
+        }
+
+        pthread_mutex_lock(&wal.log_lock);
+    }
+    pthread_mutex_unlock(&wal.log_lock);
+
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Whether the record at position is whole, of this turn of the ring and, past where the last open
+ * started writing, of that open, then indexes it
+ */
+static bool replay_record(uint64_t position, char *buffer) {
+    struct wal_record *header = (struct wal_record *)buffer;
+    uint32_t checksum;
+    uint64_t index;
+
+    if (position % wal.log_size + WAL_HEADER_SIZE > wal.log_size)
+        return false;
+    if (pread_full(wal.fd, buffer, WAL_HEADER_SIZE, file_offset(position)) < 0)
+        return false;
+    if (header->magic != WAL_RECORD_MAGIC || header->position != position || header->nr_blocks == 0 ||
+        (position >= wal.epoch_start && header->epoch != wal.epoch) ||
+        record_size(header->nr_blocks) > wal.max_record_size || position % wal.log_size + record_size(header->nr_blocks) > wal.log_size ||
+        (header->first_block + header->nr_blocks) * WAL_BLOCK_SIZE > wal.disk_size)
+        return false;
+    if (pread_full(wal.fd, buffer + WAL_HEADER_SIZE, record_size(header->nr_blocks) - WAL_HEADER_SIZE, file_offset(position) + WAL_HEADER_SIZE) < 0)
+        return false;
+
+    checksum = header->checksum;
+    header->checksum = 0;
+    if (crc32c(crc32c(0, header, sizeof(*header)), buffer + WAL_HEADER_SIZE, record_size(header->nr_blocks) - WAL_HEADER_SIZE) != checksum)
+        return false;
+
+    index = wal.back++;
+    descriptor(index)->position = position;
+    descriptor(index)->first_block = header->first_block;
+    descriptor(index)->nr_blocks = header->nr_blocks;
+    descriptor(index)->written = true;
+    for (uint32_t i = 0; i < header->nr_blocks; i++)
+        index_set(header->first_block + i, position + WAL_HEADER_SIZE + i * WAL_BLOCK_SIZE);
+
+    return true;
+}
+
+/*
+ * Indexes the records from the tail, to be checkpointed like new ones, then starts a new epoch
+ * where they end
+ */
+static int replay() {
+    char *buffer = malloc(wal.max_record_size);
+    uint64_t position = wal.tail;
+
+    if (buffer == NULL)
+        return -ENOMEM;
+
+    while (position - wal.tail < wal.log_size && wal.back - wal.front < wal.nr_descriptors) {
+        /* A record which did not fit before the end of the ring is at its start */
+        const uint64_t wrapped = position + (wal.log_size - position % wal.log_size) % wal.log_size;
+
+        if (replay_record(position, buffer))
+            position += record_size(descriptor(wal.back - 1)->nr_blocks);
+        else if (wrapped != position && wrapped - wal.tail < wal.log_size && replay_record(wrapped, buffer))
+            position = wrapped + record_size(descriptor(wal.back - 1)->nr_blocks);
+        else
+            break;
+    }
+    free(buffer);
+
+    wal.head = wal.written_position = wal.synced_position = position;
+    wal.unwritten = wal.back;
+    if (wal.back > wal.front)
+        fprintf(stderr, "wal: %lu records replayed from the log\n", wal.back - wal.front);
+
+    /* Synced before any record of the new epoch is written */
+    wal.epoch++;
+    wal.epoch_start = position;
+    return write_superblock(wal.tail);
+}
+
+static int open_log(const struct bius_wal_options *options) {
+    struct wal_superblock superblock;
+    struct stat log_stat;
+    int result;
+
+    if (fstat(wal.fd, &log_stat) < 0)
+        return -errno;
+
+    if (log_stat.st_size == 0) {
+        wal.log_size = options->log_size ? options->log_size : WAL_DEFAULT_LOG_SIZE;
+        if (ftruncate(wal.fd, WAL_SUPERBLOCK_SIZE + wal.log_size) < 0)
+            return -errno;
+        return write_superblock(0);
+    }
+
+    result = pread_full(wal.fd, (char *)&superblock, sizeof(superblock), 0);
+    if (result < 0)
+        return result;
+    if (superblock.magic != WAL_MAGIC || superblock.version != WAL_VERSION || superblock.block_size != WAL_BLOCK_SIZE ||
+        superblock.disk_size != options->disk_size || (options->log_size && superblock.log_size != options->log_size))
+        return -EINVAL;
+
+    wal.log_size = superblock.log_size;
+    wal.tail = superblock.tail;
+    wal.epoch = superblock.epoch;
+    wal.epoch_start = superblock.epoch_start;
+    return 0;
+}
+
+static void free_wal() {
+    free(wal.index);
+    free(wal.descriptors);
+    close(wal.fd);
+}
+
+int bius_wal_create(const struct bius_operations *backend, const struct bius_wal_options *options, struct bius_operations *out_operations) {
+    pthread_condattr_t cond_attr;
+    uint64_t nr_slots;
+    int result;
+
+    if (wal.created)
+        return -EBUSY;
+    if (backend->read == NULL || backend->write == NULL || options->log_file == NULL ||
+        options->disk_size == 0 || options->disk_size % WAL_BLOCK_SIZE != 0 || options->log_size % WAL_BLOCK_SIZE != 0)
+        return -EINVAL;
+
+    memset(&wal, 0, sizeof(wal));
+    wal.backend = *backend;
+    wal.disk_size = options->disk_size;
+    wal.small_write_size = options->small_write_size ? options->small_write_size : WAL_DEFAULT_SMALL_WRITE_SIZE;
+    /* An unaligned write touches one more block */
+    wal.max_record_size = record_size((wal.small_write_size + WAL_BLOCK_SIZE - 1) / WAL_BLOCK_SIZE + 1);
+
+    wal.fd = open(options->log_file, O_RDWR | O_CREAT, 0600);
+    if (wal.fd < 0)
+        return -errno;
+
+    result = open_log(options);
+    if (result < 0)
+        goto out_close;
+    if (wal.log_size % WAL_BLOCK_SIZE != 0 || wal.log_size < 4 * wal.max_record_size) {
+        result = -EINVAL;
+        goto out_close;
+    }
+
+    /* Each live entry points at a different block of the log */
+    for (nr_slots = 1, wal.index_shift = 64; nr_slots < 2 * (wal.log_size / WAL_BLOCK_SIZE); nr_slots *= 2, wal.index_shift--);
+    wal.index_mask = nr_slots - 1;
+    wal.nr_descriptors = wal.log_size / record_size(1);
+    result = -ENOMEM;
+    wal.index = calloc(nr_slots, sizeof(struct wal_index_entry));
+    wal.descriptors = calloc(wal.nr_descriptors, sizeof(struct wal_descriptor));
+    if (wal.index == NULL || wal.descriptors == NULL)
+        goto out_free;
+
+    init_block_locks(&wal.block_locks, WAL_LOCK_BLOCKS);
+    pthread_mutex_init(&wal.index_lock, NULL);
+    pthread_mutex_init(&wal.log_lock, NULL);
+    pthread_mutex_init(&wal.commit_lock, NULL);
+    pthread_cond_init(&wal.space, NULL);
+    pthread_cond_init(&wal.written, NULL);
+    pthread_cond_init(&wal.commit_done, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal.checkpoint_wakeup, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    result = replay();
+    if (result < 0)
+        goto out_free;
+    result = -pthread_key_create(&wal.record_key, free);
+    if (result < 0)
+        goto out_free;
+    result = -pthread_create(&wal.checkpointer, NULL, checkpointer_main, NULL);
+    if (result < 0) {
+        pthread_key_delete(wal.record_key);
+        goto out_free;
+    }
+
+    memset(out_operations, 0, sizeof(struct bius_operations));
+    out_operations->read = wal_read;
+    out_operations->write = wal_write;
+    out_operations->flush = wal_flush;
+    if (backend->discard)
+        out_operations->discard = wal_discard;
+    if (backend->write_zeroes)
+        out_operations->write_zeroes = wal_write_zeroes;
+    wal.created = true;
+
+    return 0;
+
+out_free:
+    free_wal();
+    return result;
+
+out_close:
+    close(wal.fd);
+    return result;
+}
+
+void bius_wal_get_stats(struct bius_wal_stats *out_stats) {
+    out_stats->logged_writes = __atomic_load_n(&wal.stats.logged_writes, __ATOMIC_RELAXED);
+    out_stats->commits = __atomic_load_n(&wal.stats.commits, __ATOMIC_RELAXED);
+    out_stats->direct_writes = __atomic_load_n(&wal.stats.direct_writes, __ATOMIC_RELAXED);
+    out_stats->drains = __atomic_load_n(&wal.stats.drains, __ATOMIC_RELAXED);
+    out_stats->log_read_blocks = __atomic_load_n(&wal.stats.log_read_blocks, __ATOMIC_RELAXED);
+    out_stats->checkpoints = __atomic_load_n(&wal.stats.checkpoints, __ATOMIC_RELAXED);
+    out_stats->checkpointed_blocks = __atomic_load_n(&wal.stats.checkpointed_blocks, __ATOMIC_RELAXED);
+    out_stats->space_waits = __atomic_load_n(&wal.stats.space_waits, __ATOMIC_RELAXED);
+}
+
+int bius_wal_destroy() {
+    char *buffer;
+    int result = 0;
+
+    if (!wal.created)
+        return -EINVAL;
+
+    pthread_mutex_lock(&wal.log_lock);
+    wal.stopping = true;
+    pthread_cond_signal(&wal.checkpoint_wakeup);
+    pthread_mutex_unlock(&wal.log_lock);
+    pthread_join(wal.checkpointer, NULL);
+
+    /* Leaves the log empty, so that the backend alone holds the data */
+    buffer = malloc(wal.max_record_size);
+    if (buffer == NULL)
+        result = -ENOMEM;
+    else if (!has_failed())
+        result = checkpoint(buffer);
+    free(buffer);
+    if (result == 0 && wal_flush() != BLK_STS_OK)
+        result = -EIO;
+
+    destroy_block_locks(&wal.block_locks);
+    pthread_mutex_destroy(&wal.index_lock);
+    pthread_mutex_destroy(&wal.log_lock);
+    pthread_mutex_destroy(&wal.commit_lock);
+    pthread_cond_destroy(&wal.space);
+    pthread_cond_destroy(&wal.written);
+    pthread_cond_destroy(&wal.commit_done);
+    pthread_cond_destroy(&wal.checkpoint_wakeup);
+    pthread_key_delete(wal.record_key);
+    free_wal();
+    wal.created = false;
+
+    return result < 0 ? result : (has_failed() ? -EIO : 0);
+}